@@ -31,6 +31,7 @@
 
 #include "common/translation.h"
 #include "gui/mainFrame.h"
+#include "backend/filters/algorithms/spatialIndexCache.h"
 
 //Unit testing code
 #include "testing/testing.h"
@@ -138,6 +139,9 @@ int threeDepictApp::OnExit()
 	//libxml2 by default seems to leak memory, unless you call this function
 	xmlCleanupParser();
 
+	//Free the spatial trees shared between filters
+	SpatialIndexCache::clear();
+
 	return wxApp::OnExit();
 }
 
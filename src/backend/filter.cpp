@@ -26,6 +26,7 @@
 
 #include "common/voxels.h"
 #include "backend/APT/vtk.h"
+#include "filters/algorithms/spaceFillingCurve.h"
 
 #include "filters/openvdb_includes.h"
 
@@ -657,14 +658,16 @@ unsigned int IonStreamData::exportStreams(const std::vector<const FilterStreamDa
 
 IonStreamData::IonStreamData() : 
 	r(1.0f), g(0.0f), b(0.0f), a(1.0f), 
-	ionSize(2.0f), valueType("Mass-to-Charge (amu/e)")
+	ionSize(2.0f), valueType("Mass-to-Charge (amu/e)"), 
+	spatialOrder(SPATIAL_ORDER_NONE)
 {
 	streamType=STREAM_TYPE_IONS;
 }
 
 IonStreamData::IonStreamData(const Filter *f) : FilterStreamData(f), 
 	r(1.0f), g(0.0f), b(0.0f), a(1.0f), 
-	ionSize(2.0f), valueType("Mass-to-Charge (amu/e)")
+	ionSize(2.0f), valueType("Mass-to-Charge (amu/e)"), 
+	spatialOrder(SPATIAL_ORDER_NONE)
 {
 	streamType=STREAM_TYPE_IONS;
 }
@@ -779,6 +782,7 @@ IonStreamData *IonStreamData::cloneSampled(float fraction) const
 	out->a=a;
 	out->ionSize=ionSize;
 	out->valueType=valueType;
+	out->spatialOrder=spatialOrder;
 	out->parent=parent;
 	out->cached=0;
 
@@ -292,6 +292,11 @@ public:
 	//!Apply filter to input data stream	
 	std::vector<IonHit> data;
 
+	//!Ordering of the data vector along a space filling curve (SPATIAL_ORDER_*,
+	// see filters/algorithms/spaceFillingCurve.h). Filters that only remove
+	// ions from a single stream, without permuting them, may retain this
+	unsigned int spatialOrder;
+
 	//!export given filterstream data pointers as ion data
 	static unsigned int exportStreams(const std::vector<const FilterStreamData *> &selected, 
 							const std::string &outFile, unsigned int format=IONFORMAT_POS);
@@ -0,0 +1,666 @@
+/*
+ * K3DTree-bucket.cpp  - KD tree with multi-point leaves, for batched queries
+ * Copyright (C) 2015  D. Haley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "K3DTree-bucket.h"
+
+#include <algorithm>
+#include <limits>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using std::vector;
+
+//Subtrees with fewer points than this are built by a single task
+const size_t BUCKET_PARALLEL_MIN_SIZE=16384;
+
+//Maximum number of pending nodes during a search. Tree depth
+// is log2(n/KDBUCKET_LEAF_SIZE), and each level adds one pending node
+const unsigned int BUCKET_STACK_SIZE=128;
+
+//!Node awaiting a visit during a block search. The queries of the block that
+// still need this subtree are listed in [start,end) of the active list
+struct BucketBlockEntry
+{
+	size_t node;
+	size_t start,end;
+};
+
+//!Functor to rank point indices by a single coordinate
+class BucketAxisCompare
+{
+	private:
+		const float *v;
+	public:
+		BucketAxisCompare(const float *values) : v(values) {};
+		inline bool operator()(size_t a, size_t b) const { return v[a] < v[b];}
+};
+
+//Squared distance from a point to the box of a node (zero if inside)
+static inline float boxSqrDist(const K3DNodeBucket &n, float qx, float qy, float qz)
+{
+	float dx = std::max(std::max(n.lo[0]-qx,qx-n.hi[0]),0.0f);
+	float dy = std::max(std::max(n.lo[1]-qy,qy-n.hi[1]),0.0f);
+	float dz = std::max(std::max(n.lo[2]-qz,qz-n.hi[2]),0.0f);
+	return dx*dx + dy*dy + dz*dz;
+}
+
+//Squared distance from a point to the farthest corner of a node's box
+static inline float boxMaxSqrDist(const K3DNodeBucket &n, float qx, float qy, float qz)
+{
+	float dx = std::max(qx-n.lo[0],n.hi[0]-qx);
+	float dy = std::max(qy-n.lo[1],n.hi[1]-qy);
+	float dz = std::max(qz-n.lo[2],n.hi[2]-qz);
+	return dx*dx + dy*dy + dz*dz;
+}
+
+size_t K3DTreeBucket::countNodes(size_t nPts)
+{
+	if(nPts <= KDBUCKET_LEAF_SIZE)
+		return 1;
+
+	//Must match the split used in buildNode
+	return 1 + countNodes(nPts/2) + countNodes(nPts - nPts/2);
+}
+
+unsigned int K3DTreeBucket::countLevels(size_t nPts)
+{
+	//Must match the split used in buildNode; the right half is the larger
+	unsigned int levels=1;
+	while(nPts > KDBUCKET_LEAF_SIZE)
+	{
+		nPts-=nPts/2;
+		levels++;
+	}
+	return levels;
+}
+
+size_t K3DTreeBucket::activeListSize(size_t nQueries) const
+{
+	//Each internal node on the current path holds one list for its
+	// children, placed after its parent's list
+	return (size_t)countLevels(size())*std::min(nQueries,(size_t)KDBUCKET_QUERY_BLOCK);
+}
+
+void K3DTreeBucket::buildNode(size_t nodeIdx, size_t lo, size_t hi,
+		const vector<float> *src, ATOMIC_BOOL &wantAbort, bool *aborted)
+{
+	if(*aborted)
+		return;
+
+	K3DNodeBucket &n = nodes[nodeIdx];
+	n.start=lo;
+	n.end=hi;
+
+	//Compute the tight bounds of the contained points
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		const float *v=&(src[ui][0]);
+		float l=std::numeric_limits<float>::max();
+		float h=-std::numeric_limits<float>::max();
+		for(size_t uj=lo;uj<hi;uj++)
+		{
+			float f=v[origIndex[uj]];
+			l=std::min(l,f);
+			h=std::max(h,f);
+		}
+		n.lo[ui]=l;
+		n.hi[ui]=h;
+	}
+
+	if(hi-lo <= KDBUCKET_LEAF_SIZE)
+	{
+		n.childRight=0;
+		return;
+	}
+
+	//Split on the widest axis, about the median
+	unsigned int axis=0;
+	for(unsigned int ui=1;ui<3;ui++)
+	{
+		if(n.hi[ui]-n.lo[ui] > n.hi[axis]-n.lo[axis])
+			axis=ui;
+	}
+
+	size_t mid = lo + (hi-lo)/2;
+	std::nth_element(origIndex.begin()+lo,origIndex.begin()+mid,
+			origIndex.begin()+hi,BucketAxisCompare(&(src[axis][0])));
+
+	size_t leftIdx=nodeIdx+1;
+	size_t rightIdx=leftIdx+countNodes(mid-lo);
+	n.childRight=rightIdx;
+
+	if(hi-lo < BUCKET_PARALLEL_MIN_SIZE)
+	{
+		buildNode(leftIdx,lo,mid,src,wantAbort,aborted);
+		buildNode(rightIdx,mid,hi,src,wantAbort,aborted);
+		return;
+	}
+
+	if(wantAbort)
+	{
+		*aborted=true;
+		return;
+	}
+
+	//Node positions are known in advance, so each side writes
+	// a disjoint part of the node array, and may be built concurrently
+	#pragma omp task firstprivate(leftIdx,lo,mid,src,aborted) shared(wantAbort)
+	buildNode(leftIdx,lo,mid,src,wantAbort,aborted);
+	#pragma omp task firstprivate(rightIdx,mid,hi,src,aborted) shared(wantAbort)
+	buildNode(rightIdx,mid,hi,src,wantAbort,aborted);
+	#pragma omp taskwait
+}
+
+unsigned int K3DTreeBucket::buildFromCoords(vector<float> *src, unsigned int &progress,
+						ATOMIC_BOOL &wantAbort)
+{
+	progress=0;
+	size_t nPts=src[0].size();
+	if(!nPts)
+		return 0;
+
+	origIndex.resize(nPts);
+	for(size_t ui=0;ui<nPts;ui++)
+		origIndex[ui]=ui;
+
+	nodes.resize(countNodes(nPts));
+
+	bool aborted=false;
+	#pragma omp parallel
+	{
+		#pragma omp single
+		buildNode(0,0,nPts,src,wantAbort,&aborted);
+	}
+
+	if(aborted || wantAbort)
+	{
+		clear();
+		return KDBUCKET_ERR_ABORT;
+	}
+	progress=50;
+
+	//Lay the coordinates out in leaf order
+	ptX.resize(nPts);
+	ptY.resize(nPts);
+	ptZ.resize(nPts);
+	#pragma omp parallel for
+	for(size_t ui=0;ui<nPts;ui++)
+	{
+		size_t idx=origIndex[ui];
+		ptX[ui]=src[0][idx];
+		ptY[ui]=src[1][idx];
+		ptZ[ui]=src[2][idx];
+	}
+
+	progress=100;
+	return 0;
+}
+
+unsigned int K3DTreeBucket::build(const vector<Point3D> &pts, unsigned int &progress,
+						ATOMIC_BOOL &wantAbort)
+{
+	clear();
+	vector<float> src[3];
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		src[ui].resize(pts.size());
+		for(size_t uj=0;uj<pts.size();uj++)
+			src[ui][uj]=pts[uj][ui];
+	}
+
+	return buildFromCoords(src,progress,wantAbort);
+}
+
+unsigned int K3DTreeBucket::build(const vector<IonHit> &pts, unsigned int &progress,
+						ATOMIC_BOOL &wantAbort)
+{
+	clear();
+	vector<float> src[3];
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		src[ui].resize(pts.size());
+		for(size_t uj=0;uj<pts.size();uj++)
+			src[ui][uj]=pts[uj][ui];
+	}
+
+	return buildFromCoords(src,progress,wantAbort);
+}
+
+void K3DTreeBucket::clear()
+{
+	nodes.clear();
+	ptX.clear();
+	ptY.clear();
+	ptZ.clear();
+	origIndex.clear();
+}
+
+size_t K3DTreeBucket::memoryUsage() const
+{
+	return nodes.size()*sizeof(K3DNodeBucket) + 
+		origIndex.size()*(3*sizeof(float) + sizeof(size_t));
+}
+
+void K3DTreeBucket::getBoundCube(BoundCube &b) const
+{
+	ASSERT(!nodes.empty());
+	b.setBounds(nodes[0].lo[0],nodes[0].lo[1],nodes[0].lo[2],
+			nodes[0].hi[0],nodes[0].hi[1],nodes[0].hi[2]);
+}
+
+void K3DTreeBucket::findKNearestBlock(const Point3D *queries, unsigned int nBlock, unsigned int k,
+		float deadDistSqr, float pruneScale, vector<unsigned short> &active,
+		float *sqrDistOut, size_t *indexOut) const
+{
+	ASSERT(nBlock <= KDBUCKET_QUERY_BLOCK);
+	for(size_t ui=0;ui<(size_t)nBlock*k;ui++)
+	{
+		sqrDistOut[ui]=std::numeric_limits<float>::infinity();
+		indexOut[ui]=(size_t)-1;
+	}
+
+	if(nodes.empty() || !k || !nBlock)
+		return;
+
+	float qx[KDBUCKET_QUERY_BLOCK],qy[KDBUCKET_QUERY_BLOCK],qz[KDBUCKET_QUERY_BLOCK];
+	for(unsigned int ui=0;ui<nBlock;ui++)
+	{
+		qx[ui]=queries[ui][0];
+		qy[ui]=queries[ui][1];
+		qz[ui]=queries[ui][2];
+		active[ui]=ui;
+	}
+
+	BucketBlockEntry stack[BUCKET_STACK_SIZE];
+	unsigned int stackSize=1;
+	stack[0].node=0;
+	stack[0].start=0;
+	stack[0].end=nBlock;
+
+	float leafDist[KDBUCKET_LEAF_SIZE];
+	while(stackSize)
+	{
+		stackSize--;
+		const BucketBlockEntry e=stack[stackSize];
+		const K3DNodeBucket &n=nodes[e.node];
+
+		//Queries that must descend further are listed after the parent's list,
+		// and their mean position picks which child to visit first
+		size_t top=e.end;
+		float cx=0,cy=0,cz=0;
+		for(size_t ui=e.start;ui<e.end;ui++)
+		{
+			const unsigned int q=active[ui];
+			float *sqrDist=sqrDistOut+(size_t)q*k;
+
+			//Box cannot contain anything closer than this query's current worst
+			// (or, for approximate searches, sufficiently closer)
+			if(boxSqrDist(n,qx[q],qy[q],qz[q])*pruneScale >= sqrDist[k-1])
+				continue;
+
+			//Whole box lies in the dead zone
+			if(boxMaxSqrDist(n,qx[q],qy[q],qz[q]) <= deadDistSqr)
+				continue;
+
+			if(!n.isLeaf())
+			{
+				active[top++]=q;
+				cx+=qx[q]; cy+=qy[q]; cz+=qz[q];
+				continue;
+			}
+
+			const float *x=&ptX[n.start], *y=&ptY[n.start], *z=&ptZ[n.start];
+			const size_t m = n.end-n.start;
+			SIMD_PRAGMA("omp simd")
+			for(size_t uj=0;uj<m;uj++)
+			{
+				float dx=x[uj]-qx[q], dy=y[uj]-qy[q],dz=z[uj]-qz[q];
+				leafDist[uj]=dx*dx+dy*dy+dz*dz;
+			}
+
+			size_t *index=indexOut+(size_t)q*k;
+			for(size_t uj=0;uj<m;uj++)
+			{
+				float d=leafDist[uj];
+				if(d <= deadDistSqr || d >= sqrDist[k-1])
+					continue;
+
+				//Insert into the sorted result list
+				unsigned int pos=k-1;
+				while(pos && sqrDist[pos-1] > d)
+				{
+					sqrDist[pos]=sqrDist[pos-1];
+					index[pos]=index[pos-1];
+					pos--;
+				}
+				sqrDist[pos]=d;
+				index[pos]=origIndex[n.start+uj];
+			}
+		}
+
+		if(n.isLeaf() || top == e.end)
+			continue;
+
+		//Visit the nearer child first, by pushing it last
+		const float inv=1.0f/(float)(top-e.end);
+		cx*=inv; cy*=inv; cz*=inv;
+		size_t left=e.node+1,right=n.childRight;
+		bool leftFirst=boxSqrDist(nodes[left],cx,cy,cz) < boxSqrDist(nodes[right],cx,cy,cz);
+		ASSERT(stackSize+2 <= BUCKET_STACK_SIZE);
+		stack[stackSize].node= leftFirst ? right : left;
+		stack[stackSize+1].node= leftFirst ? left : right;
+		for(unsigned int ui=0;ui<2;ui++)
+		{
+			stack[stackSize+ui].start=e.end;
+			stack[stackSize+ui].end=top;
+		}
+		stackSize+=2;
+	}
+}
+
+void K3DTreeBucket::inSphereBlock(const Point3D *queries, unsigned int nBlock, float sqrRadius,
+		float deadDistSqr, vector<unsigned short> &active, size_t *counts,
+		vector<unsigned short> *hitQuery, vector<size_t> *hitPt) const
+{
+	ASSERT(nBlock <= KDBUCKET_QUERY_BLOCK);
+	ASSERT(!hitQuery == !hitPt);
+	for(unsigned int ui=0;ui<nBlock;ui++)
+		counts[ui]=0;
+
+	if(nodes.empty() || !nBlock)
+		return;
+
+	float qx[KDBUCKET_QUERY_BLOCK],qy[KDBUCKET_QUERY_BLOCK],qz[KDBUCKET_QUERY_BLOCK];
+	for(unsigned int ui=0;ui<nBlock;ui++)
+	{
+		qx[ui]=queries[ui][0];
+		qy[ui]=queries[ui][1];
+		qz[ui]=queries[ui][2];
+		active[ui]=ui;
+	}
+
+	BucketBlockEntry stack[BUCKET_STACK_SIZE];
+	unsigned int stackSize=1;
+	stack[0].node=0;
+	stack[0].start=0;
+	stack[0].end=nBlock;
+
+	while(stackSize)
+	{
+		stackSize--;
+		const BucketBlockEntry e=stack[stackSize];
+		const K3DNodeBucket &n=nodes[e.node];
+
+		size_t top=e.end;
+		for(size_t ui=e.start;ui<e.end;ui++)
+		{
+			const unsigned int q=active[ui];
+			float minDist=boxSqrDist(n,qx[q],qy[q],qz[q]);
+			if(minDist > sqrRadius)
+				continue;
+
+			float maxDist=boxMaxSqrDist(n,qx[q],qy[q],qz[q]);
+			if(maxDist <= deadDistSqr)
+				continue;
+
+			//If the box is wholly inside the shell, we can take all of its points
+			if(maxDist <= sqrRadius && minDist > deadDistSqr)
+			{
+				counts[q]+=n.end-n.start;
+				if(hitPt)
+				{
+					hitQuery->insert(hitQuery->end(),n.end-n.start,(unsigned short)q);
+					hitPt->insert(hitPt->end(),origIndex.begin()+n.start,
+								origIndex.begin()+n.end);
+				}
+				continue;
+			}
+
+			if(!n.isLeaf())
+			{
+				active[top++]=q;
+				continue;
+			}
+
+			const float *x=&ptX[n.start], *y=&ptY[n.start], *z=&ptZ[n.start];
+			const size_t m = n.end-n.start;
+			if(!hitPt)
+			{
+				size_t leafCount=0;
+				SIMD_PRAGMA("omp simd reduction(+:leafCount)")
+				for(size_t uj=0;uj<m;uj++)
+				{
+					float dx=x[uj]-qx[q], dy=y[uj]-qy[q],dz=z[uj]-qz[q];
+					float d=dx*dx+dy*dy+dz*dz;
+					leafCount+= (d <=sqrRadius && d > deadDistSqr);
+				}
+				counts[q]+=leafCount;
+			}
+			else
+			{
+				for(size_t uj=0;uj<m;uj++)
+				{
+					float dx=x[uj]-qx[q], dy=y[uj]-qy[q],dz=z[uj]-qz[q];
+					float d=dx*dx+dy*dy+dz*dz;
+					if(d <=sqrRadius && d > deadDistSqr)
+					{
+						hitQuery->push_back(q);
+						hitPt->push_back(origIndex[n.start+uj]);
+						counts[q]++;
+					}
+				}
+			}
+		}
+
+		if(n.isLeaf() || top == e.end)
+			continue;
+
+		ASSERT(stackSize+2 <= BUCKET_STACK_SIZE);
+		stack[stackSize].node=e.node+1;
+		stack[stackSize+1].node=n.childRight;
+		for(unsigned int ui=0;ui<2;ui++)
+		{
+			stack[stackSize+ui].start=e.end;
+			stack[stackSize+ui].end=top;
+		}
+		stackSize+=2;
+	}
+}
+
+void K3DTreeBucket::findKNearest(const Point3D *queries, size_t nQueries, unsigned int k,
+		float deadDistSqr, float *sqrDistOut, size_t *indexOut, float maxError) const
+{
+	ASSERT(maxError >=0.0f);
+	//Boxes are compared using squared distances, so square the error bound
+	const float pruneScale=(1.0f+maxError)*(1.0f+maxError);
+
+	vector<unsigned short> active(activeListSize(nQueries));
+	for(size_t start=0;start<nQueries;start+=KDBUCKET_QUERY_BLOCK)
+	{
+		unsigned int nBlock=std::min(nQueries-start,(size_t)KDBUCKET_QUERY_BLOCK);
+		findKNearestBlock(queries+start,nBlock,k,deadDistSqr,pruneScale,active,
+					sqrDistOut+start*k,indexOut+start*k);
+	}
+}
+
+void K3DTreeBucket::countInSphere(const Point3D *queries, size_t nQueries, float sqrRadius,
+		float deadDistSqr, size_t *counts) const
+{
+	vector<unsigned short> active(activeListSize(nQueries));
+	for(size_t start=0;start<nQueries;start+=KDBUCKET_QUERY_BLOCK)
+	{
+		unsigned int nBlock=std::min(nQueries-start,(size_t)KDBUCKET_QUERY_BLOCK);
+		inSphereBlock(queries+start,nBlock,sqrRadius,deadDistSqr,active,
+					counts+start,0,0);
+	}
+}
+
+void K3DTreeBucket::findInSphere(const Point3D *queries, size_t nQueries, float sqrRadius,
+		float deadDistSqr, vector<size_t> &offsets, vector<size_t> &pts) const
+{
+	offsets.resize(nQueries+1);
+	pts.clear();
+
+	vector<unsigned short> active(activeListSize(nQueries)),hitQuery;
+	vector<size_t> hitPt,blockCounts(KDBUCKET_QUERY_BLOCK);
+	for(size_t start=0;start<nQueries;start+=KDBUCKET_QUERY_BLOCK)
+	{
+		unsigned int nBlock=std::min(nQueries-start,(size_t)KDBUCKET_QUERY_BLOCK);
+		hitQuery.clear();
+		hitPt.clear();
+		inSphereBlock(queries+start,nBlock,sqrRadius,deadDistSqr,active,
+					&blockCounts[0],&hitQuery,&hitPt);
+
+		//Hits arrive in tree order; group them by query
+		size_t base=pts.size();
+		for(unsigned int ui=0;ui<nBlock;ui++)
+		{
+			offsets[start+ui]=base;
+			base+=blockCounts[ui];
+			blockCounts[ui]=offsets[start+ui];
+		}
+		pts.resize(base);
+		for(size_t ui=0;ui<hitPt.size();ui++)
+			pts[blockCounts[hitQuery[ui]]++]=hitPt[ui];
+	}
+	offsets[nQueries]=pts.size();
+}
+
+#ifdef DEBUG
+
+#include <cstdlib>
+
+bool K3DTreeBucketTests()
+{
+	RandNumGen rng;
+	rng.initialise(4321);
+
+	//Include a clump of coincident points, to check tie handling
+	vector<Point3D> pts(20000);
+	for(size_t ui=0;ui<pts.size();ui++)
+	{
+		if(ui < 100)
+			pts[ui]=Point3D(0.5,0.5,0.5);
+		else
+		{
+			pts[ui]=Point3D(rng.genUniformDev(),rng.genUniformDev(),
+						rng.genUniformDev());
+		}
+	}
+
+	K3DTreeBucket tree;
+	unsigned int prog;
+	ATOMIC_BOOL wantAbort(false);
+	TEST(!tree.build(pts,prog,wantAbort),"bucket tree build");
+	TEST(tree.size() == pts.size(),"bucket tree size");
+
+	BoundCube bc,bcTree;
+	bc.setBounds(pts);
+	tree.getBoundCube(bcTree);
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		TEST(bc.getBound(ui,0) == bcTree.getBound(ui,0),"bounds");
+		TEST(bc.getBound(ui,1) == bcTree.getBound(ui,1),"bounds");
+	}
+
+	//Span several query blocks, with a partial block at the end
+	const unsigned int NQUERY=2*KDBUCKET_QUERY_BLOCK+50;
+	const unsigned int K=10;
+	const float DEAD_DIST=std::numeric_limits<float>::epsilon();
+	const float SQR_RADIUS=0.01;
+	vector<Point3D> queries(NQUERY);
+	for(size_t ui=0;ui<NQUERY;ui++)
+	{
+		//Query some points from the dataset (so dead zone matters), and some not
+		if(ui%2)
+			queries[ui]=pts[(size_t)(rng.genUniformDev()*(pts.size()-1))];
+		else
+			queries[ui]=Point3D(rng.genUniformDev(),rng.genUniformDev(),rng.genUniformDev());
+	}
+	queries[0]=Point3D(0.5,0.5,0.5);
+
+	vector<float> dists(NQUERY*K);
+	vector<size_t> idx(NQUERY*K),counts(NQUERY),offsets,inSphere;
+	tree.findKNearest(&queries[0],NQUERY,K,DEAD_DIST,&dists[0],&idx[0]);
+	tree.countInSphere(&queries[0],NQUERY,SQR_RADIUS,DEAD_DIST,&counts[0]);
+	tree.findInSphere(&queries[0],NQUERY,SQR_RADIUS,DEAD_DIST,offsets,inSphere);
+
+	for(size_t ui=0;ui<NQUERY;ui++)
+	{
+		vector<float> bruteDist;
+		size_t bruteCount=0;
+		for(size_t uj=0;uj<pts.size();uj++)
+		{
+			float d=pts[uj].sqrDist(queries[ui]);
+			if(d <= DEAD_DIST)
+				continue;
+			bruteDist.push_back(d);
+			if(d <= SQR_RADIUS)
+				bruteCount++;
+		}
+		std::sort(bruteDist.begin(),bruteDist.end());
+
+		for(size_t uj=0;uj<K;uj++)
+		{
+			TEST(dists[ui*K+uj] == bruteDist[uj],"kNN distance matches brute force");
+			TEST(pts[idx[ui*K+uj]].sqrDist(queries[ui]) == bruteDist[uj],"kNN index");
+		}
+
+		TEST(counts[ui] == bruteCount,"sphere count matches brute force");
+		TEST(offsets[ui+1]-offsets[ui] == bruteCount,"sphere search size");
+		for(size_t uj=offsets[ui];uj<offsets[ui+1];uj++)
+		{
+			float d=pts[inSphere[uj]].sqrDist(queries[ui]);
+			TEST(d <= SQR_RADIUS && d > DEAD_DIST,"sphere search point");
+		}
+	}
+
+	//Without a dead zone, the clump is all found first
+	tree.findKNearest(&queries[0],1,K,-1.0f,&dists[0],&idx[0]);
+	for(size_t uj=0;uj<K;uj++)
+	{
+		TEST(dists[uj] == 0.0f,"coincident kNN");
+		TEST(idx[uj] < 100,"coincident kNN index");
+	}
+
+	//Approximate searches stay within the error bound
+	const float MAX_ERR=0.5f;
+	vector<float> approxDists(NQUERY*K);
+	tree.findKNearest(&queries[0],NQUERY,K,DEAD_DIST,&approxDists[0],&idx[0],MAX_ERR);
+	tree.findKNearest(&queries[0],NQUERY,K,DEAD_DIST,&dists[0],&idx[0]);
+	for(size_t ui=0;ui<NQUERY*K;ui++)
+	{
+		TEST(approxDists[ui] >= dists[ui],"approx kNN no closer than exact");
+		TEST(approxDists[ui] <= dists[ui]*(1.0f+MAX_ERR)*(1.0f+MAX_ERR),"approx kNN error bound");
+	}
+
+	//Asking for more points than exist pads the output
+	vector<Point3D> few(3,Point3D(0,0,0));
+	few[1]=Point3D(1,0,0);
+	few[2]=Point3D(0,2,0);
+	TEST(!tree.build(few,prog,wantAbort),"small build");
+	tree.findKNearest(&few[0],1,K,DEAD_DIST,&dists[0],&idx[0]);
+	TEST(idx[0] == 1 && idx[1] == 2,"small tree kNN");
+	TEST(idx[2] == (size_t)-1,"small tree kNN padding");
+
+	return true;
+}
+
+#endif
@@ -0,0 +1,169 @@
+/*
+ * K3DTree-bucket.h  - KD tree with multi-point leaves, for batched queries
+ * Copyright (C) 2015  D. Haley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef K3DTREEBUCKET_H
+#define K3DTREEBUCKET_H
+
+#include <vector>
+
+#include "common/basics.h"
+#include "backend/APT/ionhit.h"
+
+//Bucketed variant of the KD tree. Compared to K3DTree/K3DTreeMk2
+//	- Leaves hold up to KDBUCKET_LEAF_SIZE points, stored contiguously
+//	  as separate x,y,z arrays, so leaf distance tests vectorise
+//	- Each node holds the tight bounds of its points, for box pruning
+//	- Nodes are laid out in depth-first order; the left child
+//	  immediately follows its parent
+//	- Queries are answered a block of up to KDBUCKET_QUERY_BLOCK points
+//	  at a time. The block descends the tree together, so each node is
+//	  visited once per block, not once per query, and writes into
+//	  caller-provided buffers (no per-query allocation)
+// Points are not tagged, and the tree cannot be modified once built
+
+//!Maximum number of points stored in a leaf
+const unsigned int KDBUCKET_LEAF_SIZE=32;
+
+//!Number of query points that descend the tree together. Blocks of
+// spatially close points (eg, from a spatially ordered stream) share the most work
+const unsigned int KDBUCKET_QUERY_BLOCK=256;
+
+enum
+{
+	KDBUCKET_ERR_ABORT=1,
+	KDBUCKET_ERR_ENUM_END
+};
+
+//!Node of the bucketed KD tree
+class K3DNodeBucket
+{
+	public:
+		//!Tight bounds of the points in this subtree
+		float lo[3],hi[3];
+		//!Range of points [start,end) spanned by this subtree
+		size_t start,end;
+		//!Index of the right child. The left child is at this node+1. 0 for a leaf
+		size_t childRight;
+
+		bool isLeaf() const { return !childRight;}
+};
+
+//!3D KD tree with bucketed leaves and batched search functions
+class K3DTreeBucket
+{
+	private:
+		//!Tree nodes, root first
+		std::vector<K3DNodeBucket> nodes;
+
+		//!Point coordinates, in leaf order
+		std::vector<float> ptX,ptY,ptZ;
+		//!Offset of each (leaf order) point in the array used to build the tree
+		std::vector<size_t> origIndex;
+
+		//!Number of nodes a subtree with the given number of points will use
+		static size_t countNodes(size_t nPts);
+		//!Number of levels (including the leaves) in a subtree with the given number of points
+		static unsigned int countLevels(size_t nPts);
+		//!Size of the active query list needed by the block searches
+		size_t activeListSize(size_t nQueries) const;
+
+		//!Build the subtree rooted at nodeIdx, covering [lo,hi) in origIndex,
+		// using src as the input coordinates
+		void buildNode(size_t nodeIdx, size_t lo, size_t hi,
+			const std::vector<float> *src, ATOMIC_BOOL &wantAbort, bool *aborted);
+
+		//!Build from coordinate arrays, taking ownership of the array contents
+		unsigned int buildFromCoords(std::vector<float> *src, unsigned int &progress,
+						ATOMIC_BOOL &wantAbort);
+
+		//!Find the k nearest points to each point of a block of up to
+		// KDBUCKET_QUERY_BLOCK queries, in a single tree traversal
+		void findKNearestBlock(const Point3D *queries, unsigned int nBlock, unsigned int k,
+				float deadDistSqr, float pruneScale, std::vector<unsigned short> &active,
+				float *sqrDistOut, size_t *indexOut) const;
+		//!Count the points in the sphere about each point of a block of queries,
+		// in a single tree traversal. If hitPt is non-null, each point found is
+		// also appended to hitPt, with its (block) query number in hitQuery
+		void inSphereBlock(const Point3D *queries, unsigned int nBlock, float sqrRadius,
+				float deadDistSqr, std::vector<unsigned short> &active, size_t *counts,
+				std::vector<unsigned short> *hitQuery, std::vector<size_t> *hitPt) const;
+	public:
+		K3DTreeBucket(){};
+
+		//!Build the tree from the given points. Returns 0 on success, or
+		// KDBUCKET_ERR_ABORT if aborted, in which case the tree is empty.
+		// Subtrees are built in parallel, when OpenMP is available
+		unsigned int build(const std::vector<Point3D> &pts, unsigned int &progress,
+						ATOMIC_BOOL &wantAbort);
+		unsigned int build(const std::vector<IonHit> &pts, unsigned int &progress,
+						ATOMIC_BOOL &wantAbort);
+
+		//!Erase tree contents
+		void clear();
+
+		//!Obtain the number of points in the tree
+		size_t size() const { return origIndex.size();}
+		bool empty() const { return origIndex.empty();}
+
+		//!Approximate number of bytes used by the tree
+		size_t memoryUsage() const;
+
+		//!Get the bounding box of the points in the tree. Tree must be non-empty
+		void getBoundCube(BoundCube &b) const;
+
+		//!Find the k nearest points to each of nQueries query points,
+		// ignoring points within (<=) deadDistSqr of the query point.
+		/*! Results are written into sqrDistOut and indexOut, which must
+		 * hold nQueries*k entries; the results for query i start at i*k, sorted
+		 * by increasing distance. Indices are offsets into the array used to build
+		 * the tree. Where fewer than k points are available, the remaining
+		 * entries are given an index of (size_t)-1 and an infinite distance.
+		 * Unlike K3DTree::findKNearest, points at equal distances are each
+		 * counted, so this returns the true k nearest neighbours.
+		 *
+		 * If maxError is nonzero, the search is approximate : the i-th
+		 * returned point is at most (1+maxError) times further than the true
+		 * i-th nearest neighbour. Subtrees that cannot improve the result by
+		 * more than this are skipped, which is considerably faster for larger k
+		 */
+		void findKNearest(const Point3D *queries, size_t nQueries, unsigned int k,
+				float deadDistSqr, float *sqrDistOut, size_t *indexOut,
+				float maxError=0.0f) const;
+
+		//!Count the points lying within the sphere (<= sqrRadius) about each query point,
+		// ignoring points within (<=) deadDistSqr. counts must hold nQueries entries
+		void countInSphere(const Point3D *queries, size_t nQueries, float sqrRadius,
+				float deadDistSqr, size_t *counts) const;
+
+		//!Find the points lying within the sphere about each query point, as per countInSphere.
+		/*! Output is in compressed-row form : the indices (of the input array) of
+		 * the points for query i are found in [offsets[i],offsets[i+1]) in pts.
+		 * offsets is resized to nQueries+1. Within each query, the order
+		 * of the points is unspecified
+		 */
+		void findInSphere(const Point3D *queries, size_t nQueries, float sqrRadius,
+				float deadDistSqr, std::vector<size_t> &offsets,
+				std::vector<size_t> &pts) const;
+};
+
+#ifdef DEBUG
+//Compare bucketed tree queries against brute force searches
+// - return true on OK, false on fail
+bool K3DTreeBucketTests();
+#endif
+#endif
@@ -22,6 +22,11 @@
 
 #include <stack>
 #include <queue>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 using std::stack;
 using std::vector;
@@ -31,6 +36,13 @@ unsigned int *K3DTreeMk2::progress=0;
 //Pointer for aborting during build process
 ATOMIC_BOOL *K3DTreeMk2::abort=0;
 
+//Subtrees smaller than this are built by a single task
+const size_t PARALLEL_BUILD_MIN_SIZE=16384;
+//Do not spawn new tasks below this tree depth
+const size_t PARALLEL_BUILD_MAX_DEPTH=24;
+//Number of nodes each task builds between progress/abort checks
+const size_t BUILD_PROGRESS_REDUCE=5000;
+
 class NodeWalk
 {
 	public:
@@ -58,12 +70,14 @@ void K3DTreeMk2::resetPts(std::vector<Point3D> &p, bool clear)
 		p.clear();
 
 	nodes.resize(indexedPoints.size());
+	tags.init(nodes.size());
 }
 
 void K3DTreeMk2::resetPts(std::vector<IonHit> &p, bool clear)
 {
 	indexedPoints.resize(p.size());
 	nodes.resize(p.size());
+	tags.init(nodes.size());
 
 	if(p.empty())
 		return;
@@ -84,7 +98,7 @@ void K3DTreeMk2::resetPts(std::vector<IonHit> &p, bool clear)
 
 }
 
-void K3DTreeMk2::getBoundCube(BoundCube &b)
+void K3DTreeMk2::getBoundCube(BoundCube &b) const
 {
 	ASSERT(treeBounds.isValid());
 	b.setBounds(treeBounds);
@@ -107,16 +121,113 @@ size_t K3DTreeMk2::getOrigIndex(size_t treeIndex) const
 	return indexedPoints[treeIndex].second;
 }
 
+//OpenMP 3.1 allows atomic read and capture. Older versions
+// fall back to a critical section
+#if defined(_OPENMP) && (_OPENMP >= 201107)
+	#define K3D_TAG_ATOMIC_CAPTURE
+#endif
+
+void K3DTagSet::init(size_t nTags)
+{
+	numTags=nTags;
+	bits.assign((nTags+K3D_TAG_BITS-1)/K3D_TAG_BITS,0);
+}
+
+void K3DTagSet::tag(size_t tagID, bool tagVal)
+{	
+	ASSERT(tagID < numTags);
+	K3DTagWord &w=bits[tagID/K3D_TAG_BITS];
+	K3DTagWord mask=(K3DTagWord)1 << (tagID%K3D_TAG_BITS);
+	if(tagVal)
+	{
+#ifdef K3D_TAG_ATOMIC_CAPTURE
+		#pragma omp atomic
+		w|=mask;
+#else
+		#pragma omp critical(K3D_TAG)
+		w|=mask;
+#endif
+	}
+	else
+	{
+		mask=~mask;
+#ifdef K3D_TAG_ATOMIC_CAPTURE
+		#pragma omp atomic
+		w&=mask;
+#else
+		#pragma omp critical(K3D_TAG)
+		w&=mask;
+#endif
+	}
+}
+
+bool K3DTagSet::claim(size_t tagID)
+{
+	ASSERT(tagID < numTags);
+	K3DTagWord &w=bits[tagID/K3D_TAG_BITS];
+	const K3DTagWord mask=(K3DTagWord)1 << (tagID%K3D_TAG_BITS);
+	K3DTagWord old;
+#ifdef K3D_TAG_ATOMIC_CAPTURE
+	#pragma omp atomic capture
+	{ old=w; w|=mask; }
+#else
+	#pragma omp critical(K3D_TAG)
+	{ old=w; w|=mask; }
+#endif
+	return !(old & mask);
+}
+
+bool K3DTagSet::get(size_t tagID) const
+{
+	ASSERT(tagID < numTags);
+	K3DTagWord w;
+#ifdef K3D_TAG_ATOMIC_CAPTURE
+	#pragma omp atomic read
+	w=bits[tagID/K3D_TAG_BITS];
+#else
+	w=bits[tagID/K3D_TAG_BITS];
+#endif
+	return w & ((K3DTagWord)1 << (tagID%K3D_TAG_BITS));
+}
+
+size_t K3DTagSet::count() const
+{
+	size_t count=0;
+	for(size_t ui=0;ui<bits.size();ui++)
+	{
+		//Count set bits, one per iteration
+		for(K3DTagWord w=bits[ui]; w; w&=w-1)
+			count++;
+	}
+
+	return count;
+}
+
+void K3DTagSet::clear(const std::vector<size_t> &tagsToClear)
+{
+#pragma omp parallel for
+	for(size_t ui=0;ui<tagsToClear.size();ui++)
+		tag(tagsToClear[ui],false);
+}
+
+void K3DTagSet::clearAll()
+{
+	std::fill(bits.begin(),bits.end(),0);
+}
+
 void K3DTreeMk2::tag(size_t tagID, bool tagVal)
 {	
-	ASSERT(tagID < nodes.size());
-	nodes[tagID].tagged=tagVal;
+	tags.tag(tagID,tagVal);
+}
+
+bool K3DTreeMk2::claimTag(size_t tagID)
+{
+	return tags.claim(tagID);
 }
 
 bool K3DTreeMk2::getTag(size_t tagID) const
 {
-	ASSERT(tagID < nodes.size());
-	return nodes[tagID].tagged;
+	return tags.get(tagID);
 }
 
 size_t K3DTreeMk2::size() const
@@ -125,11 +236,38 @@ size_t K3DTreeMk2::size() const
 	return indexedPoints.size();
 }
 
-bool K3DTreeMk2::build()
+size_t K3DTreeMk2::partitionRange(size_t lo, size_t hi, unsigned int axis)
 {
-	ASSERT(progress); // Check progress pointer is inited
-	ASSERT(abort); //Check abort pointer is initialised
+	AxisCompareMk2 axisCmp;
+	axisCmp.setAxis(axis);
+
+	//Place the median in its sorted position, with all lower
+	// values to its left and higher or equal ones to its right.
+	// Note that hi is the INCLUSIVE upper end
+	size_t splitIndex=(lo+hi)/2;
+	std::nth_element(indexedPoints.begin()+lo,indexedPoints.begin()+splitIndex,
+			indexedPoints.begin()+hi+1,axisCmp);
+
+	//Slide the split up past any entries equal to the median. 
+	// This ensures that all data on the left of the sub-tree is <= 
+	// to the split value for the specified axis, and all on the right is >
+	const float splitVal=indexedPoints[splitIndex].first[axis];
+	size_t nEqual=0;
+	for(size_t ui=splitIndex+1;ui<=hi;ui++)
+	{
+		if(indexedPoints[ui].first[axis] == splitVal)
+		{
+			nEqual++;
+			std::swap(indexedPoints[ui],indexedPoints[splitIndex+nEqual]);
+		}
+	}
+
+	return splitIndex+nEqual;
+}
 
+bool K3DTreeMk2::buildSerial(size_t lo, size_t hi, size_t baseDepth, size_t *rootPtr,
+				size_t *numSeen, bool *aborted)
+{
 	using std::make_pair;
 
 	enum
@@ -139,44 +277,22 @@ bool K3DTreeMk2::build()
 		BUILT_BOTH
 	};
 
-	
-	//Clear any existing tags
-	clearAllTags();
-	maxDepth=0;
-
-	//No indexedPoints? That was easy.
-	if(indexedPoints.empty())
-		return true;
-
-	
-	ASSERT(treeBounds.isValid());
-
 	//Maintain a stack of nodeoffsets, and whether we have built the left hand side
 	stack<pair<size_t,size_t> > limits;
 	stack<char> buildStatus;
 	stack<size_t> splitStack;
 
-	//Data runs from 0 to size-1 INCLUSIVE
-	limits.push(make_pair(0,indexedPoints.size()-1));
+	//Data runs from lo to hi INCLUSIVE
+	limits.push(make_pair(lo,hi));
 	buildStatus.push(BUILT_NONE);
 	splitStack.push((size_t)-1);
 
-
-	AxisCompareMk2 axisCmp;
-
-	size_t numSeen=0; // for progress reporting	
+	size_t localSeen=0; // for progress reporting	
+	size_t localMaxDepth=0;
 	size_t splitIndex=0;
 
+	size_t *childPtr=rootPtr;
 
-	
-	size_t *childPtr;
-
-#ifdef DEBUG
-	for(size_t ui=0;ui<nodes.size();ui++)
-	{
-		nodes[ui].childLeft=nodes[ui].childRight=(size_t)-2;
-	}
-#endif
 	do
 	{
 
@@ -185,37 +301,14 @@ bool K3DTreeMk2::build()
 			case BUILT_NONE:
 			{
 				//OK, so we have not seen this data at this level before
-				int curAxis=(limits.size()-1)%3;
-				//First time we have seen this group? OK, we need to sort
+				unsigned int curAxis=(baseDepth+limits.size()-1)%3;
+				//First time we have seen this group? OK, we need to partition
 				//along its hyper plane.
-				axisCmp.setAxis(curAxis);
-			
-				//Sort data; note that the limits.top().second is the INCLUSIVE
-				// upper end.	
-				std::sort(indexedPoints.begin()+limits.top().first,
-						indexedPoints.begin() + limits.top().second+1,axisCmp);
-
-				//Initially assume that the mid node is the median; then we slide it up 
-				splitIndex=(limits.top().second+limits.top().first)/2;
-				
-				//Keep sliding the split towards the upper boundary until we hit a different
-				//data value. This ensure that all data on the left of the sub-tree is <= 
-				// to this data value for the specified sort axis
-				while(splitIndex != limits.top().second
-					&& indexedPoints[splitIndex].first.getValue(curAxis) ==
-				       		indexedPoints[splitIndex+1].first.getValue(curAxis))
-					splitIndex++;
+				splitIndex=partitionRange(limits.top().first,limits.top().second,curAxis);
 
 				buildStatus.top()++; //Increment the build status to "left" case.
 						
-
-				if(limits.size() ==1)
-				{
-					//root node
-					treeRoot=splitIndex;
-				}
-				else
-					*childPtr=splitIndex;
+				*childPtr=splitIndex;
 
 				//look to see if there is any left data
 				if(splitIndex >limits.top().first)
@@ -226,7 +319,7 @@ bool K3DTreeMk2::build()
 					
 					buildStatus.push(BUILT_NONE);
 					//Set the child pointer, as we don't know
-					//the correct value until the next sort.
+					//the correct value until the next partition.
 					childPtr=&nodes[splitIndex].childLeft;
 				}
 				else
@@ -254,7 +347,7 @@ bool K3DTreeMk2::build()
 					buildStatus.push(BUILT_NONE);
 
 					//Set the child pointer, as we don't know
-					//the correct value until the next sort.
+					//the correct value until the next partition.
 					childPtr=&nodes[splitIndex].childRight;
 				}
 				else
@@ -269,7 +362,7 @@ bool K3DTreeMk2::build()
 			{
 				ASSERT(nodes[splitStack.top()].childLeft != (size_t)-2
 					&& nodes[splitStack.top()].childRight!= (size_t)-2 );
-				maxDepth=std::max(maxDepth,limits.size());
+				localMaxDepth=std::max(localMaxDepth,baseDepth+limits.size());
 				//pop limits and build status.
 				limits.pop();
 				buildStatus.pop();
@@ -277,18 +370,119 @@ bool K3DTreeMk2::build()
 				ASSERT(limits.size() == buildStatus.size());
 				
 
-				numSeen++;
+				localSeen++;
 				break;
 			}
 		}	
 
-		*progress= (unsigned int)((float)numSeen/(float)nodes.size()*100.0f);
+		//Periodically report progress, and check for abort
+		if(localSeen == BUILD_PROGRESS_REDUCE)
+		{
+			#pragma omp atomic
+			*numSeen+=localSeen;
+			localSeen=0;
+#ifdef _OPENMP
+			if(!omp_get_thread_num())
+#endif
+				*progress= (unsigned int)((float)*numSeen/(float)nodes.size()*100.0f);
+
+			if(*abort)
+				*aborted=true;
+		}
 
-		if(*abort)
+		if(*aborted)
 			return false;
 
 	}while(!limits.empty());
 
+	#pragma omp atomic
+	*numSeen+=localSeen;
+
+	#pragma omp critical
+	maxDepth=std::max(maxDepth,localMaxDepth);
+
+	return true;
+}
+
+void K3DTreeMk2::buildSubtree(size_t lo, size_t hi, size_t depth, size_t *rootPtr,
+				size_t *numSeen, bool *aborted)
+{
+	if(*aborted)
+		return;
+
+	//Small subtrees (or deep ones, which can arise from many
+	// coincident points) are built serially, within this task
+	if(hi-lo+1 < PARALLEL_BUILD_MIN_SIZE || depth >= PARALLEL_BUILD_MAX_DEPTH)
+	{
+		buildSerial(lo,hi,depth,rootPtr,numSeen,aborted);
+		return;
+	}
+
+	size_t splitIndex=partitionRange(lo,hi,depth%3);
+	*rootPtr=splitIndex;
+
+	//Each side of the split is disjoint, so can be built concurrently
+	if(splitIndex > lo)
+	{
+		size_t *leftPtr=&nodes[splitIndex].childLeft;
+		#pragma omp task firstprivate(lo,splitIndex,depth,leftPtr,numSeen,aborted)
+		buildSubtree(lo,splitIndex-1,depth+1,leftPtr,numSeen,aborted);
+	}
+	else
+		nodes[splitIndex].childLeft=(size_t)-1;
+
+	if(splitIndex < hi)
+	{
+		size_t *rightPtr=&nodes[splitIndex].childRight;
+		#pragma omp task firstprivate(hi,splitIndex,depth,rightPtr,numSeen,aborted)
+		buildSubtree(splitIndex+1,hi,depth+1,rightPtr,numSeen,aborted);
+	}
+	else
+		nodes[splitIndex].childRight=(size_t)-1;
+
+	#pragma omp atomic
+	(*numSeen)++;
+}
+
+bool K3DTreeMk2::build()
+{
+	ASSERT(progress); // Check progress pointer is inited
+	ASSERT(abort); //Check abort pointer is initialised
+
+	//Clear any existing tags
+	clearAllTags();
+	maxDepth=0;
+
+	//No indexedPoints? That was easy.
+	if(indexedPoints.empty())
+		return true;
+
+	
+	ASSERT(treeBounds.isValid());
+
+#ifdef DEBUG
+	for(size_t ui=0;ui<nodes.size();ui++)
+	{
+		nodes[ui].childLeft=nodes[ui].childRight=(size_t)-2;
+	}
+#endif
+
+	size_t numSeen=0;
+	bool aborted=false;
+
+	//Recursively partition the data, spawning tasks for
+	// each half of the larger subtrees
+	#pragma omp parallel
+	{
+		#pragma omp single
+		buildSubtree(0,indexedPoints.size()-1,0,&treeRoot,&numSeen,&aborted);
+	}
+
+	if(aborted)
+		return false;
+
+	*progress=100;
+
 #ifdef DEBUG
 	for(unsigned int ui=0;ui<nodes.size();ui++)
 	{
@@ -396,6 +590,29 @@ void K3DTreeMk2::ptsInSphere(const Point3D &origin, float radius,
 
 size_t K3DTreeMk2::findNearestUntagged(const Point3D &searchPt,
 				const BoundCube &domainCube, bool shouldTag, size_t pseudoRoot)
+{
+	return findNearestUntagged(searchPt,domainCube,tags,shouldTag,pseudoRoot);
+}
+
+size_t K3DTreeMk2::findNearestUntagged(const Point3D &searchPt,
+				const BoundCube &domainCube, K3DTagSet &searchTags,
+				bool shouldTag, size_t pseudoRoot) const
+{
+	ASSERT(searchTags.size() == nodes.size());
+	size_t bestPoint;
+	//If another thread claims the point between our search
+	// and our tagging, search again
+	do
+	{
+		bestPoint=searchNearestUntagged(searchPt,domainCube,searchTags,pseudoRoot);
+	}while(shouldTag && bestPoint != (size_t)-1 && !searchTags.claim(bestPoint));
+
+	return bestPoint;
+}
+
+size_t K3DTreeMk2::searchNearestUntagged(const Point3D &searchPt,
+				const BoundCube &domainCube, const K3DTagSet &searchTags,
+				size_t pseudoRoot) const
 {
 	//Tree must be built!
 	ASSERT(treeRoot < nodes.size() && maxDepth <=nodes.size())
@@ -440,7 +657,7 @@ size_t K3DTreeMk2::findNearestUntagged(const Point3D &searchPt,
 	curNode=startNode;
 
 	//check start node	
-	if(!nodes[curNode].tagged)
+	if(!searchTags.get(curNode))
 	{
 		float tmpDistSqr;
 		tmpDistSqr = indexedPoints[curNode].first.sqrDist(searchPt); 
@@ -595,7 +812,7 @@ size_t K3DTreeMk2::findNearestUntagged(const Point3D &searchPt,
 				//to "best" (i.e. nearest untagged) node.
 				//To promote, it mustn't be tagged, and it must
 				//be closer than cur best estimate.
-				if(!nodes[curNode].tagged)
+				if(!searchTags.get(curNode))
 				{
 					float tmpDistSqr;
 					tmpDistSqr = indexedPoints[curNode].first.sqrDist(searchPt); 
@@ -639,8 +856,6 @@ size_t K3DTreeMk2::findNearestUntagged(const Point3D &searchPt,
 	//Keep going until we meet the root node for the third time (one left, one right, one finish)	
 	}while(!(curNode== startNode &&  visit== NODE_THIRD_VISIT));
 
-	if(bestPoint != (size_t) -1)
-		nodes[bestPoint].tagged|=shouldTag;
 	return bestPoint;	
 
 }
@@ -691,7 +906,7 @@ size_t K3DTreeMk2::findNearestWithSkip(const Point3D &searchPt,
 	curNode=startNode;
 
 	//check start node and that we have not seen this already	
-	if(!(nodes[curNode].tagged  || (skipPts.find(curNode) !=skipPts.end() )) )
+	if(!(getTag(curNode)  || (skipPts.find(curNode) !=skipPts.end() )) )
 	{
 		float tmpDistSqr;
 		tmpDistSqr = indexedPoints[curNode].first.sqrDist(searchPt); 
@@ -846,7 +1061,7 @@ size_t K3DTreeMk2::findNearestWithSkip(const Point3D &searchPt,
 				//to "best" (i.e. nearest untagged) node.
 				//To promote, it mustn't be tagged, and it must
 				//be closer than cur best estimate.
-				if(!(nodes[curNode].tagged || (skipPts.find(curNode) !=skipPts.end()) ) )
+				if(!(getTag(curNode) || (skipPts.find(curNode) !=skipPts.end()) ) )
 				{
 					float tmpDistSqr;
 					tmpDistSqr = indexedPoints[curNode].first.sqrDist(searchPt); 
@@ -1051,29 +1266,17 @@ size_t K3DTreeMk2::getBoxInTree(const BoundCube &box) const
 
 size_t K3DTreeMk2::tagCount() const
 {
-	size_t count=0;
-	for(size_t ui=0;ui<nodes.size();ui++)
-	{
-		if(nodes[ui].tagged)
-			count++;
-	
-	}
-
-	return count;
+	return tags.count();
 }
 
 void K3DTreeMk2::clearTags(std::vector<size_t> &tagsToClear)
 {
-#pragma omp parallel for
-	for(size_t ui=0;ui<tagsToClear.size();ui++)
-		nodes[tagsToClear[ui]].tagged=false;
+	tags.clear(tagsToClear);
 }
 
 void K3DTreeMk2::clearAllTags()
 {
-#pragma omp parallel for
-	for(size_t ui=0;ui<nodes.size();ui++)
-		nodes[ui].tagged=false;
+	tags.clearAll();
 }
 
 
@@ -1125,6 +1328,74 @@ bool K3DMk2Tests()
 	TEST(tree.getBoxInTree(testBox)==2,"subtree test pt2");
 	//---
 
+	//Build a tree large enough to be constructed in parallel,
+	// with some coincident points, and check against brute force
+	//---
+	RandNumGen rng;
+	rng.initialise(1234);
+	pts.resize(100000);
+	for(size_t ui=0;ui<pts.size();ui++)
+	{
+		if(ui%10)
+			pts[ui]=Point3D(rng.genUniformDev(),rng.genUniformDev(),rng.genUniformDev());
+		else
+			pts[ui]=Point3D(0.5,0.5,rng.genUniformDev());
+	}
+
+	tree.resetPts(pts,false);
+	TEST(tree.build(),"parallel tree build");
+	TEST(tree.size() == pts.size(),"parallel tree size");
+	tree.getBoundCube(dummyCube);
+
+	for(size_t ui=0;ui<20;ui++)
+	{
+		Point3D q(rng.genUniformDev(),rng.genUniformDev(),rng.genUniformDev());
+
+		float bestSqrDist=std::numeric_limits<float>::max();
+		for(size_t uj=0;uj<pts.size();uj++)
+			bestSqrDist=std::min(bestSqrDist,q.sqrDist(pts[uj]));
+
+		resultIdx=tree.findNearestUntagged(q,dummyCube,false);
+		TEST(resultIdx != (size_t)-1,"parallel tree NN found");
+		TEST(tree.getPtRef(resultIdx).sqrDist(q) == bestSqrDist,"parallel tree NN distance");
+		TEST(tree.getPtRef(resultIdx).sqrDist(pts[tree.getOrigIndex(resultIdx)]) ==0,"parallel tree index map");
+	}
+	//---
+
+	//Have several threads consume the tree concurrently, and
+	// check that each point is claimed by exactly one of them
+	//---
+	pts.resize(20000);
+	tree.resetPts(pts,false);
+	TEST(tree.build(),"claim tree build");
+	tree.getBoundCube(dummyCube);
+
+	vector<unsigned int> claimCount(pts.size(),0);
+#pragma omp parallel for
+	for(size_t ui=0;ui<100;ui++)
+	{
+		Point3D q(ui/100.0f,0.5,0.5);
+		size_t idx;
+		while((idx=tree.findNearestUntagged(q,dummyCube,true)) != (size_t)-1)
+		{
+			#pragma omp atomic
+			claimCount[idx]++;
+		}
+	}
+
+	TEST(tree.tagCount() == pts.size(),"concurrent tag count");
+	for(size_t ui=0;ui<claimCount.size();ui++)
+	{
+		TEST(claimCount[ui] == 1,"concurrent claim unique");
+	}
+
+	tree.clearAllTags();
+	TEST(!tree.tagCount(),"clear tags");
+	TEST(tree.claimTag(5) && !tree.claimTag(5),"claim tag");
+	tree.tag(5,false);
+	TEST(!tree.getTag(5),"untag");
+	//---
+
 	return true;
 
 }
@@ -31,6 +31,12 @@
 //	- Improved build performance by minimising memory allocation calls
 //	  and avoiding recursive implementations
 //	- index based construction for smaller in-tree storage
+//	- parallel construction, by partitioning subtrees concurrently
+//	- tags held in a separate bitset, which may be claimed atomically,
+//	  so that several threads can search and tag the same tree. The
+//	  bitset may also be held outside the tree, so that a shared (const)
+//	  tree can be searched with each user's own tags
+
 
 
 //!Functor allowing for sorting of points in 3D
@@ -57,11 +63,45 @@ class K3DNodeMk2
 		size_t childLeft;
 		//Index of right child in parent tree array. -1 if no child
 		size_t childRight;
+};
 
-		//Has this point been marked by an external algorithm?
-		bool tagged;
+//!Storage word for the tag bitset
+typedef unsigned long long K3DTagWord;
+//!Number of tags held in each K3DTagWord
+const unsigned int K3D_TAG_BITS=64;
+
+//!Tag bit for each point of a tree, marking points visited by an external
+// algorithm. Tags may be set and claimed atomically, from several threads
+class K3DTagSet
+{
+	private:
+		std::vector<K3DTagWord> bits;
+		size_t numTags;
+	public:
+		K3DTagSet() : numTags(0) {}
+
+		//!Hold nTags tags, all cleared
+		void init(size_t nTags);
+		//!Number of tags held
+		size_t size() const { return numTags;}
+
+		//!Mark a point as tagged (or untagged, if tagVal=false)
+		void tag(size_t tagID, bool tagVal=true);
+		//!Atomically tag a point. Returns true if the point was untagged,
+		// i.e. this caller now owns it, false if it was already tagged
+		bool claim(size_t tagID);
+		//!Obtain the tag status of a point
+		bool get(size_t tagID) const;
+
+		//!Number of tagged points
+		size_t count() const;
+		//!Reset the given tags
+		void clear(const std::vector<size_t> &tagsToClear);
+		//!Reset all tags
+		void clearAll();
 };
 
+
 //!3D specific KD tree
 class K3DTreeMk2
 {
@@ -76,6 +116,10 @@ class K3DTreeMk2
 		//!Tree node array (stores parent->child relations)
 		std::vector<K3DNodeMk2> nodes;
 
+		//!Tags for searches that do not supply their own
+		K3DTagSet tags;
+
+
 		//!total size of array
 		size_t arraySize;
 
@@ -87,6 +131,22 @@ class K3DTreeMk2
 		static unsigned int *progress; //Progress counter
 		static ATOMIC_BOOL *abort; //set to true if build should abort. Must be initalised prior to build
 
+		//!Partition the inclusive range [lo,hi] about its median along the given axis,
+		// returning the index of the split node
+		size_t partitionRange(size_t lo, size_t hi, unsigned int axis);
+		//!Build the subtree spanning [lo,hi] using a single thread, writing its root to rootPtr.
+		// returns false if aborted
+		bool buildSerial(size_t lo, size_t hi, size_t depth, size_t *rootPtr,
+					size_t *numSeen, bool *aborted);
+		//!Build the subtree spanning [lo,hi], spawning OpenMP tasks for each large child
+		void buildSubtree(size_t lo, size_t hi, size_t depth, size_t *rootPtr,
+					size_t *numSeen, bool *aborted);
+
+		//!Find the nearest point that is untagged in searchTags, without tagging it
+		size_t searchNearestUntagged(const Point3D &queryPt,
+				const BoundCube &b, const K3DTagSet &searchTags, size_t pseudoRoot) const;
+
+
 	public:
 		//KD Tree constructor
 		K3DTreeMk2(){};
@@ -110,11 +170,12 @@ class K3DTreeMk2
 
 		/*! Builds a balanced KD tree from a list of points
 		 *  previously set by "resetPts". returns false if callback returns
-		 *  false;
+		 *  false; Subtrees are built in parallel, when OpenMP is available
 		 */	
 		bool build();
 
-		void getBoundCube(BoundCube &b);
+		void getBoundCube(BoundCube &b) const;
+
 
 		//!Textual output of tree. tabs are used to separate different levels of the tree
 		/*!The output from this function can be quite large for even modest trees. 
@@ -125,9 +186,16 @@ class K3DTreeMk2
 		//Find the nearest "untagged" point's internal index.
 		//Mark the found point as "tagged" in the tree. Returns -1 on failure (no untagged points)
 		// optionaly, a sub-root branch of the tree can be specified, eg based upon range query,
-		// in order to speed up search
+		// in order to speed up search. When tagging, this may be called concurrently;
+		// each point is only returned to the thread that succeeds in claiming it
 		size_t findNearestUntagged(const Point3D &queryPt,
 						const BoundCube &b, bool tag=true,size_t pseudoRoot=(size_t)-1);
+		//As above, but using (and tagging) the given tags, which must hold one
+		// tag per point, in place of the tree's own. The tree is not modified
+		size_t findNearestUntagged(const Point3D &queryPt,
+						const BoundCube &b, K3DTagSet &searchTags, bool tag=true,
+						size_t pseudoRoot=(size_t)-1) const;
+
 
 		//Find the nearest "untagged" point's internal index.
 		// Skip any of the listed points.
@@ -168,11 +236,15 @@ class K3DTreeMk2
 		
 
 		//Erase tree contents
-		void clear() { nodes.clear(); indexedPoints.clear();};
+		void clear() { nodes.clear(); indexedPoints.clear(); tags.init(0);};
 
 		//mark a point as "tagged" (or untagged,if tagVal=false) via its tree index.
 		void tag(size_t tagID,bool tagVal=true) ;
 
+		//Atomically tag a point. Returns true if the point was untagged,
+		// i.e. this caller now owns it, false if it was already tagged
+		bool claimTag(size_t tagID);
+
 		//obtain the tag status for a given point, using the tree index
 		bool getTag(size_t treeIndex) const ;
 
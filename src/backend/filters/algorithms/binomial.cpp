@@ -28,6 +28,10 @@
 #include <utility>
 #include <numeric>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 using std::pair;
 using std::vector;
 using std::map;
@@ -61,44 +65,83 @@ int countBinnedIons(const std::vector<IonHit> &ions, const RangeFile *rng,
 			const std::vector<size_t> &selectedIons, const SEGMENT_OPTION &segmentOptions,
 			vector<GRID_ENTRY> &completedGridEntries)
 {
+	BINOMIAL_IONS prepared;
+	int errCode;
+	errCode=prepareBinomialIons(ions,rng,selectedIons,
+			segmentOptions.extrusionDirection,prepared);
+	if(errCode)
+		return errCode;
+
+	return countBinnedIons(prepared,segmentOptions,completedGridEntries);
+}
 
-	//Step 1 - filter the ions to only the ranges we want to examine
-	std::vector<IonHit> filteredIons;
-
-	//Convert the selection into a map.
-	map<size_t,size_t> selectionMapping;
+int prepareBinomialIons(const std::vector<IonHit> &ions, const RangeFile *rng,
+			const std::vector<size_t> &selectedIons, unsigned int extrusionAxis,
+			BINOMIAL_IONS &prepared)
+{
+	//Convert the selection into a lookup table, by range ID
+	vector<unsigned int> selectionMapping(rng->getNumIons(),(unsigned int)-1);
 	for(size_t ui=0;ui<selectedIons.size();ui++)
 	{
 		ASSERT(selectedIons[ui] < rng->getNumIons());
 		selectionMapping[selectedIons[ui]] = ui;
 	}
 
-	//Filter ions by ranging
-	for(size_t ui=0;ui<ions.size();ui++)
+	//Filter ions by ranging, recording the selection ID of each, and
+	// their position along the extrusion axis
+	vector<pair<float,size_t> > axisOrder;
+	vector<size_t> ionIndex;
+	vector<unsigned int> ionSelection;
+	try
 	{
-		unsigned int ionID;
-		ionID = rng->getIonID(ions[ui].getMassToCharge());
+		for(size_t ui=0;ui<ions.size();ui++)
+		{
+			unsigned int ionID;
+			ionID = rng->getIonID(ions[ui].getMassToCharge());
+			
+			//Skip unranged ions
+			if(ionID == (unsigned int)-1)
+				continue;
+
+			axisOrder.push_back(std::make_pair(ions[ui].getPos()[extrusionAxis],ionIndex.size()));
+			ionIndex.push_back(ui);
+			ionSelection.push_back(selectionMapping[ionID]);
+		}
 		
-		//Skip unranged ions
-		if(ionID == (unsigned int)-1)
-			continue;
+		// Sort the ions according to their position along the extrusion axis
+		std::sort(axisOrder.begin(),axisOrder.end(),ComparePairFirst());
 
-		filteredIons.push_back(ions[ui]);
+		prepared.pos.resize(axisOrder.size());
+		prepared.selectionId.resize(axisOrder.size());
+		for(size_t ui=0;ui<axisOrder.size();ui++)
+		{
+			size_t offset=axisOrder[ui].second;
+			prepared.pos[ui]=ions[ionIndex[offset]].getPos();
+			prepared.selectionId[ui]=ionSelection[offset];
+		}
 	}
-	
+	catch(std::bad_alloc)
+	{
+		return BINOMIAL_NO_MEM;
+	}
+
 	//Obtain the bounding box for the filtered ions
-	BoundCube totalBound;
-	IonHit::getBoundCube(filteredIons,totalBound);
+	prepared.bound.setBounds(prepared.pos);
+	prepared.extrusionAxis=extrusionAxis;
+	prepared.nSelected=selectedIons.size();
 
-	// Sort the ions according to their Z value
-	//--
-	unsigned int extrusionAxis=segmentOptions.extrusionDirection;
-	IonAxisCompare axisCmp(extrusionAxis);
+	return 0;
+}
 
-	std::sort(filteredIons.begin(),
-			filteredIons.end(),axisCmp);
+int countBinnedIons(const BINOMIAL_IONS &prepared, const SEGMENT_OPTION &segmentOptions,
+			vector<GRID_ENTRY> &completedGridEntries)
+{
+	ASSERT(segmentOptions.extrusionDirection == prepared.extrusionAxis);
 
-	//--
+	const vector<Point3D> &filteredIons=prepared.pos;
+	const BoundCube &totalBound=prepared.bound;
+	const size_t nSelected=prepared.nSelected;
+	unsigned int extrusionAxis=prepared.extrusionAxis;
 
 	unsigned int direction[2];
 	float binLen[2];
@@ -152,11 +195,6 @@ int countBinnedIons(const std::vector<IonHit> &ions, const RangeFile *rng,
 		return BINOMIAL_NO_MEM;
 	}
 
-#ifdef DEBUG
-	BoundCube wrappingBound=totalBound;
-	wrappingBound.expand(0.1f);
-#endif
-
 	//Initialise the grid entries
 	//--
 	float zStart = totalBound.getBound(extrusionAxis,0);
@@ -164,7 +202,7 @@ int countBinnedIons(const std::vector<IonHit> &ions, const RangeFile *rng,
 	for(size_t ui=0;ui<nGrids;ui++)
 	{
 		//Set the start and end 
-		gridEntries[ui].nIons.resize(selectedIons.size(),0);
+		gridEntries[ui].nIons.resize(nSelected,0);
 		gridEntries[ui].totalIons=0;
 		gridEntries[ui].startPt[extrusionAxis]=gridEntries[ui].endPt[extrusionAxis]=zStart;
 
@@ -181,29 +219,19 @@ int countBinnedIons(const std::vector<IonHit> &ions, const RangeFile *rng,
 		//Find the X y division for the ion
 		unsigned int xPos,yPos;
 		Point3D ionOffset;
-		ionOffset=filteredIons[ui].getPos() - lowBound;
+		ionOffset=filteredIons[ui] - lowBound;
 		xPos =ionOffset[direction[0]]/binLen[0];
 		yPos = ionOffset[direction[1]]/binLen[1];
 
 		
-		//Find the bin that this new ion is in,
-		// and its range value
-		unsigned int binIdx,selectionId,range;
+		//Find the bin that this new ion is in
+		unsigned int binIdx,selectionId;
 		binIdx = rowMajorOffset(xPos,yPos,nBins[1]);
-		
-		//get range
-		range=rng->getIonID(filteredIons[ui].getMassToCharge());
-		ASSERT(range!=(unsigned int)-1);
-
-		//convert range ID to selection ID
-		//TODO: It might be faster not use the map, but rather
-		// to use a fixed (but oversized) array to do the idx remapping.
-		// the mem cost is pretty negligible for any sensible use case
-		ASSERT(selectionMapping.find(range) != selectionMapping.end());
-		selectionId= selectionMapping.find(range)->second;
 
 		//Increment the nIons for the given bin
-		gridEntries[binIdx].nIons[selectionId]++;
+		selectionId= prepared.selectionId[ui];
+		if(selectionId != (unsigned int)-1)
+			gridEntries[binIdx].nIons[selectionId]++;
 		gridEntries[binIdx].totalIons++;
 
 		//Update grid end
@@ -214,15 +242,15 @@ int countBinnedIons(const std::vector<IonHit> &ions, const RangeFile *rng,
 		{
 #ifdef DEBUG
 			//Set the grid end
-			gridEntries[binIdx].endPt[extrusionAxis] = filteredIons[ui].getPos()[extrusionAxis];
+			gridEntries[binIdx].endPt[extrusionAxis] = filteredIons[ui][extrusionAxis];
 #endif
 			completedGridEntries.push_back(gridEntries[binIdx]);
 
 			//Reset the grid for the next round
 			// TODO: Should we initialise zStart to this ion,
 			//   or should we snap it to the next ion we encounter?
-			gridEntries[binIdx].startPt[extrusionAxis] =filteredIons[ui].getPos()[extrusionAxis];
-			gridEntries[binIdx].endPt[extrusionAxis]=filteredIons[ui].getPos()[extrusionAxis];
+			gridEntries[binIdx].startPt[extrusionAxis] =filteredIons[ui][extrusionAxis];
+			gridEntries[binIdx].endPt[extrusionAxis]=filteredIons[ui][extrusionAxis];
 
 			//Set the box x-y (where extrusion=z)  coordinates.
 			setGridABCoords(binIdx,direction,nBins,
@@ -231,8 +259,8 @@ int countBinnedIons(const std::vector<IonHit> &ions, const RangeFile *rng,
 			//Set the start for the next grid, but not the end
 			gridEntries[binIdx].startPt.setValue(extrusionAxis,gridEntries[binIdx].startPt[extrusionAxis]);
 			
-			for(size_t ui=0;ui<selectedIons.size();ui++)
-				gridEntries[binIdx].nIons[ui]=0;
+			for(size_t uj=0;uj<nSelected;uj++)
+				gridEntries[binIdx].nIons[uj]=0;
 			gridEntries[binIdx].totalIons=0;
 
 		}
@@ -265,6 +293,75 @@ int countBinnedIons(const std::vector<IonHit> &ions, const RangeFile *rng,
 	return 0;
 }
 
+int binomialBlockSizeSweep(const BINOMIAL_IONS &prepared, const SEGMENT_OPTION &segmentOptions,
+			const vector<size_t> &blockSizes, vector<BINOMIAL_STATS> &stats,
+			vector<char> &statsOK, unsigned int *progress, ATOMIC_BOOL &wantAbort)
+{
+	stats.resize(blockSizes.size());
+	statsOK.assign(blockSizes.size(),0);
+
+	//Each block size is binned by one thread, into its own grid. 
+	// Larger blocks are quicker to bin, so hand out work dynamically
+	size_t nDone=0;
+	bool spin=false,memFail=false;
+#pragma omp parallel for schedule(dynamic)
+	for(size_t ui=0;ui<blockSizes.size();ui++)
+	{
+		if(spin)
+			continue;
+
+		SEGMENT_OPTION opts=segmentOptions;
+		opts.nIons=blockSizes[ui];
+
+		bool ok=false;
+		try
+		{
+			vector<GRID_ENTRY> gridEntries;
+			if(countBinnedIons(prepared,opts,gridEntries))
+			{
+				#pragma omp critical
+				memFail=true;
+				spin=true;
+				continue;
+			}
+
+			if(gridEntries.size())
+			{
+				BINOMIAL_HIST binHist;
+				genBinomialHistogram(gridEntries,prepared.nSelected,binHist);
+				computeBinomialStats(gridEntries,binHist,prepared.nSelected,stats[ui]);
+				ok=true;
+			}
+		}
+		catch(std::bad_alloc)
+		{
+			#pragma omp critical
+			memFail=true;
+			spin=true;
+			continue;
+		}
+		statsOK[ui]=ok;
+
+		#pragma omp atomic
+		nDone++;
+#ifdef _OPENMP
+		if(!omp_get_thread_num())
+#endif
+		{
+			*progress= (unsigned int)((float)nDone/(float)blockSizes.size()*100.0f);
+			if(wantAbort)
+				spin=true;
+		}
+	}
+
+	if(memFail)
+		return BINOMIAL_NO_MEM;
+	if(spin || wantAbort)
+		return BINOMIAL_ABORT;
+
+	return 0;
+}
+
 //Vector output is a vector of frequency vectors
 void genBinomialHistogram(const vector<GRID_ENTRY> &completedGridEntries,
 				unsigned int nSelected, BINOMIAL_HIST &binHist)
@@ -496,6 +593,7 @@ bool testBinomialBinning();
 bool testBinomialGSLChi();
 bool testBinomialRandomnessTruePositive();
 bool testBinomialRandomnessTrueNegative();
+bool testBinomialSweep();
 
 
 bool testBinomial()
@@ -504,6 +602,7 @@ bool testBinomial()
 	TEST(testBinomialBinning(),"Binomial Binning");
 	TEST(testBinomialRandomnessTruePositive(),"Binomial random correctly detected");
 	TEST(testBinomialRandomnessTrueNegative(),"Binomial non-random correclty deteced");
+	TEST(testBinomialSweep(),"Binomial block size sweep");
 	return true;
 }
 
@@ -778,6 +877,94 @@ bool testBinomialBinning()
 
 	return true;
 }
+
+bool testBinomialSweep()
+{
+	RangeFile rng;
+	RGBf col;
+	col.red=col.green=col.blue=0.5f;
+	rng.addIon("A","A",col);
+	rng.addIon("B","B",col);
+	rng.addIon("C","C",col);
+	rng.addRange(0.5,1.4,rng.getIonID("A"));
+	rng.addRange(1.5,2.4,rng.getIonID("B"));
+	rng.addRange(2.5,3.4,rng.getIonID("C"));
+
+	RandNumGen rnd;
+	rnd.initTimer();
+	vector<IonHit> ions(20000);
+	for(unsigned int ui=0;ui<ions.size(); ui++)
+	{
+		ions[ui].setPos(100.0f*rnd.genUniformDev(),100.0f*rnd.genUniformDev(),
+					100.0f*rnd.genUniformDev());
+		ions[ui].setMassToCharge( 1 + (ui %3));
+	}
+
+	//C is not selected, but still fills blocks
+	vector<size_t> selectedIons;
+	selectedIons.push_back(0);
+	selectedIons.push_back(1);
+
+	SEGMENT_OPTION segOpt;
+	segOpt.extrusionDirection=2;
+	segOpt.extrudeMaxRatio=1000;
+	segOpt.strategy=BINOMIAL_SEGMENT_AUTO_BRICK;
+
+	BINOMIAL_IONS prepared;
+	TEST(!prepareBinomialIons(ions,&rng,selectedIons,segOpt.extrusionDirection,prepared),"prepare");
+	TEST(prepared.pos.size() == ions.size(),"prepared count");
+	for(size_t ui=1;ui<prepared.pos.size();ui++)
+	{
+		TEST(prepared.pos[ui-1][2] <= prepared.pos[ui][2],"prepared order");
+	}
+
+	vector<size_t> blockSizes;
+	blockSizes.push_back(30);
+	blockSizes.push_back(60);
+	blockSizes.push_back(120);
+	blockSizes.push_back(1000000);
+
+	vector<BINOMIAL_STATS> stats;
+	vector<char> statsOK;
+	unsigned int dummyProg;
+	ATOMIC_BOOL wantAbort(false);
+	TEST(!binomialBlockSizeSweep(prepared,segOpt,blockSizes,stats,statsOK,
+				&dummyProg,wantAbort),"sweep");
+	TEST(stats.size() == blockSizes.size(),"sweep size");
+
+	//Sweep results should match binning each size separately
+	for(size_t ui=0;ui<blockSizes.size()-1;ui++)
+	{
+		segOpt.nIons=blockSizes[ui];
+		vector<GRID_ENTRY> g;
+		TEST(!countBinnedIons(ions,&rng,selectedIons,segOpt,g),"single binning");
+		TEST(g.size(),"blocks found");
+		TEST(statsOK[ui],"sweep stats ok");
+
+		size_t nSelectedCounted=0;
+		for(size_t uj=0;uj<g.size();uj++)
+			nSelectedCounted+=g[uj].nIons[0]+g[uj].nIons[1];
+		//Roughly two thirds of each block is selected
+		TEST(nSelectedCounted < g.size()*blockSizes[ui],"unselected ions fill blocks");
+
+		BINOMIAL_HIST binHist;
+		genBinomialHistogram(g,selectedIons.size(),binHist);
+		BINOMIAL_STATS single;
+		computeBinomialStats(g,binHist,selectedIons.size(),single);
+
+		TEST(single.nBlocks == stats[ui].nBlocks,"sweep block count");
+		for(size_t uj=0;uj<selectedIons.size();uj++)
+		{
+			TEST(single.chiSquare[uj] == stats[ui].chiSquare[uj],"sweep chi-square");
+			TEST(single.comparisonCoeff[uj] == stats[ui].comparisonCoeff[uj],"sweep mu");
+		}
+	}
+
+	//Oversize blocks are never filled
+	TEST(!statsOK.back(),"oversize block");
+
+	return true;
+}
 #endif
 
 
@@ -84,10 +84,27 @@ struct GRID_ENTRY
 	unsigned int totalIons;
 };
 
+//Ranged ions, prepared for binning. This does not depend upon the block
+// size, so may be shared when binning with several block sizes
+struct BINOMIAL_IONS
+{
+	//Ion positions, sorted along the extrusion axis
+	std::vector<Point3D> pos;
+	//Offset of each ion's range in the selected ions, or -1 if not selected
+	std::vector<unsigned int> selectionId;
+	//Bounds of the ions
+	BoundCube bound;
+	//Axis the ions are sorted along
+	unsigned int extrusionAxis;
+	//Number of selected ion types
+	size_t nSelected;
+};
+
 //Binomial algorithm error codes
 enum
 {
 	BINOMIAL_NO_MEM=1,
+	BINOMIAL_ABORT,
 	BINOMIAL_ERR_END
 };
 
@@ -96,6 +113,25 @@ int countBinnedIons(const std::vector<IonHit> &ions, const RangeFile *rng,
 			const std::vector<size_t> &selectedIons, const SEGMENT_OPTION &segmentOptions,
 			std::vector<GRID_ENTRY> &completedGridEntries);
 
+//Range, and sort, the ions for binning. Ions of unselected ranges count
+// towards filling a block, but are not counted as any species in it
+int prepareBinomialIons(const std::vector<IonHit> &ions, const RangeFile *rng,
+			const std::vector<size_t> &selectedIons, unsigned int extrusionAxis,
+			BINOMIAL_IONS &prepared);
+
+//As countBinnedIons, for prepared ions. The extrusion direction of 
+// the segment options must match that used to prepare the ions
+int countBinnedIons(const BINOMIAL_IONS &prepared, const SEGMENT_OPTION &segmentOptions,
+			std::vector<GRID_ENTRY> &completedGridEntries);
+
+//Compute binomial statistics for each of several block sizes, in parallel.
+// The block size (nIons) in the segment options is replaced by each entry of blockSizes.
+// statsOK is zero for block sizes that yielded no blocks. It is a vector<char>, not
+// vector<bool>, as each thread writes its own entry
+int binomialBlockSizeSweep(const BINOMIAL_IONS &prepared, const SEGMENT_OPTION &segmentOptions,
+			const std::vector<size_t> &blockSizes, std::vector<BINOMIAL_STATS> &stats,
+			std::vector<char> &statsOK, unsigned int *progress, ATOMIC_BOOL &wantAbort);
+
 //Generate a vector of ion frequencies in histogram of segment counts, 
 void genBinomialHistogram(const std::vector<GRID_ENTRY> &completedGridEntries,
 				unsigned int nSelected, BINOMIAL_HIST &binHist);
@@ -0,0 +1,471 @@
+/*
+ * cellList.cpp  - Uniform grid (cell list) for fixed-radius neighbour searches
+ * Copyright (C) 2015  D. Haley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cellList.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <new>
+
+using std::vector;
+using std::pair;
+
+//Maximum number of cells to allocate per point. Beyond this, the
+// cells are enlarged, to bound the memory used on sparse data
+const size_t CELLLIST_CELLS_PER_POINT=4;
+
+static inline const Point3D &getPos(const Point3D &p) { return p;}
+static inline const Point3D &getPos(const IonHit &h) { return h.getPosRef();}
+
+static void getBounds(const vector<Point3D> &pts, BoundCube &b) { b.setBounds(pts);}
+static void getBounds(const vector<IonHit> &pts, BoundCube &b) { IonHit::getBoundCube(pts,b);}
+
+CellList::CellList() : cellSize(0), invCellSize(0)
+{
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		origin[ui]=0;
+		dims[ui]=0;
+	}
+}
+
+template<class T>
+unsigned int CellList::buildImpl(const vector<T> &pts, float minCellSize,
+		unsigned int &progress, ATOMIC_BOOL &wantAbort)
+{
+	ASSERT(minCellSize > 0);
+	clear();
+	progress=0;
+	if(pts.empty())
+	{
+		progress=100;
+		return 0;
+	}
+
+	//Lay out the grid over the data
+	BoundCube bc;
+	getBounds(pts,bc);
+	const size_t maxCells=std::max(pts.size()*CELLLIST_CELLS_PER_POINT,(size_t)1);
+	cellSize=minCellSize;
+	for(;;)
+	{
+		double nCells=1;
+		for(unsigned int ui=0;ui<3;ui++)
+			nCells*=floor((bc.getBound(ui,1)-bc.getBound(ui,0))/cellSize)+1;
+
+		if(nCells <= maxCells)
+			break;
+		//Grow the cells to roughly meet the limit, with some margin for the rounding
+		cellSize*=1.01*pow(nCells/(double)maxCells,1.0/3.0);
+	}
+	invCellSize=1.0f/cellSize;
+	size_t numCells=1;
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		origin[ui]=bc.getBound(ui,0);
+		dims[ui]=(size_t)((bc.getBound(ui,1)-origin[ui])*invCellSize)+1;
+		numCells*=dims[ui];
+	}
+
+	//Find each point's cell, and sort by cell.
+	// Ties are broken by original index, so the layout is deterministic.
+	vector<pair<size_t,size_t> > keys(pts.size());
+	#pragma omp parallel for
+	for(size_t ui=0;ui<pts.size();ui++)
+	{
+		const Point3D &p=getPos(pts[ui]);
+		size_t cell[3];
+		for(unsigned int uj=0;uj<3;uj++)
+		{
+			cell[uj]=(size_t)std::max(0.0f,(p[uj]-origin[uj])*invCellSize);
+			cell[uj]=std::min(cell[uj],dims[uj]-1);
+		}
+		keys[ui].first=(cell[2]*dims[1] + cell[1])*dims[0] + cell[0];
+		keys[ui].second=ui;
+	}
+	progress=33;
+
+	if(wantAbort)
+	{
+		clear();
+		return CELLLIST_ERR_ABORT;
+	}
+
+	//std::sort is parallelised when built with _GLIBCXX_PARALLEL
+	std::sort(keys.begin(),keys.end());
+	progress=66;
+
+	if(wantAbort)
+	{
+		clear();
+		return CELLLIST_ERR_ABORT;
+	}
+
+	ptX.resize(pts.size());
+	ptY.resize(pts.size());
+	ptZ.resize(pts.size());
+	origIndex.resize(pts.size());
+	cellStart.resize(numCells+1);
+	#pragma omp parallel for
+	for(size_t ui=0;ui<keys.size();ui++)
+	{
+		const Point3D &p=getPos(pts[keys[ui].second]);
+		ptX[ui]=p[0];
+		ptY[ui]=p[1];
+		ptZ[ui]=p[2];
+		origIndex[ui]=keys[ui].second;
+
+		//Every cell between the previous point's and this one
+		// (including this one's) starts at this point. Each thread
+		// writes a disjoint range of cells
+		size_t firstCell= ui ? keys[ui-1].first+1 : 0;
+		for(size_t uj=firstCell;uj<=keys[ui].first;uj++)
+			cellStart[uj]=ui;
+	}
+	for(size_t ui=keys.back().first+1;ui<=numCells;ui++)
+		cellStart[ui]=keys.size();
+
+	progress=100;
+	return 0;
+}
+
+unsigned int CellList::build(const vector<Point3D> &pts, float minCellSize,
+		unsigned int &progress, ATOMIC_BOOL &wantAbort)
+{
+	try
+	{
+		return buildImpl(pts,minCellSize,progress,wantAbort);
+	}
+	catch(std::bad_alloc)
+	{
+		clear();
+		return CELLLIST_ERR_MEMALLOC;
+	}
+}
+
+unsigned int CellList::build(const vector<IonHit> &pts, float minCellSize,
+		unsigned int &progress, ATOMIC_BOOL &wantAbort)
+{
+	try
+	{
+		return buildImpl(pts,minCellSize,progress,wantAbort);
+	}
+	catch(std::bad_alloc)
+	{
+		clear();
+		return CELLLIST_ERR_MEMALLOC;
+	}
+}
+
+void CellList::clear()
+{
+	cellStart.clear();
+	ptX.clear();
+	ptY.clear();
+	ptZ.clear();
+	origIndex.clear();
+	for(unsigned int ui=0;ui<3;ui++)
+		dims[ui]=0;
+}
+
+size_t CellList::memoryUsage() const
+{
+	return cellStart.size()*sizeof(size_t) +
+		origIndex.size()*(3*sizeof(float) + sizeof(size_t));
+}
+
+bool CellList::cellRange(const Point3D &q, float radius, size_t *lo, size_t *hi) const
+{
+	if(origIndex.empty())
+		return false;
+
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		float fLo=(q[ui]-radius-origin[ui])*invCellSize;
+		float fHi=(q[ui]+radius-origin[ui])*invCellSize;
+		if(fHi < 0 || fLo >= (float)dims[ui])
+			return false;
+
+		lo[ui]=(size_t)std::max(fLo,0.0f);
+		hi[ui]=(fHi >= (float)dims[ui]) ? dims[ui]-1 : (size_t)fHi;
+	}
+	return true;
+}
+
+size_t CellList::inSphereSingle(const Point3D &q, float sqrRadius, float deadDistSqr,
+					vector<size_t> *pts, vector<float> *sqrDists) const
+{
+	size_t lo[3],hi[3];
+	if(!cellRange(q,sqrtf(sqrRadius),lo,hi))
+		return 0;
+
+	const float qx=q[0],qy=q[1],qz=q[2];
+	size_t count=0;
+	for(size_t uz=lo[2];uz<=hi[2];uz++)
+	{
+		for(size_t uy=lo[1];uy<=hi[1];uy++)
+		{
+			//Cells along x are contiguous, so scan the whole row at once
+			size_t rowBase=(uz*dims[1]+uy)*dims[0];
+			size_t start=cellStart[rowBase+lo[0]];
+			size_t end=cellStart[rowBase+hi[0]+1];
+
+			const float *x=&ptX[0], *y=&ptY[0], *z=&ptZ[0];
+			if(!pts)
+			{
+				size_t rowCount=0;
+				SIMD_PRAGMA("omp simd reduction(+:rowCount)")
+				for(size_t ui=start;ui<end;ui++)
+				{
+					float dx=x[ui]-qx, dy=y[ui]-qy,dz=z[ui]-qz;
+					float d=dx*dx+dy*dy+dz*dz;
+					rowCount+= (d <=sqrRadius && d > deadDistSqr);
+				}
+				count+=rowCount;
+			}
+			else
+			{
+				for(size_t ui=start;ui<end;ui++)
+				{
+					float dx=x[ui]-qx, dy=y[ui]-qy,dz=z[ui]-qz;
+					float d=dx*dx+dy*dy+dz*dz;
+					if(d <=sqrRadius && d > deadDistSqr)
+					{
+						pts->push_back(origIndex[ui]);
+						if(sqrDists)
+							sqrDists->push_back(d);
+						count++;
+					}
+				}
+			}
+		}
+	}
+
+	return count;
+}
+
+void CellList::countInSphere(const Point3D *queries, size_t nQueries, float sqrRadius,
+		float deadDistSqr, size_t *counts) const
+{
+	for(size_t ui=0;ui<nQueries;ui++)
+		counts[ui]=inSphereSingle(queries[ui],sqrRadius,deadDistSqr,0,0);
+}
+
+void CellList::findInSphere(const Point3D *queries, size_t nQueries, float sqrRadius,
+		float deadDistSqr, vector<size_t> &offsets, vector<size_t> &pts,
+		vector<float> *sqrDists) const
+{
+	offsets.resize(nQueries+1);
+	pts.clear();
+	if(sqrDists)
+		sqrDists->clear();
+	for(size_t ui=0;ui<nQueries;ui++)
+	{
+		offsets[ui]=pts.size();
+		inSphereSingle(queries[ui],sqrRadius,deadDistSqr,&pts,sqrDists);
+	}
+	offsets[nQueries]=pts.size();
+}
+
+void CellList::toCellOrder(const vector<unsigned int> &in, vector<unsigned int> &out) const
+{
+	ASSERT(in.size() == origIndex.size());
+	out.resize(in.size());
+	#pragma omp parallel for
+	for(size_t ui=0;ui<origIndex.size();ui++)
+		out[ui]=in[origIndex[ui]];
+}
+
+void CellList::countLabelsInSphere(const Point3D *queries, size_t nQueries, float sqrRadius,
+		float deadDistSqr, const unsigned int *labels, unsigned int nLabels,
+		unsigned int *counts) const
+{
+	const float radius=sqrtf(sqrRadius);
+	const float *x=ptX.empty() ? 0 : &ptX[0];
+	const float *y=ptY.empty() ? 0 : &ptY[0];
+	const float *z=ptZ.empty() ? 0 : &ptZ[0];
+	for(size_t uq=0;uq<nQueries;uq++)
+	{
+		unsigned int *c=counts+uq*nLabels;
+		for(unsigned int ui=0;ui<nLabels;ui++)
+			c[ui]=0;
+
+		size_t lo[3],hi[3];
+		if(!cellRange(queries[uq],radius,lo,hi))
+			continue;
+
+		const float qx=queries[uq][0],qy=queries[uq][1],qz=queries[uq][2];
+		for(size_t uz=lo[2];uz<=hi[2];uz++)
+		{
+			for(size_t uy=lo[1];uy<=hi[1];uy++)
+			{
+				size_t rowBase=(uz*dims[1]+uy)*dims[0];
+				size_t start=cellStart[rowBase+lo[0]];
+				size_t end=cellStart[rowBase+hi[0]+1];
+				for(size_t ui=start;ui<end;ui++)
+				{
+					float dx=x[ui]-qx, dy=y[ui]-qy,dz=z[ui]-qz;
+					float d=dx*dx+dy*dy+dz*dz;
+					if(d <=sqrRadius && d > deadDistSqr)
+					{
+						ASSERT(labels[ui] < nLabels);
+						c[labels[ui]]++;
+					}
+				}
+			}
+		}
+	}
+}
+
+#ifdef DEBUG
+
+bool CellListTests()
+{
+	RandNumGen rng;
+	rng.initialise(8642);
+
+	//Include a clump of coincident points, to check the dead zone
+	vector<Point3D> pts(20000);
+	for(size_t ui=0;ui<pts.size();ui++)
+	{
+		if(ui < 100)
+			pts[ui]=Point3D(0.5,0.5,0.5);
+		else
+		{
+			pts[ui]=Point3D(rng.genUniformDev(),rng.genUniformDev(),
+						2.0f*rng.genUniformDev());
+		}
+	}
+
+	const float DEAD_DIST=std::numeric_limits<float>::epsilon();
+	const float RADIUS=0.1;
+
+	CellList cells;
+	unsigned int prog;
+	ATOMIC_BOOL wantAbort(false);
+	TEST(!cells.build(pts,RADIUS,prog,wantAbort),"cell list build");
+	TEST(cells.size() == pts.size(),"cell list size");
+	TEST(cells.getCellSize() >= RADIUS,"cell size");
+
+	//Query some points from the dataset (so dead zone matters), some not,
+	// and some outside the data
+	const unsigned int NQUERY=60;
+	vector<Point3D> queries(NQUERY);
+	for(size_t ui=0;ui<NQUERY;ui++)
+	{
+		if(ui%3 == 0)
+			queries[ui]=pts[(size_t)(rng.genUniformDev()*(pts.size()-1))];
+		else if(ui%3 == 1)
+			queries[ui]=Point3D(rng.genUniformDev(),rng.genUniformDev(),2.0f*rng.genUniformDev());
+		else
+			queries[ui]=Point3D(1.05,-0.05+rng.genUniformDev()*0.1f,rng.genUniformDev());
+	}
+	queries[0]=Point3D(0.5,0.5,0.5);
+	queries[2]=Point3D(5,5,5);
+
+	//Check both the radius the list was built for, and a larger one
+	const float SQR_RADII[2] = { RADIUS*RADIUS, 9.0f*RADIUS*RADIUS};
+	for(unsigned int ur=0;ur<2;ur++)
+	{
+		vector<size_t> counts(NQUERY),offsets,inSphere;
+		cells.countInSphere(&queries[0],NQUERY,SQR_RADII[ur],DEAD_DIST,&counts[0]);
+		vector<float> sqrDists;
+		cells.findInSphere(&queries[0],NQUERY,SQR_RADII[ur],DEAD_DIST,offsets,inSphere,&sqrDists);
+		TEST(sqrDists.size() == inSphere.size(),"cell search distance count");
+
+		for(size_t ui=0;ui<NQUERY;ui++)
+		{
+			size_t bruteCount=0;
+			for(size_t uj=0;uj<pts.size();uj++)
+			{
+				float d=pts[uj].sqrDist(queries[ui]);
+				if(d <= SQR_RADII[ur] && d > DEAD_DIST)
+					bruteCount++;
+			}
+
+			TEST(counts[ui] == bruteCount,"cell count matches brute force");
+			TEST(offsets[ui+1]-offsets[ui] == bruteCount,"cell search size");
+			for(size_t uj=offsets[ui];uj<offsets[ui+1];uj++)
+			{
+				float d=pts[inSphere[uj]].sqrDist(queries[ui]);
+				TEST(d <= SQR_RADII[ur] && d > DEAD_DIST,"cell search point");
+				TEST(EQ_TOLV(d,sqrDists[uj],1e-5f),"cell search distance");
+			}
+		}
+		TEST(!counts[2],"far query");
+	}
+
+	//Labelled counts must sum to the plain counts, and match brute force
+	{
+		const unsigned int NLABELS=3;
+		vector<unsigned int> labels(pts.size()),cellLabels;
+		for(size_t ui=0;ui<pts.size();ui++)
+			labels[ui]=ui%NLABELS;
+		cells.toCellOrder(labels,cellLabels);
+
+		vector<unsigned int> labelCounts(NQUERY*NLABELS);
+		cells.countLabelsInSphere(&queries[0],NQUERY,RADIUS*RADIUS,DEAD_DIST,
+				&cellLabels[0],NLABELS,&labelCounts[0]);
+		for(size_t ui=0;ui<NQUERY;ui++)
+		{
+			size_t bruteCount[NLABELS]={0,0,0};
+			for(size_t uj=0;uj<pts.size();uj++)
+			{
+				float d=pts[uj].sqrDist(queries[ui]);
+				if(d <= RADIUS*RADIUS && d > DEAD_DIST)
+					bruteCount[labels[uj]]++;
+			}
+			for(unsigned int uj=0;uj<NLABELS;uj++)
+			{
+				TEST(labelCounts[ui*NLABELS+uj] == bruteCount[uj],"labelled count matches brute force");
+			}
+		}
+	}
+
+	//Without a dead zone, the clump itself is counted
+	size_t count;
+	cells.countInSphere(&queries[0],1,0.0f,-1.0f,&count);
+	TEST(count == 100,"coincident count");
+
+	//A tiny radius must not produce a huge grid
+	TEST(!cells.build(pts,1e-6f,prog,wantAbort),"small cell build");
+	TEST(cells.memoryUsage() < pts.size()*(CELLLIST_CELLS_PER_POINT+1)*sizeof(size_t) +
+			pts.size()*(3*sizeof(float)+sizeof(size_t)),"cell count limit");
+	cells.countInSphere(&queries[0],1,0.01f,DEAD_DIST,&count);
+	size_t bruteCount=0;
+	for(size_t uj=0;uj<pts.size();uj++)
+	{
+		float d=pts[uj].sqrDist(queries[0]);
+		if(d <= 0.01f && d > DEAD_DIST)
+			bruteCount++;
+	}
+	TEST(count == bruteCount,"enlarged cell count");
+
+	//Single point, and empty lists
+	vector<Point3D> one(1,Point3D(1,2,3));
+	TEST(!cells.build(one,RADIUS,prog,wantAbort),"single point build");
+	cells.countInSphere(&one[0],1,RADIUS*RADIUS,-1.0f,&count);
+	TEST(count == 1,"single point count");
+	one.clear();
+	TEST(!cells.build(one,RADIUS,prog,wantAbort) && cells.empty(),"empty build");
+
+	return true;
+}
+
+#endif
@@ -0,0 +1,138 @@
+/*
+ * cellList.h  - Uniform grid (cell list) for fixed-radius neighbour searches
+ * Copyright (C) 2015  D. Haley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CELLLIST_H
+#define CELLLIST_H
+
+#include <vector>
+
+#include "common/basics.h"
+#include "backend/APT/ionhit.h"
+
+//Cell list for fixed-radius searches. Points are binned into a
+// uniform grid of cubic cells, whose side is no smaller than the search
+// radius, so a sphere query need only visit the 27 cells about the query point.
+// For the near-uniform densities of APT data, this is considerably cheaper
+// than a KD tree traversal, but unlike the trees, it cannot answer kNN queries.
+//	- Points are stored in cell order, as separate x,y,z arrays
+//	- Cells along x are adjacent in memory, so each row of cells
+//	  searched is a single contiguous run of points
+//	- The grid is dense, but the cell size is increased if needed
+//	  to keep the number of cells proportional to the number of points
+
+enum
+{
+	CELLLIST_ERR_ABORT=1,
+	CELLLIST_ERR_MEMALLOC,
+	CELLLIST_ERR_ENUM_END
+};
+
+class CellList
+{
+	private:
+		//!Lower corner of the grid
+		float origin[3];
+		//!Side length of each cell, and its inverse
+		float cellSize,invCellSize;
+		//!Number of cells along each axis
+		size_t dims[3];
+
+		//!Offset of the first point in each cell, with a final entry
+		// holding the total number of points (compressed-row form)
+		std::vector<size_t> cellStart;
+
+		//!Point coordinates, in cell order
+		std::vector<float> ptX,ptY,ptZ;
+		//!Offset of each (cell order) point in the array used to build the list
+		std::vector<size_t> origIndex;
+
+		//!Build from point positions
+		template<class T>
+		unsigned int buildImpl(const std::vector<T> &pts, float minCellSize,
+				unsigned int &progress, ATOMIC_BOOL &wantAbort);
+
+		//!Find the range of cells overlapped by the bounding box of the sphere
+		// about q. Returns false if the sphere misses the grid
+		bool cellRange(const Point3D &q, float radius, size_t *lo, size_t *hi) const;
+
+		//!Count or collect (if pts is non-null) the points in the sphere about q,
+		// optionally with their square distances from q
+		size_t inSphereSingle(const Point3D &q, float sqrRadius, float deadDistSqr,
+					std::vector<size_t> *pts, std::vector<float> *sqrDists) const;
+	public:
+		CellList();
+
+		//!Bin the given points into cells of at least the given size, which
+		// should be the search radius. Returns 0 on success, or a CELLLIST_ERR
+		// value on abort or allocation failure, in which case the list is empty
+		unsigned int build(const std::vector<Point3D> &pts, float minCellSize,
+				unsigned int &progress, ATOMIC_BOOL &wantAbort);
+		unsigned int build(const std::vector<IonHit> &pts, float minCellSize,
+				unsigned int &progress, ATOMIC_BOOL &wantAbort);
+
+		//!Erase contents
+		void clear();
+
+		//!Obtain the number of points in the list
+		size_t size() const { return origIndex.size();}
+		bool empty() const { return origIndex.empty();}
+
+		//!Side length of the cells. This may be larger than requested
+		float getCellSize() const { return cellSize;}
+
+		//!Approximate number of bytes used by the list
+		size_t memoryUsage() const;
+
+		//!Count the points lying within the sphere (<= sqrRadius) about each query point,
+		// ignoring points within (<=) deadDistSqr. counts must hold nQueries entries.
+		// This matches K3DTreeBucket::countInSphere. Radii larger than
+		// the cell size are allowed, but are slower
+		void countInSphere(const Point3D *queries, size_t nQueries, float sqrRadius,
+				float deadDistSqr, size_t *counts) const;
+
+		//!Find the points lying within the sphere about each query point, as per countInSphere.
+		/*! Output is in compressed-row form : the indices (of the input array) of
+		 * the points for query i are found in [offsets[i],offsets[i+1]) in pts.
+		 * offsets is resized to nQueries+1. If sqrDists is given, it receives
+		 * the square distance of each found point from its query, in the same order as pts
+		 */
+		void findInSphere(const Point3D *queries, size_t nQueries, float sqrRadius,
+				float deadDistSqr, std::vector<size_t> &offsets,
+				std::vector<size_t> &pts, std::vector<float> *sqrDists=0) const;
+
+		//!Reorder per-point values, given in the order of the array used
+		// to build the list, into the list's internal order
+		void toCellOrder(const std::vector<unsigned int> &in,
+				std::vector<unsigned int> &out) const;
+
+		//!As countInSphere, but counting points separately by label.
+		/*! labels holds the label (< nLabels) of each point, in the list's order
+		 * (see toCellOrder). counts must hold nQueries*nLabels entries; the counts
+		 * for query i are at counts[i*nLabels]
+		 */
+		void countLabelsInSphere(const Point3D *queries, size_t nQueries, float sqrRadius,
+				float deadDistSqr, const unsigned int *labels, unsigned int nLabels,
+				unsigned int *counts) const;
+};
+
+#ifdef DEBUG
+//Compare cell list queries against brute force searches
+// - return true on OK, false on fail
+bool CellListTests();
+#endif
+#endif
@@ -0,0 +1,425 @@
+/*
+ * hullIndex.cpp - Spatial index over the facets of a convex hull
+ * Copyright (C) 2015  D. Haley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hullIndex.h"
+
+#include "common/mathfuncs.h"
+
+#include <new>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using std::vector;
+
+//Nodes with no more than this many facets are not subdivided
+const size_t HULLINDEX_LEAF_FACETS=6;
+//Number of points tested between progress updates
+const size_t HULLINDEX_QUERY_BLOCK=16384;
+
+namespace
+{
+//Recursive octree construction. Facets that cannot affect the result within
+// the box are dropped, and the box is split while it still has many facets
+class HullIndexBuilder
+{
+	public:
+		const vector<Point3D> *normals,*planePts;
+		//Slack used when classifying boxes, to allow for
+		// rounding in the per-point tests
+		double tol;
+		unsigned int maxDepth;
+
+		vector<size_t> *firstChild,*facetStart,*facetCount;
+		vector<unsigned int> *states;
+		vector<unsigned int> *nodeFacets;
+
+		void buildNode(size_t node, const Point3D &low, const Point3D &high,
+				const vector<unsigned int> &candidates, unsigned int depth);
+};
+
+void HullIndexBuilder::buildNode(size_t node, const Point3D &low, const Point3D &high,
+		const vector<unsigned int> &candidates, unsigned int depth)
+{
+	double centre[3],halfWidth[3];
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		centre[ui]=0.5*((double)low[ui]+(double)high[ui]);
+		halfWidth[ui]=0.5*((double)high[ui]-(double)low[ui]);
+	}
+
+	vector<unsigned int> kept;
+	for(size_t ui=0;ui<candidates.size();ui++)
+	{
+		const Point3D &n=(*normals)[candidates[ui]];
+		const Point3D &v=(*planePts)[candidates[ui]];
+
+		//Range of n.(v-p) over the box. Points pass the facet if this is >=0
+		double mid=0,spread=0;
+		for(unsigned int uj=0;uj<3;uj++)
+		{
+			mid+=(double)n[uj]*((double)v[uj]-centre[uj]);
+			spread+=fabs((double)n[uj])*halfWidth[uj];
+		}
+
+		if(mid - spread > tol)
+			continue;
+
+		if(mid + spread < -tol)
+		{
+			//Every point in the box fails this facet
+			(*states)[node]=HullIndex::NODE_OUTSIDE;
+			return;
+		}
+		kept.push_back(candidates[ui]);
+	}
+
+	if(kept.empty())
+	{
+		(*states)[node]=HullIndex::NODE_INSIDE;
+		return;
+	}
+
+	if(kept.size() <= HULLINDEX_LEAF_FACETS || depth >= maxDepth)
+	{
+		(*states)[node]=HullIndex::NODE_MIXED;
+		(*facetStart)[node]=nodeFacets->size();
+		(*facetCount)[node]=kept.size();
+		nodeFacets->insert(nodeFacets->end(),kept.begin(),kept.end());
+		return;
+	}
+
+	//Split into octants. Child bit 0 is x, 1 is y, 2 is z
+	size_t child=states->size();
+	(*firstChild)[node]=child;
+	firstChild->resize(child+8,0);
+	facetStart->resize(child+8,0);
+	facetCount->resize(child+8,0);
+	states->resize(child+8,HullIndex::NODE_MIXED);
+
+	for(unsigned int ui=0;ui<8;ui++)
+	{
+		Point3D childLow,childHigh;
+		for(unsigned int uj=0;uj<3;uj++)
+		{
+			if(ui & (1<<uj))
+			{
+				childLow[uj]=(float)centre[uj];
+				childHigh[uj]=high[uj];
+			}
+			else
+			{
+				childLow[uj]=low[uj];
+				childHigh[uj]=(float)centre[uj];
+			}
+		}
+		buildNode(child+ui,childLow,childHigh,kept,depth+1);
+	}
+}
+}
+
+HullIndex::HullIndex()
+{
+}
+
+bool HullIndex::build(const vector<Point3D> &facetNormals,
+		const vector<Point3D> &facetPts, const BoundCube &bounds,
+		unsigned int maxDepth)
+{
+	ASSERT(facetNormals.size() == facetPts.size());
+	ASSERT(bounds.isValid());
+
+	nodes.clear();
+	nodeFacets.clear();
+
+	//Node data is gathered into separate arrays during
+	// construction, then packed into the node list
+	vector<size_t> firstChild,facetStart,facetCount;
+	vector<unsigned int> states;
+	try
+	{
+		normals=facetNormals;
+		planePts=facetPts;
+
+		bounds.getBound(rootLow,0);
+		bounds.getBound(rootHigh,1);
+
+		double maxCoord=0;
+		for(unsigned int ui=0;ui<3;ui++)
+		{
+			maxCoord=std::max(maxCoord,(double)fabs(rootLow[ui]));
+			maxCoord=std::max(maxCoord,(double)fabs(rootHigh[ui]));
+		}
+		for(size_t ui=0;ui<planePts.size();ui++)
+		{
+			for(unsigned int uj=0;uj<3;uj++)
+				maxCoord=std::max(maxCoord,(double)fabs(planePts[ui][uj]));
+		}
+
+		HullIndexBuilder builder;
+		builder.normals=&normals;
+		builder.planePts=&planePts;
+		builder.tol=8.0*std::numeric_limits<float>::epsilon()*(1.0+maxCoord);
+		builder.maxDepth=maxDepth;
+		builder.firstChild=&firstChild;
+		builder.facetStart=&facetStart;
+		builder.facetCount=&facetCount;
+		builder.states=&states;
+		builder.nodeFacets=&nodeFacets;
+
+		firstChild.resize(1,0);
+		facetStart.resize(1,0);
+		facetCount.resize(1,0);
+		states.resize(1,NODE_MIXED);
+
+		vector<unsigned int> allFacets(normals.size());
+		for(size_t ui=0;ui<allFacets.size();ui++)
+			allFacets[ui]=ui;
+
+		builder.buildNode(0,rootLow,rootHigh,allFacets,0);
+
+		nodes.resize(states.size());
+	}
+	catch(std::bad_alloc)
+	{
+		nodes.clear();
+		nodeFacets.clear();
+		normals.clear();
+		planePts.clear();
+		return false;
+	}
+
+	for(size_t ui=0;ui<nodes.size();ui++)
+	{
+		nodes[ui].firstChild=firstChild[ui];
+		nodes[ui].facetStart=facetStart[ui];
+		nodes[ui].facetCount=facetCount[ui];
+		nodes[ui].state=states[ui];
+	}
+
+	return true;
+}
+
+bool HullIndex::insideFacets(const Point3D &p, const unsigned int *facets, size_t count) const
+{
+	for(size_t ui=0;ui<count;ui++)
+	{
+		const Point3D &n=normals[facets[ui]];
+		const Point3D &v=planePts[facets[ui]];
+
+		//if the dotproduct is negative, then the vector from the
+		//point to the facet opposes the outwards facing normal,
+		//and the point lies outside the hull
+		if(dotProduct(v[0]-p[0],v[1]-p[1],v[2]-p[2],
+					n[0],n[1],n[2]) < 0)
+			return false;
+	}
+	return true;
+}
+
+bool HullIndex::contains(const Point3D &p) const
+{
+	ASSERT(nodes.size());
+
+	//Points outside the indexed region test every facet
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		if(p[ui] < rootLow[ui] || p[ui] > rootHigh[ui])
+		{
+			for(size_t uj=0;uj<normals.size();uj++)
+			{
+				unsigned int facet=uj;
+				if(!insideFacets(p,&facet,1))
+					return false;
+			}
+			return true;
+		}
+	}
+
+	//Descend to the leaf holding the point
+	Point3D low=rootLow,high=rootHigh;
+	const HullIndexNode *node=&nodes[0];
+	while(node->firstChild)
+	{
+		unsigned int octant=0;
+		for(unsigned int ui=0;ui<3;ui++)
+		{
+			float centre=(float)(0.5*((double)low[ui]+(double)high[ui]));
+			if(p[ui] >= centre)
+			{
+				octant|=(1<<ui);
+				low[ui]=centre;
+			}
+			else
+				high[ui]=centre;
+		}
+		node=&nodes[node->firstChild+octant];
+	}
+
+	switch(node->state)
+	{
+		case NODE_INSIDE:
+			return true;
+		case NODE_OUTSIDE:
+			return false;
+		default:
+			return insideFacets(p,&nodeFacets[node->facetStart],node->facetCount);
+	}
+}
+
+bool markInsideHull(const HullIndex &hull, const vector<Point3D> &pts,
+		vector<char> &inside, unsigned int *progressPtr, ATOMIC_BOOL &wantAbort)
+{
+	inside.resize(pts.size());
+
+	const size_t numBlocks=(pts.size()+HULLINDEX_QUERY_BLOCK-1)/HULLINDEX_QUERY_BLOCK;
+	size_t numAnalysed=0;
+	bool spin=false;
+#pragma omp parallel for schedule(dynamic)
+	for(size_t ui=0;ui<numBlocks;ui++)
+	{
+		if(spin)
+			continue;
+
+		size_t start=ui*HULLINDEX_QUERY_BLOCK;
+		size_t end=std::min(start+HULLINDEX_QUERY_BLOCK,pts.size());
+		for(size_t uj=start;uj<end;uj++)
+			inside[uj]=hull.contains(pts[uj]);
+
+		#pragma omp atomic
+		numAnalysed+=end-start;
+#ifdef _OPENMP
+		if(!omp_get_thread_num())
+#endif
+		{
+			*progressPtr= (unsigned int)((float)(numAnalysed)/((float)pts.size())*100.0f);
+			if(wantAbort)
+				spin=true;
+		}
+	}
+
+	return !(spin || wantAbort);
+}
+
+#ifdef DEBUG
+
+//Outward unit normals and points of a cube of the given half width,
+// built from two triangles per face, as qhull would
+static void cubeFacets(float halfWidth, vector<Point3D> &normals, vector<Point3D> &facetPts)
+{
+	normals.clear();
+	facetPts.clear();
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		for(int sign=-1;sign<=1;sign+=2)
+		{
+			Point3D n(0,0,0);
+			n[ui]=(float)sign;
+			for(unsigned int uj=0;uj<2;uj++)
+			{
+				normals.push_back(n);
+				facetPts.push_back(n*halfWidth);
+			}
+		}
+	}
+}
+
+bool testHullIndex()
+{
+	//Octahedron |x|+|y|+|z| <= 1, within a larger box
+	vector<Point3D> normals,facetPts;
+	const float invRoot3=1.0f/sqrtf(3.0f);
+	for(unsigned int ui=0;ui<8;ui++)
+	{
+		Point3D n((ui&1) ? invRoot3 : -invRoot3,
+			(ui&2) ? invRoot3 : -invRoot3,
+			(ui&4) ? invRoot3 : -invRoot3);
+		normals.push_back(n);
+		facetPts.push_back(Point3D((ui&1) ? 1 : -1,0,0));
+	}
+
+	BoundCube bc;
+	bc.setBounds(-1.5f,-1.5f,-1.5f,1.5f,1.5f,1.5f);
+
+	HullIndex hull;
+	TEST(hull.build(normals,facetPts,bc,6),"build");
+	TEST(hull.numFacets() == 8,"facet count");
+	//The root must have been split
+	TEST(hull.numNodes() > 1,"subdivision");
+
+	//Compare against testing every facet
+	RandNumGen rng;
+	rng.initTimer();
+	vector<Point3D> pts(20000);
+	for(size_t ui=0;ui<pts.size();ui++)
+	{
+		pts[ui]=Point3D(rng.genUniformDev()*3.0f-1.5f,
+				rng.genUniformDev()*3.0f-1.5f,
+				rng.genUniformDev()*3.0f-1.5f);
+	}
+	//Some on the surface, some outside the indexed region
+	pts[0]=Point3D(1,0,0);
+	pts[1]=Point3D(0.25f,0.25f,0.5f);
+	pts[2]=Point3D(0,0,2.0f);
+	pts[3]=Point3D(0.1f,0.1f,-1.6f);
+
+	vector<char> inside;
+	unsigned int dummyProg;
+	ATOMIC_BOOL wantAbort(false);
+	TEST(markInsideHull(hull,pts,inside,&dummyProg,wantAbort),"mark");
+
+	size_t numInside=0;
+	for(size_t ui=0;ui<pts.size();ui++)
+	{
+		bool bruteInside=true;
+		for(size_t uj=0;uj<normals.size();uj++)
+		{
+			if(dotProduct(facetPts[uj][0]-pts[ui][0],facetPts[uj][1]-pts[ui][1],
+					facetPts[uj][2]-pts[ui][2],
+					normals[uj][0],normals[uj][1],normals[uj][2]) < 0)
+			{
+				bruteInside=false;
+				break;
+			}
+		}
+		TEST((bool)inside[ui] == bruteInside,"match brute force");
+		numInside+=inside[ui];
+	}
+
+	TEST(inside[0] && inside[1],"surface points");
+	TEST(!inside[2] && !inside[3],"outside region");
+
+	//Octahedron volume 4/3, over a box of volume 27
+	float frac=(float)numInside/(float)pts.size();
+	TEST(frac > 0.035f && frac < 0.065f,"inside fraction");
+
+	//Cube of half width 1 : interior of box [-1,1] should
+	// need no facet tests
+	cubeFacets(1.0f,normals,facetPts);
+	bc.setBounds(-2,-2,-2,2,2,2);
+	TEST(hull.build(normals,facetPts,bc,4),"cube build");
+	TEST(hull.contains(Point3D(0.5f,-0.5f,0.25f)),"cube inside");
+	TEST(hull.contains(Point3D(1.0f,0,0)),"cube face");
+	TEST(!hull.contains(Point3D(1.5f,0,0)),"cube outside");
+	TEST(!hull.contains(Point3D(3,0,0)),"cube far outside");
+
+	return true;
+}
+
+#endif
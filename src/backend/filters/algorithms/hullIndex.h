@@ -0,0 +1,98 @@
+/*
+ * hullIndex.h - Spatial index over the facets of a convex hull
+ * Copyright (C) 2015  D. Haley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HULLINDEX_H
+#define HULLINDEX_H
+
+#include <vector>
+
+#include "common/basics.h"
+
+//!Octree over the facet planes of a convex hull, for fast inside/outside tests.
+/*! A point lies inside a convex hull if it lies behind every facet plane,
+ * which costs one test per facet. Here, each octree node records only the
+ * facets whose plane passes through (or near) the node. Nodes that no plane
+ * passes through are wholly inside, or wholly outside, the hull; most points
+ * therefore need no facet tests at all, and the rest only test the few
+ * facets near them.
+ *
+ * The tests that are performed are identical to testing every facet, so
+ * results do not depend upon the index.
+ */
+class HullIndex
+{
+	public:
+		//!Classification of octree nodes
+		enum
+		{
+			NODE_INSIDE,
+			NODE_OUTSIDE,
+			NODE_MIXED
+		};
+	private:
+		class HullIndexNode
+		{
+			public:
+				//!Index of the first of the 8 children, or zero for leaves
+				size_t firstChild;
+				//!Range of this node's facets in nodeFacets (leaves only)
+				size_t facetStart,facetCount;
+				//!NODE_ enum value
+				unsigned int state;
+		};
+
+		//!Facet plane normals (outwards) and a point on each plane
+		std::vector<Point3D> normals,planePts;
+		//!Octree nodes; the root is first
+		std::vector<HullIndexNode> nodes;
+		//!Facets that each leaf must test
+		std::vector<unsigned int> nodeFacets;
+		//!Bounds of the root node
+		Point3D rootLow,rootHigh;
+
+		//!Test the point against the given facets
+		bool insideFacets(const Point3D &p, const unsigned int *facets, size_t count) const;
+	public:
+		HullIndex();
+
+		//!Build the index for the given facets, over the given region. Each
+		// facet is given by its outward normal, and any point on the facet.
+		// Returns false if there is insufficient memory
+		bool build(const std::vector<Point3D> &facetNormals,
+				const std::vector<Point3D> &facetPts, const BoundCube &bounds,
+				unsigned int maxDepth);
+
+		//!True if the point lies inside, or upon, the hull
+		bool contains(const Point3D &p) const;
+
+		//!Number of octree nodes
+		size_t numNodes() const { return nodes.size();}
+		//!Number of facets in the hull
+		size_t numFacets() const { return normals.size();}
+};
+
+//!Mark which points lie inside the hull, in parallel. inside is resized to
+// match pts. Returns false if aborted
+bool markInsideHull(const HullIndex &hull, const std::vector<Point3D> &pts,
+		std::vector<char> &inside, unsigned int *progressPtr, ATOMIC_BOOL &wantAbort);
+
+#ifdef DEBUG
+bool testHullIndex();
+#endif
+
+#endif
@@ -0,0 +1,642 @@
+/*
+ * linkClustering.cpp - Parallel linkage of points into clusters
+ * Copyright (C) 2015  D. Haley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "linkClustering.h"
+#include "cellList.h"
+
+#include <new>
+#include <algorithm>
+#include <utility>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using std::vector;
+using std::pair;
+
+//Number of points whose searches are run together by one thread
+const size_t LINK_QUERY_BLOCK=1024;
+//Number of blocks searched before their links are merged
+const size_t LINK_BLOCKS_PER_BATCH=64;
+
+void UnionFind::init(size_t n)
+{
+	parent.resize(n);
+	for(size_t ui=0;ui<n;ui++)
+		parent[ui]=ui;
+}
+
+size_t UnionFind::find(size_t x)
+{
+	//Path halving : point every other node on the path at its grandparent
+	while(parent[x] !=x)
+	{
+		parent[x]=parent[parent[x]];
+		x=parent[x];
+	}
+	return x;
+}
+
+size_t UnionFind::findConst(size_t x) const
+{
+	while(parent[x] !=x)
+		x=parent[x];
+	return x;
+}
+
+bool UnionFind::merge(size_t a, size_t b)
+{
+	a=find(a);
+	b=find(b);
+	if(a == b)
+		return false;
+
+	//Keep the lowest member as the root
+	if(a < b)
+		parent[b]=a;
+	else
+		parent[a]=b;
+	return true;
+}
+
+//Convert the sets to lists of indices. Clusters are in order of their
+// lowest member, and indices within each cluster are ascending
+static void setsToClusters(UnionFind &sets, vector<vector<size_t> > &clusters)
+{
+	//Each set's root is its lowest member, so scanning upwards meets
+	// the root before any other member
+	vector<size_t> clusterOf(sets.size());
+	vector<size_t> clusterSize;
+	for(size_t ui=0;ui<sets.size();ui++)
+	{
+		size_t root=sets.find(ui);
+		if(root == ui)
+		{
+			clusterOf[ui]=clusterSize.size();
+			clusterSize.push_back(0);
+		}
+		else
+			clusterOf[ui]=clusterOf[root];
+		clusterSize[clusterOf[ui]]++;
+	}
+
+	clusters.clear();
+	clusters.resize(clusterSize.size());
+	for(size_t ui=0;ui<clusters.size();ui++)
+		clusters[ui].reserve(clusterSize[ui]);
+	for(size_t ui=0;ui<sets.size();ui++)
+		clusters[clusterOf[ui]].push_back(ui);
+}
+
+//Find the links for the points in [start,end). Links inside the block are
+// resolved with a local union-find, so only one link is emitted per
+// point that joins a block-local set, plus one per distinct set
+// that each block-local set touches outside the block.
+// global is only read here
+static void linkBlock(const vector<Point3D> &pts, const CellList &cells,
+		float sqrLinkDist, size_t start, size_t end, const UnionFind &global,
+		vector<pair<size_t,size_t> > &links)
+{
+	links.clear();
+
+	vector<size_t> offsets,nn;
+	vector<float> sqrDists;
+	cells.findInSphere(&pts[start],end-start,sqrLinkDist,-1.0f,offsets,nn,&sqrDists);
+
+	UnionFind local;
+	local.init(end-start);
+	vector<pair<size_t,size_t> > external;
+	for(size_t ui=start;ui<end;ui++)
+	{
+		size_t q=ui-start;
+		for(size_t uj=offsets[q];uj<offsets[q+1];uj++)
+		{
+			//Each link is found from both ends; keep only one. The search is
+			// inclusive of the radius, but links must be strictly closer
+			size_t idx=nn[uj];
+			if(idx <= ui || sqrDists[uj] >= sqrLinkDist)
+				continue;
+
+			if(idx < end)
+				local.merge(q,idx-start);
+			else
+				external.push_back(std::make_pair(q,idx));
+		}
+	}
+
+	//Join each point to the root of its local set
+	for(size_t ui=0;ui<end-start;ui++)
+	{
+		size_t root=local.find(ui);
+		if(root !=ui)
+			links.push_back(std::make_pair(start+root,start+ui));
+	}
+
+	//Reduce the external links to one per pair of sets
+	for(size_t ui=0;ui<external.size();ui++)
+	{
+		external[ui].first=start+local.find(external[ui].first);
+		external[ui].second=global.findConst(external[ui].second);
+	}
+	std::sort(external.begin(),external.end());
+	external.erase(std::unique(external.begin(),external.end()),external.end());
+	for(size_t ui=0;ui<external.size();ui++)
+	{
+		if(global.findConst(external[ui].first) !=external[ui].second)
+			links.push_back(external[ui]);
+	}
+}
+
+unsigned int linkPoints(const vector<Point3D> &pts, const CellList &cells,
+		float linkDist, vector<vector<size_t> > &clusters,
+		unsigned int &progress, ATOMIC_BOOL &wantAbort)
+{
+	ASSERT(cells.size() == pts.size());
+	ASSERT(pts.empty() || cells.getCellSize() >= linkDist);
+
+	clusters.clear();
+	progress=0;
+
+	const float sqrLinkDist=linkDist*linkDist;
+	const size_t numBlocks=(pts.size()+LINK_QUERY_BLOCK-1)/LINK_QUERY_BLOCK;
+	try
+	{
+		UnionFind sets;
+		sets.init(pts.size());
+
+		//Links for each block of the current batch
+		vector<vector<pair<size_t,size_t> > > blockLinks(LINK_BLOCKS_PER_BATCH);
+		for(size_t batch=0;batch<numBlocks;batch+=LINK_BLOCKS_PER_BATCH)
+		{
+			size_t batchEnd=std::min(batch+LINK_BLOCKS_PER_BATCH,numBlocks);
+
+			//Search the batch in parallel; the sets are not modified here
+			bool memErr=false;
+			#pragma omp parallel for schedule(dynamic)
+			for(size_t ui=batch;ui<batchEnd;ui++)
+			{
+				if(memErr)
+					continue;
+
+				size_t start=ui*LINK_QUERY_BLOCK;
+				size_t end=std::min(start+LINK_QUERY_BLOCK,pts.size());
+				try
+				{
+					linkBlock(pts,cells,sqrLinkDist,start,end,sets,blockLinks[ui-batch]);
+				}
+				catch(std::bad_alloc)
+				{
+					memErr=true;
+				}
+			}
+			if(memErr)
+				return LINKCLUSTER_ERR_MEMALLOC;
+
+			//Merge the links, in block order
+			for(size_t ui=0;ui<batchEnd-batch;ui++)
+			{
+				for(size_t uj=0;uj<blockLinks[ui].size();uj++)
+					sets.merge(blockLinks[ui][uj].first,blockLinks[ui][uj].second);
+			}
+
+			progress= (unsigned int)((float)batchEnd/(float)numBlocks*100.0f);
+			if(wantAbort)
+				return LINKCLUSTER_ERR_ABORT;
+		}
+		blockLinks.clear();
+
+		setsToClusters(sets,clusters);
+	}
+	catch(std::bad_alloc)
+	{
+		clusters.clear();
+		return LINKCLUSTER_ERR_MEMALLOC;
+	}
+
+	progress=100;
+	return 0;
+}
+
+bool LinkEdge::operator<(const LinkEdge &e) const
+{
+	if(sqrDist != e.sqrDist)
+		return sqrDist < e.sqrDist;
+	if(a != e.a)
+		return a < e.a;
+	return b < e.b;
+}
+
+//Find the spanning forest of the links from the points in [start,end)
+// to higher-numbered points. Any link that this rejects is the longest
+// link in some cycle, so cannot be in the spanning forest of all links
+static void treeBlock(const vector<Point3D> &pts, const CellList &cells,
+		float sqrMaxDist, size_t start, size_t end, vector<LinkEdge> &forest)
+{
+	forest.clear();
+
+	vector<size_t> offsets,nn;
+	vector<float> sqrDists;
+	cells.findInSphere(&pts[start],end-start,sqrMaxDist,-1.0f,offsets,nn,&sqrDists);
+
+	//Links from this block, and the points outside the block that they reach
+	vector<LinkEdge> links;
+	vector<size_t> outside;
+	for(size_t ui=start;ui<end;ui++)
+	{
+		size_t q=ui-start;
+		for(size_t uj=offsets[q];uj<offsets[q+1];uj++)
+		{
+			size_t idx=nn[uj];
+			if(idx <= ui || sqrDists[uj] >= sqrMaxDist)
+				continue;
+
+			LinkEdge e;
+			e.a=ui;
+			e.b=idx;
+			e.sqrDist=sqrDists[uj];
+			links.push_back(e);
+			if(idx >=end)
+				outside.push_back(idx);
+		}
+	}
+	std::sort(outside.begin(),outside.end());
+	outside.erase(std::unique(outside.begin(),outside.end()),outside.end());
+
+	//Kruskal's algorithm, with the outside points numbered after the block
+	std::sort(links.begin(),links.end());
+	UnionFind local;
+	local.init(end-start+outside.size());
+	for(size_t ui=0;ui<links.size();ui++)
+	{
+		size_t b=links[ui].b;
+		if(b < end)
+			b-=start;
+		else
+		{
+			b=end-start + (std::lower_bound(outside.begin(),
+						outside.end(),b)-outside.begin());
+		}
+
+		if(local.merge(links[ui].a-start,b))
+			forest.push_back(links[ui]);
+	}
+}
+
+unsigned int linkTree(const vector<Point3D> &pts, const CellList &cells,
+		float maxLinkDist, vector<LinkEdge> &edges,
+		unsigned int &progress, ATOMIC_BOOL &wantAbort)
+{
+	ASSERT(cells.size() == pts.size());
+	ASSERT(pts.empty() || cells.getCellSize() >= maxLinkDist);
+
+	edges.clear();
+	progress=0;
+
+	const float sqrMaxDist=maxLinkDist*maxLinkDist;
+	const size_t numBlocks=(pts.size()+LINK_QUERY_BLOCK-1)/LINK_QUERY_BLOCK;
+	try
+	{
+		vector<vector<LinkEdge> > blockForests(numBlocks);
+
+		size_t numDone=0;
+		bool spin=false,memErr=false;
+		#pragma omp parallel for schedule(dynamic)
+		for(size_t ui=0;ui<numBlocks;ui++)
+		{
+			if(spin)
+				continue;
+
+			size_t start=ui*LINK_QUERY_BLOCK;
+			size_t end=std::min(start+LINK_QUERY_BLOCK,pts.size());
+			try
+			{
+				treeBlock(pts,cells,sqrMaxDist,start,end,blockForests[ui]);
+			}
+			catch(std::bad_alloc)
+			{
+				memErr=spin=true;
+			}
+
+			#pragma omp atomic
+			numDone++;
+#ifdef _OPENMP
+			if(!omp_get_thread_num())
+#endif
+			{
+				progress= (unsigned int)((float)numDone/(float)numBlocks*100.0f);
+				if(wantAbort)
+					spin=true;
+			}
+		}
+
+		if(memErr)
+			return LINKCLUSTER_ERR_MEMALLOC;
+		if(spin)
+			return LINKCLUSTER_ERR_ABORT;
+
+		//Merge the forests of each block
+		size_t totalEdges=0;
+		for(size_t ui=0;ui<numBlocks;ui++)
+			totalEdges+=blockForests[ui].size();
+		edges.reserve(totalEdges);
+		for(size_t ui=0;ui<numBlocks;ui++)
+		{
+			edges.insert(edges.end(),blockForests[ui].begin(),blockForests[ui].end());
+			vector<LinkEdge>().swap(blockForests[ui]);
+		}
+
+		std::sort(edges.begin(),edges.end());
+		UnionFind sets;
+		sets.init(pts.size());
+		size_t nKept=0;
+		for(size_t ui=0;ui<edges.size();ui++)
+		{
+			if(sets.merge(edges[ui].a,edges[ui].b))
+				edges[nKept++]=edges[ui];
+		}
+		edges.resize(nKept);
+	}
+	catch(std::bad_alloc)
+	{
+		edges.clear();
+		return LINKCLUSTER_ERR_MEMALLOC;
+	}
+
+	if(wantAbort)
+	{
+		edges.clear();
+		return LINKCLUSTER_ERR_ABORT;
+	}
+
+	progress=100;
+	return 0;
+}
+
+void clustersFromTree(size_t nPts, const vector<LinkEdge> &edges,
+		float linkDist, vector<vector<size_t> > &clusters)
+{
+	const float sqrLinkDist=linkDist*linkDist;
+
+	UnionFind sets;
+	sets.init(nPts);
+	for(size_t ui=0;ui<edges.size() && edges[ui].sqrDist < sqrLinkDist;ui++)
+		sets.merge(edges[ui].a,edges[ui].b);
+
+	setsToClusters(sets,clusters);
+}
+
+void clusterCountsFromTree(size_t nPts, const vector<LinkEdge> &edges,
+		const vector<float> &linkDists, size_t minSize, size_t maxSize,
+		vector<size_t> &counts)
+{
+	UnionFind sets;
+	sets.init(nPts);
+	vector<size_t> setSize(nPts,1);
+
+	//Every point starts as its own cluster
+	size_t count=0;
+	if(minSize <=1 && maxSize >=1)
+		count=nPts;
+
+	counts.resize(linkDists.size());
+	size_t curEdge=0;
+	for(size_t ui=0;ui<linkDists.size();ui++)
+	{
+		ASSERT(!ui || linkDists[ui-1] <= linkDists[ui]);
+		const float sqrLinkDist=linkDists[ui]*linkDists[ui];
+		for(;curEdge<edges.size() && edges[curEdge].sqrDist < sqrLinkDist;curEdge++)
+		{
+			size_t rootA,rootB;
+			rootA=sets.find(edges[curEdge].a);
+			rootB=sets.find(edges[curEdge].b);
+			ASSERT(rootA != rootB);
+
+			//Replace the two clusters with their union
+			size_t sizeA=setSize[rootA], sizeB=setSize[rootB];
+			if(sizeA >= minSize && sizeA <= maxSize)
+				count--;
+			if(sizeB >= minSize && sizeB <= maxSize)
+				count--;
+			if(sizeA+sizeB >= minSize && sizeA+sizeB <= maxSize)
+				count++;
+
+			sets.merge(rootA,rootB);
+			setSize[std::min(rootA,rootB)]=sizeA+sizeB;
+		}
+		counts[ui]=count;
+	}
+}
+
+#ifdef DEBUG
+
+//Group points by breadth first search, as per the cluster analysis filter
+static void bruteLinkPoints(const vector<Point3D> &pts, float linkDist,
+		vector<vector<size_t> > &clusters)
+{
+	const float sqrLinkDist=linkDist*linkDist;
+	vector<bool> visited(pts.size(),false);
+	clusters.clear();
+	for(size_t ui=0;ui<pts.size();ui++)
+	{
+		if(visited[ui])
+			continue;
+
+		vector<size_t> cluster(1,ui);
+		visited[ui]=true;
+		for(size_t uj=0;uj<cluster.size();uj++)
+		{
+			const Point3D &p=pts[cluster[uj]];
+			for(size_t uk=0;uk<pts.size();uk++)
+			{
+				if(!visited[uk] && p.sqrDist(pts[uk]) < sqrLinkDist)
+				{
+					visited[uk]=true;
+					cluster.push_back(uk);
+				}
+			}
+		}
+		std::sort(cluster.begin(),cluster.end());
+		clusters.push_back(cluster);
+	}
+}
+
+bool testLinkClustering()
+{
+	RandNumGen rng;
+	rng.initialise(2468);
+
+	//Clumps of points, in a sparse background. Several thousand points,
+	// so that links span several blocks
+	vector<Point3D> pts;
+	for(size_t ui=0;ui<60;ui++)
+	{
+		Point3D centre(20.0f*rng.genUniformDev(),20.0f*rng.genUniformDev(),
+				20.0f*rng.genUniformDev());
+		for(size_t uj=0;uj<50;uj++)
+		{
+			pts.push_back(centre+Point3D(rng.genUniformDev(),rng.genUniformDev(),
+						rng.genUniformDev()));
+		}
+	}
+	for(size_t ui=0;ui<2000;ui++)
+	{
+		pts.push_back(Point3D(20.0f*rng.genUniformDev(),20.0f*rng.genUniformDev(),
+				20.0f*rng.genUniformDev()));
+	}
+	//Points separated by exactly the link distance are not linked
+	pts.push_back(Point3D(-10,-10,-10));
+	pts.push_back(Point3D(-9.5,-10,-10));
+
+	const float LINK_DISTS[] = {0.1f,0.5f,1.0f};
+	ATOMIC_BOOL wantAbort(false);
+	for(size_t ui=0;ui<THREEDEP_ARRAYSIZE(LINK_DISTS);ui++)
+	{
+		CellList cells;
+		unsigned int prog;
+		TEST(!cells.build(pts,LINK_DISTS[ui],prog,wantAbort),"cell list build");
+
+		vector<vector<size_t> > clusters,bruteClusters;
+		TEST(!linkPoints(pts,cells,LINK_DISTS[ui],clusters,prog,wantAbort),"link points");
+		bruteLinkPoints(pts,LINK_DISTS[ui],bruteClusters);
+		TEST(clusters == bruteClusters,"link clusters match brute force");
+	}
+
+	//The hierarchy must give the same clusters at each distance below its maximum
+	{
+		const float MAX_LINK_DIST=1.0f;
+		CellList cells;
+		unsigned int prog;
+		TEST(!cells.build(pts,MAX_LINK_DIST,prog,wantAbort),"tree cell list build");
+		vector<LinkEdge> edges;
+		TEST(!linkTree(pts,cells,MAX_LINK_DIST,edges,prog,wantAbort),"link tree");
+		for(size_t ui=1;ui<edges.size();ui++)
+		{
+			TEST(!(edges[ui] < edges[ui-1]),"tree edge order");
+		}
+
+		vector<float> sweepDists;
+		vector<size_t> bruteCounts;
+		const size_t MIN_SIZE=5, MAX_SIZE=100;
+		for(size_t ui=0;ui<THREEDEP_ARRAYSIZE(LINK_DISTS);ui++)
+		{
+			vector<vector<size_t> > clusters,treeClusters;
+			bruteLinkPoints(pts,LINK_DISTS[ui],clusters);
+			clustersFromTree(pts.size(),edges,LINK_DISTS[ui],treeClusters);
+			TEST(clusters == treeClusters,"tree clusters match brute force");
+
+			sweepDists.push_back(LINK_DISTS[ui]);
+			size_t nInRange=0;
+			for(size_t uj=0;uj<clusters.size();uj++)
+			{
+				if(clusters[uj].size() >= MIN_SIZE && clusters[uj].size() <=MAX_SIZE)
+					nInRange++;
+			}
+			bruteCounts.push_back(nInRange);
+		}
+		TEST(LINK_DISTS[THREEDEP_ARRAYSIZE(LINK_DISTS)-1] == MAX_LINK_DIST,"max link dist");
+
+		vector<size_t> counts;
+		clusterCountsFromTree(pts.size(),edges,sweepDists,MIN_SIZE,MAX_SIZE,counts);
+		TEST(counts == bruteCounts,"cluster counts from tree");
+
+		//A forest has one fewer edge than points, per tree
+		vector<vector<size_t> > clusters;
+		clustersFromTree(pts.size(),edges,MAX_LINK_DIST,clusters);
+		TEST(edges.size() + clusters.size() == pts.size(),"forest edge count");
+	}
+
+	//Enough points to span several batches, near the percolation density.
+	// Compare against merging every link serially
+	vector<Point3D> manyPts(150000);
+	for(size_t ui=0;ui<manyPts.size();ui++)
+	{
+		manyPts[ui]=Point3D(50.0f*rng.genUniformDev(),50.0f*rng.genUniformDev(),
+				50.0f*rng.genUniformDev());
+	}
+	{
+		const float LINK_DIST=0.7f;
+		CellList cells;
+		unsigned int prog;
+		TEST(!cells.build(manyPts,LINK_DIST,prog,wantAbort),"large cell list build");
+		vector<vector<size_t> > clusters;
+		TEST(!linkPoints(manyPts,cells,LINK_DIST,clusters,prog,wantAbort),"large link points");
+
+		vector<size_t> offsets,nn;
+		cells.findInSphere(&manyPts[0],manyPts.size(),LINK_DIST*LINK_DIST,-1.0f,offsets,nn);
+		UnionFind uf;
+		uf.init(manyPts.size());
+		for(size_t ui=0;ui<manyPts.size();ui++)
+		{
+			for(size_t uj=offsets[ui];uj<offsets[ui+1];uj++)
+			{
+				if(manyPts[ui].sqrDist(manyPts[nn[uj]]) < LINK_DIST*LINK_DIST)
+					uf.merge(ui,nn[uj]);
+			}
+		}
+
+		size_t nClustered=0;
+		for(size_t ui=0;ui<clusters.size();ui++)
+		{
+			TEST(clusters[ui].size(),"non-empty cluster");
+			TEST(!ui || clusters[ui-1][0] < clusters[ui][0],"cluster order");
+			for(size_t uj=0;uj<clusters[ui].size();uj++)
+			{
+				TEST(uf.find(clusters[ui][uj]) == clusters[ui][0],"large cluster membership");
+			}
+			nClustered+=clusters[ui].size();
+		}
+		TEST(nClustered == manyPts.size(),"large cluster total");
+
+		vector<LinkEdge> edges;
+		TEST(!linkTree(manyPts,cells,LINK_DIST,edges,prog,wantAbort),"large link tree");
+		vector<vector<size_t> > treeClusters;
+		clustersFromTree(manyPts.size(),edges,LINK_DIST,treeClusters);
+		TEST(treeClusters == clusters,"large tree clusters");
+
+		CellList halfCells;
+		TEST(!halfCells.build(manyPts,0.5f*LINK_DIST,prog,wantAbort),"half cell list build");
+		TEST(!linkPoints(manyPts,halfCells,0.5f*LINK_DIST,clusters,prog,wantAbort),"half link points");
+		clustersFromTree(manyPts.size(),edges,0.5f*LINK_DIST,treeClusters);
+		TEST(treeClusters == clusters,"large tree clusters, half distance");
+	}
+
+	//Exact separation
+	CellList cells;
+	unsigned int prog;
+	vector<Point3D> twoPts(pts.end()-2,pts.end());
+	vector<vector<size_t> > clusters;
+	TEST(!cells.build(twoPts,0.5f,prog,wantAbort),"pair build");
+	TEST(!linkPoints(twoPts,cells,0.5f,clusters,prog,wantAbort),"pair link");
+	TEST(clusters.size() == 2,"separation equal to link distance");
+
+	//Empty input
+	vector<Point3D> none;
+	cells.clear();
+	TEST(!linkPoints(none,cells,1.0f,clusters,prog,wantAbort) && clusters.empty(),"empty link");
+
+	//Union find
+	UnionFind uf;
+	uf.init(6);
+	TEST(uf.merge(5,3) && uf.merge(4,5) && !uf.merge(3,4),"union find merge");
+	TEST(uf.find(4) == 3 && uf.findConst(5) == 3 && uf.find(0) == 0,"union find root");
+
+	return true;
+}
+
+#endif
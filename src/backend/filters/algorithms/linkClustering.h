@@ -0,0 +1,107 @@
+/*
+ * linkClustering.h - Parallel linkage of points into clusters
+ * Copyright (C) 2015  D. Haley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LINKCLUSTERING_H
+#define LINKCLUSTERING_H
+
+#include <vector>
+
+#include "common/basics.h"
+
+class CellList;
+
+enum
+{
+	LINKCLUSTER_ERR_ABORT=1,
+	LINKCLUSTER_ERR_MEMALLOC,
+	LINKCLUSTER_ERR_ENUM_END
+};
+
+//!Disjoint set forest. The root of each set is always its lowest member
+class UnionFind
+{
+	private:
+		std::vector<size_t> parent;
+	public:
+		//!Place each of n elements in its own set
+		void init(size_t n);
+		//!Number of elements
+		size_t size() const { return parent.size();}
+		//!Find the root of the set containing x, compressing the path
+		size_t find(size_t x);
+		//!Find the root of the set containing x, without modification.
+		// This may be called from several threads, if none are modifying the sets
+		size_t findConst(size_t x) const;
+		//!Join the sets containing a and b. Returns false if already joined
+		bool merge(size_t a, size_t b);
+};
+
+//!Group points into clusters, where points closer than (<) linkDist are in the same cluster.
+/*! cells must have been built from pts, with a cell size of at least linkDist.
+ * Clusters are ordered by their lowest point index, and each cluster's
+ * indices are ascending, so the output does not depend upon the thread count.
+ * Each block of points is linked by its own thread, using a local union-find;
+ * the links from each block are then merged into a global union-find.
+ * Returns 0 on success, or a LINKCLUSTER_ERR value
+ */
+unsigned int linkPoints(const std::vector<Point3D> &pts, const CellList &cells,
+		float linkDist, std::vector<std::vector<size_t> > &clusters,
+		unsigned int &progress, ATOMIC_BOOL &wantAbort);
+
+//!A link between two points, and its square length
+class LinkEdge
+{
+	public:
+		size_t a,b;
+		float sqrDist;
+
+		//!Order by length, then by end points
+		bool operator<(const LinkEdge &e) const;
+};
+
+//!Find the single-linkage hierarchy of the points, up to a maximum link distance.
+/*! edges receives a minimum spanning forest of the links that are
+ * strictly shorter than maxLinkDist, in ascending order of length. Joining
+ * the edges shorter than any link distance d <= maxLinkDist gives
+ * the same clusters as linkPoints(d), so one tree can be used for any
+ * link distance. cells must have been built from pts, with a cell size of at
+ * least maxLinkDist. Each block of points reduces its links to a local
+ * spanning forest in parallel, before the forests are merged.
+ * Returns 0 on success, or a LINKCLUSTER_ERR value
+ */
+unsigned int linkTree(const std::vector<Point3D> &pts, const CellList &cells,
+		float maxLinkDist, std::vector<LinkEdge> &edges,
+		unsigned int &progress, ATOMIC_BOOL &wantAbort);
+
+//!Extract the clusters for the given link distance, from the
+// output of linkTree, as per linkPoints. Takes linear time
+void clustersFromTree(size_t nPts, const std::vector<LinkEdge> &edges,
+		float linkDist, std::vector<std::vector<size_t> > &clusters);
+
+//!Count the clusters of between minSize and maxSize points (inclusive)
+// at each link distance, from the output of linkTree. linkDists must be
+// ascending. All distances are obtained in a single pass over the tree
+void clusterCountsFromTree(size_t nPts, const std::vector<LinkEdge> &edges,
+		const std::vector<float> &linkDists, size_t minSize, size_t maxSize,
+		std::vector<size_t> &counts);
+
+#ifdef DEBUG
+bool testLinkClustering();
+#endif
+
+#endif
@@ -0,0 +1,460 @@
+/*
+ * pairCorrelation.cpp - Grid (FFT) based pair correlation functions
+ * Copyright (C) 2015  D. Haley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pairCorrelation.h"
+
+#include <gsl/gsl_fft_complex.h>
+
+#include <new>
+#include <cmath>
+#include <limits>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using std::vector;
+using std::pair;
+
+//Largest grid (in voxels) we will attempt to transform. Each grid
+// needs 16 bytes per voxel (256MB at this limit), and one grid is held
+// per group, plus the window and a scratch grid
+const size_t PAIRCORR_MAX_VOXELS=1<<24;
+
+//Minimum mean number of points in each cell of the coarse grid
+// used to determine which regions of the grid are occupied by data
+const float WINDOW_MIN_COUNT=10.0f;
+
+//Smallest size >= n that is a product of small primes, which GSL transforms efficiently
+static size_t nextFFTSize(size_t n)
+{
+	const size_t FACTORS[] = {2,3,5,7};
+	for(size_t m=std::max(n,(size_t)1);;m++)
+	{
+		size_t r=m;
+		for(unsigned int ui=0;ui<THREEDEP_ARRAYSIZE(FACTORS);ui++)
+		{
+			while(!(r%FACTORS[ui]))
+				r/=FACTORS[ui];
+		}
+		if(r == 1)
+			return m;
+	}
+}
+
+//Transform a packed complex 3D grid (x fastest), in place, along each axis in turn
+static bool fft3D(vector<double> &data, const size_t *dims, bool forward,
+			ATOMIC_BOOL &wantAbort)
+{
+	for(unsigned int axis=0;axis<3;axis++)
+	{
+		const size_t n=dims[axis];
+		if(n == 1)
+			continue;
+
+		size_t stride=1;
+		for(unsigned int ui=0;ui<axis;ui++)
+			stride*=dims[ui];
+		const size_t numLines=(dims[0]*dims[1]*dims[2])/n;
+
+		gsl_fft_complex_wavetable *wavetable = gsl_fft_complex_wavetable_alloc(n);
+		bool spin=false;
+#pragma omp parallel
+		{
+			gsl_fft_complex_workspace *work=gsl_fft_complex_workspace_alloc(n);
+			vector<double> line(2*n);
+
+#pragma omp for schedule(dynamic,64)
+			for(size_t ui=0;ui<numLines;ui++)
+			{
+				if(spin)
+					continue;
+
+				//Offset of the first element of this line. Lines
+				// run over all axes except this one
+				size_t start=(ui/stride)*stride*n + ui%stride;
+
+				//Gather into contiguous storage, transform, then scatter
+				double *p=&data[2*start];
+				for(size_t uj=0;uj<n;uj++)
+				{
+					line[2*uj]=p[2*uj*stride];
+					line[2*uj+1]=p[2*uj*stride+1];
+				}
+
+				if(forward)
+					gsl_fft_complex_forward(&line[0],1,n,wavetable,work);
+				else
+					gsl_fft_complex_inverse(&line[0],1,n,wavetable,work);
+
+				for(size_t uj=0;uj<n;uj++)
+				{
+					p[2*uj*stride]=line[2*uj];
+					p[2*uj*stride+1]=line[2*uj+1];
+				}
+
+#ifdef _OPENMP
+				if(!omp_get_thread_num() && wantAbort)
+#else
+				if(wantAbort)
+#endif
+					spin=true;
+			}
+
+			gsl_fft_complex_workspace_free(work);
+		}
+		gsl_fft_complex_wavetable_free(wavetable);
+
+		if(spin)
+			return false;
+	}
+
+	return true;
+}
+
+unsigned int generateFFTPairCorrelation(const vector<const vector<Point3D> *> &groups,
+		const vector<pair<unsigned int, unsigned int> > &pairs,
+		float voxelSize, float distMax, unsigned int numBins,
+		vector<vector<float> > &gr, vector<bool> &binValid,
+		unsigned int *progressPtr, ATOMIC_BOOL &wantAbort)
+{
+	ASSERT(voxelSize > 0 && distMax > 0 && numBins);
+
+	gr.resize(pairs.size());
+	for(size_t ui=0;ui<pairs.size();ui++)
+		gr[ui].assign(numBins,0.0f);
+	binValid.assign(numBins,false);
+
+	//Find the bounds of the data
+	float lo[3],hi[3];
+	size_t totalPts=0;
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		lo[ui]=std::numeric_limits<float>::max();
+		hi[ui]=-std::numeric_limits<float>::max();
+	}
+	for(size_t ui=0;ui<groups.size();ui++)
+	{
+		const vector<Point3D> &pts=*(groups[ui]);
+		for(size_t uj=0;uj<pts.size();uj++)
+		{
+			for(unsigned int uk=0;uk<3;uk++)
+			{
+				lo[uk]=std::min(lo[uk],pts[uj][uk]);
+				hi[uk]=std::max(hi[uk],pts[uj][uk]);
+			}
+		}
+		totalPts+=pts.size();
+	}
+
+	if(!totalPts)
+		return 0;
+
+	//Size the grid to hold the data, plus padding to prevent
+	// correlations wrapping around within distMax
+	const size_t pad=(size_t)ceil(distMax/voxelSize)+1;
+	size_t dataDims[3],dims[3];
+	float numVoxels=1;
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		float fDim=(hi[ui]-lo[ui])/voxelSize + 1;
+		numVoxels*=fDim+pad;
+		if(numVoxels > (float)PAIRCORR_MAX_VOXELS)
+			return PAIRCORR_ERR_GRID_TOO_LARGE;
+
+		dataDims[ui]=(size_t)fDim;
+		dims[ui]=nextFFTSize(dataDims[ui]+pad);
+	}
+	const size_t gridSize=dims[0]*dims[1]*dims[2];
+	if(gridSize > PAIRCORR_MAX_VOXELS)
+		return PAIRCORR_ERR_GRID_TOO_LARGE;
+
+	//Refuse grids that will not fit in free memory, as the allocation
+	// may otherwise succeed, and then swap heavily
+	const size_t gridMB=2*gridSize*sizeof(double)/(1024*1024);
+	if((groups.size()+2)*gridMB > getAvailRAM())
+		return PAIRCORR_ERR_MEMALLOC;
+
+
+	//Number of transforms to perform; one per group, one for the window,
+	// one per pair and one for the window autocorrelation
+	const size_t totalSteps=groups.size()+pairs.size()+2;
+	size_t curStep=0;
+
+	//Grids for each group, then the window
+	vector<vector<double> > spectra;
+	vector<double> scratch;
+	try
+	{
+		spectra.resize(groups.size()+1);
+		for(size_t ui=0;ui<spectra.size();ui++)
+			spectra[ui].assign(2*gridSize,0.0);
+		scratch.resize(2*gridSize);
+	}
+	catch(std::bad_alloc)
+	{
+		return PAIRCORR_ERR_MEMALLOC;
+	}
+
+	//Bin each group onto the grid (nearest grid point)
+	for(size_t ui=0;ui<groups.size();ui++)
+	{
+		const vector<Point3D> &pts=*(groups[ui]);
+		double *grid=&spectra[ui][0];
+#pragma omp parallel for
+		for(size_t uj=0;uj<pts.size();uj++)
+		{
+			size_t idx=0;
+			for(unsigned int uk=3;uk--;)
+			{
+				size_t pos=(size_t)((pts[uj][uk]-lo[uk])/voxelSize);
+				pos=std::min(pos,dataDims[uk]-1);
+				idx=idx*dims[uk]+pos;
+			}
+			#pragma omp atomic
+			grid[2*idx]+=1.0;
+		}
+	}
+
+	//Build the window. A voxel lies within the data if the cell of a coarser
+	// grid containing it holds any points. The coarse cells are sized so that
+	// most cells inside the data are occupied, even for sparse species
+	size_t coarseSize;
+	{
+	float volume=(float)(dataDims[0]*dataDims[1]*dataDims[2])*voxelSize*voxelSize*voxelSize;
+	float coarseLen=pow(WINDOW_MIN_COUNT*volume/(float)totalPts,1.0f/3.0f);
+	coarseSize=std::max((size_t)1,(size_t)(coarseLen/voxelSize+0.5f));
+	}
+
+	size_t coarseDims[3];
+	for(unsigned int ui=0;ui<3;ui++)
+		coarseDims[ui]=(dataDims[ui]+coarseSize-1)/coarseSize;
+	vector<char> occupied(coarseDims[0]*coarseDims[1]*coarseDims[2],0);
+	for(size_t ui=0;ui<groups.size();ui++)
+	{
+		const double *grid=&spectra[ui][0];
+		for(size_t uz=0;uz<dataDims[2];uz++)
+		{
+			for(size_t uy=0;uy<dataDims[1];uy++)
+			{
+				for(size_t ux=0;ux<dataDims[0];ux++)
+				{
+					if(grid[2*((uz*dims[1]+uy)*dims[0]+ux)] == 0.0)
+						continue;
+					occupied[((uz/coarseSize)*coarseDims[1]+uy/coarseSize)*coarseDims[0]
+								+ux/coarseSize]=1;
+				}
+			}
+		}
+	}
+
+	double windowVolume=0;
+	{
+	double *window=&spectra.back()[0];
+	for(size_t uz=0;uz<dataDims[2];uz++)
+	{
+		for(size_t uy=0;uy<dataDims[1];uy++)
+		{
+			for(size_t ux=0;ux<dataDims[0];ux++)
+			{
+				if(occupied[((uz/coarseSize)*coarseDims[1]+uy/coarseSize)*coarseDims[0]
+							+ux/coarseSize])
+				{
+					window[2*((uz*dims[1]+uy)*dims[0]+ux)]=1.0;
+					windowVolume+=1.0;
+				}
+			}
+		}
+	}
+	}
+	occupied.clear();
+
+	if(wantAbort)
+		return PAIRCORR_ERR_ABORT;
+
+	//Transform every grid
+	for(size_t ui=0;ui<spectra.size();ui++)
+	{
+		if(!fft3D(spectra[ui],dims,true,wantAbort))
+			return PAIRCORR_ERR_ABORT;
+		curStep++;
+		*progressPtr=(unsigned int)((float)curStep/(float)totalSteps*100.0f);
+	}
+
+	//Find the grid offsets lying within distMax, and their radial bins.
+	// The zero offset is excluded, as is done for exact matches in the RDF
+	vector<pair<size_t,unsigned int> > offsets;
+	{
+	const int maxOffset=(int)(distMax/voxelSize);
+	for(int dz=-maxOffset;dz<=maxOffset;dz++)
+	{
+		for(int dy=-maxOffset;dy<=maxOffset;dy++)
+		{
+			for(int dx=-maxOffset;dx<=maxOffset;dx++)
+			{
+				if(!dx && !dy && !dz)
+					continue;
+
+				float r=voxelSize*sqrtf((float)(dx*dx+dy*dy+dz*dz));
+				if(r >= distMax)
+					continue;
+
+				unsigned int bin=(unsigned int)(r/distMax*(float)numBins);
+				if(bin >= numBins)
+					bin=numBins-1;
+
+				//Negative offsets wrap around to the end of the grid
+				size_t idx=(((size_t)(dz+(int)dims[2])%dims[2])*dims[1] +
+						((size_t)(dy+(int)dims[1])%dims[1]))*dims[0] +
+						((size_t)(dx+(int)dims[0])%dims[0]);
+				offsets.push_back(std::make_pair(idx,bin));
+			}
+		}
+	}
+	}
+
+	//Correlate the window with itself. This gives the overlap volume of the
+	// data with a translated copy of itself, which is the number of voxel
+	// pairs at each offset that could contain points
+	vector<double> windowSum(numBins,0.0);
+	{
+	const double *w=&spectra.back()[0];
+	for(size_t ui=0;ui<gridSize;ui++)
+	{
+		scratch[2*ui]=w[2*ui]*w[2*ui]+w[2*ui+1]*w[2*ui+1];
+		scratch[2*ui+1]=0;
+	}
+	if(!fft3D(scratch,dims,false,wantAbort))
+		return PAIRCORR_ERR_ABORT;
+	curStep++;
+	*progressPtr=(unsigned int)((float)curStep/(float)totalSteps*100.0f);
+
+	for(size_t ui=0;ui<offsets.size();ui++)
+		windowSum[offsets[ui].second]+=scratch[2*offsets[ui].first];
+	}
+
+	for(unsigned int ui=0;ui<numBins;ui++)
+		binValid[ui]=(windowSum[ui] > 0.5);
+
+	//Cross-correlate each pair, then normalise by the expected
+	// number of pairs for a random distribution of the same mean density
+	for(size_t ui=0;ui<pairs.size();ui++)
+	{
+		const double *a=&spectra[pairs[ui].first][0];
+		const double *b=&spectra[pairs[ui].second][0];
+		ASSERT(pairs[ui].first < groups.size() && pairs[ui].second < groups.size());
+
+		//conj(A)*B transforms to sum_x A(x)B(x+r)
+#pragma omp parallel for
+		for(size_t uj=0;uj<gridSize;uj++)
+		{
+			double aRe=a[2*uj],aIm=a[2*uj+1];
+			double bRe=b[2*uj],bIm=b[2*uj+1];
+			scratch[2*uj]=aRe*bRe + aIm*bIm;
+			scratch[2*uj+1]=aRe*bIm - aIm*bRe;
+		}
+
+		if(!fft3D(scratch,dims,false,wantAbort))
+			return PAIRCORR_ERR_ABORT;
+
+		vector<double> pairSum(numBins,0.0);
+		for(size_t uj=0;uj<offsets.size();uj++)
+			pairSum[offsets[uj].second]+=scratch[2*offsets[uj].first];
+
+		double densityProduct= (double)groups[pairs[ui].first]->size()/windowVolume *
+					(double)groups[pairs[ui].second]->size()/windowVolume;
+		for(unsigned int uj=0;uj<numBins;uj++)
+		{
+			if(binValid[uj] && densityProduct > 0)
+				gr[ui][uj]=(float)(pairSum[uj]/(densityProduct*windowSum[uj]));
+		}
+
+		curStep++;
+		*progressPtr=(unsigned int)((float)curStep/(float)totalSteps*100.0f);
+	}
+
+	return 0;
+}
+
+#ifdef DEBUG
+
+bool testFFTPairCorrelation()
+{
+	RandNumGen rng;
+	rng.initialise(2468);
+
+	//Uniform random points should give g(r) ~ 1. Use an irregular
+	// shape (a slab), so that the edge correction matters
+	vector<Point3D> pts(60000);
+	for(size_t ui=0;ui<pts.size();ui++)
+	{
+		pts[ui]=Point3D(10.0f*rng.genUniformDev(),10.0f*rng.genUniformDev(),
+					3.0f*rng.genUniformDev());
+	}
+
+	const float VOXEL=0.25f,DIST_MAX=2.0f;
+	const unsigned int NBINS=16;
+	vector<const vector<Point3D> *> groups(1,&pts);
+	vector<pair<unsigned int,unsigned int> > pairs(1,std::make_pair(0u,0u));
+	vector<vector<float> > gr;
+	vector<bool> binValid;
+	unsigned int prog;
+	ATOMIC_BOOL wantAbort(false);
+
+	TEST(!generateFFTPairCorrelation(groups,pairs,VOXEL,DIST_MAX,NBINS,
+				gr,binValid,&prog,wantAbort),"FFT correlation");
+	TEST(gr.size() == 1 && gr[0].size() == NBINS,"output size");
+	for(unsigned int ui=0;ui<NBINS;ui++)
+	{
+		//Skip bins that are within a couple of voxels
+		if((float)ui/NBINS*DIST_MAX < 2.0f*VOXEL)
+			continue;
+		TEST(binValid[ui],"bin valid");
+		TEST(fabs(gr[0][ui]-1.0f) < 0.05f,"uniform g(r)");
+	}
+
+	//A simple cubic lattice of unit spacing should peak at r=1, and be
+	// empty between the sqrt(2) and sqrt(3) neighbour shells
+	vector<Point3D> lattice;
+	for(unsigned int ui=0;ui<12;ui++)
+	{
+		for(unsigned int uj=0;uj<12;uj++)
+		{
+			for(unsigned int uk=0;uk<4;uk++)
+			{
+				//Place the lattice points mid-voxel
+				lattice.push_back(Point3D(ui,uj,uk)+Point3D(0.5f,0.5f,0.5f)*VOXEL);
+			}
+		}
+	}
+	lattice.push_back(Point3D(0,0,0));
+	groups[0]=&lattice;
+
+	TEST(!generateFFTPairCorrelation(groups,pairs,VOXEL,DIST_MAX,NBINS,
+				gr,binValid,&prog,wantAbort),"FFT correlation");
+	TEST(gr[0][(unsigned int)(1.0f/DIST_MAX*NBINS)] > 2.0f,"lattice peak");
+	TEST(gr[0][(unsigned int)(1.55f/DIST_MAX*NBINS)] < 0.5f,"lattice gap");
+
+	//A grid that is too large should be refused
+	TEST(generateFFTPairCorrelation(groups,pairs,1e-3f,DIST_MAX,NBINS,
+				gr,binValid,&prog,wantAbort) == PAIRCORR_ERR_GRID_TOO_LARGE,"grid size limit");
+
+	return true;
+}
+
+#endif
@@ -0,0 +1,63 @@
+/*
+ * pairCorrelation.h - Grid (FFT) based pair correlation functions
+ * Copyright (C) 2015  D. Haley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PAIRCORRELATION_H
+#define PAIRCORRELATION_H
+
+#include <vector>
+#include <utility>
+
+#include "common/basics.h"
+
+//Pair correlation by FFT. Each group of points (eg a species) is binned
+// onto a common grid, and the grids are correlated in Fourier space. The
+// cost depends upon the grid size and not the number of points, so this
+// suits large datasets and long correlation distances, where neighbour
+// searches are expensive. Resolution is limited to the voxel size.
+//	- Grids are zero padded by the correlation distance, so there is no wrap-around
+//	- Edge effects are corrected using the autocorrelation of the
+//	  dataset's window (the region of the grid occupied by the data)
+
+enum
+{
+	PAIRCORR_ERR_ABORT=1,
+	PAIRCORR_ERR_MEMALLOC,
+	PAIRCORR_ERR_GRID_TOO_LARGE,
+	PAIRCORR_ERR_ENUM_END
+};
+
+//!Compute the radial pair correlation function g(r), for pairs of point groups
+/*! groups holds the points of each group, and pairs the (first,second)
+ * group indices to correlate. g(r) is binned into numBins bins over [0,distMax),
+ * and normalised such that a random distribution gives g(r)=1. On output, gr holds
+ * one histogram per pair, and binValid indicates which bins contained any grid offsets
+ * (bins smaller than the voxel spacing may not). Coincident pairs are not counted,
+ * which also excludes pairs that share a voxel.
+ * Returns 0 on success, or a PAIRCORR_ERR value
+ */
+unsigned int generateFFTPairCorrelation(const std::vector<const std::vector<Point3D> *> &groups,
+		const std::vector<std::pair<unsigned int, unsigned int> > &pairs,
+		float voxelSize, float distMax, unsigned int numBins,
+		std::vector<std::vector<float> > &gr, std::vector<bool> &binValid,
+		unsigned int *progressPtr, ATOMIC_BOOL &wantAbort);
+
+#ifdef DEBUG
+bool testFFTPairCorrelation();
+#endif
+
+#endif
@@ -0,0 +1,382 @@
+/*
+ * pointHash.cpp - Hashed grid of quantised point coordinates, for matching point sets
+ * Copyright (C) 2015  D. Haley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pointHash.h"
+
+#include <new>
+#include <algorithm>
+#include <cmath>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using std::vector;
+
+//Smallest cell size, relative to the largest coordinate magnitude. This
+// keeps quantised coordinates well within range for tiny tolerances
+const float POINTHASH_MIN_RELATIVE_CELL=1e-9f;
+
+//Mix the quantised coordinates of a cell into a hash value
+static inline size_t hashKey(const long long *k)
+{
+	unsigned long long h;
+	h=(unsigned long long)k[0]*11400714819323198485ULL;
+	h^=(unsigned long long)k[1]*14029467366897019727ULL + (h<<6) + (h>>2);
+	h^=(unsigned long long)k[2]*1609587929392839161ULL + (h<<6) + (h>>2);
+	h^=h>>29;
+	return (size_t)h;
+}
+
+PointHash::PointHash() : cellSize(0), invCellSize(0)
+{
+}
+
+long long PointHash::quantise(float f) const
+{
+	return (long long)floor((double)f*invCellSize);
+}
+
+size_t PointHash::findCell(const long long *key) const
+{
+	const size_t mask=table.size()-1;
+	size_t slot=hashKey(key) & mask;
+	for(;;)
+	{
+		size_t cell=table[slot];
+		if(cell == (size_t)-1)
+			return (size_t)-1;
+
+		const long long *k=&cellKeys[3*cell];
+		if(k[0] == key[0] && k[1] == key[1] && k[2] == key[2])
+			return cell;
+
+		slot=(slot+1) & mask;
+	}
+}
+
+unsigned int PointHash::build(const vector<IonHit> &pts, float minCellSize,
+		unsigned int &progress, ATOMIC_BOOL &wantAbort)
+{
+	clear();
+	progress=0;
+	if(pts.empty())
+	{
+		progress=100;
+		return 0;
+	}
+
+	//Choose the cell size, enlarging very small cells
+	float maxAbs=0;
+	for(size_t ui=0;ui<pts.size();ui++)
+	{
+		const Point3D &p=pts[ui].getPosRef();
+		for(unsigned int uj=0;uj<3;uj++)
+			maxAbs=std::max(maxAbs,fabsf(p[uj]));
+	}
+	//Pad the cells slightly, so that rounding cannot move points within
+	// the requested size more than one cell apart
+	cellSize=std::max(minCellSize*1.001f,maxAbs*POINTHASH_MIN_RELATIVE_CELL);
+	if(cellSize <=0)
+		cellSize=1.0f;
+	invCellSize=1.0f/cellSize;
+
+	try
+	{
+		//Quantise the coordinates of each point
+		vector<long long> keys(3*pts.size());
+		#pragma omp parallel for
+		for(size_t ui=0;ui<pts.size();ui++)
+		{
+			const Point3D &p=pts[ui].getPosRef();
+			for(unsigned int uj=0;uj<3;uj++)
+				keys[3*ui+uj]=quantise(p[uj]);
+		}
+		progress=33;
+
+		if(wantAbort)
+		{
+			clear();
+			return POINTHASH_ERR_ABORT;
+		}
+
+		//Table is at most half full
+		size_t tableSize=1;
+		while(tableSize < 2*pts.size())
+			tableSize<<=1;
+		table.assign(tableSize,(size_t)-1);
+		const size_t mask=tableSize-1;
+
+		//Find (or create) the cell for each point
+		vector<size_t> cellOf(pts.size());
+		for(size_t ui=0;ui<pts.size();ui++)
+		{
+			const long long *key=&keys[3*ui];
+			size_t slot=hashKey(key) & mask;
+			for(;;)
+			{
+				size_t cell=table[slot];
+				if(cell == (size_t)-1)
+				{
+					cell=cellKeys.size()/3;
+					cellKeys.insert(cellKeys.end(),key,key+3);
+					table[slot]=cell;
+					cellOf[ui]=cell;
+					break;
+				}
+
+				const long long *k=&cellKeys[3*cell];
+				if(k[0] == key[0] && k[1] == key[1] && k[2] == key[2])
+				{
+					cellOf[ui]=cell;
+					break;
+				}
+				slot=(slot+1) & mask;
+			}
+		}
+		keys.clear();
+		progress=66;
+
+		if(wantAbort)
+		{
+			clear();
+			return POINTHASH_ERR_ABORT;
+		}
+
+		//Lay the points out in cell order, by counting sort.
+		// Within a cell, points stay in their original order
+		const size_t nCells=cellKeys.size()/3;
+		cellStart.assign(nCells+1,0);
+		for(size_t ui=0;ui<pts.size();ui++)
+			cellStart[cellOf[ui]+1]++;
+		for(size_t ui=0;ui<nCells;ui++)
+			cellStart[ui+1]+=cellStart[ui];
+
+		vector<size_t> nextSlot(cellStart.begin(),cellStart.end()-1);
+		ptX.resize(pts.size());
+		ptY.resize(pts.size());
+		ptZ.resize(pts.size());
+		origIndex.resize(pts.size());
+		for(size_t ui=0;ui<pts.size();ui++)
+		{
+			size_t offset=nextSlot[cellOf[ui]]++;
+			const Point3D &p=pts[ui].getPosRef();
+			ptX[offset]=p[0];
+			ptY[offset]=p[1];
+			ptZ[offset]=p[2];
+			origIndex[offset]=ui;
+		}
+	}
+	catch(std::bad_alloc)
+	{
+		clear();
+		return POINTHASH_ERR_MEMALLOC;
+	}
+
+	progress=100;
+	return 0;
+}
+
+void PointHash::clear()
+{
+	table.clear();
+	cellKeys.clear();
+	cellStart.clear();
+	ptX.clear();
+	ptY.clear();
+	ptZ.clear();
+	origIndex.clear();
+}
+
+size_t PointHash::findNearest(const Point3D &q, float sqrRadius) const
+{
+	if(origIndex.empty())
+		return (size_t)-1;
+	ASSERT(sqrRadius <= cellSize*cellSize*1.0001f);
+
+	long long qKey[3];
+	for(unsigned int ui=0;ui<3;ui++)
+		qKey[ui]=quantise(q[ui]);
+
+	size_t best=(size_t)-1;
+	float bestSqrDist=sqrRadius;
+	for(int dz=-1;dz<=1;dz++)
+	{
+		for(int dy=-1;dy<=1;dy++)
+		{
+			for(int dx=-1;dx<=1;dx++)
+			{
+				long long key[3];
+				key[0]=qKey[0]+dx;
+				key[1]=qKey[1]+dy;
+				key[2]=qKey[2]+dz;
+
+				size_t cell=findCell(key);
+				if(cell == (size_t)-1)
+					continue;
+
+				for(size_t ui=cellStart[cell];ui<cellStart[cell+1];ui++)
+				{
+					float ddx=ptX[ui]-q[0], ddy=ptY[ui]-q[1], ddz=ptZ[ui]-q[2];
+					float d=ddx*ddx+ddy*ddy+ddz*ddz;
+					if(d > bestSqrDist)
+						continue;
+
+					if(best == (size_t)-1 || d < bestSqrDist || origIndex[ui] < best)
+					{
+						best=origIndex[ui];
+						bestSqrDist=d;
+					}
+				}
+			}
+		}
+	}
+
+	return best;
+}
+
+unsigned int matchPoints(const vector<IonHit> &queries, const vector<IonHit> &pts,
+		float tolerance, vector<size_t> &match, unsigned int &progress,
+		ATOMIC_BOOL &wantAbort)
+{
+	PointHash hash;
+	unsigned int errCode;
+	errCode=hash.build(pts,tolerance,progress,wantAbort);
+	if(errCode)
+		return errCode;
+
+	try
+	{
+		match.resize(queries.size());
+	}
+	catch(std::bad_alloc)
+	{
+		return POINTHASH_ERR_MEMALLOC;
+	}
+
+	const float sqrTol=tolerance*tolerance;
+	const size_t QUERY_BLOCK=4096;
+	const size_t numBlocks=(queries.size()+QUERY_BLOCK-1)/QUERY_BLOCK;
+	size_t numDone=0;
+	bool spin=false;
+	progress=0;
+	#pragma omp parallel for schedule(dynamic)
+	for(size_t ui=0;ui<numBlocks;ui++)
+	{
+		if(spin)
+			continue;
+
+		size_t end=std::min((ui+1)*QUERY_BLOCK,queries.size());
+		for(size_t uj=ui*QUERY_BLOCK;uj<end;uj++)
+			match[uj]=hash.findNearest(queries[uj].getPosRef(),sqrTol);
+
+		#pragma omp atomic
+		numDone+=end-ui*QUERY_BLOCK;
+#ifdef _OPENMP
+		if(!omp_get_thread_num())
+#endif
+		{
+			progress= (unsigned int)((float)numDone/(float)queries.size()*100.0f);
+			if(wantAbort)
+				spin=true;
+		}
+	}
+
+	if(spin)
+		return POINTHASH_ERR_ABORT;
+
+	progress=100;
+	return 0;
+}
+
+#ifdef DEBUG
+
+bool testPointHash()
+{
+	RandNumGen rng;
+	rng.initialise(4321);
+
+	//File points, and queries that are perturbed copies of some
+	// of them, plus some that are not near any point
+	const size_t NPTS=20000;
+	const float TOL=1e-3f;
+	vector<IonHit> pts(NPTS);
+	for(size_t ui=0;ui<NPTS;ui++)
+	{
+		pts[ui]=IonHit(Point3D(10.0f*rng.genUniformDev(),10.0f*rng.genUniformDev(),
+					100.0f*rng.genUniformDev()-50.0f),1);
+	}
+	//Add a duplicate, to check ties go to the lower index
+	pts.push_back(pts[4]);
+
+	vector<IonHit> queries;
+	for(size_t ui=0;ui<NPTS;ui+=2)
+	{
+		IonHit h=pts[ui];
+		Point3D p=h.getPos();
+		if(ui %4)
+			p+=Point3D(0.3f*TOL*(rng.genUniformDev()-0.5f),0.3f*TOL,-0.5f*TOL);
+		h.setPos(p);
+		queries.push_back(h);
+	}
+	for(size_t ui=0;ui<100;ui++)
+		queries.push_back(IonHit(Point3D(rng.genUniformDev(),rng.genUniformDev(),60.0f),1));
+
+	vector<size_t> match;
+	unsigned int prog;
+	ATOMIC_BOOL wantAbort(false);
+	TEST(!matchPoints(queries,pts,TOL,match,prog,wantAbort),"match points");
+	TEST(match.size() == queries.size(),"match count");
+
+	//Compare against brute force
+	const float SQR_TOL=TOL*TOL;
+	for(size_t ui=0;ui<queries.size();ui++)
+	{
+		size_t bruteIdx=(size_t)-1;
+		float bruteDist=SQR_TOL;
+		for(size_t uj=0;uj<pts.size();uj++)
+		{
+			float d=pts[uj].getPosRef().sqrDist(queries[ui].getPosRef());
+			if(d <= bruteDist && (bruteIdx == (size_t)-1 || d < bruteDist))
+			{
+				bruteIdx=uj;
+				bruteDist=d;
+			}
+		}
+		TEST(match[ui] == bruteIdx,"hash match matches brute force");
+	}
+	TEST(match[0] == 0 && match[queries.size()-1] == (size_t)-1,"match spot check");
+
+	//Exact matching, with a zero tolerance
+	vector<IonHit> exact(pts.begin(),pts.begin()+100);
+	TEST(!matchPoints(exact,pts,0.0f,match,prog,wantAbort),"exact match");
+	for(size_t ui=0;ui<exact.size();ui++)
+	{
+		TEST(match[ui] == ui,"exact match index");
+	}
+
+	//Empty inputs
+	vector<IonHit> none;
+	TEST(!matchPoints(queries,none,TOL,match,prog,wantAbort),"empty points");
+	TEST(std::count(match.begin(),match.end(),(size_t)-1) == (int)match.size(),"no matches");
+	TEST(!matchPoints(none,pts,TOL,match,prog,wantAbort) && match.empty(),"empty queries");
+
+	return true;
+}
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * pointHash.h - Hashed grid of quantised point coordinates, for matching point sets
+ * Copyright (C) 2015  D. Haley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POINTHASH_H
+#define POINTHASH_H
+
+#include <vector>
+
+#include "common/basics.h"
+#include "backend/APT/ionhit.h"
+
+//Hashed grid for matching points to within a small tolerance. Coordinates
+// are quantised to cells no smaller than the tolerance, and only the
+// occupied cells are stored, in a hash table. Unlike a dense grid (see
+// CellList), memory does not depend upon the tolerance, so the cells can be
+// as small as the tolerance even when this is far below the point spacing,
+// as when matching two copies of the same reconstruction.
+//	- Building is linear in the number of points (no sorting)
+//	- Any point within the tolerance of a query lies in one of the
+//	  27 cells about the query's cell
+
+enum
+{
+	POINTHASH_ERR_ABORT=1,
+	POINTHASH_ERR_MEMALLOC,
+	POINTHASH_ERR_ENUM_END
+};
+
+class PointHash
+{
+	private:
+		//!Side length of each cell, and its inverse
+		float cellSize,invCellSize;
+
+		//!Open addressing hash table, holding cell numbers (or -1 for empty slots)
+		std::vector<size_t> table;
+		//!Quantised coordinates of each occupied cell
+		std::vector<long long> cellKeys;
+		//!Offset of the first point in each cell, with a final entry
+		// holding the total number of points (compressed-row form)
+		std::vector<size_t> cellStart;
+
+		//!Point coordinates, in cell order
+		std::vector<float> ptX,ptY,ptZ;
+		//!Offset of each (cell order) point in the array used to build the hash
+		std::vector<size_t> origIndex;
+
+		//!Quantise a coordinate
+		long long quantise(float f) const;
+		//!Find the cell with the given quantised coordinates, or -1 if it is empty
+		size_t findCell(const long long *key) const;
+	public:
+		PointHash();
+
+		//!Hash the given points, into cells of at least the given size.
+		// Returns 0 on success, or a POINTHASH_ERR value
+		unsigned int build(const std::vector<IonHit> &pts, float minCellSize,
+				unsigned int &progress, ATOMIC_BOOL &wantAbort);
+
+		//!Erase contents
+		void clear();
+
+		//!Obtain the number of points in the hash
+		size_t size() const { return origIndex.size();}
+
+		//!Side length of the cells. This may be larger than requested
+		float getCellSize() const { return cellSize;}
+
+		//!Find the nearest point (<=sqrRadius) to q, which must be no larger
+		// than the square of the cell size. Returns the index of the point in the input
+		// array, or -1 if there is none. Ties go to the lowest index
+		size_t findNearest(const Point3D &q, float sqrRadius) const;
+};
+
+//!Find, for each query, the nearest point within the tolerance.
+/*! match is resized to the number of queries, and receives the index of the
+ * matching point, or -1 if there is none. Queries are processed in parallel.
+ * Returns 0 on success, or a POINTHASH_ERR value
+ */
+unsigned int matchPoints(const std::vector<IonHit> &queries, const std::vector<IonHit> &pts,
+		float tolerance, std::vector<size_t> &match, unsigned int &progress,
+		ATOMIC_BOOL &wantAbort);
+
+#ifdef DEBUG
+bool testPointHash();
+#endif
+
+#endif
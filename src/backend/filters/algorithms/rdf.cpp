@@ -17,6 +17,8 @@
  */
 
 #include "rdf.h"
+#include "threadHistogram.h"
+#include "hullIndex.h"
 
 #include "../filterCommon.h"
 
@@ -171,13 +173,16 @@ float distanceToFacet(const Point3D &fA, const Point3D &fB,
 //however there is a chance that memory allocation can fail, which currently I do not grab safely
 const unsigned int MAX_NN_DISTS = 0x8000000; //96 MB samples at a time 
 
+//Deepest octree used to index hull facets
+const unsigned int HULL_INDEX_MAX_DEPTH=7;
+
 
 
 //obtains all the input points from ions that lie inside the convex hull after
 //it has been shrunk such that the closest distance from the hull to the original data
 //is reductionDim 
 unsigned int GetReducedHullPts(const vector<Point3D> &points, float reductionDim,  
-		unsigned int *progress, ATOMIC_BOOL &wantAbort, vector<Point3D> &pointResult)
+		unsigned int *progress, ATOMIC_BOOL &wantAbort, vector<size_t> &pointResult)
 {
 	//TODO: This could be made to use a fixed amount of ram, by
 	//partitioning the input points, and then
@@ -324,56 +329,57 @@ unsigned int GetReducedHullPts(const vector<Point3D> &points, float reductionDim
 	//considered point P, to any vertex on all of the facets of the 
 	//convex hull F1, F2, ... , Fn is negative,
 	//then P does NOT lie inside the convex hull.
-	pointResult.reserve(points.size()/2);
-	curFac = qh facet_list;
-	
-	//minimum distance from centroid to convex hull
-	for(unsigned int ui=points.size(); ui--;)
+	//Rather than testing every facet for every point, index the facets
+	//spatially, so that only facets near each point are tested
+	vector<Point3D> facetNormals,facetPts;
+	HullIndex hullIdx;
+	vector<char> inside;
+	try
 	{
-		float fX,fY,fZ;
-		double *ptArr,*normalArr;
-		fX =points[ui][0];
-		fY = points[ui][1];
-		fZ = points[ui][2];
-		
-		//loop through the facets
 		curFac = qh facet_list;
 		while(curFac != qh facet_tail)
 		{
 			//Dont ask. It just grabs the first coords of the vertex
 			//associated with this facet
-			ptArr = ((vertexT *)curFac->vertices->e[0].p)->point;
-			
-			normalArr = curFac->normal;
-			//if the dotproduct is negative, then the point vector from the 
-			//point in question to the surface is in opposite to the outwards facing
-			//normal, which means the point lies outside the hull	
-			if (dotProduct( (float)ptArr[0]  - fX,
-					(float)ptArr[1] - fY,
-					(float)ptArr[2] - fZ,
-					normalArr[0], normalArr[1],
-					normalArr[2]) >= 0)
-			{
-				curFac=curFac->next;
-				continue;
-			}
-			goto reduced_loop_next;
+			double *ptArr = ((vertexT *)curFac->vertices->e[0].p)->point;
+			facetPts.push_back(Point3D((float)ptArr[0],(float)ptArr[1],(float)ptArr[2]));
+			facetNormals.push_back(Point3D(curFac->normal[0],curFac->normal[1],curFac->normal[2]));
+			curFac=curFac->next;
 		}
-		//we passed all tests, point is inside convex hull
-		pointResult.push_back(points[ui]);
-		
-reduced_loop_next:
-	;
 	}
-
+	catch(std::bad_alloc)
+	{
+		freeConvexHull();
+		return RDF_ERR_MEMALLOC;
+	}
 	freeConvexHull();
 
+	BoundCube bc;
+	bc.setBounds(points);
+	//Subdivide more finely for larger datasets, as the
+	// index is then shared amongst more points
+	unsigned int maxDepth=std::min(HULL_INDEX_MAX_DEPTH,
+				std::max(1u,ilog2((unsigned int)std::min(points.size(),
+					(size_t)std::numeric_limits<unsigned int>::max()))/3));
+	if(!hullIdx.build(facetNormals,facetPts,bc,maxDepth))
+		return RDF_ERR_MEMALLOC;
+
+	if(!markInsideHull(hullIdx,points,inside,progress,wantAbort))
+		return RDF_ABORT_FAIL;
+
+	pointResult.reserve(points.size()/2);
+	for(size_t ui=0;ui<points.size();ui++)
+	{
+		if(inside[ui])
+			pointResult.push_back(ui);
+	}
+
 	return 0;
 }
 
 //!Generate an NN histogram using NN-max cutoffs 
 unsigned int generateNNHist( const vector<Point3D> &pointList, 
-			const K3DTree &tree,unsigned int nnMax, unsigned int numBins,
+			const K3DTreeBucket &tree,unsigned int nnMax, unsigned int numBins,
 		       	vector<vector<size_t> > &histogram, float *binWidth , unsigned int *progressPtr,
 			ATOMIC_BOOL &wantAbort)
 {
@@ -381,178 +387,135 @@ unsigned int generateNNHist( const vector<Point3D> &pointList,
 		return RDF_ERR_INSUFFICIENT_INPUT_POINTS;
 	
 	//Disallow exact matching for NNs
-	float deadDistSqr;
-	deadDistSqr= std::numeric_limits<float>::epsilon();
-	
-	//calclate NNs
-	BoundCube cube;
-	cube.setBounds(pointList);
+	const float deadDistSqr= std::numeric_limits<float>::epsilon();
 
-	//Allocate and assign the initial max distances
-	float *maxSqrDist= new float[nnMax];
-	for(unsigned int ui=0; ui<nnMax; ui++)
-		maxSqrDist[ui] =0.0f; 
-	
+	const size_t numBlocks=(pointList.size()+KDBUCKET_QUERY_BLOCK-1)/KDBUCKET_QUERY_BLOCK;
 
+	vector<float> maxSqrDist(nnMax,0.0f);
 
-	int callbackReduce=CALLBACK_REDUCE;
-#ifdef _OPENMP
-	size_t numAnalysed=0;
-	bool spin=false;
-#endif
-	//do NN search
-#pragma omp parallel for shared(spin,numAnalysed) firstprivate(callbackReduce)
-	for(unsigned int ui=0; ui<pointList.size(); ui++)
-	{
-#ifdef _OPENMP
-		if(spin)
-			continue;
-#endif
-		vector<const Point3D *> nnPoints;	
-		tree.findKNearest(pointList[ui],cube,
-					nnMax,nnPoints,deadDistSqr);
+	histogram.resize(nnMax);
+	for(unsigned int ui=0;ui<nnMax;ui++)
+		histogram[ui].assign(numBins,0);
 
+	//Histogram of NN rank vs distance bin
+	ThreadHistogram threadHist;
+	vector<size_t> dims(2);
+	dims[0]=nnMax;
+	dims[1]=numBins;
+	if(!threadHist.init(dims))
+		return RDF_ERR_MEMALLOC;
 
-		
-		for(unsigned int uj=0; uj<nnPoints.size(); uj++)
-		{
-			float temp;
-			temp = nnPoints[uj]->sqrDist(pointList[ui]);	
-			if(temp > maxSqrDist[uj])
-				maxSqrDist[uj] = temp;
-		}
-			
-
-		//Callbacks to perform UI updates as needed
-		if(!(callbackReduce--))
-		{
-#ifdef _OPENMP 
-			#pragma omp critical
-			{
-				numAnalysed+=CALLBACK_REDUCE;
-				*progressPtr= (unsigned int)((float)(numAnalysed)/((float)pointList.size())*100.0f);
-				if(wantAbort)
-					spin=true;
-			}			
+	//Maximum distance for each NN, for each thread
+#ifdef _OPENMP
+	vector<vector<float> > threadMax(omp_get_max_threads(),vector<float>(nnMax,0.0f));
 #else
-			*progressPtr= (unsigned int)((float)(ui)/((float)pointList.size())*50.0f);
-			if(wantAbort)
-			{
-				delete[] maxSqrDist;
-				return RDF_ABORT_FAIL;
-			}
+	vector<vector<float> > threadMax(1,vector<float>(nnMax,0.0f));
 #endif
-			callbackReduce=CALLBACK_REDUCE;
-		}
 
-	}
-#ifdef _OPENMP
-	if(spin)
+	//The first pass finds the maximum distance for each NN, which sets the bin
+	// widths. Once we know these, the second pass can histogram the distances.
+	// Each thread accumulates separately, and results are merged at the end of the pass
+	bool spin=false;
+	for(unsigned int pass=0;pass<2;pass++)
 	{
-		delete[] maxSqrDist;
-		return RDF_ABORT_FAIL;
-	}
+		size_t numAnalysed=0;
+#pragma omp parallel
+		{
+			vector<float> sqrDists(KDBUCKET_QUERY_BLOCK*nnMax);
+			vector<size_t> indices(KDBUCKET_QUERY_BLOCK*nnMax);
+#ifdef _OPENMP
+			float *localMax=&threadMax[omp_get_thread_num()][0];
+#else
+			float *localMax=&threadMax[0][0];
 #endif
+			size_t *localHist=threadHist.threadBins();
 
+#pragma omp for schedule(dynamic)
+			for(size_t ui=0;ui<numBlocks;ui++)
+			{
+				if(spin)
+					continue;
 
-	float maxOfMaxDists=0;
-	float *maxDist=new float[nnMax];
-	for(unsigned int ui=0; ui<nnMax; ui++)
-	{
-		if(maxOfMaxDists < maxSqrDist[ui])
-			maxOfMaxDists = maxSqrDist[ui];
-
-		//convert maxima from sqrDistance 
-		//to normal =distance	
-		maxDist[ui] =sqrtf(maxSqrDist[ui]);
-	}	
-
-	maxOfMaxDists=sqrtf(maxOfMaxDists);
-	maxDist[nnMax-1] = maxOfMaxDists;	
+				size_t start=ui*KDBUCKET_QUERY_BLOCK;
+				size_t nQueries=std::min((size_t)KDBUCKET_QUERY_BLOCK,pointList.size()-start);
+				tree.findKNearest(&pointList[start],nQueries,nnMax,deadDistSqr,
+							&sqrDists[0],&indices[0]);
 
-	//Cacluate the bin widths required to accommodate this
-	//distribution
-	for(unsigned int ui=0; ui<nnMax; ui++)
-		binWidth[ui]= maxDist[ui]/(float)numBins;
-	delete[] maxDist;
-	
-	//Generate histogram for what we have already
-	//zero out memory
-	histogram.resize(nnMax);
-	for(unsigned int ui=0;ui<nnMax;ui++)
-		histogram[ui].resize(numBins,0);
+				for(size_t uj=0;uj<nQueries;uj++)
+				{
+					const float *dist=&sqrDists[uj*nnMax];
+					const size_t *idx=&indices[uj*nnMax];
+					for(unsigned int uk=0;uk<nnMax && idx[uk] != (size_t)-1; uk++)
+					{
+						if(!pass)
+						{
+							localMax[uk]=std::max(localMax[uk],dist[uk]);
+							continue;
+						}
+
+						unsigned int offsetTemp;
+						offsetTemp = (unsigned int)(sqrtf(dist[uk])/binWidth[uk]);
+						
+						//Prevent overflow due to temp/binWidth exceeding array dimension 
+						//as (temp is <= binwidth, not < binWidth)
+						if(offsetTemp >= numBins)
+							offsetTemp=numBins-1;
+
+						localHist[uk*numBins+offsetTemp]++;
+					}
+				}
 
-	//we know the bin that things will fall into now, so we can scan 
-	//remaining points and place into the histogram on the fly now
-	
-#ifdef _OPENMP
-	spin=false;
-	numAnalysed=0;
-#endif
-	
-	callbackReduce=CALLBACK_REDUCE;
-#pragma omp parallel for firstprivate(callbackReduce)
-	for(unsigned int ui=0; ui<pointList.size(); ui++)
-	{
-		vector<const Point3D *> nnPoints;
+				//Callbacks to perform UI updates as needed
+				#pragma omp atomic
+				numAnalysed+=nQueries;
 #ifdef _OPENMP
-		if(spin)
-			continue;
+				if(!omp_get_thread_num())
 #endif
+				{
+					*progressPtr= (unsigned int)((float)(numAnalysed)/((float)pointList.size())*50.0f + pass*50.0f);
+					if(wantAbort)
+						spin=true;
+				}
+			}
 
-		tree.findKNearest(pointList[ui],cube,
-					nnMax, nnPoints);
-
-		for(unsigned int uj=0; uj<nnPoints.size(); uj++)
-		{
-			unsigned int offsetTemp;
-			float temp;
+		}
 
-			temp=sqrtf(nnPoints[uj]->sqrDist(pointList[ui]));
-			offsetTemp = (unsigned int)(temp/binWidth[uj]);
-			
-			//Prevent overflow due to temp/binWidth exceeding array dimension 
-			//as (temp is <= binwidth, not < binWidth)
-			if(offsetTemp == numBins)
-				offsetTemp--;
-			ASSERT(offsetTemp < nnMax*numBins);
+		if(spin || wantAbort)
+			return RDF_ABORT_FAIL;
 
-			(histogram[uj])[offsetTemp]++;
+		if(pass)
+		{
+			for(unsigned int ui=0;ui<nnMax;ui++)
+				threadHist.mergeInto(&histogram[ui][0],ui*numBins,numBins);
+			break;
 		}
-	
 
-		//Callbacks to perform UI updates as needed
-#ifdef _OPENMP 
-		if(!(callbackReduce--))
+		for(size_t ui=0;ui<threadMax.size();ui++)
 		{
-		#pragma omp critical
+			for(unsigned int uj=0;uj<nnMax;uj++)
+				maxSqrDist[uj]=std::max(maxSqrDist[uj],threadMax[ui][uj]);
+		}
+
+		float maxOfMaxDists=0;
+		vector<float> maxDist(nnMax);
+		for(unsigned int ui=0; ui<nnMax; ui++)
 		{
-			*progressPtr= (unsigned int)((float)(numAnalysed)/((float)pointList.size())*50.0f + 50.0f);
-			if(wantAbort)
-				spin=true;
-			numAnalysed+=CALLBACK_REDUCE;
-		}			
-			callbackReduce=CALLBACK_REDUCE;
+			if(maxOfMaxDists < maxSqrDist[ui])
+				maxOfMaxDists = maxSqrDist[ui];
+
+			//convert maxima from sqrDistance 
+			//to normal =distance	
+			maxDist[ui] =sqrtf(maxSqrDist[ui]);
 		}	
-#else
-		if(!(callbackReduce--))
-		{
-			*progressPtr= (unsigned int)((float)(ui)/((float)pointList.size())*50.0f + 50.0f);
-			if(wantAbort)
-			{
-				delete[] maxSqrDist;
-				return RDF_ABORT_FAIL;
-			}
-			callbackReduce=CALLBACK_REDUCE;
-		}
-#endif
-	}
-	delete[] maxSqrDist;	
 
-#ifdef _OPENMP
-	if(spin)
-		return RDF_ABORT_FAIL;
-#endif
+		maxOfMaxDists=sqrtf(maxOfMaxDists);
+		maxDist[nnMax-1] = maxOfMaxDists;	
+
+		//Cacluate the bin widths required to accommodate this
+		//distribution
+		for(unsigned int ui=0; ui<nnMax; ui++)
+			binWidth[ui]= maxDist[ui]/(float)numBins;
+	}
 
 	return 0;
 }
@@ -581,6 +544,10 @@ unsigned int generate1DAxialDistHist(const vector<Point3D> &pointList, const K3D
 	//but I don't have  a tree.numvertices
 	float maxSqrDist = distMax*distMax;
 
+	ThreadHistogram threadHist;
+	if(!threadHist.init(numBins))
+		return RDF_ERR_MEMALLOC;
+
 	unsigned int warnBiasCount=0;
 #ifdef _OPENMP
 	bool spin=false;
@@ -637,10 +604,7 @@ unsigned int generate1DAxialDistHist(const vector<Point3D> &pointList, const K3D
 					// Shift the zero to the center of the histogram
 					int offset=(int)(((0.5f*distance)/distMax+0.5f)*(float)numBins);
 					if(offset < (int)numBins && offset >=0)
-					{
-#pragma omp critical
-						histogram[offset]++;
-					}
+						threadHist.add(offset);
 				}
 
 				//increase the dead distance to the last distance
@@ -681,6 +645,7 @@ unsigned int generate1DAxialDistHist(const vector<Point3D> &pointList, const K3D
 	if(spin)
 		return RDF_ABORT_FAIL;
 #endif
+	threadHist.mergeInto(histogram);
 	*progressPtr=100;
 	return 0;
 }
@@ -708,11 +673,18 @@ unsigned int generate1DAxialNNHist(const vector<Point3D> &pointList, const K3DTr
 	BoundCube cube;
 	cube.setBounds(pointList);
 
-	//Allocate and assign the initial max distances
-	float *maxAxialDist= new float[nnMax];
-	for(unsigned int ui=0; ui<nnMax; ui++)
-		maxAxialDist[ui] =0.0f; 
-	
+	ThreadHistogram threadHist;
+	if(!threadHist.init(numBins))
+		return RDF_ERR_MEMALLOC;
+
+	//Allocate and assign the initial max distances, 
+	// with a separate set for each thread
+#ifdef _OPENMP
+	const unsigned int numThreads=omp_get_max_threads();
+#else
+	const unsigned int numThreads=1;
+#endif
+	vector<float> maxAxialDist(nnMax*numThreads,0.0f);
 
 	int callbackReduce=CALLBACK_REDUCE;
 #ifdef _OPENMP
@@ -733,13 +705,18 @@ unsigned int generate1DAxialNNHist(const vector<Point3D> &pointList, const K3DTr
 		tree.findKNearest(pointList[ui],cube,
 					nnMax,nnPoints,deadDistSqr);
 
+#ifdef _OPENMP
+		float *threadMax=&maxAxialDist[omp_get_thread_num()*nnMax];
+#else
+		float *threadMax=&maxAxialDist[0];
+#endif
 		for(unsigned int uj=0; uj<nnPoints.size(); uj++)
 		{
 			//compute upper bound for plot output distance
 			float temp;
 			temp=fabs((*nnPoints[uj]-pointList[ui]).dotProd(axisDir));
-			if(temp > maxAxialDist[uj])
-				maxAxialDist[uj] = temp;
+			if(temp > threadMax[uj])
+				threadMax[uj] = temp;
 		}
 			
 
@@ -757,10 +734,7 @@ unsigned int generate1DAxialNNHist(const vector<Point3D> &pointList, const K3DTr
 #else
 			*progressPtr= (unsigned int)((float)(ui)/((float)pointList.size())*100.0f);
 			if(wantAbort)
-			{
-				delete[] maxAxialDist;
 				return RDF_ABORT_FAIL;
-			}
 #endif
 			callbackReduce=CALLBACK_REDUCE;
 		}
@@ -768,15 +742,12 @@ unsigned int generate1DAxialNNHist(const vector<Point3D> &pointList, const K3DTr
 	}
 #ifdef _OPENMP
 	if(spin)
-	{
-		delete[] maxAxialDist;
 		return RDF_ABORT_FAIL;
-	}
 #endif
 
 
 	float maxOfMaxDists=0;
-	for(unsigned int ui=0; ui<nnMax; ui++)
+	for(unsigned int ui=0; ui<maxAxialDist.size(); ui++)
 	{
 		if(maxOfMaxDists < maxAxialDist[ui])
 			maxOfMaxDists = maxAxialDist[ui];
@@ -819,13 +790,8 @@ unsigned int generate1DAxialNNHist(const vector<Point3D> &pointList, const K3DTr
 			temp=(*nnPoints[uj]-pointList[ui]).dotProd(axisDir);
 			int offset=(int)(((0.5f*temp)/maxOfMaxDists+0.5f)*numBins);
 
-			if(offset < numBins && offset >=0)	
-			{
-				//TODO: OpenMP could use multiple histograms
-				// rather than locking
-#pragma omp critical 
-				histogram[offset]++;
-			}
+			if(offset < (int)numBins && offset >=0)	
+				threadHist.add(offset);
 		}
 	
 
@@ -847,21 +813,19 @@ unsigned int generate1DAxialNNHist(const vector<Point3D> &pointList, const K3DTr
 		{
 			*progressPtr= (unsigned int)((float)(ui)/((float)pointList.size())*100.0f);
 			if(wantAbort)
-			{
-				delete[] maxAxialDist;
 				return RDF_ABORT_FAIL;
-			}
 			callbackReduce=CALLBACK_REDUCE;
 		}
 #endif
 	}
-	delete[] maxAxialDist;	
 
 #ifdef _OPENMP
 	if(spin)
 		return RDF_ABORT_FAIL;
 #endif
 
+	threadHist.mergeInto(histogram);
+
 	return 0;
 }
 
@@ -893,6 +857,11 @@ unsigned int generateDistHist(const vector<Point3D> &pointList, const K3DTree &t
 	float maxSqrDist = distMax*distMax;
 
 	warnBiasCount=0;
+
+	//Each thread bins into its own histogram
+	ThreadHistogram threadHist;
+	if(!threadHist.init(numBins))
+		return RDF_ERR_MEMALLOC;
 	
 	//Main r-max searching routine
 	unsigned int callbackReduce=CALLBACK_REDUCE;
@@ -900,16 +869,9 @@ unsigned int generateDistHist(const vector<Point3D> &pointList, const K3DTree &t
 	bool spin=false;
 	size_t numAnalysed=0;
 	size_t numAnalysedThread=0;
-
-	unsigned int threadHist[numBins][omp_get_max_threads()];
-	for(size_t ui=0; ui<omp_get_max_threads(); ui++)
-	{
-		for (size_t uj = 0; uj < numBins; uj++)
-			threadHist[uj][ui] = 0;
-	}
 #endif
 
-#pragma omp parallel for shared(spin,histogram,numAnalysed,threadHist) firstprivate(callbackReduce,numAnalysedThread) default(shared)
+#pragma omp parallel for shared(spin,numAnalysed,threadHist) firstprivate(callbackReduce,numAnalysedThread) default(shared)
 	for(unsigned int ui=0; ui<pointList.size(); ui++)
 	{
 #ifdef _OPENMP
@@ -946,11 +908,7 @@ unsigned int generateDistHist(const vector<Point3D> &pointList, const K3DTree &t
 				if(sqrDist < maxSqrDist)
 				{
 					//Add the point to the histogram
-#ifdef _OPENMP
-					threadHist[(size_t) ((sqrtf(sqrDist/maxSqrDist)*(float)numBins))] [omp_get_thread_num()]++;
-#else
-					histogram[(size_t)((sqrtf(sqrDist/maxSqrDist)*(float)numBins))]++;
-#endif
+					threadHist.add((size_t)((sqrtf(sqrDist/maxSqrDist)*(float)numBins)));
 				}
 
 				//increase the dead distance to the last distance
@@ -994,19 +952,221 @@ unsigned int generateDistHist(const vector<Point3D> &pointList, const K3DTree &t
 #ifdef _OPENMP
 	if(spin)
 		return RDF_ABORT_FAIL;
-    
-	for (size_t i = 0; i < numBins; i++)
+#endif
+	threadHist.mergeInto(histogram);
+
+	//Calculations complete!
+	return 0;
+}
+
+
+
+unsigned int generatePairDistHist(const vector<Point3D> &sourcePts,
+			const vector<unsigned int> &sourceSpecies, const CellList &targets,
+			const vector<unsigned int> &targetSpecies, unsigned int numSpecies,
+			float distMax, unsigned int numBins, vector<size_t> &histogram,
+			unsigned int *progressPtr,ATOMIC_BOOL &wantAbort)
+{
+	ASSERT(sourcePts.size() == sourceSpecies.size());
+	ASSERT(targets.size() == targetSpecies.size());
+
+	//Histogram of source species vs target species vs distance bin
+	ThreadHistogram threadHist;
+	vector<size_t> dims(3);
+	dims[0]=dims[1]=numSpecies;
+	dims[2]=numBins;
+	if(!threadHist.init(dims))
+		return RDF_ERR_MEMALLOC;
+
+	try
+	{
+		histogram.assign(threadHist.size(),0);
+	}
+	catch(std::bad_alloc)
 	{
-		for (size_t j = 0; j < omp_get_max_threads(); j++)
-			histogram[i] += threadHist[i][j];
+		return RDF_ERR_MEMALLOC;
 	}
+
+	if(sourcePts.empty() || targets.empty())
+		return 0;
+
+	//As per generateDistHist, exact matches are not counted,
+	// nor are points at distMax
+	const float maxSqrDist = distMax*distMax;
+	const float deadDistSqr=std::numeric_limits<float>::epsilon();
+	const size_t numBlocks=(sourcePts.size()+KDBUCKET_QUERY_BLOCK-1)/KDBUCKET_QUERY_BLOCK;
+
+	size_t numAnalysed=0;
+	bool spin=false;
+#pragma omp parallel
+	{
+		vector<size_t> offsets,found;
+		vector<float> sqrDists;
+		size_t *bins=threadHist.threadBins();
+
+#pragma omp for schedule(dynamic)
+		for(size_t ui=0;ui<numBlocks;ui++)
+		{
+			if(spin)
+				continue;
+
+			size_t start=ui*KDBUCKET_QUERY_BLOCK;
+			size_t nQueries=std::min((size_t)KDBUCKET_QUERY_BLOCK,sourcePts.size()-start);
+			targets.findInSphere(&sourcePts[start],nQueries,maxSqrDist,deadDistSqr,
+							offsets,found,&sqrDists);
+
+			//Each neighbour of each source point lands in
+			// the row for its (source,target) species pair
+			for(size_t uj=0;uj<nQueries;uj++)
+			{
+				size_t rowBase=sourceSpecies[start+uj]*numSpecies;
+				ASSERT(sourceSpecies[start+uj] < numSpecies);
+				for(size_t uk=offsets[uj];uk<offsets[uj+1];uk++)
+				{
+					float sqrDist=sqrDists[uk];
+					if(sqrDist >= maxSqrDist)
+						continue;
+
+					size_t offset=(size_t)(sqrtf(sqrDist/maxSqrDist)*(float)numBins);
+					if(offset >= numBins)
+						offset=numBins-1;
+
+					ASSERT(targetSpecies[found[uk]] < numSpecies);
+					bins[(rowBase+targetSpecies[found[uk]])*numBins+offset]++;
+				}
+			}
+
+			#pragma omp atomic
+			numAnalysed+=nQueries;
+#ifdef _OPENMP
+			if(!omp_get_thread_num())
 #endif
+			{
+				*progressPtr= (unsigned int)((float)(numAnalysed)/((float)sourcePts.size())*100.0f);
+				if(wantAbort)
+					spin=true;
+			}
+		}
+	}
+
+	if(spin || wantAbort)
+		return RDF_ABORT_FAIL;
+
+	threadHist.mergeInto(&histogram[0]);
 
-	//Calculations complete!
 	return 0;
 }
 
 
+unsigned int generate3DDistHist(const vector<Point3D> &sourcePts,
+			const CellList &targets, const vector<Point3D> &targetPts,
+			float distMax, unsigned int numBins, vector<size_t> &histogram,
+			const Point3D &axisDir, unsigned int numAxialBins, unsigned int *axialHist,
+			unsigned int *progressPtr,ATOMIC_BOOL &wantAbort)
+{
+	ASSERT(targets.size() == targetPts.size());
+	ASSERT(numBins);
+	ASSERT(!axialHist || fabs(axisDir.sqrMag() -1.0f) < sqrt(std::numeric_limits<float>::epsilon()));
+
+	ThreadHistogram threadHist;
+	vector<size_t> dims(3,numBins);
+	if(!threadHist.init(dims))
+		return RDF_ERR_MEMALLOC;
+
+	//Exact axial profile, accumulated in the same pass
+	ThreadHistogram axialThreadHist;
+	if(axialHist && !axialThreadHist.init(numAxialBins))
+		return RDF_ERR_MEMALLOC;
+
+
+	try
+	{
+		histogram.assign(threadHist.size(),0);
+	}
+	catch(std::bad_alloc)
+	{
+		return RDF_ERR_MEMALLOC;
+	}
+
+	if(sourcePts.empty() || targets.empty())
+		return 0;
+
+	const float maxSqrDist = distMax*distMax;
+	const float deadDistSqr=std::numeric_limits<float>::epsilon();
+	const float binScale=(float)numBins/(2.0f*distMax);
+	const size_t numBlocks=(sourcePts.size()+KDBUCKET_QUERY_BLOCK-1)/KDBUCKET_QUERY_BLOCK;
+
+	size_t numAnalysed=0;
+	bool spin=false;
+#pragma omp parallel
+	{
+		vector<size_t> offsets,found;
+		size_t *bins=threadHist.threadBins();
+		size_t *axialBins= axialHist ? axialThreadHist.threadBins() : 0;
+
+#pragma omp for schedule(dynamic)
+		for(size_t ui=0;ui<numBlocks;ui++)
+		{
+			if(spin)
+				continue;
+
+			size_t start=ui*KDBUCKET_QUERY_BLOCK;
+			size_t nQueries=std::min((size_t)KDBUCKET_QUERY_BLOCK,sourcePts.size()-start);
+			targets.findInSphere(&sourcePts[start],nQueries,maxSqrDist,deadDistSqr,
+							offsets,found);
+
+			for(size_t uj=0;uj<nQueries;uj++)
+			{
+				const Point3D &src=sourcePts[start+uj];
+				for(size_t uk=offsets[uj];uk<offsets[uj+1];uk++)
+				{
+					Point3D delta=targetPts[found[uk]]-src;
+					if(delta.sqrMag() >= maxSqrDist)
+						continue;
+
+					size_t idx[3];
+					for(unsigned int ul=0;ul<3;ul++)
+					{
+						float pos=(delta[ul]+distMax)*binScale;
+						idx[ul]= pos > 0 ? (size_t)pos : 0;
+						if(idx[ul] >= numBins)
+							idx[ul]=numBins-1;
+					}
+					bins[idx[0]+numBins*(idx[1]+numBins*idx[2])]++;
+
+					if(axialBins)
+					{
+						//Same binning as generate1DAxialDistHist
+						float distance=delta.dotProd(axisDir);
+						int offset=(int)(((0.5f*distance)/distMax+0.5f)*(float)numAxialBins);
+						if(offset < (int)numAxialBins && offset >=0)
+							axialBins[offset]++;
+					}
+				}
+			}
+
+			#pragma omp atomic
+			numAnalysed+=nQueries;
+#ifdef _OPENMP
+			if(!omp_get_thread_num())
+#endif
+			{
+				*progressPtr= (unsigned int)((float)(numAnalysed)/((float)sourcePts.size())*100.0f);
+				if(wantAbort)
+					spin=true;
+			}
+		}
+	}
+
+	if(spin || wantAbort)
+		return RDF_ABORT_FAIL;
+
+	threadHist.mergeInto(&histogram[0]);
+	if(axialHist)
+		axialThreadHist.mergeInto(axialHist);
+
+	return 0;
+}
 
 void generateKnnTheoreticalDist(const std::vector<float> &radii, float density, unsigned int nn,
 					std::vector<float> &nnDist)
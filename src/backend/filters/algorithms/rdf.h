@@ -20,6 +20,8 @@
 #define RDF_H
 
 #include "K3DTree.h"
+#include "K3DTree-bucket.h"
+#include "cellList.h"
 
 
 //RDF error codes
@@ -28,12 +30,13 @@ enum
 	RDF_ERR_NEGATIVE_SCALE_FACT=1,
 	RDF_ERR_INSUFFICIENT_INPUT_POINTS,
 	RDF_FILE_OPEN_FAIL,
-	RDF_ABORT_FAIL
+	RDF_ABORT_FAIL,
+	RDF_ERR_MEMALLOC
 };
 
 //!Generate the NN histogram specified up to a given NN
 unsigned int generateNNHist( const std::vector<Point3D> &pointList, 
-			const K3DTree &tree,unsigned int nnMax, unsigned int numBins,
+			const K3DTreeBucket &tree,unsigned int nnMax, unsigned int numBins,
 		       	std::vector<std::vector<size_t> > &histogram, float *binWidth,
 		       	unsigned int *progressPtr,ATOMIC_BOOL &wantAbort);
 
@@ -44,13 +47,42 @@ unsigned int generateDistHist(const std::vector<Point3D> &pointList, const K3DTr
 			unsigned int numBins, unsigned int &warnBiasCount,
 			unsigned int *progressPtr,ATOMIC_BOOL &wantAbort);
 
+//!Generate distance histograms for every pair of species at once.
+/*! Each source point has a species (sourceSpecies, < numSpecies), as does each point
+ * in the target cell list (targetSpecies, indexed as the points the list was built from).
+ * histogram is resized to numSpecies*numSpecies*numBins, and the counts for
+ * source species i and target species j are at [(i*numSpecies+j)*numBins].
+ * Binning matches generateDistHist. The cell list should be built for distMax
+ */
+unsigned int generatePairDistHist(const std::vector<Point3D> &sourcePts,
+			const std::vector<unsigned int> &sourceSpecies, const CellList &targets,
+			const std::vector<unsigned int> &targetSpecies, unsigned int numSpecies,
+			float distMax, unsigned int numBins, std::vector<size_t> &histogram,
+			unsigned int *progressPtr,ATOMIC_BOOL &wantAbort);
+
+//!Generate a 3D histogram (spatial distribution map) of the vectors from each
+// source point to the targets within distMax.
+/*! The histogram spans [-distMax,distMax) along each axis, with numBins bins per axis,
+ * and bin (x,y,z) is at x+numBins*(y+numBins*z). histogram is resized to numBins^3.
+ * targetPts must be the points that the cell list (built for distMax) was built from.
+ * As per generateDistHist, exact matches and points at distMax are not counted.
+ * If axialHist is non-null, the same vectors are also projected onto axisDir (which
+ * must be normalised), and added to axialHist, as per generate1DAxialDistHist
+ */
+unsigned int generate3DDistHist(const std::vector<Point3D> &sourcePts,
+			const CellList &targets, const std::vector<Point3D> &targetPts,
+			float distMax, unsigned int numBins, std::vector<size_t> &histogram,
+			const Point3D &axisDir, unsigned int numAxialBins, unsigned int *axialHist,
+			unsigned int *progressPtr,ATOMIC_BOOL &wantAbort);
+
+
 //!Returns a subset of points guaranteed to lie at least reductionDim inside hull of input points
 /*! Calculates the hull of the input ions and then scales the hull such that the 
  * smallest distance between the scaled hull and the original hull is  exactly
- * reductionDim
+ * reductionDim. Returns the offsets of the retained points in pts, in ascending order
  */
 unsigned int GetReducedHullPts(const std::vector<Point3D> &pts, float reductionDim,
-		unsigned int  *progress, ATOMIC_BOOL &wantAbort, std::vector<Point3D> &returnIons );
+		unsigned int  *progress, ATOMIC_BOOL &wantAbort, std::vector<size_t> &returnOffsets );
 
 
 //Return a 1D histogram of NN frequencies, by projecting the NNs within a given search onto a specified axis, stopping at some fixed sstance
@@ -0,0 +1,265 @@
+/*
+ *	spaceFillingCurve.cpp - Morton/Hilbert ordering of 3D point data
+ *	Copyright (C) 2015, D Haley
+
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "spaceFillingCurve.h"
+
+#include "common/translation.h"
+
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using std::vector;
+using std::pair;
+
+const char *SPATIAL_ORDER_STRING[] = { NTRANS("None"),
+					NTRANS("Morton"),
+					NTRANS("Hilbert")
+				};
+
+//Spread the lower 21 bits of v such that there are two zero bits between each
+static unsigned long long spreadBits(unsigned int v)
+{
+	unsigned long long x = v & 0x1fffff;
+	x = (x | x << 32) & 0x1f00000000ffffULL;
+	x = (x | x << 16) & 0x1f0000ff0000ffULL;
+	x = (x | x << 8) & 0x100f00f00f00f00fULL;
+	x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+	x = (x | x << 2) & 0x1249249249249249ULL;
+	return x;
+}
+
+unsigned long long mortonKey(unsigned int x, unsigned int y, unsigned int z)
+{
+	return (spreadBits(x) << 2) | (spreadBits(y) << 1) | spreadBits(z);
+}
+
+unsigned long long hilbertKey(unsigned int x, unsigned int y, unsigned int z,
+						unsigned int nBits)
+{
+	ASSERT(nBits && nBits <=SFC_BITS_PER_AXIS);
+
+	//Convert the axis values to the "transposed" Hilbert index,
+	// using the method of Skilling, AIP Conf. Proc. 707, 381 (2004).
+	// Interleaving the transposed values then yields the index
+	unsigned int X[3] = {x,y,z};
+	const unsigned int M = 1u << (nBits-1);
+
+	//Inverse undo
+	for(unsigned int Q=M; Q>1; Q>>=1)
+	{
+		unsigned int P=Q-1;
+		for(unsigned int ui=0;ui<3;ui++)
+		{
+			if(X[ui] & Q)
+				X[0]^=P;
+			else
+			{
+				unsigned int t=(X[0]^X[ui]) & P;
+				X[0]^=t;
+				X[ui]^=t;
+			}
+		}
+	}
+
+	//Gray encode
+	for(unsigned int ui=1;ui<3;ui++)
+		X[ui]^=X[ui-1];
+	unsigned int t=0;
+	for(unsigned int Q=M;Q>1;Q>>=1)
+	{
+		if(X[2] & Q)
+			t^=Q-1;
+	}
+	for(unsigned int ui=0;ui<3;ui++)
+		X[ui]^=t;
+
+	return mortonKey(X[0],X[1],X[2]);
+}
+
+unsigned int spatialReorder(vector<IonHit> &ions, unsigned int order,
+		const BoundCube &bounds, unsigned int &progress, ATOMIC_BOOL &wantAbort)
+{
+	ASSERT(order < SPATIAL_ORDER_ENUM_END);
+	progress=0;
+	if(order == SPATIAL_ORDER_NONE || ions.size() < 2)
+	{
+		progress=100;
+		return 0;
+	}
+
+	//Find the scaling to take each axis onto the integer grid
+	const float MAX_CELL = (float)((1u << SFC_BITS_PER_AXIS) -1);
+	float offset[3],scale[3];
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		offset[ui]=bounds.getBound(ui,0);
+		float width = bounds.getBound(ui,1) - offset[ui];
+		if(width > 0)
+			scale[ui] = MAX_CELL/width;
+		else
+			scale[ui]=0;
+	}
+
+	//Compute the key for each ion
+	vector<pair<unsigned long long, size_t> > keys;
+	try
+	{
+		keys.resize(ions.size());
+	}
+	catch(std::bad_alloc)
+	{
+		return SFC_ERR_MEMALLOC;
+	}
+#pragma omp parallel for
+	for(size_t ui=0;ui<ions.size();ui++)
+	{
+		const Point3D &p = ions[ui].getPosRef();
+		unsigned int cell[3];
+		for(unsigned int uj=0;uj<3;uj++)
+		{
+			float f = (p[uj]-offset[uj])*scale[uj];
+			f = std::max(0.0f,std::min(f,MAX_CELL));
+			cell[uj]=(unsigned int)f;
+		}
+
+		if(order == SPATIAL_ORDER_MORTON)
+			keys[ui].first = mortonKey(cell[0],cell[1],cell[2]);
+		else
+			keys[ui].first = hilbertKey(cell[0],cell[1],cell[2]);
+		keys[ui].second=ui;
+	}
+	progress=33;
+
+	if(wantAbort)
+		return SFC_ERR_ABORT;
+
+	//Ties are broken by original index, so the result is deterministic.
+	// std::sort is parallelised when built with _GLIBCXX_PARALLEL
+	std::sort(keys.begin(),keys.end());
+	progress=66;
+
+	if(wantAbort)
+		return SFC_ERR_ABORT;
+
+	vector<IonHit> reordered;
+	try
+	{
+		reordered.resize(ions.size());
+	}
+	catch(std::bad_alloc)
+	{
+		return SFC_ERR_MEMALLOC;
+	}
+
+#pragma omp parallel for
+	for(size_t ui=0;ui<keys.size();ui++)
+		reordered[ui]=ions[keys[ui].second];
+
+	ions.swap(reordered);
+	progress=100;
+
+	return 0;
+}
+
+#ifdef DEBUG
+
+bool testSpaceFillingCurve()
+{
+	COMPILE_ASSERT(THREEDEP_ARRAYSIZE(SPATIAL_ORDER_STRING) == SPATIAL_ORDER_ENUM_END);
+
+	//Morton keys interleave bits, x highest
+	TEST(mortonKey(1,0,0) == 4,"morton x bit");
+	TEST(mortonKey(0,1,0) == 2,"morton y bit");
+	TEST(mortonKey(0,0,1) == 1,"morton z bit");
+	TEST(mortonKey(0x1fffff,0x1fffff,0x1fffff) == 0x7fffffffffffffffULL,"morton full key");
+
+	//Walk a small Hilbert grid. Each index must be visited exactly once,
+	// and successive cells must be face-adjacent
+	const unsigned int NBITS=3;
+	const unsigned int N=1u << NBITS;
+	vector<unsigned int> cellAtKey(N*N*N,(unsigned int)-1);
+	for(unsigned int ui=0;ui<N;ui++)
+	{
+		for(unsigned int uj=0;uj<N;uj++)
+		{
+			for(unsigned int uk=0;uk<N;uk++)
+			{
+				unsigned long long key = hilbertKey(ui,uj,uk,NBITS);
+				TEST(key < cellAtKey.size(),"hilbert key range");
+				TEST(cellAtKey[key] == (unsigned int)-1,"hilbert key uniqueness");
+				cellAtKey[key] = (ui*N + uj)*N + uk;
+			}
+		}
+	}
+
+	for(size_t ui=1;ui<cellAtKey.size();ui++)
+	{
+		unsigned int a=cellAtKey[ui-1], b=cellAtKey[ui];
+		int dx = (int)(a/(N*N)) - (int)(b/(N*N));
+		int dy = (int)((a/N)%N) - (int)((b/N)%N);
+		int dz = (int)(a%N) - (int)(b%N);
+		TEST(abs(dx) + abs(dy) + abs(dz) == 1,"hilbert adjacency");
+	}
+
+	//Check that reordering is a permutation, and improves locality
+	RandNumGen rng;
+	rng.initialise(1234);
+	vector<IonHit> ions(5000);
+	for(size_t ui=0;ui<ions.size();ui++)
+	{
+		ions[ui].setPos(rng.genUniformDev(),rng.genUniformDev(),rng.genUniformDev());
+		ions[ui].setMassToCharge(ui);
+	}
+
+	BoundCube bc;
+	IonHit::getBoundCube(ions,bc);
+
+	for(unsigned int order=SPATIAL_ORDER_MORTON; order<SPATIAL_ORDER_ENUM_END;order++)
+	{
+		vector<IonHit> sorted=ions;
+		unsigned int prog;
+		ATOMIC_BOOL wantAbort(false);
+		TEST(!spatialReorder(sorted,order,bc,prog,wantAbort),"reorder");
+		TEST(sorted.size() == ions.size(),"reorder size");
+
+		vector<bool> seen(ions.size(),false);
+		float sumDistOrig=0,sumDistSorted=0;
+		for(size_t ui=0;ui<sorted.size();ui++)
+		{
+			size_t idx=(size_t)sorted[ui].getMassToCharge();
+			TEST(!seen[idx],"reorder is permutation");
+			seen[idx]=true;
+			TEST(sorted[ui].getPosRef().sqrDist(ions[idx].getPosRef()) == 0,"reorder keeps data");
+
+			if(ui)
+			{
+				sumDistOrig+=sqrtf(ions[ui].getPosRef().sqrDist(ions[ui-1].getPosRef()));
+				sumDistSorted+=sqrtf(sorted[ui].getPosRef().sqrDist(sorted[ui-1].getPosRef()));
+			}
+		}
+
+		TEST(sumDistSorted < 0.5f*sumDistOrig,"curve ordering locality");
+	}
+
+	return true;
+}
+
+#endif
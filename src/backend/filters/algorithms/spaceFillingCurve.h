@@ -0,0 +1,66 @@
+/*
+ *	spaceFillingCurve.h - Morton/Hilbert ordering of 3D point data
+ *	Copyright (C) 2015, D Haley
+
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SPACEFILLINGCURVE_H
+#define SPACEFILLINGCURVE_H
+
+#include "backend/APT/ionhit.h"
+
+//!Orderings that a point stream may be arranged in
+enum
+{
+	//Order is unknown (e.g. reconstruction/detector order)
+	SPATIAL_ORDER_NONE,
+	//Points sorted along a Morton (Z-order) curve
+	SPATIAL_ORDER_MORTON,
+	//Points sorted along a Hilbert curve
+	SPATIAL_ORDER_HILBERT,
+	SPATIAL_ORDER_ENUM_END
+};
+
+enum
+{
+	SFC_ERR_ABORT=1,
+	SFC_ERR_MEMALLOC,
+	SFC_ERR_ENUM_END
+};
+
+//!Number of bits used for each axis when computing curve keys
+const unsigned int SFC_BITS_PER_AXIS=21;
+
+//!Human readable names for each spatial order
+extern const char *SPATIAL_ORDER_STRING[];
+
+//!Interleave the lowest 21 bits of x,y,z into a Morton key. x is most significant
+unsigned long long mortonKey(unsigned int x, unsigned int y, unsigned int z);
+
+//!Compute the Hilbert curve index of the given cell, for a 2^nBits grid
+// per axis. nBits must be between 1 and SFC_BITS_PER_AXIS
+unsigned long long hilbertKey(unsigned int x, unsigned int y, unsigned int z,
+						unsigned int nBits=SFC_BITS_PER_AXIS);
+
+//!Reorder the ions such that they lie along the given space filling curve,
+// using the specified bounds to quantise positions. Returns 0 on success,
+// or SFC_ERR_ABORT/SFC_ERR_MEMALLOC on failure, in which case ions will be unmodified
+unsigned int spatialReorder(std::vector<IonHit> &ions, unsigned int order,
+		const BoundCube &bounds, unsigned int &progress, ATOMIC_BOOL &wantAbort);
+
+#ifdef DEBUG
+bool testSpaceFillingCurve();
+#endif
+
+#endif
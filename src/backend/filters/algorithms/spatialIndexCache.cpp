@@ -0,0 +1,495 @@
+/*
+ * spatialIndexCache.cpp - Shared cache of KD trees built from point data
+ * Copyright (C) 2015  D. Haley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "spatialIndexCache.h"
+
+#include <cstring>
+#include <new>
+
+using std::vector;
+using std::map;
+
+enum
+{
+	INDEX_TREE_BUCKET,
+	INDEX_TREE_MK2,
+	INDEX_CELL_LIST
+};
+
+//Number of points hashed by each thread per work item
+const size_t HASH_BLOCK=16384;
+
+//FNV-1a constants, 64 bit
+const unsigned long long FNV_OFFSET=14695981039346656037ULL;
+const unsigned long long FNV_PRIME=1099511628211ULL;
+
+map<SpatialIndexKey,SpatialIndexCache::CacheEntry> SpatialIndexCache::entries;
+vector<SpatialIndexCache::CacheEntry> SpatialIndexCache::retired;
+
+size_t SpatialIndexCache::useCounter=0;
+
+static inline unsigned long long hashPoint(unsigned long long h, const Point3D &p)
+{
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		float f=p[ui];
+		unsigned int bits;
+		memcpy(&bits,&f,sizeof(bits));
+		h=(h^bits)*FNV_PRIME;
+	}
+	return h;
+}
+
+static inline const Point3D &getPos(const Point3D &p) { return p;}
+static inline const Point3D &getPos(const IonHit &h) { return h.getPosRef();}
+
+//Compute an order-dependent fingerprint of the positions, and the
+// check sample. Blocks are hashed in parallel, then combined in sequence
+template<class T>
+static SpatialIndexKey makeKey(const vector<T> &pts, unsigned int treeType,
+				SpatialIndexCheck &check, float cellSize=0)
+{
+	size_t nBlocks=(pts.size()+HASH_BLOCK-1)/HASH_BLOCK;
+	vector<unsigned long long> blockHash(nBlocks);
+	vector<Point3D> blockLow(nBlocks),blockHigh(nBlocks);
+#pragma omp parallel for
+	for(size_t ui=0;ui<nBlocks;ui++)
+	{
+		unsigned long long h=FNV_OFFSET;
+		size_t start=ui*HASH_BLOCK;
+		size_t end=std::min((ui+1)*HASH_BLOCK,pts.size());
+		Point3D low=getPos(pts[start]), high=low;
+		for(size_t uj=start;uj<end;uj++)
+		{
+			const Point3D &p=getPos(pts[uj]);
+			h=hashPoint(h,p);
+			for(unsigned int uk=0;uk<3;uk++)
+			{
+				low[uk]=std::min(low[uk],p[uk]);
+				high[uk]=std::max(high[uk],p[uk]);
+			}
+		}
+		blockHash[ui]=h;
+		blockLow[ui]=low;
+		blockHigh[ui]=high;
+	}
+
+	SpatialIndexKey k;
+	k.hash=FNV_OFFSET;
+	for(size_t ui=0;ui<nBlocks;ui++)
+		k.hash=(k.hash^blockHash[ui])*FNV_PRIME;
+	k.count=pts.size();
+	k.treeType=treeType;
+	k.cellSize=cellSize;
+
+	if(pts.empty())
+	{
+		for(unsigned int ui=0;ui<3;ui++)
+			check.samples[ui]=Point3D(0,0,0);
+		check.lowBound=check.highBound=Point3D(0,0,0);
+		return k;
+	}
+
+	check.samples[0]=getPos(pts[0]);
+	check.samples[1]=getPos(pts[pts.size()/2]);
+	check.samples[2]=getPos(pts.back());
+	check.lowBound=blockLow[0];
+	check.highBound=blockHigh[0];
+	for(size_t ui=1;ui<nBlocks;ui++)
+	{
+		for(unsigned int uk=0;uk<3;uk++)
+		{
+			check.lowBound[uk]=std::min(check.lowBound[uk],blockLow[ui][uk]);
+			check.highBound[uk]=std::max(check.highBound[uk],blockHigh[ui][uk]);
+		}
+	}
+	return k;
+}
+
+
+bool SpatialIndexKey::operator<(const SpatialIndexKey &k) const
+{
+	if(hash != k.hash)
+		return hash < k.hash;
+	if(count != k.count)
+		return count < k.count;
+	if(treeType != k.treeType)
+		return treeType < k.treeType;
+	return cellSize < k.cellSize;
+}
+
+bool SpatialIndexCheck::operator==(const SpatialIndexCheck &c) const
+{
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		if(!(samples[ui] == c.samples[ui]))
+			return false;
+	}
+	return lowBound == c.lowBound && highBound == c.highBound;
+}
+
+
+void SpatialIndexCache::freeEntry(CacheEntry &e)
+{
+	delete e.bucketTree;
+	delete e.mk2Tree;
+	delete e.cellList;
+	e.bucketTree=0;
+	e.mk2Tree=0;
+	e.cellList=0;
+}
+
+SpatialIndexCache::CacheEntry *SpatialIndexCache::lookup(const SpatialIndexKey &k,
+					const SpatialIndexCheck &c)
+{
+	useCounter++;
+	map<SpatialIndexKey,CacheEntry>::iterator it=entries.find(k);
+	if(it==entries.end())
+		return 0;
+
+	if(!(it->second.check == c))
+	{
+		//Fingerprint collision - different data. The old tree may still
+		// be held by a caller, so retire it rather than freeing it now
+		retired.push_back(it->second);
+		entries.erase(it);
+		return 0;
+	}
+
+	it->second.lastUse=useCounter;
+	return &(it->second);
+}
+
+SpatialIndexCache::CacheEntry &SpatialIndexCache::insert(const SpatialIndexKey &k,
+					const SpatialIndexCheck &c)
+{
+	CacheEntry &e=entries[k];
+	e.bucketTree=0;
+	e.mk2Tree=0;
+	e.cellList=0;
+	e.check=c;
+	e.bytes=0;
+	e.lastUse=useCounter;
+	return e;
+}
+
+
+template<class T>
+unsigned int SpatialIndexCache::getBucketTreeImpl(const vector<T> &pts,
+		const K3DTreeBucket *&tree, unsigned int &progress, ATOMIC_BOOL &wantAbort)
+{
+	tree=0;
+	SpatialIndexCheck check;
+	SpatialIndexKey k=makeKey(pts,INDEX_TREE_BUCKET,check);
+
+	CacheEntry *cached=lookup(k,check);
+	if(cached)
+	{
+		progress=100;
+		tree=cached->bucketTree;
+		return 0;
+	}
+
+
+	K3DTreeBucket *newTree=0;
+	try
+	{
+		newTree = new K3DTreeBucket;
+		if(newTree->build(pts,progress,wantAbort))
+		{
+			delete newTree;
+			return SPATIALINDEX_ERR_ABORT;
+		}
+	}
+	catch(std::bad_alloc)
+	{
+		delete newTree;
+		return SPATIALINDEX_ERR_MEMALLOC;
+	}
+
+	CacheEntry &e=insert(k,check);
+	e.bucketTree=newTree;
+	e.bytes=newTree->memoryUsage();
+	tree=newTree;
+	return 0;
+}
+
+unsigned int SpatialIndexCache::getBucketTree(const vector<Point3D> &pts,
+		const K3DTreeBucket *&tree, unsigned int &progress, ATOMIC_BOOL &wantAbort)
+{
+	return getBucketTreeImpl(pts,tree,progress,wantAbort);
+}
+
+unsigned int SpatialIndexCache::getBucketTree(const vector<IonHit> &pts,
+		const K3DTreeBucket *&tree, unsigned int &progress, ATOMIC_BOOL &wantAbort)
+{
+	return getBucketTreeImpl(pts,tree,progress,wantAbort);
+}
+
+template<class T>
+unsigned int SpatialIndexCache::getCellListImpl(const vector<T> &pts, float cellSize,
+		const CellList *&cells, unsigned int &progress, ATOMIC_BOOL &wantAbort)
+{
+	cells=0;
+	SpatialIndexCheck check;
+	SpatialIndexKey k=makeKey(pts,INDEX_CELL_LIST,check,cellSize);
+
+	CacheEntry *cached=lookup(k,check);
+	if(cached)
+	{
+		progress=100;
+		cells=cached->cellList;
+		return 0;
+	}
+
+	CellList *newCells;
+	try
+	{
+		newCells = new CellList;
+	}
+	catch(std::bad_alloc)
+	{
+		return SPATIALINDEX_ERR_MEMALLOC;
+	}
+
+	unsigned int errCode=newCells->build(pts,cellSize,progress,wantAbort);
+	if(errCode)
+	{
+		delete newCells;
+		if(errCode == CELLLIST_ERR_MEMALLOC)
+			return SPATIALINDEX_ERR_MEMALLOC;
+		return SPATIALINDEX_ERR_ABORT;
+	}
+
+	CacheEntry &e=insert(k,check);
+	e.cellList=newCells;
+	e.bytes=newCells->memoryUsage();
+	cells=newCells;
+	return 0;
+}
+
+unsigned int SpatialIndexCache::getCellList(const vector<Point3D> &pts, float radius,
+		const CellList *&cells, unsigned int &progress, ATOMIC_BOOL &wantAbort)
+{
+	return getCellListImpl(pts,radius,cells,progress,wantAbort);
+}
+
+unsigned int SpatialIndexCache::getCellList(const vector<IonHit> &pts, float radius,
+		const CellList *&cells, unsigned int &progress, ATOMIC_BOOL &wantAbort)
+{
+	return getCellListImpl(pts,radius,cells,progress,wantAbort);
+}
+
+unsigned int SpatialIndexCache::getMk2Tree(vector<IonHit> &pts, const K3DTreeMk2 *&tree)
+{
+	tree=0;
+	SpatialIndexCheck check;
+	SpatialIndexKey k=makeKey(pts,INDEX_TREE_MK2,check);
+
+	CacheEntry *cached=lookup(k,check);
+	if(cached)
+	{
+		tree=cached->mk2Tree;
+		return 0;
+	}
+
+	K3DTreeMk2 *newTree=0;
+	try
+	{
+		newTree = new K3DTreeMk2;
+		newTree->resetPts(pts,false);
+		if(!newTree->build())
+		{
+			delete newTree;
+			return SPATIALINDEX_ERR_ABORT;
+		}
+	}
+	catch(std::bad_alloc)
+	{
+		delete newTree;
+		return SPATIALINDEX_ERR_MEMALLOC;
+	}
+
+	CacheEntry &e=insert(k,check);
+	e.mk2Tree=newTree;
+	e.bytes=newTree->size()*(sizeof(std::pair<Point3D,size_t>) + sizeof(K3DNodeMk2)) + newTree->size()/8;
+	tree=newTree;
+	return 0;
+}
+
+void SpatialIndexCache::trim(size_t maxBytes)
+{
+	for(size_t ui=0;ui<retired.size();ui++)
+		freeEntry(retired[ui]);
+	retired.clear();
+
+	size_t total=memoryUsage();
+	while(total > maxBytes)
+	{
+		ASSERT(!entries.empty());
+		//Find the least recently used entry
+		map<SpatialIndexKey,CacheEntry>::iterator oldest=entries.begin();
+		for(map<SpatialIndexKey,CacheEntry>::iterator it=entries.begin();
+				it!=entries.end();++it)
+		{
+			if(it->second.lastUse < oldest->second.lastUse)
+				oldest=it;
+		}
+
+		total-=oldest->second.bytes;
+		freeEntry(oldest->second);
+		entries.erase(oldest);
+	}
+}
+
+void SpatialIndexCache::clear()
+{
+	for(size_t ui=0;ui<retired.size();ui++)
+		freeEntry(retired[ui]);
+	retired.clear();
+
+	//Entries may report zero bytes, so free them all, rather than by trim()
+	for(map<SpatialIndexKey,CacheEntry>::iterator it=entries.begin();
+			it!=entries.end();++it)
+		freeEntry(it->second);
+	entries.clear();
+}
+
+size_t SpatialIndexCache::memoryUsage()
+{
+	size_t total=0;
+	for(map<SpatialIndexKey,CacheEntry>::const_iterator it=entries.begin();
+			it!=entries.end();++it)
+		total+=it->second.bytes;
+	return total;
+}
+
+unsigned long long SpatialIndexCache::fingerprint(const vector<IonHit> &pts)
+{
+	SpatialIndexCheck check;
+	return makeKey(pts,0,check).hash;
+}
+
+unsigned long long SpatialIndexCache::fingerprint(const vector<Point3D> &pts)
+{
+	SpatialIndexCheck check;
+	return makeKey(pts,0,check).hash;
+}
+
+#ifdef DEBUG
+
+bool testSpatialIndexCache()
+{
+	SpatialIndexCache::clear();
+
+	RandNumGen rng;
+	rng.initialise(2468);
+	vector<Point3D> pts(5000);
+	for(size_t ui=0;ui<pts.size();ui++)
+		pts[ui]=Point3D(rng.genUniformDev(),rng.genUniformDev(),rng.genUniformDev());
+
+	unsigned int prog;
+	ATOMIC_BOOL wantAbort(false);
+
+	//Identical points share a tree, even from a different array
+	const K3DTreeBucket *tA,*tB,*tC;
+	TEST(!SpatialIndexCache::getBucketTree(pts,tA,prog,wantAbort) && tA,"bucket build");
+	vector<Point3D> ptsCopy(pts);
+	TEST(!SpatialIndexCache::getBucketTree(ptsCopy,tB,prog,wantAbort),"bucket lookup");
+	TEST(tA == tB,"cache hit");
+	TEST(tA->size() == pts.size(),"cached tree size");
+	TEST(SpatialIndexCache::size() == 1,"cache entry count");
+
+	//Ion data with the same positions also shares the tree
+	vector<IonHit> ions(pts.size());
+	for(size_t ui=0;ui<ions.size();ui++)
+		ions[ui].setPos(pts[ui]);
+	TEST(!SpatialIndexCache::getBucketTree(ions,tB,prog,wantAbort) && tB == tA,"ion cache hit");
+
+	//Any change to the points must give a new tree
+	ptsCopy[ptsCopy.size()/2][1]+=0.5f;
+	TEST(!SpatialIndexCache::getBucketTree(ptsCopy,tC,prog,wantAbort),"bucket build");
+	TEST(tC && tC != tA,"cache miss on changed data");
+	TEST(SpatialIndexCache::size() == 2,"cache entry count");
+
+	//Mk2 trees are shared, with each user holding their own tags
+	unsigned int dummyProgress;
+	ATOMIC_BOOL dummyAbort(false);
+	K3DTreeMk2::setProgressPtr(&dummyProgress);
+	K3DTreeMk2::setAbortFlag(&dummyAbort);
+	const K3DTreeMk2 *mA,*mB;
+	TEST(!SpatialIndexCache::getMk2Tree(ions,mA),"mk2 build");
+	TEST(mA && mA->size() == ions.size(),"mk2 build size");
+	TEST(!SpatialIndexCache::getMk2Tree(ions,mB) && mB == mA,"mk2 cache hit");
+	TEST(SpatialIndexCache::size() == 3,"cache entry count");
+
+	BoundCube bMk2;
+	mA->getBoundCube(bMk2);
+	K3DTagSet tagsA,tagsB;
+	tagsA.init(mA->size());
+	tagsB.init(mA->size());
+	size_t nearA=mA->findNearestUntagged(pts[0],bMk2,tagsA);
+	TEST(nearA != (size_t)-1 && mA->getPtRef(nearA) == pts[0],"mk2 shared search");
+	TEST(mA->findNearestUntagged(pts[0],bMk2,tagsB) == nearA,"mk2 independent tags");
+	TEST(mA->findNearestUntagged(pts[0],bMk2,tagsA) != nearA,"mk2 tagged point skipped");
+	TEST(tagsA.count() == 2 && tagsB.count() == 1,"mk2 tag count");
+
+	//A colliding fingerprint with different data must not hit.
+	// Fake the collision by altering a cached entry's check sample
+	SpatialIndexCheck check;
+	SpatialIndexKey kBucket=makeKey(pts,INDEX_TREE_BUCKET,check);
+	TEST(SpatialIndexCache::entries.find(kBucket) != SpatialIndexCache::entries.end(),"bucket entry key");
+	SpatialIndexCache::entries[kBucket].check.samples[1][0]+=1.0f;
+	const K3DTreeBucket *tD;
+	TEST(!SpatialIndexCache::getBucketTree(pts,tD,prog,wantAbort),"collision build");
+	TEST(tD && tD != tA,"collision rebuilds");
+	TEST(SpatialIndexCache::size() == 3,"collision replaces entry");
+	TEST(SpatialIndexCache::retired.size() == 1,"collision retires old tree");
+	tA=tD;
+
+
+	//Cell lists are keyed by their cell size
+	const CellList *cA,*cB;
+	TEST(!SpatialIndexCache::getCellList(pts,0.1f,cA,prog,wantAbort) && cA,"cell list build");
+	TEST(!SpatialIndexCache::getCellList(ions,0.1f,cB,prog,wantAbort) && cB == cA,"cell list cache hit");
+	TEST(!SpatialIndexCache::getCellList(pts,0.2f,cB,prog,wantAbort) && cB != cA,"cell list size miss");
+	TEST(SpatialIndexCache::size() == 5,"cache entry count");
+
+	//Cell list errors are reported as cache errors, and nothing is cached
+	{
+	ATOMIC_BOOL abortNow(true);
+	const CellList *cC;
+	TEST(SpatialIndexCache::getCellList(pts,0.3f,cC,prog,abortNow) == SPATIALINDEX_ERR_ABORT
+			&& !cC,"cell list abort");
+	TEST(SpatialIndexCache::size() == 5,"aborted cell list not cached");
+	}
+
+	//Trimming removes the least recently used first
+	SpatialIndexCache::getBucketTree(pts,tB,prog,wantAbort);
+	size_t keepBytes=tA->memoryUsage();
+	SpatialIndexCache::trim(keepBytes);
+	TEST(SpatialIndexCache::size() == 1,"trim");
+	TEST(!SpatialIndexCache::getBucketTree(pts,tB,prog,wantAbort) && tB == tA,"trim keeps recent");
+
+	SpatialIndexCache::clear();
+	TEST(!SpatialIndexCache::size() && !SpatialIndexCache::memoryUsage(),"clear");
+
+	return true;
+}
+
+#endif
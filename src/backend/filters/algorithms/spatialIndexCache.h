@@ -0,0 +1,173 @@
+/*
+ * spatialIndexCache.h - Shared cache of KD trees built from point data
+ * Copyright (C) 2015  D. Haley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPATIALINDEXCACHE_H
+#define SPATIALINDEXCACHE_H
+
+#include <map>
+
+#include "K3DTree-bucket.h"
+#include "K3DTree-mk2.h"
+#include "cellList.h"
+
+//!Errors from obtaining a tree from the cache
+enum
+{
+	SPATIALINDEX_ERR_ABORT=1,
+	SPATIALINDEX_ERR_MEMALLOC,
+	SPATIALINDEX_ERR_ENUM_END
+};
+
+//!Identifies the point data that a tree was built from
+class SpatialIndexKey
+{
+	public:
+		//!Fingerprint of the point positions, in order
+		unsigned long long hash;
+		//!Number of points
+		size_t count;
+		//!Which kind of tree is stored
+		unsigned int treeType;
+		//!Requested cell size, for cell lists. Zero for trees
+		float cellSize;
+
+		bool operator<(const SpatialIndexKey &k) const;
+};
+
+//!Sample of the point data, checked on each cache hit, so that
+// a hash collision is not mistaken for the same data
+class SpatialIndexCheck
+{
+	public:
+		//!First, middle and last points
+		Point3D samples[3];
+		//!Lower and upper corners of the points' bounding box
+		Point3D lowBound,highBound;
+
+		bool operator==(const SpatialIndexCheck &c) const;
+};
+
+
+//!Cache of spatial search trees, shared between all filters.
+/*! Filters that sit under the same parent often see the same ions
+ * (or the same ranged subset of ions), and each would otherwise
+ * build an identical tree. Trees are looked up by a fingerprint of
+ * the point positions, so any filter, in this or a later refresh,
+ * that requests a tree for the same points (in the same order)
+ * obtains the existing tree.
+ *
+ * Hits are verified against a sample of the points and their bounds,
+ * in case of a fingerprint collision.
+ *
+ * The filter tree calls trim() after each filter completes, to keep
+ * the cache (together with the filter cache) within the memory budget.
+ * Pointers obtained from the cache are valid until the next call to
+ * trim() or clear(). Cached trees are shared, and must not be modified;
+ * Mk2 tree users hold their own K3DTagSet for tagging.
+ * The cache must only be used from the refresh thread.
+ */
+class SpatialIndexCache
+{
+	private:
+		class CacheEntry
+		{
+			public:
+				K3DTreeBucket *bucketTree;
+				K3DTreeMk2 *mk2Tree;
+				CellList *cellList;
+				//!Sample of the points the tree was built from
+				SpatialIndexCheck check;
+				//!Approximate size of the tree, in bytes
+				size_t bytes;
+				//!Value of useCounter when this entry was last requested
+				size_t lastUse;
+		};
+
+		static std::map<SpatialIndexKey,CacheEntry> entries;
+		//!Entries displaced by a colliding fingerprint. Their trees may
+		// still be in use, so these are only freed on the next trim()
+		static std::vector<CacheEntry> retired;
+		static size_t useCounter;
+
+		static void freeEntry(CacheEntry &e);
+
+		//!Find the entry for the given key, verifying it against the check.
+		// Returns null if there is no matching entry
+		static CacheEntry *lookup(const SpatialIndexKey &k, const SpatialIndexCheck &c);
+		//!Create an empty entry for the given key
+		static CacheEntry &insert(const SpatialIndexKey &k, const SpatialIndexCheck &c);
+
+
+		template<class T>
+		static unsigned int getBucketTreeImpl(const std::vector<T> &pts,
+				const K3DTreeBucket *&tree, unsigned int &progress, ATOMIC_BOOL &wantAbort);
+		template<class T>
+		static unsigned int getCellListImpl(const std::vector<T> &pts, float cellSize,
+				const CellList *&cells, unsigned int &progress, ATOMIC_BOOL &wantAbort);
+#ifdef DEBUG
+		friend bool testSpatialIndexCache();
+#endif
+	public:
+		//!Set tree to a bucketed tree for the given points, building it if needed.
+		// Returns 0 on success, or a SPATIALINDEX_ERR value on abort or
+		// allocation failure (tree is then null)
+		static unsigned int getBucketTree(const std::vector<Point3D> &pts,
+				const K3DTreeBucket *&tree, unsigned int &progress, ATOMIC_BOOL &wantAbort);
+		static unsigned int getBucketTree(const std::vector<IonHit> &pts,
+				const K3DTreeBucket *&tree, unsigned int &progress, ATOMIC_BOOL &wantAbort);
+
+		//!Set cells to a cell list for the given points, for fixed-radius searches of
+		// (up to) the given radius, building it if needed. Returns 0 on success,
+		// or a SPATIALINDEX_ERR value on abort or allocation failure (cells is then null)
+		static unsigned int getCellList(const std::vector<Point3D> &pts, float radius,
+				const CellList *&cells, unsigned int &progress, ATOMIC_BOOL &wantAbort);
+		static unsigned int getCellList(const std::vector<IonHit> &pts, float radius,
+				const CellList *&cells, unsigned int &progress, ATOMIC_BOOL &wantAbort);
+
+		//!Set tree to a Mk2 tree of the given ions, building it if needed.
+		// Returns 0 on success, or a SPATIALINDEX_ERR value on abort or
+		// allocation failure (tree is then null). The tree's own tags must
+		// not be used; search it with a K3DTagSet of size() tags instead
+		static unsigned int getMk2Tree(std::vector<IonHit> &pts, const K3DTreeMk2 *&tree);
+
+
+		//!Release the least recently used trees, until the cache uses
+		// no more than maxBytes
+		static void trim(size_t maxBytes);
+
+		//!Release all cached trees. Must be called before shutdown, as
+		// the cache is static
+		static void clear();
+
+		//!Number of trees held by the cache
+		static size_t size() { return entries.size();}
+		//!Approximate memory used by the cache, in bytes
+		static size_t memoryUsage();
+
+		//!Order-dependent fingerprint of the ion positions, as used to
+		// look up trees. Suitable for keying other caches of derived data
+		static unsigned long long fingerprint(const std::vector<IonHit> &pts);
+		static unsigned long long fingerprint(const std::vector<Point3D> &pts);
+
+};
+
+#ifdef DEBUG
+bool testSpatialIndexCache();
+#endif
+
+#endif
@@ -0,0 +1,166 @@
+/*
+ * threadHistogram.cpp - Per-thread histogram accumulation
+ * Copyright (C) 2015  D. Haley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "threadHistogram.h"
+
+#include <new>
+#include <algorithm>
+
+using std::vector;
+
+//Assumed size of a cache line, in bytes
+const size_t THREADHIST_CACHE_LINE=64;
+//Number of bins that fit in a cache line
+const size_t BINS_PER_LINE=THREADHIST_CACHE_LINE/sizeof(size_t);
+
+ThreadHistogram::ThreadHistogram() : numBins(0), stride(0), offset(0), numThreads(0)
+{
+}
+
+bool ThreadHistogram::init(size_t nBins)
+{
+	vector<size_t> binDims(1,nBins);
+	return init(binDims);
+}
+
+bool ThreadHistogram::init(const vector<size_t> &binDims)
+{
+	ASSERT(binDims.size());
+	dims=binDims;
+	numBins=1;
+	for(size_t ui=0;ui<dims.size();ui++)
+		numBins*=dims[ui];
+
+#ifdef _OPENMP
+	numThreads=omp_get_max_threads();
+#else
+	numThreads=1;
+#endif
+
+	//Round each thread's bins up to a whole number of cache lines
+	stride=((numBins+BINS_PER_LINE-1)/BINS_PER_LINE)*BINS_PER_LINE;
+
+	try
+	{
+		//Allocate an extra line, so we can align the first bin
+		storage.assign(stride*numThreads + BINS_PER_LINE,0);
+	}
+	catch(std::bad_alloc)
+	{
+		storage.clear();
+		numBins=stride=0;
+		dims.clear();
+		return false;
+	}
+
+	size_t misalign=((size_t)&storage[0]) % THREADHIST_CACHE_LINE;
+	offset= misalign ? (THREADHIST_CACHE_LINE-misalign)/sizeof(size_t) : 0;
+
+	return true;
+}
+
+size_t ThreadHistogram::binIndex(const size_t *coords) const
+{
+	size_t idx=0;
+	for(size_t ui=0;ui<dims.size();ui++)
+	{
+		ASSERT(coords[ui] < dims[ui]);
+		idx=idx*dims[ui]+coords[ui];
+	}
+	return idx;
+}
+
+size_t *ThreadHistogram::threadBins()
+{
+#ifdef _OPENMP
+	unsigned int thread=omp_get_thread_num();
+#else
+	unsigned int thread=0;
+#endif
+	ASSERT(thread < numThreads);
+	return &storage[offset+thread*stride];
+}
+
+void ThreadHistogram::clear()
+{
+	std::fill(storage.begin(),storage.end(),0);
+}
+
+#ifdef DEBUG
+
+bool testThreadHistogram()
+{
+	//1D : every thread adds to every bin
+	const size_t NBINS=20000;
+	ThreadHistogram h;
+	TEST(h.init(NBINS),"1D init");
+	TEST(h.size() == NBINS,"1D size");
+
+	const size_t NREPEAT=7;
+#pragma omp parallel for
+	for(size_t ui=0;ui<NBINS*NREPEAT;ui++)
+		h.add(ui%NBINS);
+
+	vector<unsigned int> out(NBINS,1);
+	h.mergeInto(&out[0]);
+	for(size_t ui=0;ui<NBINS;ui++)
+	{
+		TEST(out[ui] == NREPEAT+1,"1D merge");
+	}
+
+	//Thread bins must be cache line aligned
+	TEST(!(((size_t)h.threadBins()) % THREADHIST_CACHE_LINE),"alignment");
+
+	//3D : check indexing, and merging of a sub-range
+	vector<size_t> dims(3);
+	dims[0]=3; dims[1]=4; dims[2]=5;
+	TEST(h.init(dims),"3D init");
+	TEST(h.size() == 60 && h.getDim(2) == 5,"3D size");
+#pragma omp parallel
+	{
+		size_t *bins=h.threadBins();
+		#pragma omp for
+		for(size_t ui=0;ui<dims[0];ui++)
+		{
+			for(size_t uj=0;uj<dims[1];uj++)
+			{
+				size_t coords[3]={ui,uj,ui};
+				bins[h.binIndex(coords)]+=ui+uj;
+			}
+		}
+	}
+
+	vector<size_t> row(dims[1]*dims[2],0);
+	h.mergeInto(&row[0],2*dims[1]*dims[2],row.size());
+	for(size_t uj=0;uj<dims[1];uj++)
+	{
+		for(size_t uk=0;uk<dims[2];uk++)
+		{
+			TEST(row[uj*dims[2]+uk] == (uk == 2 ? 2+uj : 0),"3D merge");
+		}
+	}
+
+	h.clear();
+	vector<size_t> all(h.size(),0);
+	h.mergeInto(&all[0]);
+	TEST(std::count(all.begin(),all.end(),0) == (int)all.size(),"clear");
+
+	return true;
+}
+
+#endif
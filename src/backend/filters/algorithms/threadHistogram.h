@@ -0,0 +1,118 @@
+/*
+ * threadHistogram.h - Per-thread histogram accumulation
+ * Copyright (C) 2015  D. Haley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef THREADHISTOGRAM_H
+#define THREADHISTOGRAM_H
+
+#include <vector>
+
+#include "common/basics.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+//!Histogram which each OpenMP thread may increment without locking.
+/*! Every thread has its own copy of the bins, on the heap. Each copy is
+ * aligned to, and padded out to, a cache line, so that threads do not
+ * contend for the same lines. Once accumulation is complete, the copies
+ * are summed (in parallel, for large histograms) using mergeInto().
+ *
+ * Bins may have any number of dimensions; they are stored in row-major
+ * order, so for a 2D histogram, bin (i,j) is at i*getDim(1)+j
+ */
+class ThreadHistogram
+{
+	private:
+		//!Number of bins along each dimension
+		std::vector<size_t> dims;
+		//!Total number of bins, per thread
+		size_t numBins;
+		//!Distance between the start of each thread's bins
+		size_t stride;
+		//!Offset of the first (aligned) bin in storage
+		size_t offset;
+		//!Number of threads bins are allocated for
+		unsigned int numThreads;
+		//!Bins for all threads
+		std::vector<size_t> storage;
+
+		//Disallow copying, as this would break the alignment
+		ThreadHistogram(const ThreadHistogram &);
+		ThreadHistogram &operator=(const ThreadHistogram &);
+	public:
+		ThreadHistogram();
+
+		//!Allocate zeroed 1D bins for every thread that may run.
+		// Returns false if there is insufficient memory
+		bool init(size_t nBins);
+		//!Allocate zeroed N-D bins, with dimensions given by binDims
+		bool init(const std::vector<size_t> &binDims);
+
+		//!Number of bins (per thread)
+		size_t size() const { return numBins;}
+		//!Number of bins along the given dimension
+		size_t getDim(unsigned int dim) const { ASSERT(dim < dims.size()); return dims[dim];}
+
+		//!Obtain the linear index for N-D coordinates
+		size_t binIndex(const size_t *coords) const;
+		//!Obtain the linear index for a 2D histogram
+		size_t binIndex(size_t i, size_t j) const { ASSERT(dims.size() == 2); return i*dims[1]+j;}
+
+		//!Obtain the calling thread's bins. Obtain this once per parallel region
+		// and increment it directly, in preference to calling add() in a loop
+		size_t *threadBins();
+
+		//!Increment a bin, for the calling thread
+		void add(size_t bin) { ASSERT(bin < numBins); threadBins()[bin]++;}
+
+		//!Reset all bins to zero
+		void clear();
+
+		//!Add the sum over all threads of bins [start,start+count) to out,
+		// which must hold count entries. Call outside of any parallel region
+		template<class T>
+		void mergeInto(T *out, size_t start=0, size_t count=(size_t)-1) const;
+};
+
+//Histograms with fewer bins than this are merged by a single thread
+const size_t THREADHIST_PARALLEL_MERGE_MIN=16384;
+
+template<class T>
+void ThreadHistogram::mergeInto(T *out, size_t start, size_t count) const
+{
+	if(count == (size_t)-1)
+		count=numBins-start;
+	ASSERT(start+count <= numBins);
+
+	const size_t *base=&storage[offset]+start;
+#pragma omp parallel for if(count >= THREADHIST_PARALLEL_MERGE_MIN)
+	for(size_t ui=0;ui<count;ui++)
+	{
+		size_t sum=0;
+		for(unsigned int uj=0;uj<numThreads;uj++)
+			sum+=base[uj*stride+ui];
+		out[ui]+=sum;
+	}
+}
+
+#ifdef DEBUG
+bool testThreadHistogram();
+#endif
+
+#endif
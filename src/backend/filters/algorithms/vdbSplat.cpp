@@ -0,0 +1,450 @@
+/*
+ * vdbSplat.cpp - Parallel splatting of points into sparse voxel grids
+ * Copyright (C) 2015  D. Haley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vdbSplat.h"
+
+#include <openvdb/tree/LeafManager.h>
+
+#include <new>
+#include <cmath>
+#include <utility>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using std::vector;
+using std::pair;
+
+
+
+//Number of points given to a thread at a time. Large chunks keep each
+// thread's grid compact, if the points are spatially ordered
+const size_t SPLAT_CHUNK=1<<16;
+
+void splatWeights(const Point3D &p, float invVoxelSize, openvdb::Coord &base, float *weights)
+{
+	float frac[3];
+	int lo[3];
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		float f=p[ui]*invVoxelSize;
+		float fl=floorf(f);
+		lo[ui]=(int)fl;
+		frac[ui]=f-fl;
+	}
+	base.reset(lo[0],lo[1],lo[2]);
+
+	//Each vertex gets the volume of the opposite sub-cuboid
+	for(unsigned int ui=0;ui<8;ui++)
+	{
+		weights[ui]= ((ui & 4) ? frac[0] : 1.0f-frac[0])*
+				((ui & 2) ? frac[1] : 1.0f-frac[1])*
+				((ui & 1) ? frac[2] : 1.0f-frac[2]);
+	}
+}
+
+//Add one point's weights, times unit, into the grid
+template<class GridT>
+static inline void addWeights(typename GridT::Accessor &acc, const openvdb::Coord &base,
+		const float *weights, const typename GridT::ValueType &unit)
+{
+	typedef typename GridT::TreeType::LeafNodeType LeafT;
+
+	//If all 8 vertices share a leaf, write to it directly, rather than
+	// make 8 lookups through the accessor
+	const int LOCAL_MAX=LeafT::DIM-1;
+	if((base.x() & LOCAL_MAX) != LOCAL_MAX && (base.y() & LOCAL_MAX) != LOCAL_MAX &&
+			(base.z() & LOCAL_MAX) != LOCAL_MAX)
+	{
+		LeafT *leaf=acc.touchLeaf(base);
+		const openvdb::Index offset=LeafT::coordToOffset(base);
+		for(unsigned int ui=0;ui<8;ui++)
+		{
+			openvdb::Index idx=offset + ((ui>>2)&1)*LeafT::DIM*LeafT::DIM +
+						((ui>>1)&1)*LeafT::DIM + (ui&1);
+			leaf->setValueOn(idx,leaf->getValue(idx)+unit*weights[ui]);
+		}
+		return;
+	}
+
+	for(unsigned int ui=0;ui<8;ui++)
+	{
+		openvdb::Coord c=base.offsetBy((ui>>2)&1,(ui>>1)&1,ui&1);
+		acc.setValue(c,acc.getValue(c)+unit*weights[ui]);
+	}
+}
+
+//As addWeights, but only for vertices active in the mask
+template<class GridT>
+static inline void addMaskedWeights(typename GridT::Accessor &acc,
+		const openvdb::FloatGrid::ConstAccessor &maskAcc, const openvdb::Coord &base,
+		const float *weights, const typename GridT::ValueType &unit)
+{
+	for(unsigned int ui=0;ui<8;ui++)
+	{
+		openvdb::Coord c=base.offsetBy((ui>>2)&1,(ui>>1)&1,ui&1);
+		if(maskAcc.isValueOn(c))
+			acc.setValue(c,acc.getValue(c)+unit*weights[ui]);
+	}
+}
+
+//Splat each array of points, with the matching unit value, into grid.
+// If mask is non-null, only its active voxels receive weight
+template<class GridT>
+static unsigned int splatInto(const vector<const vector<IonHit> *> &pts,
+		const vector<typename GridT::ValueType> &units, float voxelSize, GridT &grid,
+		unsigned int &progress, ATOMIC_BOOL &wantAbort, const openvdb::FloatGrid *mask=0)
+{
+	typedef typename GridT::Ptr GridPtr;
+
+	ASSERT(voxelSize > 0);
+	ASSERT(pts.size() == units.size());
+	progress=0;
+
+	//Divide the input into chunks of (array, start)
+	vector<pair<size_t,size_t> > chunks;
+	size_t total=0;
+	for(size_t ui=0;ui<pts.size();ui++)
+	{
+		for(size_t uj=0;uj<pts[ui]->size();uj+=SPLAT_CHUNK)
+			chunks.push_back(std::make_pair(ui,uj));
+		total+=pts[ui]->size();
+	}
+
+	if(!total)
+	{
+		progress=100;
+		return 0;
+	}
+
+	unsigned int nThreads=1;
+#ifdef _OPENMP
+	nThreads=omp_get_max_threads();
+#endif
+	nThreads=std::max(1u,std::min(nThreads,(unsigned int)chunks.size()));
+
+	vector<GridPtr> threadGrids;
+	//Accessors need a grid, so give them an empty one if unmasked
+	openvdb::FloatGrid::Ptr noMask;
+	try
+	{
+		threadGrids.resize(nThreads);
+		for(size_t ui=0;ui<nThreads;ui++)
+			threadGrids[ui]=GridT::create(grid.background());
+		if(!mask)
+			noMask=openvdb::FloatGrid::create(0.0f);
+	}
+	catch(std::bad_alloc)
+	{
+		return VDBSPLAT_ERR_MEMALLOC;
+	}
+
+	const float invVoxelSize=1.0f/voxelSize;
+	size_t numDone=0;
+	bool spin=false,memErr=false;
+	#pragma omp parallel num_threads(nThreads)
+	{
+		unsigned int thisThread=0;
+#ifdef _OPENMP
+		thisThread=omp_get_thread_num();
+#endif
+		typename GridT::Accessor acc=threadGrids[thisThread]->getAccessor();
+		openvdb::FloatGrid::ConstAccessor maskAcc=(mask ? *mask : *noMask).getConstAccessor();
+
+
+		#pragma omp for schedule(dynamic)
+		for(size_t ui=0;ui<chunks.size();ui++)
+		{
+			if(spin)
+				continue;
+
+			const vector<IonHit> &src=*(pts[chunks[ui].first]);
+			const typename GridT::ValueType &unit=units[chunks[ui].first];
+			size_t start=chunks[ui].second;
+			size_t end=std::min(start+SPLAT_CHUNK,src.size());
+			try
+			{
+				for(size_t uj=start;uj<end;uj++)
+				{
+					openvdb::Coord base;
+					float weights[8];
+					splatWeights(src[uj].getPosRef(),invVoxelSize,base,weights);
+					if(mask)
+						addMaskedWeights<GridT>(acc,maskAcc,base,weights,unit);
+					else
+						addWeights<GridT>(acc,base,weights,unit);
+				}
+			}
+			catch(std::bad_alloc)
+			{
+				memErr=true;
+				spin=true;
+			}
+
+			#pragma omp atomic
+			numDone+=end-start;
+#ifdef _OPENMP
+			if(!omp_get_thread_num())
+#endif
+			{
+				//Leave some progress for the merge
+				progress= (unsigned int)((float)numDone/(float)total*90.0f);
+				if(wantAbort)
+					spin=true;
+			}
+		}
+	}
+
+	if(memErr)
+		return VDBSPLAT_ERR_MEMALLOC;
+	if(spin)
+		return VDBSPLAT_ERR_ABORT;
+
+	//Sum the thread grids pairwise, halving their number each round
+	try
+	{
+		for(size_t stride=1;stride<nThreads;stride*=2)
+		{
+			const size_t nPairs=(nThreads+2*stride-1)/(2*stride);
+			#pragma omp parallel for
+			for(size_t ui=0;ui<nPairs;ui++)
+			{
+				size_t a=2*stride*ui;
+				if(a+stride < nThreads)
+					openvdb::tools::compSum(*threadGrids[a],*threadGrids[a+stride]);
+			}
+		}
+		openvdb::tools::compSum(grid,*threadGrids[0]);
+	}
+	catch(std::bad_alloc)
+	{
+		return VDBSPLAT_ERR_MEMALLOC;
+	}
+
+	progress=100;
+	return 0;
+}
+
+unsigned int splatPoints(const vector<const vector<IonHit> *> &pts, float voxelSize,
+		openvdb::FloatGrid &grid, unsigned int &progress, ATOMIC_BOOL &wantAbort)
+{
+	vector<float> units(pts.size(),1.0f);
+	return splatInto(pts,units,voxelSize,grid,progress,wantAbort);
+}
+
+unsigned int splatRatio(const vector<SplatSource> &src, float voxelSize,
+		openvdb::Vec2SGrid &grid, unsigned int &progress, ATOMIC_BOOL &wantAbort,
+		const openvdb::FloatGrid *mask)
+{
+	//Each array is splatted once, into whichever channels it counts towards
+	vector<const vector<IonHit> *> pts;
+	vector<openvdb::Vec2s> units;
+	for(size_t ui=0;ui<src.size();ui++)
+	{
+		if(!src[ui].numerator && !src[ui].denominator)
+			continue;
+
+		pts.push_back(src[ui].pts);
+		units.push_back(openvdb::Vec2s(src[ui].numerator ? 1.0f : 0.0f,
+					src[ui].denominator ? 1.0f : 0.0f));
+	}
+
+	return splatInto(pts,units,voxelSize,grid,progress,wantAbort,mask);
+}
+
+void divideChannels(const openvdb::Vec2SGrid &counts, openvdb::FloatGrid &ratio)
+{
+	typedef openvdb::FloatGrid::TreeType::LeafNodeType RatioLeaf;
+	typedef openvdb::Vec2SGrid::TreeType::LeafNodeType CountLeaf;
+
+	//Give the output the same active voxels, then fill each leaf
+	// from the matching count leaf, in parallel
+	ratio.tree().topologyUnion(counts.tree());
+	openvdb::tree::LeafManager<openvdb::FloatGrid::TreeType> leaves(ratio.tree());
+
+	#pragma omp parallel for schedule(dynamic,64)
+	for(size_t ui=0;ui<leaves.leafCount();ui++)
+	{
+		RatioLeaf &leaf=leaves.leaf(ui);
+		const CountLeaf *countLeaf=counts.tree().probeConstLeaf(leaf.origin());
+		for(RatioLeaf::ValueOnIter it=leaf.beginValueOn(); it; ++it)
+		{
+			openvdb::Vec2s v= countLeaf ? countLeaf->getValue(it.pos()) : counts.background();
+			it.setValue(v[1] ? v[0]/v[1] : 0.0f);
+		}
+	}
+}
+
+#ifdef DEBUG
+
+bool testVdbSplat()
+{
+	openvdb::initialize();
+
+	//Weights of a point sum to one, and reproduce its position
+	{
+	openvdb::Coord base;
+	float weights[8];
+	const float VOXEL=0.5f;
+	Point3D p(-0.3f,1.1f,0.25f);
+	splatWeights(p,1.0f/VOXEL,base,weights);
+	TEST(base == openvdb::Coord(-1,2,0),"splat base vertex");
+
+	float sum=0;
+	Point3D centre(0,0,0);
+	for(unsigned int ui=0;ui<8;ui++)
+	{
+		TEST(weights[ui] >=0.0f,"non-negative weight");
+		sum+=weights[ui];
+		centre+=Point3D(base.x()+((ui>>2)&1),base.y()+((ui>>1)&1),base.z()+(ui&1))*(VOXEL*weights[ui]);
+	}
+	TEST(EQ_TOL(sum,1.0f),"weights sum to one");
+	TEST(centre.sqrDist(p) < 1e-8f,"weighted vertices give position");
+
+	//On a vertex, all weight goes to that vertex
+	splatWeights(Point3D(1.0f,-2.0f,0.0f),1.0f/VOXEL,base,weights);
+	TEST(base == openvdb::Coord(2,-4,0) && weights[0] == 1.0f,"vertex coincidence");
+	}
+
+	//Compare the parallel splat, over several arrays (including an
+	// empty one), with a serial sum through an accessor
+	RandNumGen rng;
+	rng.initialise(9876);
+	vector<vector<IonHit> > arrays(3);
+	arrays[0].resize(SPLAT_CHUNK*2+17);
+	arrays[2].resize(1000);
+	for(size_t ui=0;ui<arrays.size();ui++)
+	{
+		for(size_t uj=0;uj<arrays[ui].size();uj++)
+		{
+			arrays[ui][uj]=IonHit(Point3D(20.0f*rng.genUniformDev()-10.0f,
+				20.0f*rng.genUniformDev()-10.0f,5.0f*rng.genUniformDev()),1);
+		}
+	}
+
+	vector<const vector<IonHit> *> pts;
+	for(size_t ui=0;ui<arrays.size();ui++)
+		pts.push_back(&arrays[ui]);
+
+	const float VOXEL=0.7f;
+	openvdb::FloatGrid::Ptr grid=openvdb::FloatGrid::create(0.0f);
+	unsigned int prog;
+	ATOMIC_BOOL wantAbort(false);
+	TEST(!splatPoints(pts,VOXEL,*grid,prog,wantAbort),"splat points");
+
+	openvdb::FloatGrid::Ptr serial=openvdb::FloatGrid::create(0.0f);
+	openvdb::FloatGrid::Accessor acc=serial->getAccessor();
+	size_t nPts=0;
+	for(size_t ui=0;ui<arrays.size();ui++)
+	{
+		for(size_t uj=0;uj<arrays[ui].size();uj++)
+		{
+			openvdb::Coord base;
+			float weights[8];
+			splatWeights(arrays[ui][uj].getPosRef(),1.0f/VOXEL,base,weights);
+			for(unsigned int uk=0;uk<8;uk++)
+			{
+				openvdb::Coord c=base.offsetBy((uk>>2)&1,(uk>>1)&1,uk&1);
+				acc.setValue(c,acc.getValue(c)+weights[uk]);
+			}
+		}
+		nPts+=arrays[ui].size();
+	}
+
+	TEST(grid->activeVoxelCount() == serial->activeVoxelCount(),"active voxel count");
+	openvdb::FloatGrid::Accessor gridAcc=grid->getAccessor();
+	double total=0;
+	for(openvdb::FloatGrid::ValueOnCIter it=serial->cbeginValueOn(); it; ++it)
+	{
+		TEST(fabs(gridAcc.getValue(it.getCoord()) - *it) < 1e-3f,"voxel value matches serial");
+		total+=*it;
+	}
+	TEST(fabs(total-(double)nPts) < 1e-2*nPts,"total weight");
+
+	//Nothing to splat leaves the grid alone
+	vector<const vector<IonHit> *> none;
+	TEST(!splatPoints(none,VOXEL,*grid,prog,wantAbort),"empty splat");
+
+	//The fused grid should match separate numerator and denominator
+	// grids. Take arrays[2] as numerator, and all arrays as denominator
+	{
+	vector<SplatSource> src(arrays.size());
+	for(size_t ui=0;ui<arrays.size();ui++)
+	{
+		src[ui].pts=&arrays[ui];
+		src[ui].numerator=(ui==2);
+		src[ui].denominator=true;
+	}
+
+	openvdb::Vec2SGrid::Ptr counts=openvdb::Vec2SGrid::create(openvdb::Vec2s(0.0f,0.0f));
+	TEST(!splatRatio(src,VOXEL,*counts,prog,wantAbort),"splat ratio");
+	TEST(counts->activeVoxelCount() == serial->activeVoxelCount(),"ratio voxel count");
+
+	openvdb::FloatGrid::Ptr numGrid=openvdb::FloatGrid::create(0.0f);
+	vector<const vector<IonHit> *> numPts(1,&arrays[2]);
+	TEST(!splatPoints(numPts,VOXEL,*numGrid,prog,wantAbort),"splat numerator");
+
+	openvdb::FloatGrid::Ptr ratio=openvdb::FloatGrid::create(0.0f);
+	divideChannels(*counts,*ratio);
+	TEST(ratio->activeVoxelCount() == counts->activeVoxelCount(),"ratio topology");
+
+	openvdb::FloatGrid::Accessor numAcc=numGrid->getAccessor();
+	openvdb::FloatGrid::Accessor ratioAcc=ratio->getAccessor();
+	for(openvdb::Vec2SGrid::ValueOnCIter it=counts->cbeginValueOn(); it; ++it)
+	{
+		openvdb::Coord c=it.getCoord();
+		openvdb::Vec2s v=*it;
+		TEST(fabs(v[0]-numAcc.getValue(c)) < 1e-3f,"numerator channel");
+		TEST(fabs(v[1]-gridAcc.getValue(c)) < 1e-3f,"denominator channel");
+
+		float expected = v[1] ? v[0]/v[1] : 0.0f;
+		TEST(fabs(ratioAcc.getValue(c)-expected) < 1e-4f,"ratio value");
+	}
+
+	//A masked splat should give the unmasked counts, restricted to the
+	// mask. Mask off every voxel with x >= 0
+	openvdb::FloatGrid::Ptr mask=openvdb::FloatGrid::create(0.0f);
+	openvdb::FloatGrid::Accessor maskAcc=mask->getAccessor();
+	size_t nMasked=0;
+	for(openvdb::Vec2SGrid::ValueOnCIter it=counts->cbeginValueOn(); it; ++it)
+	{
+		if(it.getCoord().x() < 0)
+		{
+			maskAcc.setValueOn(it.getCoord(),1.0f);
+			nMasked++;
+		}
+	}
+
+	openvdb::Vec2SGrid::Ptr maskedCounts=openvdb::Vec2SGrid::create(openvdb::Vec2s(0.0f,0.0f));
+	TEST(!splatRatio(src,VOXEL,*maskedCounts,prog,wantAbort,mask.get()),"masked splat");
+	TEST(maskedCounts->activeVoxelCount() == (openvdb::Index64)nMasked,"masked voxel count");
+	openvdb::Vec2SGrid::Accessor countAcc=counts->getAccessor();
+	for(openvdb::Vec2SGrid::ValueOnCIter it=maskedCounts->cbeginValueOn(); it; ++it)
+	{
+		openvdb::Vec2s v=*it, full=countAcc.getValue(it.getCoord());
+		TEST(it.getCoord().x() < 0,"masked voxel in mask");
+		TEST(fabs(v[0]-full[0]) < 1e-3f && fabs(v[1]-full[1]) < 1e-3f,"masked value");
+	}
+	}
+
+
+	return true;
+}
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * vdbSplat.h - Parallel splatting of points into sparse voxel grids
+ * Copyright (C) 2015  D. Haley
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VDBSPLAT_H
+#define VDBSPLAT_H
+
+#include <vector>
+
+#include "backend/filters/openvdb_includes.h"
+#include "backend/APT/ionhit.h"
+
+//Splatting distributes each point over the 8 voxel vertices that
+// surround it, with trilinear (Hellman) weights: each vertex receives the
+// volume of the sub-cuboid opposite it, in a unit voxel. The weights of
+// each point therefore sum to one. Vertex (i,j,k) lies at world
+// position (i,j,k)*voxelSize, matching a linear transform of that size.
+//	- Weights are computed on the stack; nothing is allocated per point
+//	- Each thread splats into its own grid, writing straight into the
+//	  grid's leaf nodes where possible. The thread grids are then summed
+//	  pairwise (compSum)
+//	- Ratios (e.g. concentration) are accumulated in a single two-channel
+//	  (numerator, denominator) grid, so both counts share one tree
+//	- A mask grid may restrict the splat to the mask's active voxels
+//	  (e.g. the narrow band of a distance field), so that no voxels
+//	  outside it are ever created
+
+
+
+enum
+{
+	VDBSPLAT_ERR_ABORT=1,
+	VDBSPLAT_ERR_MEMALLOC,
+	VDBSPLAT_ERR_ENUM_END
+};
+
+//!Obtain the lowest of the 8 vertices surrounding p, and the weight of each.
+// Weight i belongs to vertex base + ((i>>2)&1, (i>>1)&1, i&1)
+void splatWeights(const Point3D &p, float invVoxelSize, openvdb::Coord &base, float *weights);
+
+//!Add the splatted weights of all the given points into grid, in parallel.
+/*! Returns 0 on success, or a VDBSPLAT_ERR value. On error, grid is unchanged
+ */
+unsigned int splatPoints(const std::vector<const std::vector<IonHit> *> &pts, float voxelSize,
+		openvdb::FloatGrid &grid, unsigned int &progress, ATOMIC_BOOL &wantAbort);
+
+//!An array of points, and the channels of a ratio grid that it counts towards
+class SplatSource
+{
+	public:
+		const std::vector<IonHit> *pts;
+		bool numerator,denominator;
+};
+
+//!As per splatPoints, but add the weights into the (numerator, denominator)
+// channels of grid, as selected by each source. Each array is splatted once.
+// If mask is non-null, only vertices active in mask receive weight
+unsigned int splatRatio(const std::vector<SplatSource> &src, float voxelSize,
+		openvdb::Vec2SGrid &grid, unsigned int &progress, ATOMIC_BOOL &wantAbort,
+		const openvdb::FloatGrid *mask=0);
+
+//!Set each active voxel of counts, in ratio, to numerator/denominator,
+// or zero where the denominator is zero. Leaves are divided in parallel
+void divideChannels(const openvdb::Vec2SGrid &counts, openvdb::FloatGrid &ratio);
+
+#ifdef DEBUG
+bool testVdbSplat();
+#endif
+
+#endif
@@ -18,14 +18,16 @@
 #include "clusterAnalysis.h"
 #include "filterCommon.h"
 
-#include <queue>
+#include <new>
 #include <algorithm>
 
-#include <gsl/gsl_linalg.h>
-#include <gsl/gsl_eigen.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
-#include "../../common/gsl_helper.h"
 #include "backend/plot.h"
+#include "algorithms/spatialIndexCache.h"
+#include "algorithms/linkClustering.h"
 
 using std::vector;
 using std::string;
@@ -56,6 +58,9 @@ enum
 	KEY_CROP_NMIN,
 	KEY_CROP_NMAX,
 	KEY_BULK_ALL,
+	KEY_LINK_SWEEP,
+	KEY_LINK_SWEEP_MAX,
+	KEY_WANT_CLUSTERSTATS,
 	KEY_CORE_OFFSET=100000,
 	KEY_BULK_OFFSET=200000
 };
@@ -64,6 +69,7 @@ enum
 {
 	NOCORE_ERR=1,
 	NOBULK_ERR,
+	CLUSTER_ERR_MEMALLOC,
 	CLUSTER_ERR_ENUM_END
 };
 
@@ -83,6 +89,14 @@ enum
 
 const char SIZE_DIST_DATALABEL[] =NTRANS("Size Distribution");
 const char CHEM_DIST_DATALABEL[] =NTRANS("Chemistry Distribution");
+const char LINK_SWEEP_DATALABEL[] =NTRANS("Cluster count vs link distance");
+
+//Number of link distances sampled for the cluster count plot
+const size_t LINK_SWEEP_SAMPLES=200;
+
+//Prefix for the columns of the per-cluster statistics table
+const char CLUSTER_STATS_DATALABEL[] =NTRANS("Cluster Statistics");
+
 
 using std::vector;
 
@@ -92,6 +106,9 @@ using std::vector;
 const float SPHERE_PRESEARCH_CUTOFF = 75;
 
 
+//Number of clusters whose bulk-link searches are run together in parallel
+const size_t BULK_LINK_BLOCK=256;
+
 //In link clustering, when we preform size cropping, do we awant to count bulk ions in our analysis?
 const bool WANT_COUNT_BULK_FORCROP=false;
 
@@ -180,60 +197,180 @@ void makeCompositionTable(const IonStreamData *i ,const RangeFile *r,
 
 }
 
-//Compute the singular values for a matrix of rows "numRows" and "cols"
-// numcols. Matrix to be stored as [curRow*rowSize + curCol]
-// Rank deficient SVs will be returned as zero at the end of the vector.
-
-// Remember that the input basis is transformed, and this function does not
-// provide the transformation vectors, so singular values only provide
-// scalar information separate from the original input basis. The first value
-// does *not* correspond to the "x" direction of your input, for example.
-void computeEigenValues(gsl_matrix *m, size_t numRows, size_t numCols,
-				vector<float> &resultValues, vector<Point3D> &resultVectors)
+//Eigen-decomposition of a symmetric 3x3 (row-major) matrix, by cyclic Jacobi
+// rotation. vals receives the eigenvalues in descending order, and
+// vecs the matching unit eigenvectors, one per row. This does not allocate,
+// so can be run per-cluster in parallel
+static void symmetricEigen3(const double *m, double *vals, double *vecs)
 {
+	double a[3][3],v[3][3];
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		for(unsigned int uj=0;uj<3;uj++)
+		{
+			a[ui][uj]=m[3*ui+uj];
+			v[ui][uj]= (ui==uj) ? 1.0 : 0.0;
+		}
+	}
 
-	//Although this function *mostly* works on arbitrary datasizes, the vector<Point3D> is of course
-	//fixed to being 3D..
-	ASSERT(numCols == 3 && numRows == 3);
+	//Converges quadratically; a handful of sweeps suffice
+	const unsigned int MAX_SWEEPS=50;
+	for(unsigned int sweep=0;sweep<MAX_SWEEPS;sweep++)
+	{
+		double off,diag;
+		off=a[0][1]*a[0][1] + a[0][2]*a[0][2] + a[1][2]*a[1][2];
+		diag=a[0][0]*a[0][0] + a[1][1]*a[1][1] + a[2][2]*a[2][2];
+		if(off <= std::numeric_limits<double>::epsilon()*std::numeric_limits<double>::epsilon()*diag
+				|| off < std::numeric_limits<double>::min())
+			break;
 
+		for(unsigned int p=0;p<2;p++)
+		{
+			for(unsigned int q=p+1;q<3;q++)
+			{
+				if(a[p][q] == 0)
+					continue;
 
-	//Set up the output vector space, the eigen result space and
-	//some scratch space for the program
-	gsl_vector *eigenVals= gsl_vector_alloc(numCols); //Eigen value results
-	gsl_matrix *eigenVecs= gsl_matrix_alloc(numCols,numCols); // Eigen vectors
-	gsl_eigen_symmv_workspace *workspace = gsl_eigen_symmv_alloc(numCols); //scratch space
+				//Rotation that zeroes a[p][q]
+				double theta,t,c,s;
+				theta=(a[q][q]-a[p][p])/(2.0*a[p][q]);
+				t=1.0/(fabs(theta) + sqrt(theta*theta+1.0));
+				if(theta < 0)
+					t=-t;
+				c=1.0/sqrt(t*t+1.0);
+				s=t*c;
+
+				//A <- J^T A J, and V <- V J
+				for(unsigned int k=0;k<3;k++)
+				{
+					double kp=a[k][p],kq=a[k][q];
+					a[k][p]=c*kp - s*kq;
+					a[k][q]=s*kp + c*kq;
+				}
+				for(unsigned int k=0;k<3;k++)
+				{
+					double pk=a[p][k],qk=a[q][k];
+					a[p][k]=c*pk - s*qk;
+					a[q][k]=s*pk + c*qk;
+				}
+				a[p][q]=a[q][p]=0;
 
-	//Decompose matrix. Note that input matrix is overwritten by gsl. 
-	gsl_eigen_symmv(m,eigenVals,
-			eigenVecs,workspace);
-	gsl_eigen_symmv_sort (eigenVals, eigenVecs, GSL_EIGEN_SORT_VAL_DESC);
+				for(unsigned int k=0;k<3;k++)
+				{
+					double kp=v[k][p],kq=v[k][q];
+					v[k][p]=c*kp - s*kq;
+					v[k][q]=s*kp + c*kq;
+				}
+			}
+		}
+	}
 
-	resultValues.clear();
-	for(size_t ui=0;ui<numCols;ui++)
+	//Sort descending. Eigenvectors are the columns of v
+	unsigned int order[3]={0,1,2};
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		for(unsigned int uj=ui+1;uj<3;uj++)
+		{
+			if(a[order[uj]][order[uj]] > a[order[ui]][order[ui]])
+				std::swap(order[ui],order[uj]);
+		}
+	}
+
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		vals[ui]=a[order[ui]][order[ui]];
+		for(unsigned int uj=0;uj<3;uj++)
+			vecs[3*ui+uj]=v[uj][order[ui]];
+	}
+}
+
+
+void InputIonView::init(const std::vector<const FilterStreamData *> &dataIn)
+{
+	streams.clear();
+	streamStart.assign(1,0);
+	for(size_t ui=0;ui<dataIn.size();ui++)
 	{
-		float v;
-		v = gsl_vector_get(eigenVals,ui);
-		resultValues.push_back(v);
+		if(dataIn[ui]->getStreamType() != STREAM_TYPE_IONS)
+			continue;
 
+		const IonStreamData *d;
+		d=(const IonStreamData *)dataIn[ui];
+		streams.push_back(d);
+		streamStart.push_back(streamStart.back()+d->data.size());
 	}
+}
+
+const IonHit &InputIonView::operator[](size_t idx) const
+{
+	ASSERT(idx < size());
+	//Find the last stream starting at or before idx
+	size_t stream;
+	stream=std::upper_bound(streamStart.begin(),streamStart.end(),idx)-streamStart.begin()-1;
+	return streams[stream]->data[idx-streamStart[stream]];
+}
 
-	//Copy out the decomposed V matrix
-	resultVectors.resize(numCols);
-	for(size_t ui=0;ui<numCols; ui++)
+unsigned long long InputIonView::fingerprint() const
+{
+	//Combine the per-stream fingerprints, in stream order
+	unsigned long long h=0;
+	for(size_t ui=0;ui<streams.size();ui++)
 	{
-		for(size_t uj=0;uj<numCols; uj++)
-			resultVectors[ui][uj] = gsl_matrix_get(eigenVecs,ui,uj);
+		h^=SpatialIndexCache::fingerprint(streams[ui]->data)
+			+ 0x9e3779b97f4a7c15ULL + (h<<6) + (h>>2);
 	}
+	return h;
+}
 
+void ClusterMembers::clear()
+{
+	core.clear();
+	bulk.clear();
+	coreStart.clear();
+	bulkStart.clear();
+}
 
-	//Free storage space
-	gsl_vector_free(eigenVals); 
-	gsl_matrix_free(eigenVecs); 
-	gsl_eigen_symmv_free(workspace);
-	
+void ClusterMembers::select(const vector<char> &keep)
+{
+	ASSERT(keep.size() == size());
+	const bool haveBulk=hasBulk();
+
+	//Compact in place; clusters only ever move towards the front
+	size_t nKept=0,coreOut=0,bulkOut=0;
+	for(size_t ui=0;ui<keep.size();ui++)
+	{
+		if(!keep[ui])
+			continue;
+
+		size_t start=coreStart[ui],end=coreStart[ui+1];
+		coreStart[nKept]=coreOut;
+		for(size_t uj=start;uj<end;uj++)
+			core[coreOut++]=core[uj];
+
+		if(haveBulk)
+		{
+			start=bulkStart[ui];
+			end=bulkStart[ui+1];
+			bulkStart[nKept]=bulkOut;
+			for(size_t uj=start;uj<end;uj++)
+				bulk[bulkOut++]=bulk[uj];
+		}
+		nKept++;
+	}
+
+	core.resize(coreOut);
+	coreStart.resize(nKept+1);
+	coreStart[nKept]=coreOut;
+	if(haveBulk)
+	{
+		bulk.resize(bulkOut);
+		bulkStart.resize(nKept+1);
+		bulkStart[nKept]=bulkOut;
+	}
 }
 
 
+
 void ClusterAnalysisFilter::checkIonEnabled(bool &core, bool &bulk) const
 {
 	bulk=core=false;
@@ -269,11 +406,13 @@ void ClusterAnalysisFilter::buildRangeEnabledMap(const RangeStreamData *r,
 
 ClusterAnalysisFilter::ClusterAnalysisFilter() : algorithm(CLUSTER_LINK_ERODE),
 	enableCoreClassify(false), coreDist(0.0f), coreKNN(1), linkDist(0.5f), 
+	wantLinkSweep(false), maxSweepLinkDist(1.0f),linkTreeOK(false), linkTreeNumPts(0),
+	linkTreeFingerprint(0), clustersOK(false), clustersNumIons(0), clustersFingerprint(0),
 	enableBulkLink(false), bulkLink(0.25), enableErosion(false), dErosion(0.25),
 	wantClusterID(false), wantCropSize(false), nMin(0),nMax(std::numeric_limits<size_t>::max()),
 	wantClusterSizeDist(false),logClusterSize(false),
 	wantClusterComposition(true),normaliseComposition(true),
-	wantClusterMorphology(false), haveRangeParent(false)
+	wantClusterMorphology(false), wantClusterStats(false), haveRangeParent(false)
 
 {
 	cacheOK=false;
@@ -296,6 +435,8 @@ Filter *ClusterAnalysisFilter::cloneUncached() const
 	p->bulkLink=bulkLink;
 	p->linkDist=linkDist;
 	p->dErosion=dErosion;
+	p->wantLinkSweep=wantLinkSweep;
+	p->maxSweepLinkDist=maxSweepLinkDist;
 
 	p->wantCropSize=wantCropSize;
 	p->nMin=nMin;
@@ -307,6 +448,8 @@ Filter *ClusterAnalysisFilter::cloneUncached() const
 	p->wantClusterComposition=wantClusterComposition;
 	p->normaliseComposition = normaliseComposition;
 	p->wantClusterMorphology= wantClusterMorphology;
+	p->wantClusterStats= wantClusterStats;
+
 
 	p->haveRangeParent=false; //lets assume not, and this will be reset at ::initFilter time
 
@@ -325,6 +468,46 @@ Filter *ClusterAnalysisFilter::cloneUncached() const
 	return p;
 }
 
+void ClusterAnalysisFilter::clearCache()
+{
+	clearLinkTree();
+	clearClusterCache();
+}
+
+void ClusterAnalysisFilter::clearLinkTree()
+{
+	linkTreeOK=false;
+	std::vector<LinkEdge>().swap(linkTreeEdges);
+	linkTreeNumPts=0;
+	linkTreeFingerprint=0;
+}
+
+void ClusterAnalysisFilter::clearClusterCache()
+{
+	clustersOK=false;
+	cachedClusters.clear();
+	clustersNumIons=0;
+	clustersFingerprint=0;
+	Filter::clearCache();
+}
+
+bool ClusterAnalysisFilter::applyPostProcessProperty(bool &prop, const std::string &value, 
+							bool &needUpdate)
+{
+	needUpdate=false;
+	bool b;
+	if(!boolStrDec(stripWhite(value),b))
+		return false;
+
+	if(b == prop)
+		return true;
+
+	prop=b;
+	Filter::clearCache();
+	needUpdate=true;
+	return true;
+}
+
 void ClusterAnalysisFilter::initFilter(const std::vector<const FilterStreamData *> &dataIn,
 				std::vector<const FilterStreamData *> &dataOut)
 {
@@ -538,44 +721,87 @@ unsigned int ClusterAnalysisFilter::refresh(const std::vector<const FilterStream
 	
 	//Do the clustering 
 	//-------------
-	vector<vector<IonHit> > clusteredCore,clusteredBulk;
-
-	switch(algorithm)
+	//Clusters only hold the offsets of their ions in the input,
+	// so nothing is copied until the output is built
+	InputIonView inputIons;
+	inputIons.init(dataIn);
+	ClusterMembers clusters;
+
+	//Clusters hold input indices, so are only valid for the same input.
+	// Upstream output can change without our cache being cleared
+	// (eg random sampling), so check the input is the one we linked
+	unsigned long long inputFingerprint=0;
+	if(cache)
+		inputFingerprint=inputIons.fingerprint();
+	if(clustersOK && !(clustersNumIons == inputIons.size() 
+				&& clustersFingerprint == inputFingerprint))
+		clearClusterCache();
+
+	if(clustersOK)
 	{
-		case CLUSTER_LINK_ERODE:
+		//Only post-processing options have changed, so
+		// reuse the clusters from the last refresh
+		clusters=cachedClusters;
+	}
+	else
+	{
+		switch(algorithm)
 		{
-			unsigned int errCode;
-			errCode=refreshLinkClustering(dataIn,clusteredCore,
-						clusteredBulk,progress);
+			case CLUSTER_LINK_ERODE:
+			{
+				unsigned int errCode;
+				errCode=refreshLinkClustering(dataIn,clusters,progress);
 
-			if(errCode)
-				return errCode;
-			break;
+				if(errCode)
+					return errCode;
+				break;
+			}
+			default:
+				ASSERT(false);
 		}
-		default:
-			ASSERT(false);
-	}
 
 #ifdef DEBUG
-	/* If you are paranoid about the quality of the output, 
-	 * This will enable running some sanity checks that do 
-	 * not use the data structure involved in the clustering; 
-	 * ie a secondary check.
-	 * However this is far too slow to enable by default, even in debug mode
-	 */
-	if(wantParanoidDebug)
-		paranoidDebugAssert(clusteredCore,clusteredBulk);
+		/* If you are paranoid about the quality of the output, 
+		 * This will enable running some sanity checks that do 
+		 * not use the data structure involved in the clustering; 
+		 * ie a secondary check.
+		 * However this is far too slow to enable by default, even in debug mode
+		 */
+		if(wantParanoidDebug)
+			paranoidDebugAssert(clusters,inputIons);
 #endif
+
+		//Keep the clusters, so post-processing changes need not
+		// relink. If there is insufficient memory, just don't keep them
+		if(cache)
+		{
+			try
+			{
+				cachedClusters=clusters;
+				clustersNumIons=inputIons.size();
+				clustersFingerprint=inputFingerprint;
+				clustersOK=true;
+			}
+			catch(std::bad_alloc)
+			{
+				cachedClusters.clear();
+			}
+		}
+	}
 	if(wantCropSize)
-		stripClusterBySize(clusteredCore,clusteredBulk,WANT_COUNT_BULK_FORCROP,progress);
+		stripClusterBySize(clusters,WANT_COUNT_BULK_FORCROP,progress);
 
 	bool haveBulk,haveCore;
-	haveBulk=clusteredBulk.size();
-	haveCore=clusteredCore.size();
+	haveBulk=clusters.hasBulk() && clusters.size();
+	haveCore=clusters.size();
 
 
 	if(!haveBulk && !haveCore)
+	{
+		if(!cache)
+			clearLinkTree();
 		return 0;
+	}
 
 	//we can't have bulk, but no core...
 ASSERT(!(haveBulk && !haveCore));
@@ -596,12 +822,29 @@ ASSERT(!(haveBulk && !haveCore));
 		}
 	}
 
+	//Compute the per-cluster statistics that the outputs need, in one pass
+	vector<ClusterShape> shapes;
+	vector<size_t> speciesCounts;
+	if(wantClusterComposition || wantClusterMorphology || wantClusterStats)
+	{
+		ASSERT(r);
+		const RangeFile *countRng=0;
+		if(wantClusterComposition || wantClusterStats)
+			countRng=r->rangeFile;
+
+		unsigned int errCode;
+		errCode=clusterStatistics(clusters,inputIons,countRng,
+				wantClusterMorphology || wantClusterStats,shapes,speciesCounts,progress);
+		if(errCode)
+			return errCode;
+	}
+
 	size_t curPlotIndex=0;
 	//Generate size distribution if we need it.
 	if(wantClusterSizeDist)
 	{
 		PlotStreamData *d;
-		d=clusterSizeDistribution(clusteredCore,clusteredBulk);
+		d=clusterSizeDistribution(clusters);
 
 		if(d)
 		{
@@ -621,11 +864,28 @@ ASSERT(!(haveBulk && !haveCore));
 
 	}
 
+	//Generate cluster count vs link distance, from the hierarchy
+	if(wantLinkSweep && linkTreeOK)
+	{
+		PlotStreamData *d;
+		d=clusterCountVsLinkDist();
+		if(d)
+		{
+			d->index=curPlotIndex;
+			curPlotIndex++;
+			cacheAsNeeded(d);
+			getOut.push_back(d);
+		}
+	}
+	//Without caching, the hierarchy is not kept between refreshes
+	if(!cache)
+		clearLinkTree();
+
 	//Generate composition distribution if we requested it
 	if(wantClusterComposition)
 	{
 		vector<PlotStreamData *> plots;
-		genCompositionVersusSize(clusteredCore,clusteredBulk,r->rangeFile,plots);
+		genCompositionVersusSize(clusters,speciesCounts,r->rangeFile,plots);
 
 		for(unsigned int ui=0;ui<plots.size();ui++)
 		{
@@ -659,17 +919,11 @@ ASSERT(!(haveBulk && !haveCore));
 		vector<std::pair<Point3D,std::vector<Point3D> > > singularVectors;
 		vector<vector<float> > singularVals; 
 
-		singularVectors.resize(clusteredCore.size());
-		singularVals.resize(clusteredCore.size());
-		for(unsigned int ui=0;ui<clusteredCore.size();ui++)
+		singularVectors.resize(clusters.size());
+		singularVals.resize(clusters.size());
+		for(size_t ui=0;ui<clusters.size();ui++)
 		{
-			if(clusteredBulk.size())	
-				getEllipsoidalFit(clusteredCore[ui],clusteredBulk[ui],singularVectors[ui]);
-			else
-			{
-				vector<IonHit> dummy;
-				getEllipsoidalFit(clusteredCore[ui],dummy,singularVectors[ui]);
-			}
+			getEllipsoidalFit(shapes[ui],singularVectors[ui]);
 			vector<float> thisSingVals;
 			thisSingVals.resize(3);
 			
@@ -716,7 +970,7 @@ ASSERT(!(haveBulk && !haveCore));
 				#pragma omp critical
 				{
 				p->scatterData.push_back(pr);
-				p->scatterIntensity.push_back(clusteredCore[ui].size());
+				p->scatterIntensity.push_back(clusters.coreSize(ui));
 				}
 
 			}
@@ -789,78 +1043,68 @@ ASSERT(!(haveBulk && !haveCore));
 	IonStreamData *i = new IonStreamData;
 	i->parent =this;	
 	std::string sDebugConsole,stmp;
-	stream_cast(stmp,clusteredCore.size());
+	stream_cast(stmp,clusters.size());
 
 	sDebugConsole=TRANS("Found :");
 	sDebugConsole+=stmp;
 	sDebugConsole+= TRANS(" clusters");
 	consoleOutput.push_back(sDebugConsole);
 
-	size_t totalSize=0;
-
-	#pragma omp parallel for reduction(+:totalSize)
-	for(size_t ui=0;ui<clusteredBulk.size();ui++)
-		totalSize+=clusteredBulk[ui].size();
-
-	#pragma omp parallel for reduction(+:totalSize)
-	for(size_t ui=0;ui<clusteredCore.size();ui++)
-		totalSize+=clusteredCore[ui].size();
-	i->data.resize(totalSize);
+	//All core ions go first, in cluster order, then all the bulk
+	const size_t coreTotal=clusters.core.size();
+	i->data.resize(coreTotal+clusters.bulk.size());
 	
+	//To prevent clusters ID from correlatiing with their position
+	// which results in odd visual effects, randomise the ID a litlle;
+	vector<size_t> idShuffle;
 	if(wantClusterID)
 	{
-
-		//To prevent clusters ID from correlatiing with their position
-		// which results in odd visual effects, randomise the ID a litlle;
-		vector<size_t> idShuffle;
-		idShuffle.resize(clusteredCore.size());
+		idShuffle.resize(clusters.size());
 
 		for(unsigned int ui=0;ui<idShuffle.size();ui++)
 			idShuffle[ui]=ui;
 
 		std::random_shuffle(idShuffle.begin(),idShuffle.end());
+	}
 
-		#pragma omp parallel
-		{
-		#pragma omp for
-		for(size_t ui=0;ui<clusteredCore.size();ui++)
-		{
-			for(size_t uj=0;uj<clusteredCore[ui].size();uj++)
-				clusteredCore[ui][uj].setMassToCharge(idShuffle[ui]);
-		}
-	
-		#pragma omp for
-		for(size_t ui=0;ui<clusteredBulk.size();ui++)
+	//copy across the core and bulk ions into the output.
+	// Each cluster's destination is given by its offsets
+	#pragma omp parallel for schedule(dynamic,64)
+	for(size_t ui=0;ui<clusters.size();ui++)
+	{
+		for(size_t uj=clusters.coreStart[ui];uj<clusters.coreStart[ui+1];uj++)
 		{
-			for(size_t uj=0;uj<clusteredBulk[ui].size();uj++)
-				clusteredBulk[ui][uj].setMassToCharge(idShuffle[ui]);
-		}
+			i->data[uj]=inputIons[clusters.core[uj]];
+			if(wantClusterID)
+				i->data[uj].setMassToCharge(idShuffle[ui]);
 		}
-	}
 
-	//copy across the core and bulk ions
-	//into the output
-	size_t copyPos=0;
-	for(size_t ui=0;ui<clusteredCore.size();ui++)
-	{
-		for(size_t uj=0;uj<clusteredCore[ui].size();uj++)
+		if(!clusters.hasBulk())
+			continue;
+
+		for(size_t uj=clusters.bulkStart[ui];uj<clusters.bulkStart[ui+1];uj++)
 		{
-			i->data[copyPos]=clusteredCore[ui][uj];
-			copyPos++;
+			i->data[coreTotal+uj]=inputIons[clusters.bulk[uj]];
+			if(wantClusterID)
+				i->data[coreTotal+uj].setMassToCharge(idShuffle[ui]);
 		}
 	}
 
-	clusteredCore.clear();
-
-	for(size_t ui=0;ui<clusteredBulk.size();ui++)
+	if(wantClusterStats)
 	{
-		for(size_t uj=0;uj<clusteredBulk[ui].size();uj++)
+		vector<PlotStreamData *> plots;
+		clusterStatsPlots(clusters,shapes,speciesCounts,idShuffle,r->rangeFile,plots);
+
+		for(unsigned int ui=0;ui<plots.size();ui++)
 		{
-			i->data[copyPos]=clusteredBulk[ui][uj];
-			copyPos++;
+			plots[ui]->index=curPlotIndex;
+			curPlotIndex++;
+
+			cacheAsNeeded(plots[ui]);
+			getOut.push_back(plots[ui]);
 		}
 	}
-	clusteredBulk.clear();
+	clusters.clear();
 
 	//The result data is drawn grey...
 	i->r=0.5f;	
@@ -988,6 +1232,24 @@ void ClusterAnalysisFilter::getProperties(FilterPropGroup &propertyList) const
 		p.key=KEY_LINKDIST;
 		propertyList.addProperty(p,curGroup);
 
+		p.name=TRANS("Link Dist. Sweep");
+		p.data=boolStrEnc(wantLinkSweep);
+		p.type=PROPERTY_TYPE_BOOL;
+		p.helpText=TRANS("Build the linkage hierarchy once, and plot the number of clusters against link distance");
+		p.key=KEY_LINK_SWEEP;
+		propertyList.addProperty(p,curGroup);
+
+		if(wantLinkSweep)
+		{
+			stream_cast(tmpStr,maxSweepLinkDist);
+			p.name=TRANS("Max Sweep Dist");
+			p.data=tmpStr;
+			p.type=PROPERTY_TYPE_REAL;
+			p.helpText=TRANS("Largest link distance in the sweep. Link distances up to this reuse the hierarchy");
+			p.key=KEY_LINK_SWEEP_MAX;
+			propertyList.addProperty(p,curGroup);
+		}
+
 
 		p.name=TRANS("Bulk Link");
 		p.data=boolStrEnc(enableBulkLink);
@@ -1083,6 +1345,15 @@ void ClusterAnalysisFilter::getProperties(FilterPropGroup &propertyList) const
 	p.key=KEY_WANT_CLUSTERMORPHOLOGY;
 	propertyList.addProperty(p,curGroup);
 
+	tmpStr=boolStrEnc(wantClusterStats);
+	p.name=TRANS("Statistics Table");
+	p.data=tmpStr;
+	p.type=PROPERTY_TYPE_BOOL;
+	p.helpText=TRANS("Plot the size, centroid, radius of gyration and composition of each cluster, against cluster id");
+	p.key=KEY_WANT_CLUSTERSTATS;
+	propertyList.addProperty(p,curGroup);
+
+
 
 	tmpStr=boolStrEnc(wantClusterID);
 	p.name=TRANS("Cluster Id");
@@ -1241,10 +1512,32 @@ bool ClusterAnalysisFilter::setProperty(unsigned int key,
 			
 			linkDist=ltmp;
 			needUpdate=true;
-			clearCache();
+			//The core linkage hierarchy does not depend upon the link distance
+			clearClusterCache();
 
 			break;
 		}	
+		case KEY_LINK_SWEEP:
+		{
+			if(!applyPropertyNow(wantLinkSweep,value,needUpdate))
+				return false;
+			break;
+		}
+		case KEY_LINK_SWEEP_MAX:
+		{
+			float ltmp;
+			if(stream_cast(ltmp,value))
+				return false;
+			
+			if(ltmp<= 0.0)
+				return false;
+			
+			maxSweepLinkDist=ltmp;
+			needUpdate=true;
+			clearCache();
+
+			break;
+		}
 		case KEY_BULKLINK_ENABLE:
 		{
 			if(!applyPropertyNow(enableBulkLink,value,needUpdate))
@@ -1262,7 +1555,7 @@ bool ClusterAnalysisFilter::setProperty(unsigned int key,
 			
 			bulkLink=ltmp;
 			needUpdate=true;
-			clearCache();
+			clearClusterCache();
 
 			break;
 		}	
@@ -1283,7 +1576,7 @@ bool ClusterAnalysisFilter::setProperty(unsigned int key,
 			
 			dErosion=ltmp;
 			needUpdate=true;
-			clearCache();
+			clearClusterCache();
 
 			break;
 		}
@@ -1329,8 +1622,8 @@ bool ClusterAnalysisFilter::setProperty(unsigned int key,
 				else
 				{
 					//OK, we don't have one and we would like one.
-					// We have to compute this. Wipe cache and start over
-					clearCache(); 
+					// We have to compute this. Wipe output cache and start over
+					Filter::clearCache(); 
 				}
 					needUpdate=true;
 			}
@@ -1426,8 +1719,8 @@ bool ClusterAnalysisFilter::setProperty(unsigned int key,
 				else
 				{
 					//OK, we don't have one and we would like one.
-					// We have to compute this. Wipe cache and start over
-					clearCache(); 
+					// We have to compute this. Wipe output cache and start over
+					Filter::clearCache(); 
 				}
 					needUpdate=true;
 			}
@@ -1449,7 +1742,7 @@ bool ClusterAnalysisFilter::setProperty(unsigned int key,
 			if(lastVal!=normaliseComposition)
 			{
 				needUpdate=true;
-				clearCache();
+				Filter::clearCache();
 			}
 
 			//composition analysis is mutually
@@ -1460,7 +1753,7 @@ bool ClusterAnalysisFilter::setProperty(unsigned int key,
 		}
 		case KEY_CROP_SIZE:
 		{
-			if(!applyPropertyNow(wantCropSize,value,needUpdate))
+			if(!applyPostProcessProperty(wantCropSize,value,needUpdate))
 				return false;
 			break;
 		}
@@ -1475,7 +1768,7 @@ bool ClusterAnalysisFilter::setProperty(unsigned int key,
 
 			nMin=ltmp;
 			needUpdate=true;
-			clearCache();
+			Filter::clearCache();
 
 			break;
 		}	
@@ -1493,19 +1786,25 @@ bool ClusterAnalysisFilter::setProperty(unsigned int key,
 
 			nMax=ltmp;
 			needUpdate=true;
-			clearCache();
+			Filter::clearCache();
 
 			break;
 		}	
 		case KEY_WANT_CLUSTERMORPHOLOGY:
 		{
-			if(!applyPropertyNow(wantClusterMorphology,value,needUpdate))
+			if(!applyPostProcessProperty(wantClusterMorphology,value,needUpdate))
+				return false;
+			break;
+		}
+		case KEY_WANT_CLUSTERSTATS:
+		{
+			if(!applyPostProcessProperty(wantClusterStats,value,needUpdate))
 				return false;
 			break;
 		}
 		case KEY_WANT_CLUSTERID:
 		{
-			if(!applyPropertyNow(wantClusterID,value,needUpdate))
+			if(!applyPostProcessProperty(wantClusterID,value,needUpdate))
 				return false;
 
 			//composition & id are mutually exclusive
@@ -1606,6 +1905,7 @@ bool ClusterAnalysisFilter::writeState(std::ostream &f,unsigned int format,
 			f << tabs(depth+1) << "<linkdist value=\""<<linkDist<< "\"/>"  << endl;
 			f << tabs(depth+1) << "<bulklink value=\""<<bulkLink<< "\" enabled=\"" << boolStrEnc(enableBulkLink) << "\"/>"  << endl;
 			f << tabs(depth+1) << "<derosion value=\""<<dErosion<< "\" enabled=\"" << boolStrEnc(enableErosion) << "\"/>"  << endl;
+			f << tabs(depth+1) << "<linksweep value=\""<<boolStrEnc(wantLinkSweep)<< "\" maxdist=\"" << maxSweepLinkDist << "\"/>"  << endl;
 			
 			//Cropping control
 			f << tabs(depth+1) << "<wantcropsize value=\""<<boolStrEnc(wantCropSize)<< "\"/>"  << endl;
@@ -1620,6 +1920,7 @@ bool ClusterAnalysisFilter::writeState(std::ostream &f,unsigned int format,
 			
 			f << tabs(depth+1) << "<wantclustermorphology value=\"" <<boolStrEnc(wantClusterMorphology)	<< "\"/>"  << endl;
 			f << tabs(depth+1) << "<wantclusterid value=\"" <<boolStrEnc(wantClusterID)<< "\"/>"  << endl;
+			f << tabs(depth+1) << "<wantclusterstats value=\"" <<boolStrEnc(wantClusterStats)<< "\"/>"  << endl;
 
 
 			f << tabs(depth+1) << "<enabledions>"  << endl;
@@ -1640,7 +1941,17 @@ bool ClusterAnalysisFilter::writeState(std::ostream &f,unsigned int format,
 
 size_t ClusterAnalysisFilter::numBytesForCache(size_t nObjects) const
 {
-	return (size_t)nObjects*IONDATA_SIZE;
+	size_t bytes=(size_t)nObjects*IONDATA_SIZE;
+
+	//The clusters are also kept, as the input index of each member ion,
+	// plus the start of each cluster (at most one per member)
+	bytes+=nObjects*2*sizeof(size_t);
+
+	//The link hierarchy has at most one edge per core ion
+	if(wantLinkSweep)
+		bytes+=nObjects*sizeof(LinkEdge);
+
+	return bytes;
 }
 
 bool ClusterAnalysisFilter::readState(xmlNodePtr &nodePtr, const std::string &packDir)
@@ -1712,6 +2023,16 @@ bool ClusterAnalysisFilter::readState(xmlNodePtr &nodePtr, const std::string &pa
 				// setting a value of zero for the link distance
 				enableErosion=!(dErosion== 0);
 			}
+
+			//Link distance sweep. Did not exist in older files
+			xmlNodePtr tmpNode;
+			tmpNode=nodePtr;
+			if(!XMLGetNextElemAttrib(tmpNode,wantLinkSweep,"linksweep","value"))
+				wantLinkSweep=false;
+			tmpNode=nodePtr;
+			if(!XMLGetNextElemAttrib(tmpNode,maxSweepLinkDist,"linksweep","maxdist")
+				|| maxSweepLinkDist <=0)
+				maxSweepLinkDist=1.0f;
 			break;
 		}
 		default:
@@ -1766,6 +2087,14 @@ bool ClusterAnalysisFilter::readState(xmlNodePtr &nodePtr, const std::string &pa
 	{
 		wantClusterComposition=false;
 	}
+
+	//Statistics table. Did not exist in older files
+	{
+	xmlNodePtr statsNode;
+	statsNode=tmpPtr;
+	if(!XMLGetNextElemAttrib(statsNode,wantClusterStats,"wantclusterstats","value"))
+		wantClusterStats=false;
+	}
 	//===
 
 
@@ -1856,7 +2185,8 @@ std::string ClusterAnalysisFilter::getSpecificErrString(unsigned int i) const
 {
 	const char *errStrs[] = {"",
 		"No core ions for cluster",
-		"No bulk ions for cluster" };
+		"No bulk ions for cluster",
+		"Insufficient memory for clustering" };
 
 	COMPILE_ASSERT(THREEDEP_ARRAYSIZE(errStrs) == CLUSTER_ERR_ENUM_END );
 	ASSERT(i < CLUSTER_ERR_ENUM_END);
@@ -1870,8 +2200,7 @@ void ClusterAnalysisFilter::setPropFromBinding(const SelectionBinding &b)
 }
 
 unsigned int ClusterAnalysisFilter::refreshLinkClustering(const std::vector<const FilterStreamData *> &dataIn,
-		std::vector< std::vector<IonHit> > &clusteredCore, 
-		std::vector<std::vector<IonHit>  > &clusteredBulk,ProgressData &progress)
+		ClusterMembers &clusters, ProgressData &progress)
 					
 {
 
@@ -1959,13 +2288,17 @@ unsigned int ClusterAnalysisFilter::refreshLinkClustering(const std::vector<cons
 		return FILTER_ERR_ABORT;
 
 	vector<IonHit> coreIons,bulkIons;
-	createRangedIons(dataIn,coreIons,bulkIons,progress);
+	vector<size_t> coreSource,bulkSource;
+	createRangedIons(dataIn,coreIons,bulkIons,coreSource,bulkSource,progress);
 
 	if(coreIons.empty())
 		return 0;
 	//----------
 
-	K3DTreeMk2 coreTree,bulkTree;
+	//Trees are shared via the spatial index cache, so must not be
+	// modified. Bulk points are instead tagged in a separate tag set
+	const K3DTreeMk2 *coreTree=0,*bulkTree=0;
+	K3DTagSet bulkTags;
 	BoundCube bCore,bBulk;
 
 	//Build the core KD & bulk trees
@@ -1977,14 +2310,17 @@ unsigned int ClusterAnalysisFilter::refreshLinkClustering(const std::vector<cons
 		return FILTER_ERR_ABORT;
 
 	unsigned int errCode;
-	errCode=buildKDTrees(coreIons,bulkIons,coreTree,bulkTree,progress);
+	errCode=buildKDTrees(coreIons,bulkIons,coreSource,bulkSource,coreTree,bulkTree,progress);
 
 
 	if(errCode)
 		return errCode;
-	coreTree.getBoundCube(bCore);
+	coreTree->getBoundCube(bCore);
 	if(enableBulkLink)
-		bulkTree.getBoundCube(bBulk);
+	{
+		bulkTree->getBoundCube(bBulk);
+		bulkTags.init(bulkTree->size());
+	}
 		
 
 	//----------
@@ -1992,10 +2328,10 @@ unsigned int ClusterAnalysisFilter::refreshLinkClustering(const std::vector<cons
 	
 	//Step 2 in the  Process : Cluster Construction 
 	//====
-	//Loop over the solutes in the material, 
-	//running searches from each solute. Group them using a queue
-	//that keeps on adding newly found solutes until it can find no more
-	//within a given radius. This becomes one cluster.
+	//Link together all solutes lying within the link distance of
+	//one another. Each group of linked solutes becomes one cluster.
+	//The links are found in parallel, using a cell list over the
+	//core points (in tree order), and joined using a union-find.
 
 	//Update progress stuff
 	progress.step++;
@@ -2006,76 +2342,107 @@ unsigned int ClusterAnalysisFilter::refreshLinkClustering(const std::vector<cons
 		
 
 	vector<vector<size_t> > allCoreClusters,allBulkClusters;
-	//When this queue is exhausted, move to the next cluster
-	for(size_t ui=0;ui<coreTree.size();ui++)
-	{
-		size_t curPt;
-		//Indicies of each cluster
-		vector<size_t> soluteCluster,dummy;
-		//Queue for atoms in this cluster waiting to be checked
-		//for their NNs.
-		std::queue<size_t> thisClusterQueue;
-		
-		
-		//This solute is already clustered. move along.
-		if(coreTree.getTag(ui))
-			continue;
-		coreTree.tag(ui);
-
-	
-		//If the atom is not clustered, use it as a point from 
-		//which we start a search	
-		thisClusterQueue.push(ui);
-		soluteCluster.push_back(ui);
-	
-		//Keep looping throughe queue until it is exhausted
-		do
+	{
+		vector<Point3D> corePts;
+		try
 		{
-			//search atom's position
-			curPt=thisClusterQueue.front();
-
-			//Find all the points in a sphere around this one
-			vector<size_t> nnIdxs;
-			coreTree.ptsInSphere(*(coreTree.getPt(curPt)),linkDist,nnIdxs);
-
-			//Loop over this solute's NNs
-			for(size_t uj=0;uj<nnIdxs.size();uj++)
+			corePts.resize(coreTree->size());
+		}
+		catch(std::bad_alloc)
+		{
+			return CLUSTER_ERR_MEMALLOC;
+		}
+		for(size_t ui=0;ui<coreTree->size();ui++)
+			corePts[ui]=*(coreTree->getPt(ui));
+
+		//Build the single-linkage hierarchy, if it is wanted and not cached
+		// for these core points (in this order)
+		unsigned long long coreFingerprint=0;
+		if(wantLinkSweep)
+			coreFingerprint=SpatialIndexCache::fingerprint(corePts);
+		if(wantLinkSweep && !(linkTreeOK && linkTreeNumPts == corePts.size()
+					&& linkTreeFingerprint == coreFingerprint))
+		{
+			linkTreeOK=false;
+			const CellList *cells;
+			switch(SpatialIndexCache::getCellList(corePts,maxSweepLinkDist,cells,
+					progress.filterProgress,*Filter::wantAbort))
 			{
-				size_t clustIdx;
-				ASSERT(curPt < coreTree.size());
-				//Find the next point that we have not yet retreived
-				//the find will tag the point, so we won't see it again
-				ASSERT(bCore.isValid());
-				clustIdx=nnIdxs[uj];
+				case 0:
+					break;
+				case SPATIALINDEX_ERR_ABORT:
+					return FILTER_ERR_ABORT;
+				case SPATIALINDEX_ERR_MEMALLOC:
+					return CLUSTER_ERR_MEMALLOC;
+				default:
+					ASSERT(false);
+			}
 
-				//Record it as part of the cluster	
 
-				if(!coreTree.getTag(clustIdx))
-				{
-					thisClusterQueue.push(clustIdx);
-					soluteCluster.push_back(clustIdx);
-					//tag point as visited
-					coreTree.tag(clustIdx);
-				}
+			switch(linkTree(corePts,*cells,maxSweepLinkDist,linkTreeEdges,
+					progress.filterProgress,*Filter::wantAbort))
+			{
+				case 0:
+					break;
+				case LINKCLUSTER_ERR_ABORT:
+					return FILTER_ERR_ABORT;
+				case LINKCLUSTER_ERR_MEMALLOC:
+					return CLUSTER_ERR_MEMALLOC;
+				default:
+					ASSERT(false);
 			}
+			linkTreeNumPts=corePts.size();
+			linkTreeFingerprint=coreFingerprint;
+			linkTreeOK=true;
+		}
 
+		if(wantLinkSweep && linkDist <= maxSweepLinkDist)
+		{
+			//Cut the hierarchy at the link distance
+			try
+			{
+				clustersFromTree(corePts.size(),linkTreeEdges,linkDist,allCoreClusters);
+			}
+			catch(std::bad_alloc)
+			{
+				return CLUSTER_ERR_MEMALLOC;
+			}
+		}
+		else
+		{
+			if(wantLinkSweep)
+			{
+				consoleOutput.push_back(
+					TRANS("Link distance exceeds the maximum sweep distance; linking directly"));
+			}
 
-			//Progress may be a little non-linear if cluster sizes are not random
-			progress.filterProgress= (unsigned int)(((float)ui/(float)coreTree.size())*100.0f);
-			if(*Filter::wantAbort)
-				return FILTER_ERR_ABORT;
-
-			thisClusterQueue.pop();
+			const CellList *cells;
+			switch(SpatialIndexCache::getCellList(corePts,linkDist,cells,
+					progress.filterProgress,*Filter::wantAbort))
+			{
+				case 0:
+					break;
+				case SPATIALINDEX_ERR_ABORT:
+					return FILTER_ERR_ABORT;
+				case SPATIALINDEX_ERR_MEMALLOC:
+					return CLUSTER_ERR_MEMALLOC;
+				default:
+					ASSERT(false);
+			}
 
-		}while(!thisClusterQueue.empty());
-			
 
-		if(soluteCluster.size())
-		{
-			//Record the solute cluster in the total array
-			allCoreClusters.push_back(dummy);
-			allCoreClusters.back().swap(soluteCluster);
-			soluteCluster.clear();
+			switch(linkPoints(corePts,*cells,linkDist,allCoreClusters,
+					progress.filterProgress,*Filter::wantAbort))
+			{
+				case 0:
+					break;
+				case LINKCLUSTER_ERR_ABORT:
+					return FILTER_ERR_ABORT;
+				case LINKCLUSTER_ERR_MEMALLOC:
+					return CLUSTER_ERR_MEMALLOC;
+				default:
+					ASSERT(false);
+			}
 		}
 	}
 
@@ -2090,8 +2457,9 @@ unsigned int ClusterAnalysisFilter::refreshLinkClustering(const std::vector<cons
 	// now, as we are going to do that anyway as soon as we return from our cluster
 	// computation.
 	// The advantage to doing it now is that we can (potentially) drop lots of clusters
-	// from or analysis before we do the following steps, saving lots of time
-	if(!enableBulkLink && (nMin > 0 || nMax <(size_t)-1) && wantCropSize )
+	// from or analysis before we do the following steps, saving lots of time.
+	// If caching, the clusters are kept uncropped, so the crop can change without relinking
+	if(!cache && !enableBulkLink && (nMin > 0 || nMax <(size_t)-1) && wantCropSize )
 	{
 		for(size_t ui=0;ui<allCoreClusters.size();)
 		{
@@ -2127,64 +2495,61 @@ unsigned int ClusterAnalysisFilter::refreshLinkClustering(const std::vector<cons
 		if(*Filter::wantAbort)
 			return FILTER_ERR_ABORT;
 
-		if(bulkTree.size())
+		if(bulkTree->size())
 		{
-			bulkTree.getBoundCube(bBulk);
+			bulkTree->getBoundCube(bBulk);
 
 			//So-called "envelope" step.
-			size_t prog=PROGRESS_REDUCE;
 			//Now do the same thing with the matrix, but use the clusters as the "seed"
-			//positions
-			for(size_t ui=0;ui<allCoreClusters.size();ui++)
+			//positions. The sphere searches for a block of clusters are run
+			//in parallel, then the bulk points are claimed in cluster order,
+			//so that a bulk point near several clusters is always given to the
+			//first, as per a serial search
+			allBulkClusters.resize(allCoreClusters.size());
+			for(size_t blockStart=0;blockStart<allCoreClusters.size();blockStart+=BULK_LINK_BLOCK)
 			{
+				size_t blockEnd=std::min(blockStart+BULK_LINK_BLOCK,allCoreClusters.size());
+				vector<vector<size_t> > candidates(blockEnd-blockStart);
 
-				//The bulkTree component of the cluster
-				vector<size_t> thisBulkCluster,dummy;
-				for(size_t uj=0;uj<allCoreClusters[ui].size();uj++)
+				bool spin=false;
+				#pragma omp parallel for schedule(dynamic)
+				for(size_t ui=blockStart;ui<blockEnd;ui++)
 				{
-					size_t curIdx;
-					curIdx=allCoreClusters[ui][uj];
+					if(spin)
+						continue;
 
-					//Scan for bulkTree NNs.
-					vector<size_t> nnIdxs;
-					bulkTree.ptsInSphere(*(coreTree.getPt(curIdx)),bulkLink,nnIdxs);
-
-					//loop over the points we found
-					for(unsigned int uj=0;uj<nnIdxs.size();uj++)
+					for(size_t uj=0;uj<allCoreClusters[ui].size();uj++)
 					{
-						size_t bulkTreeIdx;
-						bulkTreeIdx=nnIdxs[uj];
-				
-						ASSERT(bulkTree.getPt(nnIdxs[uj])->sqrDist(
-						*(coreTree.getPt(curIdx)))< bulkLink*bulkLink);
-						if(bulkTree.getTag(bulkTreeIdx))
-							continue;
-
-						//Record as part of the cluster	
-						thisBulkCluster.push_back(bulkTreeIdx);
-						bulkTree.tag(bulkTreeIdx);
-					}
+						size_t curIdx;
+						curIdx=allCoreClusters[ui][uj];
 
-						
-					//Update progress data as needed	
-					if(prog <=nnIdxs.size())
-					{
-						prog=PROGRESS_REDUCE;
-						//Progress may be a little non-linear if cluster sizes are not random
-						progress.filterProgress= (unsigned int)(((float)ui/(float)allCoreClusters.size())*100.0f);
-						if(*Filter::wantAbort)
-							return FILTER_ERR_ABORT;
+						//Scan for bulkTree NNs. These are appended to the candidates
+						bulkTree->ptsInSphere(*(coreTree->getPt(curIdx)),bulkLink,
+									candidates[ui-blockStart]);
 					}
-					else
-						prog-=nnIdxs.size();	
 
+					if(*Filter::wantAbort)
+						spin=true;
 				}
 
+				if(spin)
+					return FILTER_ERR_ABORT;
+
+				for(size_t ui=blockStart;ui<blockEnd;ui++)
+				{
+					const vector<size_t> &thisCandidates=candidates[ui-blockStart];
+					vector<size_t> &thisBulkCluster=allBulkClusters[ui];
+					//Record as part of the cluster, if not already taken	
+					for(size_t uj=0;uj<thisCandidates.size();uj++)
+					{
+						if(bulkTags.claim(thisCandidates[uj]))
+							thisBulkCluster.push_back(thisCandidates[uj]);
+					}
+				}
 
-				allBulkClusters.push_back(dummy);
-				allBulkClusters.back().swap(thisBulkCluster);
-				thisBulkCluster.clear();
-			}	
+				//Progress may be a little non-linear if cluster sizes are not random
+				progress.filterProgress= (unsigned int)(((float)blockEnd/(float)allCoreClusters.size())*100.0f);
+			}
 		}
 	}
 	//====
@@ -2225,14 +2590,14 @@ unsigned int ClusterAnalysisFilter::refreshLinkClustering(const std::vector<cons
 
 				//Find the nearest untagged bulkTree, but tagging is irrelevant, as it
 				//is already tagged from previous "envelope" step.
-				nnId = bulkTree.findNearestUntagged(
-							*(bulkTree.getPt(bulkTreeId)),bBulk, false);
+				nnId = bulkTree->findNearestUntagged(
+							*(bulkTree->getPt(bulkTreeId)),bBulk,bulkTags, false);
 				
 				if(nnId !=(size_t)-1)
 				{
 					float curDistSqr;
-					curDistSqr=bulkTree.getPt(bulkTreeId)->sqrDist(
-							*(bulkTree.getPt(nnId)) );
+					curDistSqr=bulkTree->getPt(bulkTreeId)->sqrDist(
+							*(bulkTree->getPt(nnId)) );
 					if( curDistSqr < dErosionSqr)
 					{
 						//Bulk is to be eroded. Swap it with the vector tail
@@ -2281,32 +2646,59 @@ unsigned int ClusterAnalysisFilter::refreshLinkClustering(const std::vector<cons
 	progress.filterProgress=0;
 	progress.stepName=TRANS("Re-Collate");
 
-	clusteredCore.resize(allCoreClusters.size());
-	clusteredBulk.resize(allBulkClusters.size());
-
 	ASSERT(coreClusterBeforeCount == allCoreClusters.size()); //Must be equal, independant of erosion/bulk link steps
 	ASSERT(bulkClusterBeforeCount >= allBulkClusters.size()); //Must be <= after (optional) erosion step
-	
+	ASSERT(allBulkClusters.empty() || allBulkClusters.size() == allCoreClusters.size());
 
-	//Use a no-barrier construct, to avoid the 
+	//Lay out the cluster offsets, then fill in the input
+	// index of each clustered ion
+	clusters.clear();
+	try
+	{
+		clusters.coreStart.resize(allCoreClusters.size()+1);
+		clusters.coreStart[0]=0;
+		for(size_t ui=0;ui<allCoreClusters.size();ui++)
+			clusters.coreStart[ui+1]=clusters.coreStart[ui]+allCoreClusters[ui].size();
+		clusters.core.resize(clusters.coreStart.back());
+
+		if(enableBulkLink)
+		{
+			clusters.bulkStart.resize(allCoreClusters.size()+1);
+			clusters.bulkStart[0]=0;
+			for(size_t ui=0;ui<allCoreClusters.size();ui++)
+			{
+				size_t n;
+				n= allBulkClusters.empty() ? 0 : allBulkClusters[ui].size();
+				clusters.bulkStart[ui+1]=clusters.bulkStart[ui]+n;
+			}
+			clusters.bulk.resize(clusters.bulkStart.back());
+		}
+	}
+	catch(std::bad_alloc)
+	{
+		clusters.clear();
+		return CLUSTER_ERR_MEMALLOC;
+	}
+
+	//Use a no-barrier construct, to avoid the 
 	//flush wait in the middle
 	#pragma omp parallel 
 	{
-		#pragma omp for
+		#pragma omp for nowait
 		for(size_t ui=0;ui<allCoreClusters.size();ui++)
 		{
-			clusteredCore[ui].resize(allCoreClusters[ui].size());
+			size_t offset=clusters.coreStart[ui];
 			for(size_t uj=0;uj<allCoreClusters[ui].size();uj++)
-				clusteredCore[ui][uj]=coreIons[coreTree.getOrigIndex(allCoreClusters[ui][uj])];
+				clusters.core[offset+uj]=coreSource[coreTree->getOrigIndex(allCoreClusters[ui][uj])];
 		}
 
 
 		#pragma omp for
 		for(size_t ui=0;ui<allBulkClusters.size();ui++)
 		{
-			clusteredBulk[ui].resize(allBulkClusters[ui].size());
+			size_t offset=clusters.bulkStart[ui];
 			for(size_t uj=0;uj<allBulkClusters[ui].size();uj++)
-				clusteredBulk[ui][uj]=bulkIons[bulkTree.getOrigIndex(allBulkClusters[ui][uj])];
+				clusters.bulk[offset+uj]=bulkSource[bulkTree->getOrigIndex(allBulkClusters[ui][uj])];
 		}
 	}
 
@@ -2316,21 +2708,28 @@ unsigned int ClusterAnalysisFilter::refreshLinkClustering(const std::vector<cons
 }
 
 unsigned int ClusterAnalysisFilter::buildKDTrees(vector<IonHit> &coreIons, vector<IonHit> & bulkIons,
-		K3DTreeMk2 &coreTree, K3DTreeMk2 &bulkTree, ProgressData &progress) const
+		vector<size_t> &coreSource, vector<size_t> &bulkSource, const K3DTreeMk2 *&coreTree, const K3DTreeMk2 *&bulkTree, ProgressData &progress) const
 {
-		
-	coreTree.resetPts(coreIons,false);
-	if(!coreTree.build())
-		return FILTER_ERR_ABORT;
+	//Trees are shared with other filters (and later refreshes)
+	// that use the same ions, via the spatial index cache
+	switch(SpatialIndexCache::getMk2Tree(coreIons,coreTree))
+	{
+		case 0:
+			break;
+		case SPATIALINDEX_ERR_MEMALLOC:
+			return CLUSTER_ERR_MEMALLOC;
+		default:
+			return FILTER_ERR_ABORT;
+	}
 
 	BoundCube bCore;
-	coreTree.getBoundCube(bCore);
+	coreTree->getBoundCube(bCore);
 
 
 	if(enableCoreClassify)
 	{
 		//Perform Clustering Stage (1) : clustering classification
-		// This modifies the trees, so we have to do it here.
+		// This moves rejected core ions to the bulk, so we have to do it here.
 		//==	
 		progress.step++;
 		progress.filterProgress=0;
@@ -2338,23 +2737,51 @@ unsigned int ClusterAnalysisFilter::buildKDTrees(vector<IonHit> &coreIons, vecto
 		if(*Filter::wantAbort)
 			return FILTER_ERR_ABORT;
 		
-		vector<bool> coreOK;
-		ASSERT(coreIons.size() == coreTree.size());
-		coreOK.resize(coreTree.size());
+		//The tree is shared and const, so each thread searches it
+		// with its own tag set, and writes its results by index
+		unsigned int nThreads;
+#ifdef _OPENMP
+		nThreads=omp_get_max_threads();
+#else
+		nThreads=1;
+#endif
+		vector<char> coreOK;
+		vector<K3DTagSet> threadTags;
+		ASSERT(coreIons.size() == coreTree->size());
+		ASSERT(coreSource.size() == coreIons.size());
+		try
+		{
+			coreOK.resize(coreTree->size());
+			threadTags.resize(nThreads);
+			for(size_t ui=0;ui<threadTags.size();ui++)
+				threadTags[ui].init(coreTree->size());
+		}
+		catch(std::bad_alloc)
+		{
+			return CLUSTER_ERR_MEMALLOC;
+		}
 		float coreDistSqr=coreDist*coreDist;
 
-		//TODO: the trees internal Tags prevent us from parallelising this. 
-		//       :(. If we could pass a tag map to the tree, this would solve the problem
-		for(size_t ui=0;ui<coreTree.size();ui++)
+		size_t numCounted=0;
+		bool spin=false;
+		#pragma omp parallel for schedule(dynamic,PROGRESS_REDUCE)
+		for(size_t ui=0;ui<coreTree->size();ui++)
 		{
+			if(spin)
+				continue;
+#ifdef _OPENMP
+			K3DTagSet &coreTags=threadTags[omp_get_thread_num()];
+#else
+			K3DTagSet &coreTags=threadTags[0];
+#endif
 			const Point3D *p;
 			size_t pNN;	
 			unsigned int k;
 			vector<size_t> tagsToClear;
 		
 			//Don't match ourselves -- to do this we must "tag" this tree node before we start
-			p=coreTree.getPt(ui);
-			coreTree.tag(ui);
+			p=coreTree->getPt(ui);
+			coreTags.tag(ui);
 			tagsToClear.push_back(ui);
 			
 			k=1;
@@ -2362,7 +2789,7 @@ unsigned int ClusterAnalysisFilter::buildKDTrees(vector<IonHit> &coreIons, vecto
 			//Loop through this ions NNs, seeing if the kth NN is within a given radius
 			do
 			{
-				pNN=coreTree.findNearestUntagged(*p,bCore,true);
+				pNN=coreTree->findNearestUntagged(*p,bCore,coreTags,true);
 				tagsToClear.push_back(pNN);
 				k++;
 
@@ -2373,27 +2800,46 @@ unsigned int ClusterAnalysisFilter::buildKDTrees(vector<IonHit> &coreIons, vecto
 			//specified distance
 			if(pNN == (size_t)-1)
 			{
-				coreOK[coreTree.getOrigIndex(ui)]=false;
+				coreOK[coreTree->getOrigIndex(ui)]=false;
 				ASSERT(tagsToClear.back() == (size_t) -1);
 				tagsToClear.pop_back(); //get rid of the -1
 			}
 			else
 			{
 				float nnSqrDist;
-				nnSqrDist=p->sqrDist(*(coreTree.getPt(pNN)));
-				coreOK[coreTree.getOrigIndex(ui)] = nnSqrDist < coreDistSqr;
+				nnSqrDist=p->sqrDist(*(coreTree->getPt(pNN)));
+				coreOK[coreTree->getOrigIndex(ui)] = nnSqrDist < coreDistSqr;
 			}
 
 
 			//reset the tags, so we can find near NNs
-			coreTree.clearTags(tagsToClear);
-			tagsToClear.clear();
+			coreTags.clear(tagsToClear);
 
-			progress.filterProgress= (unsigned int)(((float)ui/(float)coreTree.size())*100.0f);
-			if(*Filter::wantAbort)
-				return FILTER_ERR_ABORT;
+			if(!(ui%PROGRESS_REDUCE))
+			{
+				#pragma omp critical 
+				{
+				numCounted+=PROGRESS_REDUCE;
+				progress.filterProgress= (unsigned int)(((float)numCounted/(float)coreTree->size())*100.0f);
+				if(*Filter::wantAbort)
+					spin=true;
+				}
+			}
 		}
 
+		if(spin)
+			return FILTER_ERR_ABORT;
+
+		try
+		{
+			size_t numRejected=std::count(coreOK.begin(),coreOK.end(),0);
+			bulkIons.reserve(bulkIons.size()+numRejected);
+			bulkSource.reserve(bulkSource.size()+numRejected);
+		}
+		catch(std::bad_alloc)
+		{
+			return CLUSTER_ERR_MEMALLOC;
+		}
 
 		for(size_t ui=coreOK.size();ui;)
 		{
@@ -2402,20 +2848,30 @@ unsigned int ClusterAnalysisFilter::buildKDTrees(vector<IonHit> &coreIons, vecto
 			if(!coreOK[ui])
 			{
 				//We have to convert the core ion to a bulk ion
-				//as it is rejected.
+				//as it is rejected. Its input index moves with it
 				bulkIons.push_back(coreIons[ui]);
 				coreIons[ui]=coreIons.back();
 				coreIons.pop_back();
+
+				bulkSource.push_back(coreSource[ui]);
+				coreSource[ui]=coreSource.back();
+				coreSource.pop_back();
 			}
 		}
 
 		//Re-Build the core KD tree
-		coreTree.resetPts(coreIons,false);
-		if(!coreTree.build())
-			return FILTER_ERR_ABORT;
+		switch(SpatialIndexCache::getMk2Tree(coreIons,coreTree))
+		{
+			case 0:
+				break;
+			case SPATIALINDEX_ERR_MEMALLOC:
+				return CLUSTER_ERR_MEMALLOC;
+			default:
+				return FILTER_ERR_ABORT;
+		}
 		//==	
 	}
-	coreTree.getBoundCube(bCore);
+	coreTree->getBoundCube(bCore);
 	//----------
 
 
@@ -2429,9 +2885,15 @@ unsigned int ClusterAnalysisFilter::buildKDTrees(vector<IonHit> &coreIons, vecto
 		if(*Filter::wantAbort)
 			return FILTER_ERR_ABORT;
 
-		bulkTree.resetPts(bulkIons,false);
-		if(!bulkTree.build())
-			return FILTER_ERR_ABORT;
+		switch(SpatialIndexCache::getMk2Tree(bulkIons,bulkTree))
+		{
+			case 0:
+				break;
+			case SPATIALINDEX_ERR_MEMALLOC:
+				return CLUSTER_ERR_MEMALLOC;
+			default:
+				return FILTER_ERR_ABORT;
+		}
 
 	}
 
@@ -2442,14 +2904,14 @@ unsigned int ClusterAnalysisFilter::buildKDTrees(vector<IonHit> &coreIons, vecto
 
 #ifdef DEBUG
 
-bool ClusterAnalysisFilter::paranoidDebugAssert(
-	const std::vector<vector<IonHit> > &core, const std::vector<vector<IonHit> > &bulk) const
+bool ClusterAnalysisFilter::paranoidDebugAssert(const ClusterMembers &clusters,
+					const InputIonView &ions) const
 {
-	for(size_t ui=0;ui<bulk.size(); ui++)
+	for(size_t ui=0;ui<clusters.size(); ui++)
 	{
-		if(bulk[ui].size())
+		if(clusters.bulkSize(ui))
 		{
-			ASSERT(core[ui].size());
+			ASSERT(clusters.coreSize(ui));
 		}
 	}
 
@@ -2464,18 +2926,19 @@ bool ClusterAnalysisFilter::paranoidDebugAssert(
 			//If the bulklink is zero, we shouldn't have ANY bulk at all.
 
 			bool failure=false;
-			for(size_t ui=0;ui<bulk.size(); ui++)
+			for(size_t ui=0;ui<clusters.size(); ui++)
 			{
-				if(failure)
+				if(failure || !clusters.hasBulk())
 					continue;
-				for(size_t uj=0;uj<bulk[ui].size(); uj++)
+				for(size_t uj=clusters.bulkStart[ui];uj<clusters.bulkStart[ui+1]; uj++)
 				{
 					bool haveNear;
 					haveNear=false;
+					const Point3D &bulkPt=ions[clusters.bulk[uj]].getPosRef();
 					//check bulk UI against core UI
-					for(size_t um=0;um<core[ui].size();um++)
+					for(size_t um=clusters.coreStart[ui];um<clusters.coreStart[ui+1];um++)
 					{
-						if(core[ui][um].getPos().sqrDist(bulk[ui][uj].getPos()) < bulkLinkSqr)
+						if(ions[clusters.core[um]].getPosRef().sqrDist(bulkPt) < bulkLinkSqr)
 						{
 							haveNear=true;
 							break;
@@ -2493,16 +2956,16 @@ bool ClusterAnalysisFilter::paranoidDebugAssert(
 						using std::endl;	
 						cerr << "FAILED! " << endl;
 
-						cerr << "BULK:" << bulk[ui].size() << endl;
-						for(unsigned int un=0;un<bulk[ui].size();un++)
+						cerr << "BULK:" << clusters.bulkSize(ui) << endl;
+						for(size_t un=clusters.bulkStart[ui];un<clusters.bulkStart[ui+1];un++)
 						{
-							cerr << bulk[ui][un].getPos() << endl;
+							cerr << ions[clusters.bulk[un]].getPos() << endl;
 						}
 						
-						cerr << "CORE:" << core[ui].size() << endl;
-						for(unsigned int un=0;un<core[ui].size();un++)
+						cerr << "CORE:" << clusters.coreSize(ui) << endl;
+						for(size_t un=clusters.coreStart[ui];un<clusters.coreStart[ui+1];un++)
 						{
-							cerr << core[ui][un].getPos() << endl;
+							cerr << ions[clusters.core[un]].getPos() << endl;
 						}
 					#endif
 
@@ -2526,7 +2989,8 @@ bool ClusterAnalysisFilter::paranoidDebugAssert(
 #endif
 
 void ClusterAnalysisFilter::createRangedIons(const std::vector<const FilterStreamData *> &dataIn,vector<IonHit> &core,
-			vector<IonHit> &bulk, ProgressData &p) const
+			vector<IonHit> &bulk, vector<size_t> &coreSource, vector<size_t> &bulkSource,
+			ProgressData &p) const
 {
 
 	//TODO: Progress reporting and callback
@@ -2554,112 +3018,84 @@ void ClusterAnalysisFilter::createRangedIons(const std::vector<const FilterStrea
 	ASSERT(rangeEnabledMap.size() == ionCoreEnabled.size());
 
 
-	unsigned int numIonsRanged=0;
-
-	if(enableBulkLink)
+	//Ions are classified in parallel, then collected in input order, so the
+	// core and bulk are identical between refreshes. The core linkage
+	// hierarchy relies upon this, as it is cached in core tree order
+	enum
+	{
+		ION_UNUSED,
+		ION_CORE,
+		ION_BULK
+	};
+
+	vector<char> ionType;
+	//Input index of the first ion in the current stream
+	size_t streamBase=0;
+	for(size_t ui=0;ui<dataIn.size();ui++)
 	{
-		for(size_t ui=0;ui<dataIn.size();ui++)
+		if(dataIn[ui]->getStreamType() != STREAM_TYPE_IONS)
+			continue;
+
+		const IonStreamData *d;
+		d=(const IonStreamData *)dataIn[ui];
+		ionType.resize(d->data.size());
+		#pragma omp parallel for 
+		for(size_t uj=0;uj<d->data.size();uj++)
 		{
-			if(dataIn[ui]->getStreamType() == STREAM_TYPE_IONS)
-			{
-				const IonStreamData *d;
-				d=(const IonStreamData *)dataIn[ui];
-				#pragma omp parallel for 
-				for(size_t ui=0;ui<d->data.size();ui++)
-				{
-					unsigned int ionId;
-					ionId=r->rangeFile->getIonID(d->data[ui].getMassToCharge());
-					if(ionId!=(unsigned int)-1)
-					{
-						if( ionCoreEnabled[rangeEnabledMap[ionId]])
-						{
-							#pragma omp critical 
-							core.push_back(d->data[ui]);
-						}
-						else if(ionBulkEnabled[rangeEnabledMap[ionId]]) //mutually exclusive with core (both cannot be true)
-						{
-							#pragma omp critical 
-							bulk.push_back(d->data[ui]);
-						}
-					}
-				}
-				numIonsRanged++;
-			}
-		
-		
+			unsigned int ionId;
+			ionId=r->rangeFile->getIonID(d->data[uj].getMassToCharge());
+			ionType[uj]=ION_UNUSED;
+			if(ionId==(unsigned int)-1)
+				continue;
+
+			map<size_t,size_t>::const_iterator it=rangeEnabledMap.find(ionId);
+			if(it == rangeEnabledMap.end())
+				continue;
+
+			if(ionCoreEnabled[it->second])
+				ionType[uj]=ION_CORE;
+			else if(enableBulkLink && ionBulkEnabled[it->second]) //mutually exclusive with core (both cannot be true)
+				ionType[uj]=ION_BULK;
 		}
-	}
-	else
-	{
-#pragma omp parallel for 
-		for(size_t ui=0;ui<dataIn.size();ui++)
+
+		for(size_t uj=0;uj<d->data.size();uj++)
 		{
-			if(dataIn[ui]->getStreamType() == STREAM_TYPE_IONS)
+			if(ionType[uj] == ION_CORE)
 			{
-				const IonStreamData *d;
-				d=(const IonStreamData *)dataIn[ui];
-				for(size_t ui=0;ui<d->data.size();ui++)
-				{
-					unsigned int ionId;
-					ionId=r->rangeFile->getIonID(d->data[ui].getMassToCharge());
-					if(ionId!=(unsigned int)-1 && ionCoreEnabled[rangeEnabledMap[ionId]])
-					{
-						#pragma omp critical 
-						core.push_back(d->data[ui]);
-					}
-					numIonsRanged++;
-				}
+				core.push_back(d->data[uj]);
+				coreSource.push_back(streamBase+uj);
+			}
+			else if(ionType[uj] == ION_BULK)
+			{
+				bulk.push_back(d->data[uj]);
+				bulkSource.push_back(streamBase+uj);
 			}
 		}
+		streamBase+=d->data.size();
 	}
 	
 }
 
-PlotStreamData* ClusterAnalysisFilter::clusterSizeDistribution(const vector<vector<IonHit> > &core, 
-						const vector<vector<IonHit> > &bulk) const
+PlotStreamData* ClusterAnalysisFilter::clusterSizeDistribution(const ClusterMembers &clusters) const
 {
-	//each cluster is represented by one entry in core and bulk
-	ASSERT(bulk.size() == core.size() || bulk.empty());
-
 	//Map that maps input number to frequency
 	map<size_t,size_t> countMap;
 	size_t maxSize=0;
-	if(bulk.size())
+	for(size_t ui=0;ui<clusters.size();ui++)
 	{
-		ASSERT(bulk.size() == core.size());
-		for(size_t ui=0;ui<core.size();ui++)
+		//Bulk size is zero, if there is no bulk
+		size_t curSize;
+		curSize=clusters.coreSize(ui)+clusters.bulkSize(ui);
+		//Check map for existing entry
+		if(countMap.find(curSize) ==countMap.end())
 		{
-			size_t curSize;
-			curSize=core[ui].size()+bulk[ui].size();
-			//Check map for existing entry
-			if(countMap.find(curSize) ==countMap.end())
-			{
-				//we haven't seen this size before, push it back
-				countMap.insert(make_pair(curSize,1));
-			}
-			else
-				countMap[curSize]++; //increment size.
-
-			maxSize=max(maxSize,curSize);//update max size
+			//we haven't seen this size before, push it back
+			countMap.insert(make_pair(curSize,1));
 		}
-	}
-	else	
-	{
-		for(size_t ui=0;ui<core.size();ui++)
-		{
-			size_t curSize;
-			curSize=core[ui].size();
-			//Check map for existing entry
-			if(countMap.find(curSize) ==countMap.end())
-			{
-				//we haven't seen this size before, push it back
-				countMap.insert(make_pair(curSize,1));
-			}
-			else
-				countMap[curSize]++; //increment size.
+		else
+			countMap[curSize]++; //increment size.
 
-			maxSize=max(maxSize,curSize); //update max size
-		}
+		maxSize=max(maxSize,curSize); //update max size
 	}
 
 	if(!maxSize)
@@ -2688,148 +3124,349 @@ PlotStreamData* ClusterAnalysisFilter::clusterSizeDistribution(const vector<vect
 }
 
 
-bool ClusterAnalysisFilter::stripClusterBySize(vector<vector<IonHit> > &clusteredCore,
-						vector<vector<IonHit> > &clusteredBulk,
+PlotStreamData *ClusterAnalysisFilter::clusterCountVsLinkDist() const
+{
+	ASSERT(linkTreeOK);
+	if(!linkTreeNumPts)
+		return 0;
+
+	//Count only clusters that would survive cropping. As with
+	// stripClusterBySize, bulk ions are not counted
+	size_t minSize=1,maxSize=std::numeric_limits<size_t>::max();
+	if(wantCropSize)
+	{
+		minSize=nMin;
+		maxSize=nMax;
+	}
+
+	vector<float> dists(LINK_SWEEP_SAMPLES);
+	for(size_t ui=0;ui<LINK_SWEEP_SAMPLES;ui++)
+		dists[ui]=maxSweepLinkDist*(float)(ui+1)/(float)LINK_SWEEP_SAMPLES;
+
+	vector<size_t> counts;
+	clusterCountsFromTree(linkTreeNumPts,linkTreeEdges,dists,minSize,maxSize,counts);
+
+	PlotStreamData* d=new PlotStreamData;
+	d->parent=this;
+	d->r=0;
+	d->g=0;
+	d->b=1;
+
+	d->xLabel=TRANS("Link Distance");
+	d->yLabel=TRANS("Clusters");
+	d->dataLabel=LINK_SWEEP_DATALABEL;
+
+	d->plotStyle=PLOT_LINE_LINES;
+	d->plotMode=PLOT_MODE_1D;
+	d->xyData.resize(dists.size());
+	for(size_t ui=0;ui<dists.size();ui++)
+		d->xyData[ui]=make_pair(dists[ui],(float)counts[ui]);
+
+	return d;
+}
+
+bool ClusterAnalysisFilter::stripClusterBySize(ClusterMembers &clusters,
 							bool countBulk,
 							ProgressData &progress) const
 
 {
+	//Mark the clusters to keep, then cull the rest in one pass.
+	// Cluster order is retained
+	vector<char> keep(clusters.size());
+	#pragma omp parallel for
+	for(size_t ui=0;ui<clusters.size();ui++)
+	{
+		//Count both bulk and core, and operate on both.
+		size_t count;
+		count=clusters.coreSize(ui);
+		if(countBulk)
+			count+=clusters.bulkSize(ui);
 
-	//TODO: Parallelise? Could create a vector of bools and then 
-	// spin through, find the ones we want to kill, then do a cull.
-	// Progress reporting would be a bit more difficult.
+		keep[ui]= !(count < nMin || count > nMax);
+	}
+
+	if(*Filter::wantAbort)
+		return FILTER_ERR_ABORT;
 
-	if(clusteredBulk.size())
+	clusters.select(keep);
+	progress.filterProgress=100;
+
+	return true;
+}
+
+unsigned int ClusterAnalysisFilter::clusterStatistics(const ClusterMembers &clusters,
+		const InputIonView &ions, const RangeFile *rng, bool wantShape,
+		vector<ClusterShape> &shapes, vector<size_t> &speciesCounts, ProgressData &progress) const
+{
+	const size_t numIons= rng ? rng->getNumIons() : 0;
+	shapes.clear();
+	speciesCounts.clear();
+	try
+	{
+		if(wantShape)
+			shapes.resize(clusters.size());
+		speciesCounts.resize(clusters.size()*numIons,0);
+	}
+	catch(std::bad_alloc)
 	{
-		//should be the same numbers of bulk as core
-		ASSERT(clusteredBulk.size() == clusteredCore.size());
-		for(size_t ui=clusteredCore.size();ui;)
+		shapes.clear();
+		speciesCounts.clear();
+		return CLUSTER_ERR_MEMALLOC;
+	}
+
+	progress.stepName=TRANS("Statistics");
+	progress.filterProgress=0;
+
+	//Clusters are handled in blocks, one thread per block. Per-cluster
+	// scratch space is on the stack, so nothing is allocated per cluster
+	const size_t STATS_BLOCK=256;
+	const size_t numBlocks=(clusters.size()+STATS_BLOCK-1)/STATS_BLOCK;
+	size_t numDone=0;
+	bool spin=false;
+	#pragma omp parallel for schedule(dynamic)
+	for(size_t ui=0;ui<numBlocks;ui++)
+	{
+		if(spin)
+			continue;
+
+		size_t end=std::min((ui+1)*STATS_BLOCK,clusters.size());
+		for(size_t uj=ui*STATS_BLOCK;uj<end;uj++)
 		{
-			ui--;
-			//Count both bulk and core, and operate on both.
-			size_t count;
-			if(countBulk)
-				count =clusteredCore[ui].size() + clusteredBulk[ui].size() ;
-			else
-				count =clusteredCore[ui].size();
+			//Members are the cluster's core, then its bulk
+			const vector<size_t> *members[2]={&clusters.core,&clusters.bulk};
+			size_t begin[2],finish[2];
+			begin[0]=clusters.coreStart[uj];
+			finish[0]=clusters.coreStart[uj+1];
+			begin[1]=finish[1]=0;
+			if(clusters.hasBulk())
+			{
+				begin[1]=clusters.bulkStart[uj];
+				finish[1]=clusters.bulkStart[uj+1];
+			}
+			const size_t nAtoms=(finish[0]-begin[0]) + (finish[1]-begin[1]);
+			ASSERT(nAtoms);
 
-			if(count < nMin || count > nMax)
+			//Centroid and species counts
+			size_t *freq= numIons ? &speciesCounts[uj*numIons] : 0;
+			double centre[3]={0,0,0};
+			for(unsigned int list=0;list<2;list++)
 			{
-				clusteredCore[ui].swap(clusteredCore.back());
-				clusteredCore.pop_back();
-				clusteredBulk[ui].swap(clusteredBulk.back());
-				clusteredBulk.pop_back();
+				for(size_t um=begin[list];um<finish[list];um++)
+				{
+					const IonHit &h=ions[(*members[list])[um]];
+					const Point3D &pt=h.getPosRef();
+					for(unsigned int k=0;k<3;k++)
+						centre[k]+=pt[k];
+
+					if(freq)
+					{
+						unsigned int ionId;
+						ionId=rng->getIonID(h.getMassToCharge());
+						//this should not happen, as to cluster the ion,it must be ranged
+						ASSERT(ionId != (unsigned int)-1);
+						if(ionId != (unsigned int)-1)
+							freq[ionId]++;
+					}
+				}
 			}
-			progress.filterProgress= (unsigned int)(((float)ui/(float)clusteredCore.size()+1)*100.0f);
-				
-			if(*Filter::wantAbort)
-				return FILTER_ERR_ABORT;
-		}
-	}
-	else
-	{
-		//OK, we haven't any bulk, but we just want to count core;
-		//but operate on both
-		for(size_t ui=clusteredCore.size();ui;)
-		{
-			ui--;
 
-			if(clusteredCore[ui].size() <  nMin || clusteredCore[ui].size() > nMax)
+			if(!wantShape)
+				continue;
+
+			for(unsigned int k=0;k<3;k++)
+				centre[k]/=(double)nAtoms;
+
+			//Gyration tensor, summed about the centroid
+			double g[9]={0,0,0,0,0,0,0,0,0};
+			for(unsigned int list=0;list<2;list++)
 			{
-				clusteredCore[ui].swap(clusteredCore.back());
-				clusteredCore.pop_back();
+				for(size_t um=begin[list];um<finish[list];um++)
+				{
+					const Point3D &pt=ions[(*members[list])[um]].getPosRef();
+					double d[3];
+					for(unsigned int k=0;k<3;k++)
+						d[k]=pt[k]-centre[k];
+					g[0]+=d[0]*d[0];
+					g[1]+=d[0]*d[1];
+					g[2]+=d[0]*d[2];
+					g[4]+=d[1]*d[1];
+					g[5]+=d[1]*d[2];
+					g[8]+=d[2]*d[2];
+				}
 			}
+			g[3]=g[1];
+			g[6]=g[2];
+			g[7]=g[5];
+			for(unsigned int k=0;k<9;k++)
+				g[k]/=(double)nAtoms;
+
+			double vals[3],vecs[9];
+			symmetricEigen3(g,vals,vecs);
+
+			ClusterShape &shape=shapes[uj];
+			shape.centroid=Point3D(centre[0],centre[1],centre[2]);
+			for(unsigned int k=0;k<3;k++)
+			{
+				//Tensor is positive semi-definite; clamp rounding error
+				shape.gyrationVals[k]=std::max(vals[k],0.0);
+				shape.gyrationAxes[k]=Point3D(vecs[3*k],vecs[3*k+1],vecs[3*k+2]);
+			}
+			shape.radiusGyration=sqrt(std::max(g[0]+g[4]+g[8],0.0));
+		}
 
-			progress.filterProgress= (unsigned int)(((float)ui/(float)clusteredCore.size()+1)*100.0f);
-			
+		#pragma omp atomic
+		numDone+=end-ui*STATS_BLOCK;
+#ifdef _OPENMP
+		if(!omp_get_thread_num())
+#endif
+		{
+			progress.filterProgress= (unsigned int)((float)numDone/(float)clusters.size()*100.0f);
 			if(*Filter::wantAbort)
-				return FILTER_ERR_ABORT;
+				spin=true;
 		}
-
 	}
 
-	return true;
+	if(spin)
+		return FILTER_ERR_ABORT;
+
+	progress.filterProgress=100;
+	return 0;
 }
 
-void ClusterAnalysisFilter::genCompositionVersusSize(const vector<vector<IonHit> > &clusteredCore,
-		const vector<vector<IonHit> > &clusteredBulk, const RangeFile *rng,vector<PlotStreamData *> &plots) const
+void ClusterAnalysisFilter::clusterStatsPlots(const ClusterMembers &clusters,
+		const vector<ClusterShape> &shapes, const vector<size_t> &speciesCounts,
+		const vector<size_t> &clusterIds, const RangeFile *rng, vector<PlotStreamData *> &plots) const
 {
-	ASSERT(rng && haveRangeParent)
+	ASSERT(shapes.size() == clusters.size());
+	const size_t numIons=rng->getNumIons();
+	ASSERT(speciesCounts.size() == clusters.size()*numIons);
 
-	//Frequency of ions, as a function of composition.
-	//The inner vector<size_t> is the the array of frequencies
-	//for this particular sie for each ion (ie, the array is of size rng->getNumIons)
-	map<size_t,vector<size_t> > countMap;
-	
-	bool needCountBulk=clusteredBulk.size();
-
-
-	vector<size_t> ionFreq;
-	ionFreq.resize(rng->getNumIons(),0);	
-	//Create the frequency table, per ion
-	//-------
-	//TODO: Below, there is a multi-threaded version. When we are happy with the single-threaded code
-	// try implementing the multi-threaded routine.
-	//Count the cluster elements, then increment the frequency table
-	if(needCountBulk)
+	//Table columns, in order. Species counts follow these
+	enum
 	{
-		ASSERT(clusteredBulk.size() == clusteredCore.size());
-		
-		//Create entries of zero vectors for ion counting
-		for(size_t ui=0;ui<clusteredCore.size();ui++)
+		STATS_COL_CORE,
+		STATS_COL_BULK,
+		STATS_COL_X,
+		STATS_COL_Y,
+		STATS_COL_Z,
+		STATS_COL_RG,
+		STATS_COL_G1,
+		STATS_COL_G2,
+		STATS_COL_G3,
+		STATS_COL_ENUM_END
+	};
+	const char *COL_NAMES[] = {
+		NTRANS("Core Size"),
+		NTRANS("Bulk Size"),
+		NTRANS("Centroid X"),
+		NTRANS("Centroid Y"),
+		NTRANS("Centroid Z"),
+		NTRANS("Radius of Gyration"),
+		NTRANS("Gyration Eigenvalue 1"),
+		NTRANS("Gyration Eigenvalue 2"),
+		NTRANS("Gyration Eigenvalue 3")
+	};
+	COMPILE_ASSERT(THREEDEP_ARRAYSIZE(COL_NAMES) == STATS_COL_ENUM_END);
+
+	const size_t numCols=STATS_COL_ENUM_END+numIons;
+	const size_t firstPlot=plots.size();
+	plots.reserve(firstPlot+numCols);
+	for(size_t ui=0;ui<numCols;ui++)
+	{
+		PlotStreamData *p;
+		p=new PlotStreamData;
+		p->parent=this;
+		p->plotMode=PLOT_MODE_1D;
+		p->plotStyle=PLOT_LINE_POINTS;
+		p->xLabel=TRANS("Cluster Id");
+
+		string colName;
+		if(ui < STATS_COL_ENUM_END)
 		{
-			size_t curSize;
-			curSize=clusteredCore[ui].size() + clusteredBulk[ui].size();
-			if(countMap.find(curSize) ==countMap.end())
-				countMap.insert(make_pair(curSize,ionFreq));
+			colName=TRANS(COL_NAMES[ui]);
+			p->r=p->g=p->b=0.0f;
 		}
-
-		//Fill up the vectors by counting ions
-		for(size_t ui=0;ui<clusteredCore.size();ui++)
+		else
 		{
-			size_t curSize,offset;
-			curSize=clusteredCore[ui].size() + clusteredBulk[ui].size();
-			for(size_t uj=0;uj<clusteredCore[ui].size();uj++)
-			{
-				offset= rng->getIonID(clusteredCore[ui][uj].getMassToCharge());
-				countMap[curSize][offset]++;
-			}
-			
-			for(size_t uj=0;uj<clusteredBulk[ui].size();uj++)
-			{
-				offset= rng->getIonID(clusteredBulk[ui][uj].getMassToCharge());
-				countMap[curSize][offset]++;
-			}
+			//Colour species counts as per the range file
+			size_t ionId=ui-STATS_COL_ENUM_END;
+			colName=rng->getName(ionId);
+			RGBf ionColour;
+			ionColour=rng->getColour(ionId);
+			p->r=ionColour.red;
+			p->g=ionColour.green;
+			p->b=ionColour.blue;
 		}
+		p->yLabel=colName;
+		p->dataLabel=string(TRANS(CLUSTER_STATS_DATALABEL)) + string(":") + colName;
+		p->xyData.resize(clusters.size());
+		plots.push_back(p);
 	}
-	else
+
+	//Every cluster is listed. The id matches the output mass, if
+	// cluster ids are in use, and is the row for that cluster
+	#pragma omp parallel for
+	for(size_t ui=0;ui<clusters.size();ui++)
 	{
-		//Create entries of zero vectors for ion counting
-		for(size_t ui=0;ui<clusteredCore.size();ui++)
+		const size_t id= clusterIds.empty() ? ui : clusterIds[ui];
+		const ClusterShape &shape=shapes[ui];
+
+		float vals[STATS_COL_ENUM_END];
+		vals[STATS_COL_CORE]=clusters.coreSize(ui);
+		vals[STATS_COL_BULK]=clusters.bulkSize(ui);
+		for(unsigned int uj=0;uj<3;uj++)
 		{
-			size_t curSize;
-			curSize=clusteredCore[ui].size();
-			if(countMap.find(curSize) ==countMap.end())
-				countMap.insert(make_pair(curSize,ionFreq));
+			vals[STATS_COL_X+uj]=shape.centroid[uj];
+			vals[STATS_COL_G1+uj]=shape.gyrationVals[uj];
 		}
+		vals[STATS_COL_RG]=shape.radiusGyration;
 
-		//Now count the ions
-		for(size_t ui=0;ui<clusteredCore.size();ui++)
+		for(size_t uj=0;uj<numCols;uj++)
 		{
-			size_t curSize;
-			curSize=clusteredCore[ui].size();
-			for(size_t uj=0;uj<clusteredCore[ui].size();uj++)
-			{
-				size_t offset;
-				offset= rng->getIonID(clusteredCore[ui][uj].getMassToCharge());
-				
-				//this should not happen, as to cluster the ion,it must be ranged
-				ASSERT(offset!=(size_t)-1); 
-
-				countMap[curSize][offset]++;
-			}
+			float v;
+			if(uj < STATS_COL_ENUM_END)
+				v=vals[uj];
+			else
+				v=speciesCounts[ui*numIons+uj-STATS_COL_ENUM_END];
+			plots[firstPlot+uj]->xyData[id]=std::make_pair((float)id,v);
 		}
 	}
+
+	//Without a bulk, the bulk column is all zero
+	if(!clusters.hasBulk())
+	{
+		delete plots[firstPlot+STATS_COL_BULK];
+		plots.erase(plots.begin()+firstPlot+STATS_COL_BULK);
+	}
+}
+
+void ClusterAnalysisFilter::genCompositionVersusSize(const ClusterMembers &clusters,
+		const vector<size_t> &speciesCounts, const RangeFile *rng,vector<PlotStreamData *> &plots) const
+{
+	ASSERT(rng && haveRangeParent)
+
+	const size_t numIons=rng->getNumIons();
+	ASSERT(speciesCounts.size() == clusters.size()*numIons);
+
+	//Frequency of ions, as a function of composition.
+	//The inner vector<size_t> is the the array of frequencies
+	//for this particular sie for each ion (ie, the array is of size rng->getNumIons)
+	map<size_t,vector<size_t> > countMap;
+	vector<size_t> ionFreq;
+	ionFreq.resize(numIons,0);	
+	for(size_t ui=0;ui<clusters.size();ui++)
+	{
+		//Bulk size is zero, if there is no bulk
+		size_t curSize;
+		curSize=clusters.coreSize(ui) + clusters.bulkSize(ui);
+		map<size_t,vector<size_t> >::iterator it=countMap.find(curSize);
+		if(it ==countMap.end())
+			it=countMap.insert(make_pair(curSize,ionFreq)).first;
+
+		const size_t *freq=&speciesCounts[ui*numIons];
+		for(size_t uj=0;uj<numIons;uj++)
+			it->second[uj]+=freq[uj];
+	}
 	//-------
 
 	//Now that we have the freq table; we need to discard any elements that are not 
@@ -2920,160 +3557,22 @@ void ClusterAnalysisFilter::genCompositionVersusSize(const vector<vector<IonHit>
 //http://arc.nucapt.northwestern.edu/refbase/files/Sudbrack_Ph.D._thesis_2004_6MB.pdf 
 //============
 
-//un-normalised deviation matrix summation (L, equation A1.1)
-void computeMatrixEntries(const vector<IonHit> &atoms,const Point3D &clusterCentre,  gsl_matrix *m)
-{
-	//TODO: ASsert matrix is 3x3
-	//Fill the data array with deviation vectors
-	for(size_t ui=0;ui<atoms.size();ui++)
-	{
-		Point3D delta;
-		delta=atoms[ui].getPos() - clusterCentre;
-		//compute diagonal terms
-		for(size_t uj=0;uj<3;uj++)
-		{
-			//Stephenson matrix and sudbrack matrix dont match
-			// on main diagonal ?
-			// - stephenson matrix has error, as does sudbrack matrix (in writing, not code) 
-			unsigned int a,b;
-			a= (uj+1)%3; //for ui=0 [a b] <=>[y,z]; similarly,  {x,z}, {x,y}
-			b= (uj+2)%3;
-			
-			float v1,v2,vRes;	
-			v1 = delta[a];
-			v2 = delta[b];
-			vRes=v1*v1+v2*v2;
-			float v;
-			v=gsl_matrix_get(m,uj,uj);
-			v+=vRes;
-			gsl_matrix_set(m,uj,uj,v);
-		}
-
-		//compute off-diagonal terms. Note matrix is symmetric,
-		// so we only need to compute xy,xz and yz 
-		// Written equation in sudbrack thesis is incorrect, and mixes distance^4 and
-		// distance^2
-		float v;
-		//xy
-		v= gsl_matrix_get(m,0,1);
-		v-=delta[0]*delta[1];
-		gsl_matrix_set(m,0,1,v);
-		//xz
-		v= gsl_matrix_get(m,0,2);
-		v-=delta[0]*delta[2];
-		gsl_matrix_set(m,0,2,v);
-		//yz
-		v= gsl_matrix_get(m,1,2);
-		v-=delta[1]*delta[2];
-		gsl_matrix_set(m,1,2,v);
-
-	}
-
-
-	//Mirror the off-diagonal terms
-	float v;
-	//yx
-	v= gsl_matrix_get(m,0,1);
-	gsl_matrix_set(m,1,0,v);
-	//zx
-	v= gsl_matrix_get(m,0,2);
-	gsl_matrix_set(m,2,0,v);
-	//zy
-	v= gsl_matrix_get(m,1,2);
-	gsl_matrix_set(m,2,1,v);
-}
-
 // NOTE: This is not the enclosing ellipse. For that, see:
 // Nima Moshtagh - "MINIMUM VOLUME ENCLOSING ELLIPSOIDS", U.Penn. 
 // 10.1.1.116.7691.
-void ClusterAnalysisFilter::getEllipsoidalFit(const vector<IonHit> &coreAtoms, const vector<IonHit> &bulkAtoms,
-		std::pair< Point3D, vector<Point3D> > &ellipseData) 
+void ClusterAnalysisFilter::getEllipsoidalFit(const ClusterShape &shape,
+		std::pair< Point3D, vector<Point3D> > &ellipseData)
 {
-
-
-	
-	gsl_matrix *m = gsl_matrix_alloc(3,3);
-	gsl_matrix_set_zero(m);
-
-
-	Point3D clusterCentre;
-	if(bulkAtoms.size())
-	{	
-		//Compute the cluster's centre of mass (assuming unit mass per object)
-		//---
-		Point3D centroid[2];
-		IonHit::getCentroid(coreAtoms,centroid[0]);
-		IonHit::getCentroid(bulkAtoms,centroid[1]);
-
-		//compute overall centroid
-		float coreFactor,bulkFactor;
-		coreFactor = coreAtoms.size()/(float)(coreAtoms.size() + bulkAtoms.size());
-		bulkFactor = bulkAtoms.size()/(float)(coreAtoms.size() + bulkAtoms.size());
-		clusterCentre= centroid[0]*coreFactor + centroid[1]*bulkFactor;
-		//---
-	
-		//compute the components of the distance deviation matrix	
-		computeMatrixEntries(coreAtoms,clusterCentre,m);
-		computeMatrixEntries(bulkAtoms,clusterCentre,m);
-
-	}
-	else
-	{
-		IonHit::getCentroid(coreAtoms,clusterCentre);
-		computeMatrixEntries(coreAtoms,clusterCentre,m);
-	}	
-
-	//normalise matrix entries	
-	gsl_matrix_scale(m,1.0/(double)(coreAtoms.size() + bulkAtoms.size()));
-
-	//std::cerr << "Fit matrix is :" << std::endl;
-	//gslPrint(m);
-
-	//compute SVD to obtain eigenvalues
-	vector<float> vals;
-	vector<Point3D> pts;
-	computeEigenValues(m,3,3,vals,pts);
-
-	gsl_matrix_free(m);
-
-	//Convert eigenvalues to their positive form
-	 
-
-	//Check that the values are sorted in *descending* order (e1 >=e2 >=e3)
-	ASSERT(vals[0] >=vals[1] && vals[1]>=vals[2]);
-
-	//Convert to semi-axes of ellipse
-	ellipseData.second.resize(3,Point3D(0,0,0));
-
-	float semiAxes[3];
-	for(size_t ui=0;ui<3;ui++)
-	{
-		unsigned int a,b,c;
-		a=ui;
-		b=(ui+1)%3;
-		c=(ui+2)%3;
-
-	
-		if(vals[b] + vals[c] > vals[a])
-		{
-			//sudbrack's example code does something different to the equations, and multiples by 2,
-			// perhaps obtaining full diameter axis, rather than semi.
-			semiAxes[ui]=sqrt(5.0/2.0*(vals[b] + vals[c] - vals[a]));
-		}
-		else
-		{
-			WARN(true,"Imaginary semi axis value - zeroing");
-			semiAxes[ui] =0;
-		}
-	}
-
+	//The deviation matrix is N(tr(G)I - G), for gyration tensor G, so shares
+	// its eigenvectors, in reverse order. The semi-axis along each
+	// eigenvector is then sqrt(5*g), for gyration eigenvalue g
+	ellipseData.first=shape.centroid;
+	ellipseData.second.resize(3);
 	for(unsigned int ui=0;ui<3;ui++)
 	{
-		pts[ui]*=semiAxes[ui];
+		unsigned int idx=2-ui;
+		ellipseData.second[ui]=shape.gyrationAxes[idx]*sqrtf(5.0f*shape.gyrationVals[idx]);
 	}
-
-	ellipseData.first=clusterCentre;
-	ellipseData.second.swap(pts);
 }
 //============
 
@@ -3104,6 +3603,12 @@ bool isolatedClusterTest();
 //Test the core mode of the core-link clustering algorithm
 bool coreClusterTest();
 
+//Test clustering from the link distance hierarchy
+bool linkSweepTest();
+
+//Test the index-based cluster membership
+bool clusterMembersTest();
+
 
 //Unit tests
 bool ClusterAnalysisFilter::runUnitTests()
@@ -3113,8 +3618,16 @@ bool ClusterAnalysisFilter::runUnitTests()
 
 	if(!coreClusterTest())
 		return false;
-	if(!singularValueTest())
+	if(!linkSweepTest())
+		return false;
+	if(!postProcessCacheTest())
+		return false;
+	if(!clusterMembersTest())
+		return false;
+	if(!ellipsoidFitTest())
 		return false;	
+	if(!clusterStatsTest())
+		return false;
 	return true;
 }
 
@@ -3328,6 +3841,30 @@ bool isolatedClusterTest()
 	return true;
 }
 
+//True if the output ions are exactly the expected positions, in any order
+bool outputMatchesPositions(const IonStreamData *d, const vector<Point3D> &expected)
+{
+	if(d->data.size() != expected.size())
+		return false;
+
+	vector<bool> seen(expected.size(),false);
+	for(size_t ui=0;ui<d->data.size();ui++)
+	{
+		size_t uj;
+		for(uj=0;uj<expected.size();uj++)
+		{
+			if(!seen[uj] && d->data[ui].getPosRef() == expected[uj])
+				break;
+		}
+
+		if(uj == expected.size())
+			return false;
+		seen[uj]=true;
+	}
+
+	return true;
+}
+
 bool coreClusterTest()
 {
 	//Build some points to pass to the filter
@@ -3382,134 +3919,532 @@ bool coreClusterTest()
 	TEST(f->setProperty(KEY_WANT_CLUSTERSIZEDIST,"0",needUp),"Set prop");
 	TEST(f->setProperty(KEY_WANT_COMPOSITIONDIST,"0",needUp),"Set prop");
 	
+	//The A ion at (0,0,2) has no neighbour within the classification
+	// distance, so is moved from the core to the bulk. Add B ions
+	// after it in the input, one next to the first group and one far away
 	IonStreamData *ionData = genCoreTestCluster();
+	IonHit h;
+	h.setMassToCharge(2);
+	h.setPos(Point3D(1,1,0));
+	ionData->data.push_back(h);
+	h.setPos(Point3D(5,5,5));
+	ionData->data.push_back(h);
 
 	streamIn.push_back(ionData);
 
+	//Without bulk linking, only the classified core survives
+	vector<Point3D> expected;
+	expected.push_back(Point3D(0,0,0));
+	expected.push_back(Point3D(0,1,0));
+	expected.push_back(Point3D(1,0,0));
+	expected.push_back(Point3D(0,0,4));
+	expected.push_back(Point3D(0,-1,4));
+
 	//Do the refresh
 	ProgressData p;
 	TEST(!(f->refresh(streamIn,streamOut,p)),"Refresh err code");
+	TEST(streamOut.size() == 1,"stream count");
+	TEST(streamOut[0]->getStreamType() == STREAM_TYPE_IONS,"stream type");
+	{
+	auto_ptr<const IonStreamData> outD((const IonStreamData*)streamOut[0]);
+	TEST(outD->data.size() == 5,"Total Cluster size");
+	TEST(outputMatchesPositions(outD.get(),expected),"core cluster members");
+	}
+	streamOut.clear();
+
+	//With bulk linking, the rejected core ion and the nearby B ion
+	// are picked up as bulk
+	TEST(f->setProperty(KEY_BULKLINK,"2.05",needUp),"set bulk distance");
+	TEST(f->setProperty(KEY_BULKLINK_ENABLE,"1",needUp),"Enable bulk link");
+	expected.push_back(Point3D(0,0,2));
+	expected.push_back(Point3D(1,1,0));
+
+	TEST(!(f->refresh(streamIn,streamOut,p)),"Refresh err code");
+	TEST(streamOut.size() == 1,"stream count");
+	{
+	auto_ptr<const IonStreamData> outD((const IonStreamData*)streamOut[0]);
+	TEST(outD->data.size() == 7,"Total Cluster size, with bulk");
+	TEST(outputMatchesPositions(outD.get(),expected),"core and bulk cluster members");
+	}
+	streamOut.clear();
+
 	delete f;
 	delete ionData;
 	delete rng;
 
-	TEST(streamOut.size() == 1,"stream count");
+	return true;	
+}
 
-	const IonStreamData *outD=(const IonStreamData*)streamOut[0];;
-	TEST(streamOut[0]->getStreamType() == STREAM_TYPE_IONS,"stream type");
-	TEST(outD->data.size() == 5,"Total Cluster size");
+bool linkSweepTest()
+{
+	vector<const FilterStreamData*> streamIn,streamOut;
+	
+	RangeFile r;
+	RGBf filler;
+	filler.red=filler.green=filler.blue=0.5f;
+
+	unsigned int ionA;
+	std::string shortName,longName;
+	shortName="A"; longName="AType";
+	ionA=r.addIon(shortName,longName,filler);
+	r.addRange(0.5,1.5,ionA);
 
-	delete outD;
+	RangeStreamData *rng = new RangeStreamData;
+	rng->rangeFile=&r;
+	rng->parent=0;
+	rng->enabledIons.resize(r.getNumIons(),1);
+	rng->enabledRanges.resize(r.getNumRanges(),1);
+
+	ClusterAnalysisFilter *f=new ClusterAnalysisFilter;
+	f->setCaching(false);	
+	
+	streamIn.push_back(rng);
+	f->initFilter(streamIn,streamOut);
+	streamOut.clear();	
+	
+	bool needUp;
+	TEST(f->setProperty(KEY_CORE_OFFSET,"1",needUp),"Set core range");
+	TEST(f->setProperty(KEY_LINK_SWEEP,"1",needUp),"Enable link sweep");
+	TEST(f->setProperty(KEY_LINK_SWEEP_MAX,"2.5",needUp),"Set sweep distance");
+	TEST(f->setProperty(KEY_WANT_CLUSTERSIZEDIST,"0",needUp),"Set prop");
+	TEST(f->setProperty(KEY_WANT_COMPOSITIONDIST,"0",needUp),"Set prop");
+
+	//Groups of 3, 1 and 2 points, joined by links of length 2
+	IonStreamData *ionData = genCoreTestCluster();
+	streamIn.push_back(ionData);
+
+	//Cut the hierarchy at two distances. Cropping removes the single point
+	const char *LINK_DISTS[] = { "1.1", "2.5"};
+	const size_t OUTPUT_SIZES[] = {5,6};
+	TEST(f->setProperty(KEY_CROP_SIZE,"1",needUp),"Enable cropping");
+	TEST(f->setProperty(KEY_CROP_NMIN,"2",needUp),"Set min size");
+	for(size_t ui=0;ui<THREEDEP_ARRAYSIZE(LINK_DISTS);ui++)
+	{
+		TEST(f->setProperty(KEY_LINKDIST,LINK_DISTS[ui],needUp),"set link distance");
+
+		ProgressData p;
+		TEST(!(f->refresh(streamIn,streamOut,p)),"Refresh err code");
+		TEST(streamOut.size() == 2,"stream count");
+		TEST(streamOut[0]->getStreamType() == STREAM_TYPE_PLOT,"stream type");
+		TEST(streamOut[1]->getStreamType() == STREAM_TYPE_IONS,"stream type");
 
+		auto_ptr<const PlotStreamData> plot((const PlotStreamData*)streamOut[0]);
+		auto_ptr<const IonStreamData> outD((const IonStreamData*)streamOut[1]);
+		TEST(outD->data.size() == OUTPUT_SIZES[ui],"clustered ion count");
+
+		//Clusters of at least two points, for each link distance
+		for(size_t uj=0;uj<plot->xyData.size();uj++)
+		{
+			float d=plot->xyData[uj].first;
+			size_t expected;
+			if(d <=1.0f)
+				expected=0;
+			else if(d <=2.0f)
+				expected=2;
+			else
+				expected=1;
+			TEST(plot->xyData[uj].second == expected,"cluster count vs link distance");
+		}
+		streamOut.clear();
+	}
+
+	delete f;
+	delete ionData;
+	delete rng;
 
 	return true;	
 }
 
-bool ClusterAnalysisFilter::singularValueTest()
+bool ClusterAnalysisFilter::postProcessCacheTest()
 {
+	vector<const FilterStreamData*> streamIn,streamOut;
+	
+	RangeFile r;
+	RGBf filler;
+	filler.red=filler.green=filler.blue=0.5f;
 
-	gsl_matrix *m = gsl_matrix_alloc(3,3);
-	gsl_matrix_set(m,0,0,1);
-	gsl_matrix_set(m,0,1,3);
-	gsl_matrix_set(m,0,2,0);
+	unsigned int ionA;
+	std::string shortName,longName;
+	shortName="A"; longName="AType";
+	ionA=r.addIon(shortName,longName,filler);
+	r.addRange(0.5,1.5,ionA);
+
+	RangeStreamData *rng = new RangeStreamData;
+	rng->rangeFile=&r;
+	rng->parent=0;
+	rng->enabledIons.resize(r.getNumIons(),1);
+	rng->enabledRanges.resize(r.getNumRanges(),1);
+
+	//Filter owns its (cached) outputs. The reference filter
+	// always relinks, to obtain the expected output
+	ClusterAnalysisFilter *f=new ClusterAnalysisFilter;
+	ClusterAnalysisFilter *fRef=new ClusterAnalysisFilter;
+	f->setCaching(true);	
+	fRef->setCaching(false);	
+	
+	streamIn.push_back(rng);
+	f->initFilter(streamIn,streamOut);
+	streamOut.clear();	
+	fRef->initFilter(streamIn,streamOut);
+	streamOut.clear();	
 	
+	bool needUp;
+	ClusterAnalysisFilter *filters[2] = { f, fRef};
+	for(size_t ui=0;ui<2;ui++)
+	{
+		TEST(filters[ui]->setProperty(KEY_CORE_OFFSET,"1",needUp),"Set core range");
+		TEST(filters[ui]->setProperty(KEY_LINKDIST,"1.1",needUp),"set link distance");
+		TEST(filters[ui]->setProperty(KEY_WANT_CLUSTERSIZEDIST,"0",needUp),"Set prop");
+		TEST(filters[ui]->setProperty(KEY_WANT_COMPOSITIONDIST,"0",needUp),"Set prop");
+		TEST(filters[ui]->setProperty(KEY_CROP_SIZE,"1",needUp),"Enable cropping");
+	}
 
-	gsl_matrix_set(m,1,0,3);
-	gsl_matrix_set(m,1,1,-3);
-	gsl_matrix_set(m,1,2,2);
+	//Groups of 3, 1 and 2 points
+	IonStreamData *ionData = genCoreTestCluster();
+	streamIn.push_back(ionData);
 
-	gsl_matrix_set(m,2,0,0);
-	gsl_matrix_set(m,2,1,2);
-	gsl_matrix_set(m,2,2,3);
+	ProgressData p;
+	TEST(!(f->refresh(streamIn,streamOut,p)),"Refresh err code");
+	TEST(streamOut.size() == 1,"stream count");
+	TEST(((const IonStreamData*)streamOut[0])->data.size() == 6,"uncropped size");
+	TEST(f->clustersOK,"clusters kept");
+	streamOut.clear();
+
+	//Cropping is post-processing only, so must not relink
+	TEST(f->setProperty(KEY_CROP_NMIN,"3",needUp) && needUp,"Set min size");
+	TEST(fRef->setProperty(KEY_CROP_NMIN,"3",needUp),"Set min size");
+	TEST(f->clustersOK,"clusters kept after post-processing change");
+
+	ProgressData pReuse;
+	TEST(!(f->refresh(streamIn,streamOut,pReuse)),"Refresh err code");
+	TEST(pReuse.stepName.empty(),"post-processing refresh skips linking");
+	TEST(streamOut.size() == 1,"stream count");
+	//Output is owned by the filter's cache, and is replaced on next refresh
+	vector<IonHit> outReuse=((const IonStreamData*)streamOut[0])->data;
+	streamOut.clear();
 
-	vector<float> vals;
-	vector<Point3D> pts;
-	computeEigenValues(m,3,3,vals,pts);
-	gsl_matrix_free(m);
+	TEST(!(fRef->refresh(streamIn,streamOut,p)),"Refresh err code");
+	TEST(streamOut.size() == 1,"stream count");
+	auto_ptr<const IonStreamData> outRef((const IonStreamData*)streamOut[0]);
+	streamOut.clear();
 
-	TEST(vals.size() == pts.size(),"Vector sizes");
-	TEST(vals.size() == 3,"vector size");
+	//Reused clusters must match those from a full relink
+	TEST(outReuse.size() == 3 && outRef->data.size() == 3,"cropped size");
+	for(size_t ui=0;ui<outRef->data.size();ui++)
+	{
+		bool found=false;
+		for(size_t uj=0;uj<outReuse.size() && !found;uj++)
+			found=(outReuse[uj].getPosRef() == outRef->data[ui].getPosRef());
+		TEST(found,"reused cluster matches relinked cluster");
+	}
 
-	//check eigen values, sorted in desc. order
-	TEST(EQ_TOL(vals[0] ,4.0) ,"Correct eigen value");
-	TEST(EQ_TOL(vals[1] ,2.0) ,"Correct eigen value");
-	TEST(EQ_TOL(vals[2] ,-5.000),"Correct eigen value");
+	//Changing the link distance relinks
+	TEST(f->setProperty(KEY_LINKDIST,"2.5",needUp) && needUp,"set link distance");
+	TEST(!f->clustersOK,"link change discards clusters");
+	TEST(!(f->refresh(streamIn,streamOut,p)),"Refresh err code");
+	TEST(streamOut.size() == 1,"stream count");
+	TEST(((const IonStreamData*)streamOut[0])->data.size() == 6,"relinked size");
+	TEST(f->clustersOK,"relinked clusters kept");
+	streamOut.clear();
+
+	//Upstream may change its output without clearing our cache
+	// (eg random sampling). Spread the input out, so that the stale
+	// clusters would survive cropping, but relinked clusters would not
+	for(size_t ui=0;ui<ionData->data.size();ui++)
+		ionData->data[ui].setPos(ionData->data[ui].getPos()*10.0f);
+	TEST(f->setProperty(KEY_CROP_NMIN,"2",needUp) && needUp,"Set min size");
+	TEST(!(f->refresh(streamIn,streamOut,p)),"Refresh err code");
+	TEST(streamOut.empty(),"changed input relinks");
 
+	delete f;
+	delete fRef;
+	delete ionData;
+	delete rng;
+
+	return true;	
+}
 
-	pts.clear();
+bool clusterMembersTest()
+{
+	//Two ion streams, joined by the view
+	IonStreamData *a = new IonStreamData;
+	IonStreamData *b = new IonStreamData;
+	for(unsigned int ui=0;ui<3;ui++)
+		a->data.push_back(IonHit(Point3D(ui,0,0),1));
+	for(unsigned int ui=3;ui<7;ui++)
+		b->data.push_back(IonHit(Point3D(ui,0,0),1));
+
+	vector<const FilterStreamData*> streamIn;
+	streamIn.push_back(a);
+	streamIn.push_back(b);
+
+	InputIonView ions;
+	ions.init(streamIn);
+	TEST(ions.size() == 7,"view size");
+	for(unsigned int ui=0;ui<ions.size();ui++)
+	{
+		TEST(ions[ui].getPosRef()[0] == (float)ui,"view order");
+	}
 
-	//check the matrix makes sense
-	vector<IonHit> ionVec;
-	ionVec.push_back(IonHit(Point3D(0,0,1),1));	
-	ionVec.push_back(IonHit(Point3D(0,0,-1),1));
-	ionVec.push_back(IonHit(Point3D(1,0,0),1));	
-	ionVec.push_back(IonHit(Point3D(-1,0,0),1));
-	ionVec.push_back(IonHit(Point3D(0,1,0),1));	
-	ionVec.push_back(IonHit(Point3D(0,-1,0),1));
+	//Three clusters, of core sizes 2, 1 and 3,
+	// and bulk sizes 1, 0 and 0
+	ClusterMembers c;
+	size_t coreIdx[]={0,4,2,1,5,6};
+	size_t coreStart[]={0,2,3,6};
+	size_t bulkStart[]={0,1,1,1};
+	c.core.assign(coreIdx,coreIdx+6);
+	c.coreStart.assign(coreStart,coreStart+4);
+	c.bulk.push_back(3);
+	c.bulkStart.assign(bulkStart,bulkStart+4);
+	TEST(c.size() == 3 && c.coreSize(2) == 3 && c.bulkSize(0) == 1,"cluster sizes");
+
+	//Dropping the middle cluster keeps the order of the others
+	vector<char> keep(3,1);
+	keep[1]=0;
+	c.select(keep);
+	TEST(c.size() == 2 && c.hasBulk(),"selected count");
+	TEST(c.coreSize(0) == 2 && c.coreSize(1) == 3,"selected core sizes");
+	TEST(c.core[2] == 1 && c.core[4] == 6,"selected core members");
+	TEST(c.bulkSize(0) == 1 && c.bulkSize(1) == 0 && c.bulk[0] == 3,"selected bulk");
+
+	keep.assign(2,0);
+	c.select(keep);
+	TEST(!c.size() && c.core.empty() && c.bulk.empty(),"select none");
+
+	delete a;
+	delete b;
+	return true;
+}
 
-	m = gsl_matrix_alloc(3,3);
-	gsl_matrix_set_zero(m);
-	computeMatrixEntries(ionVec,Point3D(0,0,0),m);
-	//gslPrint(m);
-	gsl_matrix_free(m);
+bool ClusterAnalysisFilter::ellipsoidFitTest()
+{
+	//Check the eigen-solver against a matrix with known eigenvalues
 	{
-	vector<IonHit> dummy;
-	pair<Point3D, vector<Point3D> > resultEllipse;
-	getEllipsoidalFit(ionVec,dummy, resultEllipse);
-	for(size_t ui=0;ui<resultEllipse.second.size() ;ui++)
+	const double mat[9]={1,3,0, 3,-3,2, 0,2,3};
+	double vals[3],vecs[9];
+	symmetricEigen3(mat,vals,vecs);
+	TEST(EQ_TOL(vals[0],4.0) && EQ_TOL(vals[1],2.0) && EQ_TOL(vals[2],-5.0),"Jacobi eigenvalues");
+	for(unsigned int ui=0;ui<3;ui++)
 	{
-		ASSERT(EQ_TOL(resultEllipse.second[ui].sqrMag(), 5.0/2.0*2.0/3.0));
-		
+		for(unsigned int uj=0;uj<3;uj++)
+		{
+			double mv=0;
+			for(unsigned int uk=0;uk<3;uk++)
+				mv+=mat[3*uj+uk]*vecs[3*ui+uk];
+			TEST(fabs(mv - vals[ui]*vecs[3*ui+uj]) < 1e-6,"Jacobi eigenvector");
+		}
 	}
 	}
-	ionVec.clear();
-	pts.clear();
 
-	//generate some random points in an ellipse
-	RandNumGen rng;
-	rng.initTimer();
+	//A diagonal matrix needs no rotation, and keeps repeated eigenvalues
+	{
+	const double mat[9]={2,0,0, 0,5,0, 0,0,2};
+	double vals[3],vecs[9];
+	symmetricEigen3(mat,vals,vecs);
+	TEST(vals[0] == 5.0 && vals[1] == 2.0 && vals[2] == 2.0,"diagonal eigenvalues");
+	TEST(fabs(vecs[1]) == 1.0,"diagonal eigenvector");
+	}
 
+	//Known-answer ellipsoids, rotated about z by ANGLE and offset. Semi-axes
+	// are along x, y and z before rotation, and are given in ascending order,
+	// as for getEllipsoidalFit
+	const float ANGLE=0.5f;
+	const float C=cos(ANGLE),S=sin(ANGLE);
+	const Point3D OFFSET(10,20,30);
 	const float SEMI_AXIS[] = {1,2,3};
-	const unsigned int NUM_PTS = 10000;
-	
-	
-	Point3D p;
-	while(ionVec.size() < NUM_PTS)	
+
+	enum
+	{
+		ELLIPSOID_OCTAHEDRON,
+		ELLIPSOID_LATTICE,
+		ELLIPSOID_ENUM_END
+	};
+
+	IonStreamData *d = new IonStreamData;
+	vector<size_t> start;
+	for(unsigned int shape=0;shape<ELLIPSOID_ENUM_END;shape++)
 	{
+		start.push_back(d->data.size());
+		vector<Point3D> pts;
+		switch(shape)
+		{
+			case ELLIPSOID_OCTAHEDRON:
+			{
+				//Vertices at +-a along each axis. The gyration tensor 
+				// is exactly diag(a^2/3), so the fit gives a*sqrt(5/3)
+				for(unsigned int ui=0;ui<3;ui++)
+				{
+					Point3D p(0,0,0);
+					p[ui]=SEMI_AXIS[ui];
+					pts.push_back(p);
+					pts.push_back(-p);
+				}
+				break;
+			}
+			case ELLIPSOID_LATTICE:
+			{
+				//Regular lattice filling the ellipsoid. A solid ellipsoid
+				// has gyration eigenvalues a^2/5, so the fit gives a
+				const float STEP=0.04f;
+				const int N=(int)(1.0f/STEP);
+				for(int ui=-N;ui<=N;ui++)
+				{
+					for(int uj=-N;uj<=N;uj++)
+					{
+						for(int uk=-N;uk<=N;uk++)
+						{
+							Point3D u(ui*STEP,uj*STEP,uk*STEP);
+							if(u.sqrMag() > 1.0f)
+								continue;
+							pts.push_back(Point3D(u[0]*SEMI_AXIS[0],u[1]*SEMI_AXIS[1],
+										u[2]*SEMI_AXIS[2]));
+						}
+					}
+				}
+				break;
+			}
+			default:
+				ASSERT(false);
+		}
 
-		float f[3];
-		for(unsigned int ui=0;ui<3;ui++)
+		for(size_t ui=0;ui<pts.size();ui++)
 		{
-			f[ui]=rng.genUniformDev()-0.5f;
-			ASSERT(f[ui] <0.51 && f[ui] >-0.51);
+			const Point3D &p=pts[ui];
+			d->data.push_back(IonHit(Point3D(C*p[0]-S*p[1],S*p[0]+C*p[1],p[2]) + OFFSET,1));
 		}
-	      //generate some random points, then check for inside ellipse
-		p = Point3D(2.0*SEMI_AXIS[0]*f[0], 2.0*SEMI_AXIS[1]*f[1],
-				2.0*SEMI_AXIS[2]*f[2]);
+	}
+	start.push_back(d->data.size());
 
-		//check if the pt is outside the ellipsoid
-		Point3D ellipsePt;
-		for(size_t ui=0;ui<3;ui++)
-			ellipsePt[ui]=p[ui]/SEMI_AXIS[ui];
+	vector<const FilterStreamData*> streamIn;
+	streamIn.push_back(d);
+	InputIonView ions;
+	ions.init(streamIn);
 
-		if( ellipsePt.sqrMag() < 1.0f)
-			ionVec.push_back(IonHit(p,1.0));
-	}
+	ClusterMembers clusters;
+	for(size_t ui=0;ui<d->data.size();ui++)
+		clusters.core.push_back(ui);
+	clusters.coreStart=start;
 
-	IonHit::makePos(ionVec,"test-ellipsoid.pos");
+	ClusterAnalysisFilter f;
+	vector<ClusterShape> shapes;
+	vector<size_t> counts;
+	ProgressData p;
+	TEST(!f.clusterStatistics(clusters,ions,0,true,shapes,counts,p),"cluster statistics");
+	TEST(shapes.size() == ELLIPSOID_ENUM_END && counts.empty(),"statistics sizes");
 
+	const float AXIS_SCALE[ELLIPSOID_ENUM_END] = { sqrtf(5.0f/3.0f), 1.0f};
+	const float AXIS_TOL[ELLIPSOID_ENUM_END] = { 1e-4f, 0.02f};
+	for(unsigned int shape=0;shape<ELLIPSOID_ENUM_END;shape++)
+	{
+		pair<Point3D, vector<Point3D> > fit;
+		getEllipsoidalFit(shapes[shape],fit);
+		TEST(fit.first.sqrDist(OFFSET) < 1e-6f,"ellipsoid centre");
+		TEST(fit.second.size() == 3,"semi-axis count");
 
-	//Run the ellipsoidal fit. This will crash if any NaNs or imag. values
-	// are generated.
-	vector<IonHit> dummy;
-	pair<Point3D, vector<Point3D> > resultEllipse;
-	getEllipsoidalFit(ionVec,dummy, resultEllipse);
+		//Rotated unit axes, in ascending semi-axis order
+		const Point3D AXES[3] = { Point3D(C,S,0), Point3D(-S,C,0), Point3D(0,0,1)};
+		for(unsigned int ui=0;ui<3;ui++)
+		{
+			float len=sqrtf(fit.second[ui].sqrMag());
+			TEST(fabs(len - SEMI_AXIS[ui]*AXIS_SCALE[shape]) < AXIS_TOL[shape]*SEMI_AXIS[ui],
+				"semi-axis length");
+			TEST(fabs(fabs(fit.second[ui].dotProd(AXES[ui])) - len) < 1e-3f*len,"semi-axis direction");
+		}
+	}
 
-	for(size_t ui=0;ui<3;ui++)
+	delete d;
+	return true;
+}
+
+bool ClusterAnalysisFilter::clusterStatsTest()
+{
+	//Two species, and a tilted ellipsoid with a small cluster beside it
+	RangeFile r;
+	RGBf filler;
+	filler.red=filler.green=filler.blue=0.5f;
+	std::string shortName,longName;
+	shortName="A"; longName="AType";
+	r.addRange(0.5,1.5,r.addIon(shortName,longName,filler));
+	shortName="B"; longName="BType";
+	r.addRange(1.5,2.5,r.addIon(shortName,longName,filler));
+
+	RandNumGen rng;
+	rng.initialise(1234);
+	IonStreamData *d = new IonStreamData;
+	const float SEMI_AXIS[] = {1,2,3};
+	const float C=cos(0.5f),S=sin(0.5f);
+	while(d->data.size() < 5000)
 	{
-		TEST(fabs(sqrtf(resultEllipse.second[ui].sqrMag()) -SEMI_AXIS[ui]) < 0.25f,"Semi axes retrieval");
+		Point3D p;
+		for(unsigned int ui=0;ui<3;ui++)
+			p[ui]=2.0f*SEMI_AXIS[ui]*(rng.genUniformDev()-0.5f);
+		if(Point3D(p[0]/SEMI_AXIS[0],p[1]/SEMI_AXIS[1],p[2]/SEMI_AXIS[2]).sqrMag() >= 1.0f)
+			continue;
+		//Rotate about z, and offset
+		p=Point3D(C*p[0]-S*p[1],S*p[0]+C*p[1],p[2]) + Point3D(10,20,30);
+		d->data.push_back(IonHit(p,(d->data.size()%3) ? 1 : 2));
 	}
+	for(unsigned int ui=0;ui<4;ui++)
+		d->data.push_back(IonHit(Point3D(ui,0,-10),2));
+
+	vector<const FilterStreamData*> streamIn;
+	streamIn.push_back(d);
+	InputIonView ions;
+	ions.init(streamIn);
+
+	//Ellipsoid as core, with its last 1000 ions as bulk
+	ClusterMembers clusters;
+	clusters.coreStart.push_back(0);
+	clusters.bulkStart.push_back(0);
+	for(size_t ui=0;ui<4000;ui++)
+		clusters.core.push_back(ui);
+	clusters.coreStart.push_back(clusters.core.size());
+	for(size_t ui=4000;ui<5000;ui++)
+		clusters.bulk.push_back(ui);
+	clusters.bulkStart.push_back(clusters.bulk.size());
+	for(size_t ui=5000;ui<5004;ui++)
+		clusters.core.push_back(ui);
+	clusters.coreStart.push_back(clusters.core.size());
+	clusters.bulkStart.push_back(clusters.bulk.size());
+
+	ClusterAnalysisFilter f;
+	vector<ClusterShape> shapes;
+	vector<size_t> counts;
+	ProgressData p;
+	TEST(!f.clusterStatistics(clusters,ions,&r,true,shapes,counts,p),"cluster statistics");
+	TEST(shapes.size() == 2 && counts.size() == 4,"statistics sizes");
+
+	//Species counts
+	size_t nB=0;
+	for(size_t ui=0;ui<5000;ui++)
+		nB+=(ui%3) ? 0 : 1;
+	TEST(counts[0] == 5000-nB && counts[1] == nB,"ellipsoid species counts");
+	TEST(counts[2] == 0 && counts[3] == 4,"small cluster species counts");
+
+	//Compare to a direct centroid and radius of gyration. Core and
+	// bulk ions both count
+	Point3D centroid;
+	vector<IonHit> members(d->data.begin(),d->data.begin()+5000);
+	IonHit::getCentroid(members,centroid);
+	TEST(centroid.sqrDist(shapes[0].centroid) < 1e-6f,"centroid");
+
+	pair<Point3D, vector<Point3D> > fit;
+	getEllipsoidalFit(shapes[0],fit);
+	for(unsigned int ui=0;ui<3;ui++)
+		TEST(fabs(sqrtf(fit.second[ui].sqrMag()) - SEMI_AXIS[ui]) < 0.25f,"semi-axis retrieval");
+	//Largest axis is z; the others are rotated about it
+	TEST(fabs(shapes[0].gyrationAxes[0][2]) > 0.99f,"major axis");
+	TEST(fabs(shapes[0].gyrationAxes[1][0]*C + shapes[0].gyrationAxes[1][1]*S) < 0.1f,"rotated axis");
+
+	double sumSqr=0;
+	for(size_t ui=0;ui<5000;ui++)
+		sumSqr+=d->data[ui].getPosRef().sqrDist(shapes[0].centroid);
+	TEST(fabs(shapes[0].radiusGyration - sqrt(sumSqr/5000.0)) < 1e-3f,"radius of gyration");
+
+	//A line of points has one non-zero eigenvalue
+	TEST(EQ_TOL(shapes[1].gyrationVals[0],1.25f) && shapes[1].gyrationVals[1] < 1e-5f,"line eigenvalues");
 
+	delete d;
 	return true;
 }
 
@@ -21,12 +21,72 @@
 #include "../../common/translation.h"
 
 #include "algorithms/K3DTree-mk2.h"
+#include "algorithms/linkClustering.h"
 
 #include <map>
 #include <vector>
 
 
 
+//!Read-only view of the ions in a filter's input, as if the ion streams were
+// joined in order. Ions are not copied
+class InputIonView
+{
+	private:
+		std::vector<const IonStreamData *> streams;
+		//!Index of the first ion of each stream, with a final entry
+		// holding the total number of ions
+		std::vector<size_t> streamStart;
+	public:
+		//!Use the ion streams in the given input
+		void init(const std::vector<const FilterStreamData *> &dataIn);
+		//!Total number of ions
+		size_t size() const { return streamStart.empty() ? 0 : streamStart.back();}
+		//!Obtain the ion with the given (joined) index
+		const IonHit &operator[](size_t idx) const;
+		//!Order-dependent fingerprint of the positions of all ions
+		unsigned long long fingerprint() const;
+};
+
+//!Cluster membership, in compressed-row form. The core ions of cluster i are
+// core[coreStart[i]] to core[coreStart[i+1]-1], and likewise for the bulk.
+// Ions are given by their index in the input (see InputIonView)
+class ClusterMembers
+{
+	public:
+		//!Input indices of the core and bulk ions, grouped by cluster
+		std::vector<size_t> core,bulk;
+		//!Offset of each cluster's first core and bulk ion, with a final entry
+		// holding the total. bulkStart is empty if there is no bulk
+		std::vector<size_t> coreStart,bulkStart;
+
+		//!Number of clusters
+		size_t size() const { return coreStart.empty() ? 0 : coreStart.size()-1;}
+		bool hasBulk() const { return !bulkStart.empty();}
+		//!Number of core and bulk ions in the given cluster
+		size_t coreSize(size_t cluster) const { return coreStart[cluster+1]-coreStart[cluster];}
+		size_t bulkSize(size_t cluster) const 
+			{ return hasBulk() ? bulkStart[cluster+1]-bulkStart[cluster] : 0;}
+
+		void clear();
+		//!Keep only the clusters for which keep is nonzero, retaining their order
+		void select(const std::vector<char> &keep);
+};
+
+//!Shape of a single cluster
+class ClusterShape
+{
+	public:
+		//!Centre of mass, assuming unit mass per ion
+		Point3D centroid;
+		//!Eigenvalues of the gyration tensor, in descending order
+		float gyrationVals[3];
+		//!Unit eigenvectors of the gyration tensor, one per eigenvalue
+		Point3D gyrationAxes[3];
+		//!Radius of gyration
+		float radiusGyration;
+};
+
 //!Cluster analysis filter
 class ClusterAnalysisFilter : public Filter
 {
@@ -45,6 +105,28 @@ class ClusterAnalysisFilter : public Filter
 		unsigned int coreKNN;
 		//Link distance for core
 		float linkDist;
+
+		//Compute the single-linkage hierarchy of the core, to
+		// show the number of clusters for every link distance
+		bool wantLinkSweep;
+		//Largest link distance held in the hierarchy
+		float maxSweepLinkDist;
+
+		//Cached single-linkage hierarchy of the core points (in core tree order),
+		// which does not depend upon the link distance
+		bool linkTreeOK;
+		std::vector<LinkEdge> linkTreeEdges;
+		size_t linkTreeNumPts;
+		//Fingerprint of the core points the hierarchy was built from
+		unsigned long long linkTreeFingerprint;
+
+		//Cached clusters, prior to size cropping, for reuse when
+		// only post-processing options change
+		bool clustersOK;
+		ClusterMembers cachedClusters;
+		//Number of input ions, and their fingerprint, for the cached clusters
+		size_t clustersNumIons;
+		unsigned long long clustersFingerprint;
 		
 		//Enable bulk linking step
 		bool enableBulkLink;
@@ -73,6 +155,9 @@ class ClusterAnalysisFilter : public Filter
 		//Do we want a morphological analysis
 		bool wantClusterMorphology;
 
+		//Do we want a per-cluster statistics table
+		bool wantClusterStats;
+
 		//!Do we have range data to use 
 		bool haveRangeParent;
 		//!The names of the incoming ions
@@ -82,17 +167,32 @@ class ClusterAnalysisFilter : public Filter
 		std::vector<bool> ionCoreEnabled,ionBulkEnabled;
 
 
-		unsigned int buildKDTrees(std::vector<IonHit> &coreIons, std::vector<IonHit> &bulkIons,K3DTreeMk2 &coreTree,K3DTreeMk2 &bulkTree, ProgressData &prog) const;
+		//Build the core and bulk trees, reclassifying core ions as needed. The
+		// input index of each ion (coreSource/bulkSource) is moved with it
+		unsigned int buildKDTrees(std::vector<IonHit> &coreIons,std::vector<IonHit> &bulkIons,
+				std::vector<size_t> &coreSource, std::vector<size_t> &bulkSource,
+				const K3DTreeMk2 *&coreTree,const K3DTreeMk2 *&bulkTree, ProgressData &prog) const;
+
+		//Erase the cached output and clusters, but keep the core linkage hierarchy
+		void clearClusterCache();
+
+		//Release the core linkage hierarchy
+		void clearLinkTree();
+
+		//As applyPropertyNow, but only erasing the cached output, as the property
+		// is used in post-processing the clusters
+		bool applyPostProcessProperty(bool &prop, const std::string &value, bool &needUpdate);
 
 		//Do cluster refresh using Link Algorithm (Core + max sep)
 		unsigned int refreshLinkClustering(const std::vector<const FilterStreamData *> &dataIn,
-				std::vector< std::vector<IonHit> > &clusteredCore, 
-				std::vector<std::vector<IonHit>  > &clusteredBulk,ProgressData &progress);
+				ClusterMembers &clusters, ProgressData &progress);
 
 
-		//Helper function to create core and bulk std::vectors of ions from input ionstreams
+		//Helper function to create core and bulk std::vectors of ions from input ionstreams,
+		// and the input (InputIonView) index of each
 		void createRangedIons(const std::vector<const FilterStreamData *> &dataIn,
 						std::vector<IonHit> &core,std::vector<IonHit> &bulk,
+						std::vector<size_t> &coreSource, std::vector<size_t> &bulkSource,
 					       		ProgressData &p) const;
 
 
@@ -103,33 +203,52 @@ class ClusterAnalysisFilter : public Filter
 					std::map<size_t,size_t> &rangeEnabledMap);
 
 		//Strip out clusters with a given number of elements
-		bool stripClusterBySize(std::vector<std::vector<IonHit> > &clusteredCore,
-						std::vector<std::vector<IonHit> > &clusteredBulk,
-							bool countBulk,
+		bool stripClusterBySize(ClusterMembers &clusters, bool countBulk,
 							ProgressData &p) const;
+		//Build a plot of the number of clusters as a function of link distance,
+		// from the cached hierarchy
+		PlotStreamData *clusterCountVsLinkDist() const;
+
 		//Build a plot that is the cluster size distribution as a function of cluster size
-		PlotStreamData *clusterSizeDistribution(const std::vector<std::vector<IonHit> > &solutes, 
-						const std::vector<std::vector<IonHit> > &matrix) const;
+		PlotStreamData *clusterSizeDistribution(const ClusterMembers &clusters) const;
 
 
 		//Build plots that are the cluster size distribution as
 		// a function of cluster size, specific to each ion type.
-		void genCompositionVersusSize(const std::vector<std::vector<IonHit> > &clusteredCore,
-				const std::vector<std::vector<IonHit> > &clusteredBulk, const RangeFile *rng,
+		void genCompositionVersusSize(const ClusterMembers &clusters,
+				const std::vector<size_t> &speciesCounts, const RangeFile *rng,
 							std::vector<PlotStreamData *> &plots) const;
 
+		//Compute the shape (if wantShape) and the species counts (if rng is nonzero)
+		// of every cluster, in parallel. speciesCounts receives rng->getNumIons()
+		// entries per cluster. Returns 0, or an error code
+		unsigned int clusterStatistics(const ClusterMembers &clusters, const InputIonView &ions,
+				const RangeFile *rng, bool wantShape, std::vector<ClusterShape> &shapes,
+				std::vector<size_t> &speciesCounts, ProgressData &progress) const;
+
+		//Build the per-cluster statistics table, as one plot per column,
+		// with a point for every cluster against its id
+		void clusterStatsPlots(const ClusterMembers &clusters, const std::vector<ClusterShape> &shapes,
+				const std::vector<size_t> &speciesCounts, const std::vector<size_t> &clusterIds,
+				const RangeFile *rng, std::vector<PlotStreamData *> &plots) const;
+
 #ifdef DEBUG
-		bool paranoidDebugAssert(const std::vector<std::vector<IonHit > > &core, 
-				const std::vector<std::vector<IonHit> > &bulk) const;
+		bool paranoidDebugAssert(const ClusterMembers &clusters, const InputIonView &ions) const;
 		
-		//Check to see if the singular value routine is working
-		static bool singularValueTest(); 
+		//Check the eigen-solver and ellipsoid fit against known answers
+		static bool ellipsoidFitTest(); 
 
-#endif
-		///Find the best fit ellipse, per Karnesky et al to a set of IonHit events. Returned values are a pair : [ centroid, vector<semiaxes of ellipse> ]
-		static void getEllipsoidalFit(const std::vector<IonHit> &coreAtoms, const std::vector<IonHit> &bulkAtoms,
+		//Check the batched cluster statistics against the per-cluster fit
+		static bool clusterStatsTest(); 
 
-		std::pair< Point3D, std::vector<Point3D> > &ellipseData);
+		//Check that post-processing changes reuse the cached clusters
+		static bool postProcessCacheTest();
+
+#endif
+		///Find the best fit ellipse, per Karnesky et al, from the cluster's shape statistics.
+		/// Returned values are a pair : [ centroid, vector<semiaxes of ellipse> ]
+		static void getEllipsoidalFit(const ClusterShape &shape,
+			std::pair< Point3D, std::vector<Point3D> > &ellipseData);
 	public:
 		ClusterAnalysisFilter(); 
 		//!Duplicate filter contents, excluding cache.
@@ -139,6 +258,9 @@ class ClusterAnalysisFilter : public Filter
 		virtual void initFilter(const std::vector<const FilterStreamData *> &dataIn,
 				std::vector<const FilterStreamData *> &dataOut);
 
+		//!Erase the cached output, clusters and core hierarchy
+		virtual void clearCache();
+
 		//!Returns -1, as range file cache size is dependant upon input.
 		virtual size_t numBytesForCache(size_t nObjects) const;
 		//!Returns FILTER_TYPE_SPATIAL_ANALYSIS
@@ -23,6 +23,7 @@
 #include "../../wx/wxcommon.h"
 
 #include "filterCommon.h"
+#include "algorithms/spaceFillingCurve.h"
 
 
 #include "backend/APT/APTFileIO.h"
@@ -75,7 +76,7 @@ const char *DEFAULT_LABEL="Mass-to-Charge (Da/e)";
 DataLoadFilter::DataLoadFilter() : fileType(FILEDATA_TYPE_POS), doSample(true), maxIons(MAX_IONS_LOAD_DEFAULT),
 	rgbaf(1.0f,0.0f,0.0f,1.0f),ionSize(2.0f), numColumns(4), enabled(true),
 	volumeRestrict(false), monitorTimestamp(-1),monitorSize((size_t)-1),wantMonitor(false),
-	valueLabel(TRANS(DEFAULT_LABEL)), endianMode(0)
+	valueLabel(TRANS(DEFAULT_LABEL)), endianMode(0), spatialOrder(SPATIAL_ORDER_NONE)
 {
 	COMPILE_ASSERT(THREEDEP_ARRAYSIZE(AVAILABLE_FILEDATA_TYPES) == FILEDATA_TYPE_ENUM_END);
 	cache=true;
@@ -116,6 +117,7 @@ Filter *DataLoadFilter::cloneUncached() const
 
 	p->wantMonitor=wantMonitor;
 	p->numColumns=numColumns;
+	p->spatialOrder=spatialOrder;
 
 	return p;
 }
@@ -273,7 +275,10 @@ unsigned int DataLoadFilter::refresh(const std::vector<const FilterStreamData *>
 
 	progress.step=1;
 	progress.stepName=TRANS("Reading File");
-	progress.maxStep=1;
+	if(spatialOrder == SPATIAL_ORDER_NONE)
+		progress.maxStep=1;
+	else
+		progress.maxStep=2;
 
 	unsigned int uiErr;	
 	switch(fileType)
@@ -462,6 +467,30 @@ unsigned int DataLoadFilter::refresh(const std::vector<const FilterStreamData *>
 			       "(magnitude too large). Consider rescaling data before loading"));
 	}
 
+	//Sort the ions along a space filling curve, so that ions that are
+	// close in space are also close in memory
+	if(spatialOrder != SPATIAL_ORDER_NONE)
+	{
+		progress.step=2;
+		progress.stepName=TRANS("Reorder");
+		progress.filterProgress=0;
+		switch(spatialReorder(ionData->data,spatialOrder,dataCube,
+				progress.filterProgress,*Filter::wantAbort))
+		{
+			case 0:
+				break;
+			case SFC_ERR_MEMALLOC:
+				delete ionData;
+				errStr=TRANS("Insufficient memory to reorder ions along space filling curve");
+				return POS_ALLOC_FAIL;
+			default:
+				delete ionData;
+				errStr=TRANS(POS_ERR_STRINGS[POS_ABORT_FAIL]);
+				return POS_ABORT_FAIL;
+		}
+		ionData->spatialOrder=spatialOrder;
+	}
+
 	cacheAsNeeded(ionData);
 
 	//Append the ion data 
@@ -632,6 +661,16 @@ void DataLoadFilter::getProperties(FilterPropGroup &propertyList) const
 			}
 		}
 
+		vector<pair<unsigned int,string> > orderChoices;
+		for(unsigned int ui=0;ui<SPATIAL_ORDER_ENUM_END;ui++)
+			orderChoices.push_back(make_pair(ui,TRANS(SPATIAL_ORDER_STRING[ui])));
+		p.name=TRANS("Spatial order");
+		p.data=choiceString(orderChoices,spatialOrder);
+		p.type=PROPERTY_TYPE_CHOICE;
+		p.helpText=TRANS("Reorder loaded points along a space filling curve, to speed up spatial analyses");
+		p.key=DATALOAD_KEY_SPATIAL_ORDER;
+		propertyList.addProperty(p,curGroup);
+
 		stream_cast(tmpStr,wantMonitor);
 		p.name=TRANS("Monitor");
 		p.data=tmpStr;
@@ -943,6 +982,27 @@ bool DataLoadFilter::setProperty(  unsigned int key,
 			needUpdate=true;
 			break;
 		}
+		case DATALOAD_KEY_SPATIAL_ORDER:
+		{
+			unsigned int ltmp;
+			ltmp=(unsigned int)-1;
+			
+			for(unsigned int ui=0;ui<SPATIAL_ORDER_ENUM_END; ui++)
+			{
+				if(TRANS(SPATIAL_ORDER_STRING[ui]) == value)
+				{
+					ltmp=ui;
+					break;
+				}
+			}
+			if(ltmp == (unsigned int) -1 || ltmp == spatialOrder)
+				return false;
+
+			spatialOrder=ltmp;
+			clearCache();
+			needUpdate=true;
+			break;
+		}
 		default:
 			ASSERT(false);
 			break;
@@ -1123,6 +1183,18 @@ bool DataLoadFilter::readState(xmlNodePtr &nodePtr, const std::string &stateFile
 		return false;
 	//--
 
+	//Retrieve spatial ordering, if present (not in older files)
+	//--
+	nodeTmp=nodePtr;
+	if(!XMLGetNextElemAttrib(nodePtr,spatialOrder,"spatialorder","value"))
+	{
+		nodePtr=nodeTmp;
+		spatialOrder=SPATIAL_ORDER_NONE;
+	}
+	if(spatialOrder >= SPATIAL_ORDER_ENUM_END)
+		return false;
+	//--
+
 
 	return true;
 }
@@ -1174,6 +1246,7 @@ bool DataLoadFilter::writeState(std::ostream &f,unsigned int format, unsigned in
 			f << tabs(depth+1) << "<colour r=\"" <<  rgbaf.r() << "\" g=\"" << rgbaf.g() 
 				<< "\" b=\"" << rgbaf.b() << "\" a=\"" << rgbaf.a() << "\"/>" <<endl;
 			f << tabs(depth+1) << "<ionsize value=\"" << ionSize << "\"/>" << endl;
+			f << tabs(depth+1) << "<spatialorder value=\"" << spatialOrder << "\"/>" << endl;
 			f << tabs(depth) << "</" << trueName() << ">" << endl;
 			break;
 		}
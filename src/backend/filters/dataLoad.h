@@ -46,7 +46,8 @@ enum
 	DATALOAD_KEY_SELECTED_COLUMN3,
 	DATALOAD_KEY_NUMBER_OF_COLUMNS,
 	DATALOAD_KEY_ENDIANNESS,
-	DATALOAD_KEY_MONITOR
+	DATALOAD_KEY_MONITOR,
+	DATALOAD_KEY_SPATIAL_ORDER
 };
 
 class DataLoadFilter:public Filter
@@ -106,6 +107,9 @@ class DataLoadFilter:public Filter
 
 		//!Endian read mode
 		unsigned int endianMode;
+
+		//!Space filling curve to reorder ions along after load (SPATIAL_ORDER_*)
+		unsigned int spatialOrder;
 	public:
 		DataLoadFilter();
 		//!Duplicate filter contents, excluding cache.
@@ -442,6 +442,8 @@ unsigned int IonClipFilter::refresh(const std::vector<const FilterStreamData *>
 						d->b =((IonStreamData *)dataIn[ui])->b;
 						d->a =((IonStreamData *)dataIn[ui])->a;
 						d->ionSize =((IonStreamData *)dataIn[ui])->ionSize;
+						//Cropping does not permute the ions
+						d->spatialOrder=((IonStreamData *)dataIn[ui])->spatialOrder;
 
 						//getOut is const, so shouldn't be modified
 						cacheAsNeeded(d);
@@ -123,6 +123,10 @@ unsigned int IonColourFilter::refresh(const std::vector<const FilterStreamData *
 	haveIonSize=false;
 	sameSize=true;
 
+	//Ions split from a single stream keep its spatial ordering
+	size_t numIonStreams=0;
+	unsigned int spatialOrder=0;
+
 	//Did we find any ions in this pass?
 	bool foundIons=false;	
 	unsigned int totalSize=numElements(dataIn);
@@ -135,6 +139,8 @@ unsigned int IonColourFilter::refresh(const std::vector<const FilterStreamData *
 			case STREAM_TYPE_IONS: 
 			{
 				foundIons=true;
+				numIonStreams++;
+				spatialOrder=((const IonStreamData *)dataIn[ui])->spatialOrder;
 
 				//Check for ion size consistency	
 				if(haveIonSize)
@@ -203,6 +209,11 @@ unsigned int IonColourFilter::refresh(const std::vector<const FilterStreamData *
 		for(unsigned int ui=0;ui<nColours;ui++)
 			d[ui]->ionSize=ionSize;
 	}
+	if(numIonStreams == 1)
+	{
+		for(unsigned int ui=0;ui<nColours;ui++)
+			d[ui]->spatialOrder=spatialOrder;
+	}
 	//merge the results as needed
 	if(cache)
 	{
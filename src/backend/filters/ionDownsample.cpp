@@ -269,6 +269,10 @@ unsigned int IonDownsampleFilter::refresh(const std::vector<const FilterStreamDa
 					d->a =((IonStreamData *)dataIn[ui])->a;
 					d->ionSize =((IonStreamData *)dataIn[ui])->ionSize;
 					d->valueType=((IonStreamData *)dataIn[ui])->valueType;
+					//Fractional sampling keeps the ions in order, but
+					// fixed count selection may permute them
+					if(!fixedNumOut)
+						d->spatialOrder=((IonStreamData *)dataIn[ui])->spatialOrder;
 
 					//getOut is const, so shouldn't be modified
 					cacheAsNeeded(d);
@@ -405,6 +409,8 @@ unsigned int IonDownsampleFilter::refresh(const std::vector<const FilterStreamDa
 						d->a =input->a;
 						d->ionSize =input->ionSize;
 						d->valueType=input->valueType;
+						if(!fixedNumOut)
+							d->spatialOrder=input->spatialOrder;
 
 
 						//getOut is const, so shouldn't be modified
@@ -20,6 +20,7 @@
 
 #include "filterCommon.h"
 #include "geometryHelpers.h"
+#include "algorithms/threadHistogram.h"
 
 using std::vector;
 using std::string;
@@ -76,26 +77,22 @@ ProfileFilter::ProfileFilter() : primitiveType(PRIMITIVE_CYLINDER_AXIAL),
 }
 
 //Puts an ion in its appropriate range position, given ionID mapping,
-//range data (if any), mass to charge and the output table
+//range data (if any), mass to charge and the output table.
+// The table is (species x bin); the calling thread's bins are incremented
 void ProfileFilter::binIon(unsigned int targetBin, const RangeStreamData* rng, 
 	const map<unsigned int,unsigned int> &ionIDMapping,
-	vector<vector<size_t> > &frequencyTable, float massToCharge) 
+	ThreadHistogram &frequencyTable, float massToCharge) 
 {
 	//if we have no range data, then simply increment its position in a 1D table
 	//which will later be used as "count" data (like some kind of density plot)
 	if(!rng)
 	{
-		ASSERT(frequencyTable.size() == 1);
+		ASSERT(frequencyTable.getDim(0) == 1);
 		//There is a really annoying numerical boundary case
 		//that makes the target bin equate to the table size. 
 		//disallow this.
-		if(targetBin < frequencyTable[0].size())
-		{
-			vector<size_t>::iterator it;
-			it=frequencyTable[0].begin()+targetBin;
-			#pragma omp critical
-			(*it)++;
-		}
+		if(targetBin < frequencyTable.getDim(1))
+			frequencyTable.add(targetBin);
 		return;
 	}
 
@@ -109,10 +106,7 @@ void ProfileFilter::binIon(unsigned int targetBin, const RangeStreamData* rng,
 		unsigned int ionID=rng->rangeFile->getIonID(rangeID); 
 		unsigned int pos;
 		pos = ionIDMapping.find(ionID)->second;
-		vector<size_t>::iterator it;
-		it=frequencyTable[pos].begin()+targetBin;
-		#pragma omp critical
-		(*it)++;
+		frequencyTable.add(frequencyTable.binIndex(pos,targetBin));
 	}
 }
 
@@ -407,6 +401,16 @@ unsigned int ProfileFilter::refresh(const std::vector<const FilterStreamData *>
 	}
 
 
+	//Per-thread counts, merged into ionFrequencies once binning is complete
+	ThreadHistogram threadFrequencies;
+	{
+	vector<size_t> dims(2);
+	dims[0]=ionFrequencies.size();
+	dims[1]=numBins;
+	if(!threadFrequencies.init(dims))
+		return ERR_MEMALLOC;
+	}
+
 	size_t n=0;
 	size_t totalSize=numElements(dataIn);
 
@@ -449,7 +453,7 @@ unsigned int ProfileFilter::refresh(const std::vector<const FilterStreamData *>
 					{
 						//Push data into the correct bin.
 						// based upon eg ranging information and target 1D bin
-						binIon(targetBin,rngData,ionIDMapping,ionFrequencies,
+						binIon(targetBin,rngData,ionIDMapping,threadFrequencies,
 								dIon->data[uj].getMassToCharge());
 					}
 
@@ -489,6 +493,9 @@ unsigned int ProfileFilter::refresh(const std::vector<const FilterStreamData *>
 				
 	}
 
+	for(unsigned int ui=0;ui<ionFrequencies.size();ui++)
+		threadFrequencies.mergeInto(&ionFrequencies[ui][0],ui*numBins,numBins);
+
 #ifdef DEBUG
 	ASSERT(ionFrequencies.size());
 	//Ion frequencies must be of equal length
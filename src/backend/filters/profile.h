@@ -22,6 +22,8 @@
 
 #include <map>
 
+class ThreadHistogram;
+
 enum
 {
 	PROFILE_KEY_BINWIDTH=1,
@@ -91,7 +93,7 @@ class ProfileFilter : public Filter
 		
 		//!internal function for binning an ion dependant upon range data
 		static void binIon(unsigned int targetBin, const RangeStreamData* rng, const std::map<unsigned int,unsigned int> &ionIDMapping,
-			std::vector<std::vector<size_t> > &frequencyTable, float massToCharge);
+			ThreadHistogram &frequencyTable, float massToCharge);
 
 		static unsigned int getPrimitiveId(const std::string &s);;
 
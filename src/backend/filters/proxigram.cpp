@@ -19,6 +19,8 @@
 #include "../plot.h"
 #include "openvdb_includes.h"
 #include "contribution_transfer_function_TestSuite/CTF_functions.h"
+#include "algorithms/vdbSplat.h"
+
 #include <math.h> // pow
 
 #include <map>
@@ -33,6 +35,14 @@ enum
 	KEY_WEIGHT_FACTOR
 };
 
+enum
+{
+	PROXIGRAM_ABORT_ERR=1,
+	PROXIGRAM_MEMORY_ERR,
+	PROXIGRAM_ERR_ENUM_END
+};
+
+
 // == Proxigram filter ==
 ProxigramFilter::ProxigramFilter() 
 {
@@ -289,51 +299,11 @@ unsigned int ProxigramFilter::refresh(const std::vector<const FilterStreamData *
 			// extractActiveVoxelSegmentMasks - 	Return a mask for each connected component of the given grid's active voxels. More...
 			// extractIsosurfaceMask - 	Return a mask of the voxels that intersect the implicit surface with the given isovalue. More...	
 
-			// now get a copy of that grid, set all its active values from the narrow band to zero and fill only them with ions of interest
-			openvdb::FloatGrid::Ptr numerator_grid_proxi = sdf->deepCopy();
-			openvdb::FloatGrid::Ptr denominator_grid_proxi = sdf->deepCopy();
-
-			// initialize another grid with signed distance fields active voxels 
-			//give all actives a certain value, which can be asked for in order to retrieve the voxel state
-			openvdb::FloatGrid::Ptr voxelstate_grid = sdf->deepCopy();
-
-			// only iterate the active voxels
-			// so both the active and inactive voxels should have the value zero
-			// but nevertheless different activation states - is that possible?
-			// -> yes the result is in the test suite
-
-			// i do have to store the coordinates of all active voxels once here
-			// as i cannot find a method to evaluate whether a single voxel is active or inactive 
-			openvdb::Coord hkl;
-
-			// set all active voxels in the voxelstate grid to n
-			openvdb::FloatGrid::Accessor voxelstate_accessor = voxelstate_grid->getAccessor();
-			int active_voxel_state_value = 1.0;
-
-			for (openvdb::FloatGrid::ValueOnIter iter = voxelstate_grid->beginValueOn(); iter; ++iter)
-			{
-				iter.setValue(active_voxel_state_value);
-			}
-
-			for (openvdb::FloatGrid::ValueOnIter iter = numerator_grid_proxi->beginValueOn(); iter; ++iter)
-			{   
-					iter.setValue(0.0);
-			}
-			for (openvdb::FloatGrid::ValueOnIter iter = denominator_grid_proxi->beginValueOn(); iter; ++iter)
-			{   
-					iter.setValue(0.0);
-			}
-
-			// set the identical transforms for the other grids if this is even necessary
-
-			voxelstate_grid->setTransform(transform);
-			numerator_grid_proxi->setTransform(transform);
-			denominator_grid_proxi->setTransform(transform);
-
-			// now run through all ions but only once, and in case they are inside a active voxel write only to them
-
-			openvdb::FloatGrid::Accessor numerator_accessor_proxi = numerator_grid_proxi->getAccessor();
-			openvdb::FloatGrid::Accessor denominator_accessor_proxi = denominator_grid_proxi->getAccessor();
+			// numerator and denominator counts are accumulated together, in one
+			// two-channel grid with the same transform as the sdf. Only voxels
+			// in the narrow band of the sdf receive counts
+			openvdb::Vec2SGrid::Ptr counts_grid_proxi = openvdb::Vec2SGrid::create(openvdb::Vec2s(0.0f,0.0f));
+			counts_grid_proxi->setTransform(transform);
 
 			std::cout << " data stream size" << " = " << dataIn.size() << std::endl;
 
@@ -406,6 +376,7 @@ unsigned int ProxigramFilter::refresh(const std::vector<const FilterStreamData *
 
 			}
 	
+			std::vector<SplatSource> sources;
 			for(size_t ui=0;ui<dataIn.size();ui++)
 			{
 				//Check for ion stream types. Don't use anything else in counting
@@ -414,6 +385,8 @@ unsigned int ProxigramFilter::refresh(const std::vector<const FilterStreamData *
 
 				const IonStreamData  *ions; 
 				ions = (const IonStreamData *)dataIn[ui];
+				if(ions->data.empty())
+					continue;
 
 				//get the denominator ions
 				unsigned int ionID;
@@ -440,78 +413,40 @@ unsigned int ProxigramFilter::refresh(const std::vector<const FilterStreamData *
 				else
 					thisNumeratorIonEnabled=false;
 
-				for(size_t uj=0;uj<ions->data.size(); uj++)
-				{
-					const int xyzs = 3;
-					std::vector<float> atom_position(xyzs); 
-					for (int i=0;i<xyzs;i++)
-					{
-						atom_position[i] = ions->data[uj].getPos()[i];
-					}
-
-					// 1st step - project the current atom position to unit voxel i.e. from 0 to 1
-					std::vector<float> position_in_unit_voxel;
-					position_in_unit_voxel = projectAtompositionToUnitvoxel(atom_position, voxelsize_levelset);
-
-					// 2nd step - determine each contribution to the adjecent 8 voxels outgoining from the position in the unit voxel
-					std::vector<float> volumes_of_subcuboids;
-					std::vector<float> contributions_to_adjacent_voxels;
-					bool vertex_corner_coincidence = false;
-
-					vertex_corner_coincidence = checkVertexCornerCoincidence(position_in_unit_voxel);
-
-					// in case of coincidence of atom and voxel the contribution becomes 100 percent
-					if (vertex_corner_coincidence == false)
-					{
-						volumes_of_subcuboids = calcSubvolumes(position_in_unit_voxel);
-						contributions_to_adjacent_voxels = HellmanContributions(volumes_of_subcuboids);
-					}
-					else
-					{
-						contributions_to_adjacent_voxels = handleVertexCornerCoincidence(position_in_unit_voxel);
-					}
-
-					// 3rd step - determine the adjacent voxel indices in the actual grid
-					std::vector<std::vector<float> > adjacent_voxel_vertices;
-					adjacent_voxel_vertices = determineAdjacentVoxelVertices(atom_position, voxelsize_levelset);
-
-					// 4th step - assign each of the 8 adjacent voxels the corresponding contribution that results from the atom position in the unit voxel
-					const int number_of_adjacent_voxels = 8;
-					std::vector<float> current_voxel_index;
-					for (int i=0;i<number_of_adjacent_voxels;i++)
-					{
-						current_voxel_index = adjacent_voxel_vertices[i];
-						openvdb::Coord ijk(current_voxel_index[0], current_voxel_index[1], current_voxel_index[2]);
-
-						// write to denominator grid
-						if(voxelstate_accessor.getValue(ijk) == active_voxel_state_value)
-						{
-							denominator_accessor_proxi.setValue(ijk, contributions_to_adjacent_voxels[i] + denominator_accessor_proxi.getValue(ijk));
-							// write to numerator grid
-							//if(thisNumeratorIonEnabled)
-							// test case 								
-							if(ionID == 1)								
-							{	
-								numerator_accessor_proxi.setValue(ijk, contributions_to_adjacent_voxels[i] + numerator_accessor_proxi.getValue(ijk));
-							}
-							else
-							{
-								numerator_accessor_proxi.setValue(ijk, 0.0 + numerator_accessor_proxi.getValue(ijk));
-							
-							}
-						}
-					}
-				}
+				// the denominator holds all atoms
+				SplatSource src;
+				src.pts=&ions->data;
+				src.denominator=true;
+				//src.numerator=thisNumeratorIonEnabled;
+				// test case
+				src.numerator=(ionID == 1);
+				sources.push_back(src);
 			}
 
+			// splat each ion over its 8 adjacent voxels, in parallel,
+			// skipping any voxels outside the narrow band
+			switch(splatRatio(sources,voxelsize_levelset,*counts_grid_proxi,
+						progress.filterProgress,*Filter::wantAbort,sdf.get()))
+			{
+				case 0:
+					break;
+				case VDBSPLAT_ERR_ABORT:
+					return PROXIGRAM_ABORT_ERR;
+				case VDBSPLAT_ERR_MEMALLOC:
+					return PROXIGRAM_MEMORY_ERR;
+				default:
+					ASSERT(false);
+			}
 
-			openvdb::io::File file2("denominator_grid_proxi.vdb");
+			openvdb::io::File file2("counts_grid_proxi.vdb");
 			openvdb::GridPtrVec grids2;
-			grids2.push_back(denominator_grid_proxi);
+			grids2.push_back(counts_grid_proxi);
 
 			file2.write(grids2);
 			file2.close();
 
+			openvdb::Vec2SGrid::ConstAccessor counts_accessor_proxi = counts_grid_proxi->getConstAccessor();
+
 			float minVal = 0.0;
 			float maxVal = 0.0;
 
@@ -540,19 +475,9 @@ unsigned int ProxigramFilter::refresh(const std::vector<const FilterStreamData *
 			std::cout << " eval min max sdf_nm" << " = " << minVal << " , " << maxVal << std::endl;
 			std::cout << " active voxel count sdf_nm " << " = " << sdf_nm->activeVoxelCount() << std::endl;
 
-			numerator_grid_proxi->evalMinMax(minVal,maxVal);
-			std::cout << " eval min max numerator_grid" << " = " << minVal << " , " << maxVal << std::endl;
-			std::cout << " active voxel count numerator_grid " << " = " << numerator_grid_proxi->activeVoxelCount() << std::endl;
-
-			denominator_grid_proxi->evalMinMax(minVal,maxVal);
-			std::cout << " eval min max denominator_grid" << " = " << minVal << " , " << maxVal << std::endl;
-			std::cout << " active voxel count denominator_grid " << " = " << denominator_grid_proxi->activeVoxelCount() << std::endl;
-
 			openvdb::math::CoordBBox bounding_box1 = sdf_nm->evalActiveVoxelBoundingBox();
-			openvdb::math::CoordBBox bounding_box2 = denominator_grid_proxi->evalActiveVoxelBoundingBox();
 
 			std::cout << " bounding box sdf_nm " << " = " << bounding_box1 << std::endl;
-			std::cout << " bounding box denominator_grid _proxi " << " = " << bounding_box2 << std::endl;
 
 			// for comparison between the coord center of the sampled precipitation and the voxelized one
 			std::cout << " bounding_box.getCenter() sdf " << " = " << bounding_box1.getCenter() << std::endl;
@@ -632,7 +557,7 @@ unsigned int ProxigramFilter::refresh(const std::vector<const FilterStreamData *
 				int current_index = indicesMap[current_distance];
 				openvdb::Coord abc;
 				abc = iter.getCoord();
-				atomcounts_distances[current_index] += denominator_accessor_proxi.getValue(abc);
+				atomcounts_distances[current_index] += counts_accessor_proxi.getValue(abc)[1];
 			}
 
 			// 5th get the numerator and the denominator information for the distances
@@ -646,8 +571,9 @@ unsigned int ProxigramFilter::refresh(const std::vector<const FilterStreamData *
 				int current_index = indicesMap[current_distance];
 				openvdb::Coord abc;
 				abc = iter.getCoord();
-				numerators[current_index] += numerator_accessor_proxi.getValue(abc);
-				denominators[current_index] += denominator_accessor_proxi.getValue(abc);
+				openvdb::Vec2s counts = counts_accessor_proxi.getValue(abc);
+				numerators[current_index] += counts[0];
+				denominators[current_index] += counts[1];
 			}
 
 			// calculation of the proximity shells
@@ -1037,7 +963,15 @@ bool ProxigramFilter::setProperty(unsigned int key,
 
 std::string ProxigramFilter::getSpecificErrString(unsigned int code) const
 {
-	return "";
+	const char *errStrs[]={
+	 	"",
+		"Proxigram aborted",
+		"Out of memory",
+	};
+	COMPILE_ASSERT(THREEDEP_ARRAYSIZE(errStrs) == PROXIGRAM_ERR_ENUM_END);	
+	
+	ASSERT(code < PROXIGRAM_ERR_ENUM_END);
+	return errStrs[code];
 }
 
 bool ProxigramFilter::writeState(std::ostream &f,unsigned int format, unsigned int depth) const
@@ -152,6 +152,10 @@ unsigned int RangeFileFilter::refresh(const std::vector<const FilterStreamData *
 		haveIonSize=false;
 		sameSize=true;
 
+		//Ions split from a single stream keep its spatial ordering
+		size_t numIonStreams=0;
+		unsigned int spatialOrder=0;
+
 
 		vector<size_t> dSizes;
 		dSizes.resize(d.size(),0);
@@ -316,6 +320,9 @@ unsigned int RangeFileFilter::refresh(const std::vector<const FilterStreamData *
 							haveDefIonColour=true;
 						}
 					
+						numIonStreams++;
+						spatialOrder=((const IonStreamData *)dataIn[ui])->spatialOrder;
+
 						//Check for ion size consistency	
 						if(haveIonSize)
 						{
@@ -448,6 +455,11 @@ unsigned int RangeFileFilter::refresh(const std::vector<const FilterStreamData *
 			for(unsigned int ui=0;ui<d.size();ui++)
 				d[ui]->ionSize=ionSize;
 		}
+		if(numIonStreams == 1)
+		{
+			for(unsigned int ui=0;ui<d.size();ui++)
+				d[ui]->spatialOrder=spatialOrder;
+		}
 		
 		//Set the unranged colour
 		if(haveDefIonColour && d.size())
@@ -26,6 +26,11 @@
 #include "filterCommon.h"
 #include "algorithms/binomial.h"
 #include "algorithms/K3DTree-mk2.h"
+#include "algorithms/K3DTree-bucket.h"
+#include "algorithms/cellList.h"
+#include "algorithms/spatialIndexCache.h"
+#include "algorithms/pairCorrelation.h"
+#include "algorithms/pointHash.h"
 #include "backend/plot.h"
 #include "../APT/APTFileIO.h"
 
@@ -69,6 +74,15 @@ enum
 	KEY_REPLACE_TOLERANCE,
 	KEY_REPLACE_ALGORITHM,
 	KEY_REPLACE_VALUE,
+	KEY_NN_APPROX_ERROR,
+	KEY_RDF_PAIRS,
+	KEY_RDF_FFT,
+	KEY_RDF_FFT_VOXEL,
+	KEY_SDM_3D,
+	KEY_SDM_BINS,
+	KEY_BINOMIAL_SWEEP,
+	KEY_BINOMIAL_SWEEP_MAX,
+	KEY_BINOMIAL_SWEEP_STEPS,
 };
 
 enum 
@@ -113,6 +127,7 @@ enum
 	ERR_BINOMIAL_BIN_FAIL,
 	INSUFFICIENT_SIZE_ERR,
 	ERR_FILE_READ_FAIL,
+	ERR_FFT_GRID_SIZE,
 	SPAT_ERR_END_OF_ENUM,
 };
 // == NN analysis filter ==
@@ -157,6 +172,59 @@ const float DEFAULT_AXIAL_DISTANCE = 1.0f;
 
 const float DISTANCE_EPSILON=sqrt(std::numeric_limits<float>::epsilon());
 
+//Number of points sampled when measuring the error of approximate NN searches
+const size_t APPROX_NN_ERROR_SAMPLES=1000;
+
+//Pick up to APPROX_NN_ERROR_SAMPLES evenly spaced points for measuring NN error
+void sampleApproxNNPoints(const vector<Point3D> &p, vector<Point3D> &samples)
+{
+	samples.clear();
+	if(p.empty())
+		return;
+	size_t step=std::max(p.size()/APPROX_NN_ERROR_SAMPLES,(size_t)1);
+	for(size_t ui=0;ui<p.size();ui+=step)
+		samples.push_back(p[ui]);
+}
+
+//Report the error achieved by approximate k-th NN searches,
+// by repeating the sampled searches exactly and comparing
+// the k-th NN distances
+void reportApproxNNError(const K3DTreeBucket &tree, const vector<Point3D> &samples,
+			unsigned int k, float maxError, vector<string> &console)
+{
+	if(samples.empty())
+		return;
+
+	vector<float> exactDist(samples.size()*k),approxDist(samples.size()*k);
+	vector<size_t> indices(samples.size()*k);
+	tree.findKNearest(&samples[0],samples.size(),k,0.0f,&exactDist[0],&indices[0]);
+	tree.findKNearest(&samples[0],samples.size(),k,0.0f,&approxDist[0],&indices[0],maxError);
+
+	float worstErr=0,meanErr=0;
+	size_t count=0;
+	for(size_t ui=0;ui<samples.size();ui++)
+	{
+		float exact=exactDist[ui*k+k-1],approx=approxDist[ui*k+k-1];
+		if(exact == std::numeric_limits<float>::infinity() || exact <= 0.0f)
+			continue;
+		float err=sqrtf(approx/exact) - 1.0f;
+		worstErr=std::max(worstErr,err);
+		meanErr+=err;
+		count++;
+	}
+	if(count)
+		meanErr/=count;
+
+	string strBound,strCount,strWorst,strMean;
+	stream_cast(strBound,maxError*100.0f);
+	stream_cast(strCount,count);
+	stream_cast(strWorst,worstErr*100.0f);
+	stream_cast(strMean,meanErr*100.0f);
+	console.push_back(string(TRANS("Approximate NN search, permitted distance error: ")) + strBound + "%");
+	console.push_back(string(TRANS("Measured NN distance error (")) + strCount + 
+		TRANS(" samples) - max: ") + strWorst + TRANS("%, mean: ") + strMean + "%");
+}
+
 
 //Helper function for computing a weighted mean
 float weightedMean(const vector<float> &x, const vector<float> &y,bool zeroOutSingularity=true)
@@ -314,6 +382,76 @@ size_t buildSplitPoints(const vector<const FilterStreamData *> &dataIn,
 	return 0;
 }
 
+//Scan input datastreams to build source and target point vectors, as per
+// buildSplitPoints, also recording the range file ion ID of each point
+//Returns 0 on no error, otherwise nonzero
+size_t buildLabelledSplitPoints(const vector<const FilterStreamData *> &dataIn,
+				ProgressData &progress, size_t totalDataSize,
+				const RangeFile *rngF, const vector<bool> &pSourceEnabled, const vector<bool> &pTargetEnabled,
+				vector<Point3D> *pts, vector<unsigned int> *ionIDs)
+{
+	const vector<bool> *enabled[2] = { &pSourceEnabled, &pTargetEnabled};
+
+	//First pass counts the points needed, second pass fills them in
+	size_t sizeNeeded[2];
+	sizeNeeded[0]=sizeNeeded[1]=0;
+	for(unsigned int pass=0;pass<2;pass++)
+	{
+		if(pass)
+		{
+			for(unsigned int ui=0;ui<2;ui++)
+			{
+				pts[ui].resize(sizeNeeded[ui]);
+				ionIDs[ui].resize(sizeNeeded[ui]);
+				sizeNeeded[ui]=0;
+			}
+		}
+
+		size_t n=0;
+		for(unsigned int ui=0; ui<dataIn.size() ; ui++)
+		{
+			if(dataIn[ui]->getStreamType() != STREAM_TYPE_IONS)
+				continue;
+
+			const IonStreamData *d;
+			d=((const IonStreamData *)dataIn[ui]);
+			//Ion ID for the whole stream, if it is grouped
+			unsigned int streamIonID=getIonstreamIonID(d,rngF);
+
+			for(size_t uj=0;uj<d->data.size();uj++)
+			{
+				unsigned int ionID=streamIonID;
+				if(ionID == (unsigned int)-1)
+				{
+					ionID = rngF->getIonID(d->data[uj].getMassToCharge());
+					if(ionID == (unsigned int)-1)
+						continue;
+				}
+
+				for(unsigned int uk=0;uk<2;uk++)
+				{
+					if(ionID >= enabled[uk]->size() || !(*enabled[uk])[ionID])
+						continue;
+
+					if(pass)
+					{
+						assignIonData(pts[uk][sizeNeeded[uk]],d->data[uj]);
+						ionIDs[uk][sizeNeeded[uk]]=ionID;
+					}
+					sizeNeeded[uk]++;
+				}
+			}
+
+			n+=d->data.size();
+			progress.filterProgress= (unsigned int)((float)n/(float)totalDataSize*50.0f + pass*50.0f);
+			if(*Filter::wantAbort)
+				return FILTER_ERR_ABORT;
+		}
+	}
+
+	return 0;
+}
+
 SpatialAnalysisFilter::SpatialAnalysisFilter()
 {
 	COMPILE_ASSERT(THREEDEP_ARRAYSIZE(STOP_MODES) == STOP_MODE_ENUM_END);
@@ -325,7 +463,10 @@ SpatialAnalysisFilter::SpatialAnalysisFilter()
 	algorithm=ALGORITHM_DENSITY;
 	nnMax=1;
 	distMax=1;
+	nnApproxError=0;
 	stopMode=STOP_MODE_NEIGHBOUR;
+	lcCountsFingerprint=0;
+	lcCountsDistMax=0;
 
 	haveRangeParent=false;
 	
@@ -337,6 +478,11 @@ SpatialAnalysisFilter::SpatialAnalysisFilter()
 	excludeSurface=false;
 	reductionDistance=distMax;
 	normaliseNNHist=true;
+	wantPairRDF=false;
+	wantFFTRDF=false;
+	fftVoxelSize=0.25f;
+	want3DSDM=false;
+	sdmBins=50;
 	//Density filtering params
 	densityCutoff=1.0f;
 	keepDensityUpper=true;
@@ -351,6 +497,9 @@ SpatialAnalysisFilter::SpatialAnalysisFilter()
 	extrusionDirection=0;
 	maxBlockAspect=2;
 	showGridOverlay=true;
+	wantBinomialSweep=false;
+	sweepMaxIons=1000;
+	sweepSteps=10;
 	//--
 
 	//replace tolerance
@@ -373,12 +522,18 @@ Filter *SpatialAnalysisFilter::cloneUncached() const
 	p->stopMode=stopMode;
 	p->nnMax=nnMax;
 	p->distMax=distMax;
+	p->nnApproxError=nnApproxError;
 
 	p->numBins=numBins;
 	p->excludeSurface=excludeSurface;
 	p->reductionDistance=reductionDistance;
 	p->normaliseNNHist = normaliseNNHist;
 	p->wantRandomNNHist=wantRandomNNHist;
+	p->wantPairRDF=wantPairRDF;
+	p->wantFFTRDF=wantFFTRDF;
+	p->fftVoxelSize=fftVoxelSize;
+	p->want3DSDM=want3DSDM;
+	p->sdmBins=sdmBins;
 	
 	p->keepDensityUpper=keepDensityUpper;
 	p->densityCutoff=densityCutoff;
@@ -391,6 +546,9 @@ Filter *SpatialAnalysisFilter::cloneUncached() const
 	p->showNormalisedBinomialFrequencies=showNormalisedBinomialFrequencies;
 	p->showTheoreticFrequencies=showTheoreticFrequencies;
 	p->showGridOverlay=showGridOverlay;
+	p->wantBinomialSweep=wantBinomialSweep;
+	p->sweepMaxIons=sweepMaxIons;
+	p->sweepSteps=sweepSteps;
 
 	p->replaceFile=replaceFile;
 	p->replaceMode=replaceMode;
@@ -416,7 +574,29 @@ Filter *SpatialAnalysisFilter::cloneUncached() const
 
 size_t SpatialAnalysisFilter::numBytesForCache(size_t nObjects) const
 {
-	return nObjects*IONDATA_SIZE;
+	size_t bytes=nObjects*IONDATA_SIZE;
+
+	//Local concentration also keeps the neighbour count of each
+	// counted species, for every source ion
+	if(algorithm == ALGORITHM_LOCAL_CONCENTRATION && stopMode == STOP_MODE_RADIUS)
+	{
+		size_t nSpecies=0;
+		for(size_t ui=0;ui<ionNumeratorEnabled.size();ui++)
+		{
+			if(ionNumeratorEnabled[ui] || ionDenominatorEnabled[ui])
+				nSpecies++;
+		}
+		bytes+=nObjects*nSpecies*sizeof(unsigned int);
+	}
+
+	return bytes;
+}
+
+void SpatialAnalysisFilter::clearCache()
+{
+	std::vector<unsigned int>().swap(lcNeighbourCounts);
+	lcCountSpecies.clear();
+	Filter::clearCache();
 }
 
 void SpatialAnalysisFilter::initFilter(const std::vector<const FilterStreamData *> &dataIn,
@@ -657,56 +837,35 @@ size_t SpatialAnalysisFilter::algorithmReplace(ProgressData &progress, size_t to
 
 
 	progress.step=3;
-	progress.stepName=TRANS("Build");
+	progress.stepName=TRANS("Match");
 	progress.filterProgress=0;
 
-	//Build the search tree we will use to perform replacement
-	K3DTreeMk2 tree;
-	tree.resetPts(fileIons,false);
-	if(!tree.build())
-		return ERR_ABORT_FAIL;
-	BoundCube b;
-	tree.getBoundCube(b);
-
-	//map the offset of the nearest to
-	//the tree ID 
-	vector<size_t > nearestVec;
-	nearestVec.resize(inIons.size());
-
-	//TODO: pair vector might be faster
-	// as we can use it in sequence, and can use openmp
-	map<size_t,size_t> matchedMap;
-
-	//Find the nearest point for all points in the dataset
-
-	#pragma omp parallel for 
-	for(size_t ui=0;ui<inIons.size();ui++)
-	{
-		nearestVec[ui]=tree.findNearestUntagged(inIons[ui].getPos(),b,false);
-	}
-
-	float sqrReplaceTol=replaceTolerance*replaceTolerance;
-
-	//Filter this to only points that had an NN within range
-	#pragma omp parallel for 
-	for(size_t ui=0;ui<inIons.size();ui++)
+	//Find the nearest file ion within tolerance of each input ion, 
+	// by hashing the file ions' quantised coordinates
+	vector<size_t> matches;
+	errCode=matchPoints(inIons,fileIons,replaceTolerance,matches,
+				progress.filterProgress,*Filter::wantAbort);
+	switch(errCode)
 	{
-		if(nearestVec[ui]!=(size_t)-1 && inIons[ui].getPos().sqrDist(*tree.getPt(nearestVec[ui])) <=sqrReplaceTol)
-		{
-			#pragma omp critical
-			matchedMap[ui]=tree.getOrigIndex(nearestVec[ui]);
-		}
+		case 0:
+			break;
+		case POINTHASH_ERR_MEMALLOC:
+			return ERR_BINOMIAL_NO_MEM;
+		case POINTHASH_ERR_ABORT:
+			return ERR_ABORT_FAIL;
+		default:
+			ASSERT(false);
+			return SPAT_ERR_END_OF_ENUM;
 	}
 
-	nearestVec.clear();
-
-
 	progress.step=4;
 	progress.stepName=TRANS("Compute");
 	progress.filterProgress=0;
 
-	//Finish if no matches
-	if(matchedMap.empty())
+	size_t numMatched=matches.size()-std::count(matches.begin(),matches.end(),(size_t)-1);
+
+	//Finish if nothing can intersect
+	if(!numMatched && replaceMode == REPLACE_MODE_INTERSECT)
 	{
 		progress.filterProgress=100;
 		return 0;
@@ -717,49 +876,58 @@ size_t SpatialAnalysisFilter::algorithmReplace(ProgressData &progress, size_t to
 	{
 		case REPLACE_MODE_SUBTRACT:
 		{
-			//In subtraction mode, we should have
-			// at least this many ions
-			if(inIons.size() > matchedMap.size())
-				outIons.reserve(inIons.size()-matchedMap.size());
-			
-			//
-			#pragma omp parallel for
-			for(unsigned int ui=0;ui<inIons.size();ui++)
+			outIons.reserve(inIons.size()-numMatched);
+			for(size_t ui=0;ui<inIons.size();ui++)
 			{
-				map<size_t,size_t>::iterator it;
-				it=matchedMap.find(ui);
-				if(it != matchedMap.end())
-					continue;
-
-				#pragma omp critical
-				outIons.push_back(inIons[ui]);
+				if(matches[ui] == (size_t)-1)
+					outIons.push_back(inIons[ui]);
 			}
 			break;
 		}
 		case REPLACE_MODE_INTERSECT:
 		{
-			outIons.reserve(matchedMap.size());
-
-			if(replaceMass)
+			outIons.reserve(numMatched);
+			for(size_t ui=0;ui<inIons.size();ui++)
 			{
-				for(map<size_t,size_t>::const_iterator it=matchedMap.begin();it!=matchedMap.end();++it)
-				{
-					outIons.push_back(fileIons[it->second]);
-					ASSERT(fileIons[it->second].getPosRef().sqrDist(inIons[it->first].getPosRef()) < sqrReplaceTol);
-				}
-			}
-			else
-			{
-				for(map<size_t,size_t>::const_iterator it=matchedMap.begin();it!=matchedMap.end();++it)
+				if(matches[ui] == (size_t)-1)
+					continue;
+
+				if(replaceMass)
 				{
-					outIons.push_back(inIons[it->first]);
+					outIons.push_back(fileIons[matches[ui]]);
+					ASSERT(fileIons[matches[ui]].getPosRef().sqrDist(inIons[ui].getPosRef()) 
+						<= replaceTolerance*replaceTolerance);
 				}
+				else
+					outIons.push_back(inIons[ui]);
 			}
 			break;
 		}
 		case REPLACE_MODE_UNION:
 		{
-			ASSERT(false);
+			//All input ions (taking values from the file where matched),
+			// then the file ions that no input ion matched
+			vector<char> fileMatched(fileIons.size(),0);
+			for(size_t ui=0;ui<inIons.size();ui++)
+			{
+				if(matches[ui] != (size_t)-1)
+					fileMatched[matches[ui]]=1;
+			}
+			size_t numFileMatched=std::count(fileMatched.begin(),fileMatched.end(),1);
+
+			outIons.reserve(inIons.size() + fileIons.size()-numFileMatched);
+			for(size_t ui=0;ui<inIons.size();ui++)
+			{
+				if(replaceMass && matches[ui] != (size_t)-1)
+					outIons.push_back(fileIons[matches[ui]]);
+				else
+					outIons.push_back(inIons[ui]);
+			}
+			for(size_t ui=0;ui<fileIons.size();ui++)
+			{
+				if(!fileMatched[ui])
+					outIons.push_back(fileIons[ui]);
+			}
 			break;
 		}
 		default:
@@ -840,6 +1008,17 @@ void SpatialAnalysisFilter::getProperties(FilterPropGroup &propertyList) const
 			p.helpText=TRANS("Maximum number of neighbours to examine");
 			p.key=KEY_NNMAX;
 			propertyList.addProperty(p,curGroup);
+
+			if(algorithm == ALGORITHM_DENSITY || algorithm == ALGORITHM_DENSITY_FILTER)
+			{
+				stream_cast(tmpStr,nnApproxError);
+				p.name=TRANS("NN Error");
+				p.data=tmpStr;
+				p.type=PROPERTY_TYPE_REAL;
+				p.helpText=TRANS("Permitted relative error in neighbour distances (eg 0.1 = 10%). Non-zero values give faster, approximate, densities");
+				p.key=KEY_NN_APPROX_ERROR;
+				propertyList.addProperty(p,curGroup);
+			}
 			
 			if(algorithm == ALGORITHM_RDF)
 			{
@@ -891,16 +1070,41 @@ void SpatialAnalysisFilter::getProperties(FilterPropGroup &propertyList) const
 			p.key=KEY_NUMBINS;
 			propertyList.addProperty(p,curGroup);
 
-			tmpStr=boolStrEnc(excludeSurface);
+			if(stopMode == STOP_MODE_RADIUS)
+			{
+				p.name=TRANS("Grid (FFT)");
+				p.data=boolStrEnc(wantFFTRDF);
+				p.type=PROPERTY_TYPE_BOOL;
+				p.helpText=TRANS("Compute pair correlation g(r) from voxelised data using FFTs. Faster for large datasets or long distances, but limited to voxel resolution");
+				p.key=KEY_RDF_FFT;
+				propertyList.addProperty(p,curGroup);
+
+				if(wantFFTRDF)
+				{
+					stream_cast(tmpStr,fftVoxelSize);
+					p.name=TRANS("Voxel size");
+					p.data=tmpStr;
+					p.type=PROPERTY_TYPE_REAL;
+					p.helpText=TRANS("Side length of the voxels used for the FFT grid");
+					p.key=KEY_RDF_FFT_VOXEL;
+					propertyList.addProperty(p,curGroup);
+				}
+			}
 
-			p.name=TRANS("Surface Remove");
-			p.data=tmpStr;
-			p.type=PROPERTY_TYPE_BOOL;
-			p.helpText=TRANS("Exclude surface as part of source to minimise bias in RDF (at cost of increased noise)");
-			p.key=KEY_REMOVAL;
-			propertyList.addProperty(p,curGroup);
+			//FFT correlations correct for the data edges directly
+			const bool fftMode= (stopMode == STOP_MODE_RADIUS && wantFFTRDF);
+			if(!fftMode)
+			{
+				tmpStr=boolStrEnc(excludeSurface);
+				p.name=TRANS("Surface Remove");
+				p.data=tmpStr;
+				p.type=PROPERTY_TYPE_BOOL;
+				p.helpText=TRANS("Exclude surface as part of source to minimise bias in RDF (at cost of increased noise)");
+				p.key=KEY_REMOVAL;
+				propertyList.addProperty(p,curGroup);
+			}
 			
-			if(excludeSurface)
+			if(excludeSurface && !fftMode)
 			{
 				stream_cast(tmpStr,reductionDistance);
 				p.name=TRANS("Remove Dist");
@@ -921,6 +1125,16 @@ void SpatialAnalysisFilter::getProperties(FilterPropGroup &propertyList) const
 			p.key=KEY_COLOUR;
 			propertyList.addProperty(p,curGroup);
 
+			if(haveRangeParent && stopMode == STOP_MODE_RADIUS)
+			{
+				p.name=TRANS("Species pairs");
+				p.data=boolStrEnc(wantPairRDF);
+				p.type=PROPERTY_TYPE_BOOL;
+				p.helpText=TRANS("Compute a separate RDF for each source/target species pair, in a single pass");
+				p.key=KEY_RDF_PAIRS;
+				propertyList.addProperty(p,curGroup);
+			}
+
 			propertyList.setGroupTitle(curGroup,TRANS("Alg. Params."));
 			if(haveRangeParent)
 			{
@@ -1024,7 +1238,27 @@ void SpatialAnalysisFilter::getProperties(FilterPropGroup &propertyList) const
 			p.helpText=TRANS("Number of bins for output 1D RDF plot");
 			p.key=KEY_NUMBINS;
 			propertyList.addProperty(p,curGroup);
-			
+
+			if(stopMode == STOP_MODE_RADIUS)
+			{
+				p.name=TRANS("3D map");
+				p.data=boolStrEnc(want3DSDM);
+				p.type=PROPERTY_TYPE_BOOL;
+				p.helpText=TRANS("Also output a 3D map of the neighbour vectors (spatial distribution map), from which profiles along any axis may be obtained");
+				p.key=KEY_SDM_3D;
+				propertyList.addProperty(p,curGroup);
+
+				if(want3DSDM)
+				{
+					stream_cast(tmpStr,sdmBins);
+					p.name=TRANS("Map bins");
+					p.data=tmpStr;
+					p.type=PROPERTY_TYPE_INTEGER;
+					p.helpText=TRANS("Number of voxels along each axis of the 3D map");
+					p.key=KEY_SDM_BINS;
+					propertyList.addProperty(p,curGroup);
+				}
+			}
 			
 			p.name=TRANS("Plot colour ");
 			p.data=rgba.toColourRGBA().rgbString(); 
@@ -1075,6 +1309,34 @@ void SpatialAnalysisFilter::getProperties(FilterPropGroup &propertyList) const
 			p.key=KEY_NUMIONS;
 			propertyList.addProperty(p,curGroup);
 			//--
+
+			//--
+			p.name=TRANS("Block size sweep");
+			p.data=boolStrEnc(wantBinomialSweep);
+			p.type=PROPERTY_TYPE_BOOL;
+			p.helpText=TRANS("Evaluate a series of block sizes, from the block size up to a maximum, and plot the statistics against block size");
+			p.key=KEY_BINOMIAL_SWEEP;
+			propertyList.addProperty(p,curGroup);
+
+			if(wantBinomialSweep)
+			{
+				stream_cast(tmpStr,sweepMaxIons);	
+				p.name=TRANS("Max block size");
+				p.data=tmpStr;
+				p.type=PROPERTY_TYPE_INTEGER;
+				p.helpText=TRANS("Largest number of ions per block to evaluate");
+				p.key=KEY_BINOMIAL_SWEEP_MAX;
+				propertyList.addProperty(p,curGroup);
+				
+				stream_cast(tmpStr,sweepSteps);	
+				p.name=TRANS("Num sizes");
+				p.data=tmpStr;
+				p.type=PROPERTY_TYPE_INTEGER;
+				p.helpText=TRANS("Number of block sizes to evaluate, evenly spaced between the block size and the maximum");
+				p.key=KEY_BINOMIAL_SWEEP_STEPS;
+				propertyList.addProperty(p,curGroup);
+			}
+			//--
 			
 			//--
 			stream_cast(tmpStr,maxBlockAspect);	
@@ -1394,6 +1656,21 @@ bool SpatialAnalysisFilter::setProperty(  unsigned int key,
 
 			break;
 		}	
+		case KEY_NN_APPROX_ERROR:
+		{
+			float ltmp;
+			if(stream_cast(ltmp,value))
+				return false;
+			
+			if(ltmp < 0.0f)
+				return false;
+			
+			nnApproxError=ltmp;
+			needUpdate=true;
+			clearCache();
+
+			break;
+		}	
 		case KEY_NNMAX_NORMALISE:
 		{
 			if(!applyPropertyNow(normaliseNNHist,value,needUpdate))
@@ -1442,6 +1719,54 @@ bool SpatialAnalysisFilter::setProperty(  unsigned int key,
 				return false;
 			break;
 		}
+		case KEY_RDF_PAIRS:
+		{
+			if(!applyPropertyNow(wantPairRDF,value,needUpdate))
+				return false;
+			break;
+		}
+		case KEY_RDF_FFT:
+		{
+			if(!applyPropertyNow(wantFFTRDF,value,needUpdate))
+				return false;
+			break;
+		}
+		case KEY_SDM_3D:
+		{
+			if(!applyPropertyNow(want3DSDM,value,needUpdate))
+				return false;
+			break;
+		}
+		case KEY_SDM_BINS:
+		{
+			unsigned int ltmp;
+			if(stream_cast(ltmp,value))
+				return false;
+			
+			if(ltmp==0)
+				return false;
+			
+			sdmBins=ltmp;
+			needUpdate=true;
+			clearCache();
+
+			break;
+		}
+		case KEY_RDF_FFT_VOXEL:
+		{
+			float ltmp;
+			if(stream_cast(ltmp,value))
+				return false;
+			
+			if(ltmp <= 0.0f)
+				return false;
+			
+			fftVoxelSize=ltmp;
+			needUpdate=true;
+			clearCache();
+
+			break;
+		}
 		case KEY_COLOUR:
 		{
 			ColourRGBA tmpRgba;
@@ -1540,7 +1865,9 @@ bool SpatialAnalysisFilter::setProperty(  unsigned int key,
 				ionNumeratorEnabled[ui]=allEnabled;
 
 			needUpdate=true;
-			clearCache();
+			//Clear the generic filter cache, but not the
+			// neighbour counts
+			Filter::clearCache();
 			break;
 		}
 		case KEY_CUTOFF:
@@ -1683,6 +2010,42 @@ bool SpatialAnalysisFilter::setProperty(  unsigned int key,
 
 			break;
 		}
+		case KEY_BINOMIAL_SWEEP:
+		{
+			if(!applyPropertyNow(wantBinomialSweep,value,needUpdate))
+				return false;
+			break;
+		}
+		case KEY_BINOMIAL_SWEEP_MAX:
+		{
+			unsigned int ltmp;
+			if(stream_cast(ltmp,value))
+				return false;
+			
+			if(ltmp<=1)
+				return false;
+			
+			sweepMaxIons=ltmp;
+			needUpdate=true;
+			clearCache();
+
+			break;
+		}
+		case KEY_BINOMIAL_SWEEP_STEPS:
+		{
+			unsigned int ltmp;
+			if(stream_cast(ltmp,value))
+				return false;
+			
+			if(ltmp<2)
+				return false;
+			
+			sweepSteps=ltmp;
+			needUpdate=true;
+			clearCache();
+
+			break;
+		}
 		case KEY_REPLACE_FILE:
 		{
 			if(!applyPropertyNow(replaceFile,value,needUpdate))
@@ -1770,7 +2133,13 @@ bool SpatialAnalysisFilter::setProperty(  unsigned int key,
 				if(lastVal!=(*vBool)[ionOffset])
 				{
 					needUpdate=true;
-					clearCache();
+					//Neighbour counts do not depend upon the
+					// numerator or denominator selection
+					if(keyType == KEYTYPE_ENABLE_NUMERATOR ||
+						keyType == KEYTYPE_ENABLE_DENOMINATOR)
+						Filter::clearCache();
+					else
+						clearCache();
 				}
 			}
 		}
@@ -1787,7 +2156,8 @@ std::string  SpatialAnalysisFilter::getSpecificErrString(unsigned int code) cons
 				TRANS("Required range data not present"), 
 				TRANS("Insufficient memory for binomial. Reduce input size?"),
 				TRANS("Insufficient points to continue"),
-				TRANS("Unable to load file")
+				TRANS("Unable to load file"),
+				TRANS("Grid too large for FFT correlation. Increase voxel size?")
 				};
 	COMPILE_ASSERT(THREEDEP_ARRAYSIZE(errStrings) == SPAT_ERR_END_OF_ENUM);
 	
@@ -1832,7 +2202,7 @@ unsigned int SpatialAnalysisFilter::getRefreshEmitMask() const
 		case ALGORITHM_BINOMIAL:
 			return STREAM_TYPE_PLOT | STREAM_TYPE_DRAW;
 		case ALGORITHM_AXIAL_DF:
-			return STREAM_TYPE_IONS | STREAM_TYPE_PLOT | STREAM_TYPE_DRAW;
+			return STREAM_TYPE_IONS | STREAM_TYPE_PLOT | STREAM_TYPE_DRAW | STREAM_TYPE_VOXEL;
 		default:
 			return STREAM_TYPE_IONS;
 	}
@@ -1857,6 +2227,11 @@ bool SpatialAnalysisFilter::writeState(std::ostream &f,unsigned int format, unsi
 			f << tabs(depth+1) << "<nnmax value=\""<<nnMax<< "\"/>"  << endl;
 			f << tabs(depth+1) << "<normalisennhist value=\""<<boolStrEnc(normaliseNNHist)<< "\"/>"  << endl;
 			f << tabs(depth+1) << "<wantrandomnnhist value=\""<<boolStrEnc(wantRandomNNHist)<< "\"/>"  << endl;
+			f << tabs(depth+1) << "<wantpairrdf value=\""<<boolStrEnc(wantPairRDF)<< "\"/>"  << endl;
+			f << tabs(depth+1) << "<wantfftrdf value=\""<<boolStrEnc(wantFFTRDF)<< "\"/>"  << endl;
+			f << tabs(depth+1) << "<fftvoxelsize value=\""<<fftVoxelSize<< "\"/>"  << endl;
+			f << tabs(depth+1) << "<sdm3d value=\""<<boolStrEnc(want3DSDM)<< "\" bins=\"" << sdmBins << "\"/>"  << endl;
+			f << tabs(depth+1) << "<nnapproxerror value=\""<<nnApproxError<< "\"/>"  << endl;
 			f << tabs(depth+1) << "<distmax value=\""<<distMax<< "\"/>"  << endl;
 			f << tabs(depth+1) << "<numbins value=\""<<numBins<< "\"/>"  << endl;
 			f << tabs(depth+1) << "<excludesurface value=\""<<excludeSurface<< "\"/>"  << endl;
@@ -1880,6 +2255,9 @@ bool SpatialAnalysisFilter::writeState(std::ostream &f,unsigned int format, unsi
 						<< "\" theoreticfreqs=\""<< (int)showTheoreticFrequencies
 						<< "\" gridoverlay=\""<< (int)showGridOverlay 
 						<< "\"/>" << endl;
+			f << tabs(depth+1) << "<binomialsweep value=\""<<boolStrEnc(wantBinomialSweep)
+						<< "\" maxions=\"" << sweepMaxIons 
+						<< "\" steps=\"" << sweepSteps << "\"/>" << endl;
 
 			//--------------------------
 
@@ -1996,6 +2374,45 @@ bool SpatialAnalysisFilter::readState(xmlNodePtr &nodePtr, const std::string &st
 		wantRandomNNHist=false;
 	}
 	//===
+
+	//Retrieve species pair RDF mode. Did not exist in older files
+	//====== 
+	tmpNode = nodePtr;
+	if(!XMLGetNextElemAttrib(tmpNode,wantPairRDF,"wantpairrdf","value"))
+		wantPairRDF=false;
+	//===
+
+	//Retrieve FFT RDF mode and voxel size. Did not exist in older files
+	//====== 
+	tmpNode = nodePtr;
+	if(!XMLGetNextElemAttrib(tmpNode,wantFFTRDF,"wantfftrdf","value"))
+		wantFFTRDF=false;
+	tmpNode = nodePtr;
+	if(!XMLGetNextElemAttrib(tmpNode,fftVoxelSize,"fftvoxelsize","value")
+		|| fftVoxelSize <= 0.0f)
+		fftVoxelSize=0.25f;
+	//===
+
+	//Retrieve 3D SDM settings. Did not exist in older files
+	//====== 
+	tmpNode = nodePtr;
+	if(!XMLGetNextElemAttrib(tmpNode,want3DSDM,"sdm3d","value"))
+		want3DSDM=false;
+	tmpNode = nodePtr;
+	if(!XMLGetNextElemAttrib(tmpNode,sdmBins,"sdm3d","bins") || !sdmBins)
+		sdmBins=50;
+	//===
+
+	//Retrieve approximate NN error. Did not exist in older files,
+	// which used exact searches
+	//====== 
+	tmpNode = nodePtr;
+	if(!XMLGetNextElemAttrib(tmpNode,nnApproxError,"nnapproxerror","value")
+		|| nnApproxError < 0.0f)
+	{
+		nnApproxError=0;
+	}
+	//===
 	
 	//Retrieve distMax val
 	//====== 
@@ -2139,6 +2556,21 @@ bool SpatialAnalysisFilter::readState(xmlNodePtr &nodePtr, const std::string &st
 	else
 		nodePtr=tmpNode;
 
+	//Retrieve binomial block size sweep. Did not exist in older files
+	//====== 
+	tmpNode = nodePtr;
+	if(!XMLGetNextElemAttrib(tmpNode,wantBinomialSweep,"binomialsweep","value"))
+		wantBinomialSweep=false;
+	tmpNode = nodePtr;
+	if(!XMLGetNextElemAttrib(tmpNode,sweepMaxIons,"binomialsweep","maxions") 
+		|| sweepMaxIons <=1)
+		sweepMaxIons=1000;
+	tmpNode = nodePtr;
+	if(!XMLGetNextElemAttrib(tmpNode,sweepSteps,"binomialsweep","steps") 
+		|| sweepSteps < 2)
+		sweepSteps=10;
+	//===
+
 
 	//FIXME: COMPAT_BREAK : Earlier versions of the state file <= 1441:adaa3a3daa80
 	// do not contain this section, so we must be fault tolerant
@@ -2305,7 +2737,16 @@ size_t SpatialAnalysisFilter::algorithmRDF(ProgressData &progress, size_t totalD
 	if(*Filter::wantAbort)
 		return FILTER_ERR_ABORT;
 
+	if(wantFFTRDF && stopMode == STOP_MODE_RADIUS)
+		return algorithmRDFFFT(progress,totalDataSize,dataIn,getOut,rngF);
+
+	if(wantPairRDF && rngF && stopMode == STOP_MODE_RADIUS)
+		return algorithmRDFPairs(progress,totalDataSize,dataIn,getOut,rngF);
+
+	//NN analyses use the bucketed tree, which is faster for
+	// k-NN queries. Distance analyses use the original tree
 	K3DTree kdTree;
+	const K3DTreeBucket *bucketTree=0;
 	
 	//Source points
 	vector<Point3D> p;
@@ -2331,7 +2772,14 @@ size_t SpatialAnalysisFilter::algorithmRDF(ProgressData &progress, size_t totalD
 
 		//Build the tree using the target ions
 		//(its roughly nlogn timing, but worst case n^2)
-		kdTree.buildByRef(pts[1]);
+		if(stopMode == STOP_MODE_NEIGHBOUR)
+		{
+			if(SpatialIndexCache::getBucketTree(pts[1],bucketTree,
+				progress.filterProgress,*Filter::wantAbort) == SPATIALINDEX_ERR_MEMALLOC)
+				return ERR_BINOMIAL_NO_MEM;
+		}
+		else
+			kdTree.buildByRef(pts[1]);
 		if(*Filter::wantAbort)
 			return FILTER_ERR_ABORT;
 		pts[1].clear();
@@ -2339,38 +2787,10 @@ size_t SpatialAnalysisFilter::algorithmRDF(ProgressData &progress, size_t totalD
 		//Remove surface points from sources if desired
 		if(excludeSurface)
 		{
-			ASSERT(reductionDistance > 0);
-			progress.step++;
-			progress.stepName=TRANS("Surface");
-
-			if(*Filter::wantAbort)
-				return FILTER_ERR_ABORT;
-
-
-			//Take the input points, then use them
-			//to compute the convex hull reduced 
-			//volume. 
-			vector<Point3D> returnPoints;
-			errCode=GetReducedHullPts(pts[0],reductionDistance,
-					&progress.filterProgress,*(Filter::wantAbort),
-					returnPoints);
-			if(errCode ==1)
-				return INSUFFICIENT_SIZE_ERR;
-			else if(errCode)
-			{
-				ASSERT(false);
-				return ERR_ABORT_FAIL;
-			}
-			
-			if(*Filter::wantAbort)
-				return FILTER_ERR_ABORT;
-
-			pts[0].clear();
-			//Forget the original points, and use the new ones
-			p.swap(returnPoints);
+			if((errCode=removeSurfacePoints(progress,pts[0])))
+				return errCode;
 		}
-		else
-			p.swap(pts[0]);
+		p.swap(pts[0]);
 
 	}
 	else
@@ -2385,49 +2805,22 @@ size_t SpatialAnalysisFilter::algorithmRDF(ProgressData &progress, size_t totalD
 		treeDomain.setBounds(p);
 
 		//Build the tree (its roughly nlogn timing, but worst case n^2)
-		kdTree.buildByRef(p);
+		if(stopMode == STOP_MODE_NEIGHBOUR)
+		{
+			if(SpatialIndexCache::getBucketTree(p,bucketTree,
+				progress.filterProgress,*Filter::wantAbort) == SPATIALINDEX_ERR_MEMALLOC)
+				return ERR_BINOMIAL_NO_MEM;
+		}
+		else
+			kdTree.buildByRef(p);
 		if(*Filter::wantAbort)
 			return FILTER_ERR_ABORT;
 
 		//Remove surface points if desired
 		if(excludeSurface)
 		{
-			ASSERT(reductionDistance > 0);
-			progress.step++;
-			progress.stepName=TRANS("Surface");
-		
-			if(*Filter::wantAbort)
-				return FILTER_ERR_ABORT;
-
-
-			//Take the input points, then use them
-			//to compute the convex hull reduced 
-			//volume. 
-			vector<Point3D> returnPoints;
-			size_t errCode;
-			if((errCode=GetReducedHullPts(p,reductionDistance,
-					&progress.filterProgress, *Filter::wantAbort,
-					returnPoints)) )
-			{
-				if(errCode ==1)
-					return INSUFFICIENT_SIZE_ERR;
-				else if(errCode ==2)
-					return ERR_ABORT_FAIL;
-				else
-				{
-					ASSERT(false);
-					return ERR_ABORT_FAIL;
-				}
-			}
-
-
-
-			//Forget the original points, and use the new ones
-			p.swap(returnPoints);
-			
-			if(*Filter::wantAbort)
-				return FILTER_ERR_ABORT;
-
+			if((errCode=removeSurfacePoints(progress,p)))
+				return errCode;
 		}
 		
 	}
@@ -2437,7 +2830,7 @@ size_t SpatialAnalysisFilter::algorithmRDF(ProgressData &progress, size_t totalD
 	progress.stepName=TRANS("Analyse");
 
 	//If there is no data, there is nothing to do.
-	if(p.empty() || !kdTree.nodeCount())
+	if(p.empty() || (!kdTree.nodeCount() && (!bucketTree || bucketTree->empty())))
 		return	0;
 	
 	//OK, at this point, the KD tree contains the target points
@@ -2460,7 +2853,7 @@ size_t SpatialAnalysisFilter::algorithmRDF(ProgressData &progress, size_t totalD
 
 			unsigned int errCode;
 			//Run the analysis
-			errCode=generateNNHist(p,kdTree,nnMax,
+			errCode=generateNNHist(p,*bucketTree,nnMax,
 					numBins,histogram,binWidth,
 					&(progress.filterProgress),*Filter::wantAbort);
 			switch(errCode)
@@ -2477,6 +2870,11 @@ size_t SpatialAnalysisFilter::algorithmRDF(ProgressData &progress, size_t totalD
 					delete[] binWidth;
 					return ERR_ABORT_FAIL;
 				}
+				case RDF_ERR_MEMALLOC:
+				{
+					delete[] binWidth;
+					return ERR_BINOMIAL_NO_MEM;
+				}
 				default:
 					ASSERT(false);
 			}
@@ -2653,7 +3051,12 @@ size_t SpatialAnalysisFilter::algorithmRDF(ProgressData &progress, size_t totalD
 					warnBiasCount,&(progress.filterProgress),*(Filter::wantAbort));
 
 			if(errcode)
+			{
+				delete[] histogram;
+				if(errcode == RDF_ERR_MEMALLOC)
+					return ERR_BINOMIAL_NO_MEM;
 				return ERR_ABORT_FAIL;
+			}
 
 			if(warnBiasCount)
 			{
@@ -2717,6 +3120,336 @@ size_t SpatialAnalysisFilter::algorithmRDF(ProgressData &progress, size_t totalD
 	return 0;
 }
 
+size_t SpatialAnalysisFilter::algorithmRDFPairs(ProgressData &progress, size_t totalDataSize, 
+		const vector<const FilterStreamData *>  &dataIn, 
+		vector<const FilterStreamData * > &getOut,const RangeFile *rngF)
+{
+	ASSERT(rngF);
+	ASSERT(stopMode == STOP_MODE_RADIUS);
+
+	//Source (0) and target (1) points, and the ion ID of each point
+	vector<Point3D> pts[2];
+	vector<unsigned int> ionIDs[2];
+	size_t errCode;
+	if((errCode=buildLabelledSplitPoints(dataIn,progress,totalDataSize,
+			rngF,ionSourceEnabled, ionTargetEnabled,pts,ionIDs)))
+		return errCode;
+
+	progress.step=2;
+	progress.stepName=TRANS("Build");
+
+	//All pairs are found using a single search structure,
+	// containing every target ion
+	const CellList *cells;
+	unsigned int cellErr;
+	cellErr=SpatialIndexCache::getCellList(pts[1],distMax,cells,progress.filterProgress,*Filter::wantAbort);
+	if(cellErr == SPATIALINDEX_ERR_MEMALLOC)
+		return ERR_BINOMIAL_NO_MEM;
+	if(cellErr || *Filter::wantAbort)
+		return FILTER_ERR_ABORT;
+	pts[1].clear();
+
+	//Remove surface points from sources if desired
+	if(excludeSurface)
+	{
+		if((errCode=removeSurfacePoints(progress,pts[0],&ionIDs[0])))
+			return errCode;
+	}
+
+	progress.step++;
+	progress.stepName=TRANS("Analyse");
+
+	const unsigned int numSpecies=rngF->getNumIons();
+	vector<size_t> histogram;
+	switch(generatePairDistHist(pts[0],ionIDs[0],*cells,ionIDs[1],numSpecies,
+			distMax,numBins,histogram,&(progress.filterProgress),*(Filter::wantAbort)))
+	{
+		case 0:
+			break;
+		case RDF_ERR_MEMALLOC:
+			return ERR_BINOMIAL_NO_MEM;
+		case RDF_ABORT_FAIL:
+			return ERR_ABORT_FAIL;
+		default:
+			ASSERT(false);
+			return ERR_ABORT_FAIL;
+	}
+
+	//Output one plot per pair, coloured by the target species
+	for(unsigned int ui=0;ui<numSpecies;ui++)
+	{
+		if(ui >= ionSourceEnabled.size() || !ionSourceEnabled[ui])
+			continue;
+
+		for(unsigned int uj=0;uj<numSpecies;uj++)
+		{
+			if(uj >= ionTargetEnabled.size() || !ionTargetEnabled[uj])
+				continue;
+
+			PlotStreamData *plotData = new PlotStreamData;
+
+			plotData->plotMode=PLOT_MODE_1D;
+			plotData->index=ui*numSpecies+uj;
+			plotData->parent=this;
+			plotData->xLabel=TRANS("Radial Distance");
+			plotData->yLabel=TRANS("Count");
+			plotData->dataLabel=getUserString() + string(" ") + rngF->getName(ui) +
+						string("-") + rngF->getName(uj) + TRANS(" RDF");
+
+			RGBf colour=rngF->getColour(uj);
+			plotData->r=colour.red;
+			plotData->g=colour.green;
+			plotData->b=colour.blue;
+
+			const size_t *counts=&histogram[(ui*numSpecies+uj)*numBins];
+			plotData->xyData.resize(numBins);
+			for(unsigned int uk=0;uk<numBins;uk++)
+			{
+				float dist;
+				dist = (float)uk/(float)numBins*distMax;
+				plotData->xyData[uk] = std::make_pair(dist,(float)counts[uk]);
+			}
+
+			cacheAsNeeded(plotData);
+			getOut.push_back(plotData);
+		}
+	}
+
+	//Propagate non-ion/range data
+	for(unsigned int ui=0;ui<dataIn.size() ;ui++)
+	{
+		switch(dataIn[ui]->getStreamType())
+		{
+			case STREAM_TYPE_IONS:
+			case STREAM_TYPE_RANGE: 
+				//Do not propagate ranges, or ions
+			break;
+			default:
+				getOut.push_back(dataIn[ui]);
+				break;
+		}
+	}
+
+	return 0;
+}
+
+size_t SpatialAnalysisFilter::algorithmRDFFFT(ProgressData &progress, size_t totalDataSize, 
+		const vector<const FilterStreamData *>  &dataIn, 
+		vector<const FilterStreamData * > &getOut,const RangeFile *rngF)
+{
+	ASSERT(stopMode == STOP_MODE_RADIUS);
+
+	progress.step=1;
+	progress.stepName=TRANS("Collate");
+	progress.maxStep=2;
+
+	//Points for each group to be correlated, the pairs of groups
+	// to correlate, and the label, plot index and colour of each pair
+	vector<vector<Point3D> > groupPts;
+	vector<pair<unsigned int, unsigned int> > pairs;
+	vector<string> pairNames;
+	vector<unsigned int> plotIndices;
+	vector<ColourRGBAf> pairColours;
+
+	size_t errCode;
+	if(rngF && wantPairRDF)
+	{
+		//One group per species, for each species that is a source or target
+		vector<bool> anyEnabled(ionSourceEnabled.size());
+		for(size_t ui=0;ui<anyEnabled.size();ui++)
+			anyEnabled[ui]=ionSourceEnabled[ui] || ionTargetEnabled[ui];
+
+		vector<Point3D> pts[2];
+		vector<unsigned int> ionIDs[2];
+		if((errCode=buildLabelledSplitPoints(dataIn,progress,totalDataSize,
+				rngF,anyEnabled,vector<bool>(),pts,ionIDs)))
+			return errCode;
+
+		const unsigned int numSpecies=rngF->getNumIons();
+		vector<unsigned int> groupOfSpecies(numSpecies,(unsigned int)-1);
+		for(unsigned int ui=0;ui<anyEnabled.size() && ui < numSpecies;ui++)
+		{
+			if(!anyEnabled[ui])
+				continue;
+			groupOfSpecies[ui]=groupPts.size();
+			groupPts.push_back(vector<Point3D>());
+		}
+
+		for(size_t ui=0;ui<pts[0].size();ui++)
+			groupPts[groupOfSpecies[ionIDs[0][ui]]].push_back(pts[0][ui]);
+		pts[0].clear();
+		ionIDs[0].clear();
+
+		for(unsigned int ui=0;ui<numSpecies;ui++)
+		{
+			if(ui >= ionSourceEnabled.size() || !ionSourceEnabled[ui])
+				continue;
+			for(unsigned int uj=0;uj<numSpecies;uj++)
+			{
+				if(uj >= ionTargetEnabled.size() || !ionTargetEnabled[uj])
+					continue;
+
+				pairs.push_back(std::make_pair(groupOfSpecies[ui],groupOfSpecies[uj]));
+				pairNames.push_back(rngF->getName(ui) + string("-") + rngF->getName(uj));
+				plotIndices.push_back(ui*numSpecies+uj);
+				RGBf colour=rngF->getColour(uj);
+				pairColours.push_back(ColourRGBAf(colour.red,colour.green,colour.blue));
+			}
+		}
+	}
+	else
+	{
+		if(rngF && ((size_t)std::count(ionSourceEnabled.begin(),ionSourceEnabled.end(),true)!=ionSourceEnabled.size()
+			|| (size_t)std::count(ionTargetEnabled.begin(),ionTargetEnabled.end(),true)!=ionTargetEnabled.size()))
+		{
+			//Correlate the source ions against the target ions
+			groupPts.resize(2);
+			if((errCode=buildSplitPoints(dataIn,progress,totalDataSize,
+					rngF,ionSourceEnabled, ionTargetEnabled,groupPts[0],groupPts[1])))
+				return errCode;
+			pairs.push_back(std::make_pair(0u,1u));
+		}
+		else
+		{
+			groupPts.resize(1);
+			if((errCode=buildMonolithicPoints(dataIn,progress,totalDataSize,groupPts[0])))
+				return errCode;
+			pairs.push_back(std::make_pair(0u,0u));
+		}
+		pairNames.push_back(string(""));
+		plotIndices.push_back(0);
+		pairColours.push_back(rgba);
+	}
+
+	if(*Filter::wantAbort)
+		return FILTER_ERR_ABORT;
+
+	progress.step=2;
+	progress.stepName=TRANS("Correlate");
+	progress.filterProgress=0;
+
+	vector<const vector<Point3D> *> groups(groupPts.size());
+	for(size_t ui=0;ui<groupPts.size();ui++)
+		groups[ui]=&groupPts[ui];
+
+	vector<vector<float> > gr;
+	vector<bool> binValid;
+	switch(generateFFTPairCorrelation(groups,pairs,fftVoxelSize,distMax,numBins,
+			gr,binValid,&(progress.filterProgress),*(Filter::wantAbort)))
+	{
+		case 0:
+			break;
+		case PAIRCORR_ERR_ABORT:
+			return ERR_ABORT_FAIL;
+		case PAIRCORR_ERR_MEMALLOC:
+			return ERR_BINOMIAL_NO_MEM;
+		case PAIRCORR_ERR_GRID_TOO_LARGE:
+			return ERR_FFT_GRID_SIZE;
+		default:
+			ASSERT(false);
+			return ERR_ABORT_FAIL;
+	}
+	groupPts.clear();
+
+	//Emit one plot per pair. Bins finer than the voxel spacing
+	// may hold no grid offsets, and are left out
+	for(size_t ui=0;ui<pairs.size();ui++)
+	{
+		PlotStreamData *plotData = new PlotStreamData;
+
+		plotData->plotMode=PLOT_MODE_1D;
+		plotData->index=plotIndices[ui];
+		plotData->parent=this;
+		plotData->xLabel=TRANS("Radial Distance");
+		plotData->yLabel=TRANS("g(r)");
+		if(pairNames[ui].empty())
+			plotData->dataLabel=getUserString() + TRANS(" g(r)");
+		else
+			plotData->dataLabel=getUserString() + string(" ") + pairNames[ui] + TRANS(" g(r)");
+
+		plotData->r=pairColours[ui].r();
+		plotData->g=pairColours[ui].g();
+		plotData->b=pairColours[ui].b();
+
+		plotData->xyData.reserve(numBins);
+		for(unsigned int uj=0;uj<numBins;uj++)
+		{
+			if(!binValid[uj])
+				continue;
+
+			float dist;
+			dist = (float)uj/(float)numBins*distMax;
+			plotData->xyData.push_back(std::make_pair(dist,gr[ui][uj]));
+		}
+
+		cacheAsNeeded(plotData);
+		getOut.push_back(plotData);
+	}
+
+	//Propagate non-ion/range data
+	for(unsigned int ui=0;ui<dataIn.size() ;ui++)
+	{
+		switch(dataIn[ui]->getStreamType())
+		{
+			case STREAM_TYPE_IONS:
+			case STREAM_TYPE_RANGE: 
+				//Do not propagate ranges, or ions
+			break;
+			default:
+				getOut.push_back(dataIn[ui]);
+				break;
+		}
+	}
+
+	return 0;
+}
+
+size_t SpatialAnalysisFilter::removeSurfacePoints(ProgressData &progress, vector<Point3D> &pts,
+		vector<unsigned int> *ionIDs) const
+{
+	ASSERT(reductionDistance > 0);
+	ASSERT(!ionIDs || ionIDs->size() == pts.size());
+	progress.step++;
+	progress.stepName=TRANS("Surface");
+	progress.filterProgress=0;
+
+	if(*Filter::wantAbort)
+		return FILTER_ERR_ABORT;
+
+	//Find the points inside the convex hull, once it
+	// has been shrunk by the reduction distance
+	vector<size_t> inside;
+	switch(GetReducedHullPts(pts,reductionDistance,
+			&progress.filterProgress,*(Filter::wantAbort),inside))
+	{
+		case 0:
+			break;
+		case 1:
+			return INSUFFICIENT_SIZE_ERR;
+		case RDF_ERR_MEMALLOC:
+			return ERR_BINOMIAL_NO_MEM;
+		default:
+			return ERR_ABORT_FAIL;
+	}
+
+	if(*Filter::wantAbort)
+		return FILTER_ERR_ABORT;
+
+	//Compact the retained points in place. Offsets are ascending,
+	// so no point is overwritten before it is moved
+	for(size_t ui=0;ui<inside.size();ui++)
+	{
+		pts[ui]=pts[inside[ui]];
+		if(ionIDs)
+			(*ionIDs)[ui]=(*ionIDs)[inside[ui]];
+	}
+	pts.resize(inside.size());
+	if(ionIDs)
+		ionIDs->resize(inside.size());
+
+	return 0;
+}
+
 size_t SpatialAnalysisFilter::algorithmDensity(ProgressData &progress, 
 	size_t totalDataSize, const vector<const FilterStreamData *>  &dataIn, 
 		vector<const FilterStreamData * > &getOut)
@@ -2735,17 +3468,26 @@ size_t SpatialAnalysisFilter::algorithmDensity(ProgressData &progress,
 	if(*Filter::wantAbort)
 		return FILTER_ERR_ABORT;
 
-	BoundCube treeDomain;
-	treeDomain.setBounds(p);
-
-	//Build the tree (its roughly nlogn timing, but worst case n^2)
-	K3DTree kdTree;
-	kdTree.buildByRef(p);
-
+	//Obtain the search structure. Fixed radius searches use a cell list,
+	// neighbour searches a tree (its roughly nlogn timing, but worst case n^2)
+	const K3DTreeBucket *kdTree=0;
+	const CellList *cells=0;
+	unsigned int cellErr=0,treeErr=0;
+	if(stopMode == STOP_MODE_RADIUS)
+		cellErr=SpatialIndexCache::getCellList(p,distMax,cells,progress.filterProgress,*Filter::wantAbort);
+	else
+		treeErr=SpatialIndexCache::getBucketTree(p,kdTree,progress.filterProgress,*Filter::wantAbort);
 
-	if(*Filter::wantAbort)
+	if(cellErr == SPATIALINDEX_ERR_MEMALLOC || treeErr == SPATIALINDEX_ERR_MEMALLOC)
+		return ERR_BINOMIAL_NO_MEM;
+	if((!kdTree && !cells) || *Filter::wantAbort)
 		return FILTER_ERR_ABORT;
 
+	//Keep some points to measure the error of approximate searches
+	vector<Point3D> errorSamples;
+	if(kdTree && nnApproxError > 0.0f)
+		sampleApproxNNPoints(p,errorSamples);
+
 	p.clear(); //We don't need pts any more, as tree *is* a copy.
 
 	//Its algorithm time!
@@ -2773,155 +3515,101 @@ size_t SpatialAnalysisFilter::algorithmDensity(ProgressData &progress,
 				IonStreamData *newD = new IonStreamData;
 				newD->parent=this;
 
-				//Adjust this number to provide more update than usual, because we
-				//are not doing an o(1) task between updates; yes, it is a hack
-				unsigned int curProg=NUM_CALLBACK/(10*nnMax);
 				newD->data.resize(d->data.size());
-				if(stopMode == STOP_MODE_NEIGHBOUR)
+
+				//Fixed volume, used for radius mode
+				const float maxSqrRad = distMax*distMax;
+				const float vol = 4.0/3.0*M_PI*maxSqrRad*distMax; //Sphere volume=4/3 Pi R^3
+
+				//Ions are queried in blocks, to amortise the tree traversal costs
+				const size_t numBlocks=(d->data.size()+KDBUCKET_QUERY_BLOCK-1)/KDBUCKET_QUERY_BLOCK;
+				bool spin=false;
+				#pragma omp parallel
 				{
-					bool spin=false;
-					#pragma omp parallel for shared(spin)
-					for(size_t uj=0;uj<d->data.size();uj++)
+					vector<Point3D> queries(KDBUCKET_QUERY_BLOCK);
+					vector<float> sqrDists;
+					vector<size_t> indices,counts;
+					if(stopMode == STOP_MODE_NEIGHBOUR)
+					{
+						sqrDists.resize(KDBUCKET_QUERY_BLOCK*nnMax);
+						indices.resize(KDBUCKET_QUERY_BLOCK*nnMax);
+					}
+					else
+						counts.resize(KDBUCKET_QUERY_BLOCK);
+
+					#pragma omp for schedule(dynamic)
+					for(size_t uj=0;uj<numBlocks;uj++)
 					{
 						if(spin)
 							continue;
-						Point3D r;
-						vector<const Point3D *> res;
-						r=d->data[uj].getPosRef();
-						
-						//Assign the mass to charge using nn density estimates
-						kdTree.findKNearest(r,treeDomain,nnMax,res);
 
-						if(res.size())
-						{	
-							float maxSqrRad;
+						size_t start=uj*KDBUCKET_QUERY_BLOCK;
+						size_t nQueries=std::min((size_t)KDBUCKET_QUERY_BLOCK,d->data.size()-start);
+						for(size_t uk=0;uk<nQueries;uk++)
+							queries[uk]=d->data[start+uk].getPosRef();
 
-							//Get the radius as the furthest object
-							maxSqrRad= (res[res.size()-1]->sqrDist(r));
+						if(stopMode == STOP_MODE_NEIGHBOUR)
+						{
+							//Assign the mass to charge using nn density estimates.
+							// Zero-distance (self) matches are not counted
+							kdTree->findKNearest(&queries[0],nQueries,nnMax,0.0f,
+									&sqrDists[0],&indices[0],nnApproxError);
+							for(size_t uk=0;uk<nQueries;uk++)
+							{
+								//Get the radius as the furthest object
+								unsigned int numFound=0;
+								float maxSqrRad=0;
+								while(numFound < nnMax && indices[uk*nnMax+numFound] != (size_t)-1)
+								{
+									maxSqrRad=sqrDists[uk*nnMax+numFound];
+									numFound++;
+								}
 
-							//Set the mass as the volume of sphere * the number of NN
-							newD->data[uj].setMassToCharge(res.size()/(4.0/3.0*M_PI*powf(maxSqrRad,3.0/2.0)));
-							//Keep original position
-							newD->data[uj].setPos(r);
+								if(numFound)
+								{
+									//Set the mass as the volume of sphere * the number of NN
+									newD->data[start+uk].setMassToCharge(numFound/(4.0/3.0*M_PI*powf(maxSqrRad,3.0/2.0)));
+								}
+								else
+								{
+									#pragma omp critical
+									badPts.push_back(make_pair(start+uk,ui));
+								}
+							}
 						}
 						else
 						{
-							#pragma omp critical
-							badPts.push_back(make_pair(uj,ui));
+							ASSERT(stopMode == STOP_MODE_RADIUS);
+							cells->countInSphere(&queries[0],nQueries,maxSqrRad,0.0f,&counts[0]);
+							//Set the mass as the volume of sphere * the number of NN
+							for(size_t uk=0;uk<nQueries;uk++)
+								newD->data[start+uk].setMassToCharge(counts[uk]/vol);
 						}
 
-						res.clear();
-						
+						//Keep original position
+						for(size_t uk=0;uk<nQueries;uk++)
+							newD->data[start+uk].setPos(queries[uk]);
+
 						//Update progress as needed
-						if(!curProg--)
+						#pragma omp atomic
+						n+=nQueries;
+#ifdef _OPENMP
+						if(!omp_get_thread_num())
+#endif
 						{
-							#pragma omp critical 
-							{
-							n+=NUM_CALLBACK/(nnMax);
 							progress.filterProgress= (unsigned int)(((float)n/(float)totalDataSize)*100.0f);
 							if(*Filter::wantAbort)
 								spin=true;
-							curProg=NUM_CALLBACK/(nnMax);
-							}
 						}
 					}
-
-					if(spin)
-					{
-						delete newD;
-						return ERR_ABORT_FAIL;
-					}
-
-
 				}
-				else if(stopMode == STOP_MODE_RADIUS)
-				{
-#ifdef _OPENMP
-					bool spin=false;
-#endif
-					float maxSqrRad = distMax*distMax;
-					float vol = 4.0/3.0*M_PI*maxSqrRad*distMax; //Sphere volume=4/3 Pi R^3
-					#pragma omp parallel for shared(spin) firstprivate(treeDomain,curProg)
-					for(size_t uj=0;uj<d->data.size();uj++)
-					{
-						Point3D r;
-						const Point3D *res;
-						float deadDistSqr;
-						unsigned int numInRad;
-#ifdef _OPENMP
-						if(spin)
-							continue;
-#endif	
-						r=d->data[uj].getPosRef();
-						numInRad=0;
-						deadDistSqr=0;
-
-						//Assign the mass to charge using nn density estimates
-						//TODO: Use multi-neareast search algorithm?
-						do
-						{
-							res=kdTree.findNearest(r,treeDomain,deadDistSqr);
 
-							//Check to see if we found something
-							if(!res)
-							{
-#pragma omp critical
-								badPts.push_back(make_pair(uj, ui));
-								break;
-							}
-							
-							if(res->sqrDist(r) >maxSqrRad)
-								break;
-							numInRad++;
-							//Advance ever so slightly beyond the next ion
-							deadDistSqr = res->sqrDist(r)+std::numeric_limits<float>::epsilon();
-							//Update progress as needed
-							if(!curProg--)
-							{
-#pragma omp critical
-								{
-								progress.filterProgress= (unsigned int)((float)n/(float)totalDataSize*100.0f);
-								if(*Filter::wantAbort)
-								{
-#ifdef _OPENMP
-									spin=true;
-#else
-									delete newD;
-									return ERR_ABORT_FAIL;
-#endif
-								}
-								}
-#ifdef _OPENMP
-								if(spin)
-									break;
-#endif
-								curProg=NUM_CALLBACK/(10*nnMax);
-							}
-						}while(true);
-						
-						n++;
-						//Set the mass as the volume of sphere * the number of NN
-						newD->data[uj].setMassToCharge(numInRad/vol);
-						//Keep original position
-						newD->data[uj].setPos(r);
-						
-					}
-
-#ifdef _OPENMP
-					if(spin)
-					{
-						delete newD;
-						return ERR_ABORT_FAIL;
-					}
-#endif
-				}
-				else
+				if(spin)
 				{
-					//Should not get here.
-					ASSERT(false);
+					delete newD;
+					return ERR_ABORT_FAIL;
 				}
 
-
 				//move any bad points from the array to the end, then drop them
 				//To do this, we have to reverse sort the array, then
 				//swap the output ion vector entries with the end,
@@ -2969,6 +3657,9 @@ size_t SpatialAnalysisFilter::algorithmDensity(ProgressData &progress,
 
 	progress.filterProgress=100;
 
+	if(!errorSamples.empty())
+		reportApproxNNError(*kdTree,errorSamples,nnMax,nnApproxError,consoleOutput);
+
 	//If we have bad points, let the user know.
 	if(!badPts.empty())
 	{
@@ -3024,17 +3715,27 @@ size_t SpatialAnalysisFilter::algorithmDensityFilter(ProgressData &progress,
 	if(*Filter::wantAbort)
 		return FILTER_ERR_ABORT;
 
-	BoundCube treeDomain;
-	treeDomain.setBounds(p);
-
-	//Build the tree (its roughly nlogn timing, but worst case n^2)
-	K3DTree kdTree;
-	kdTree.buildByRef(p);
-
+	//Build the tree (its roughly nlogn timing, but worst case n^2),
+	// or for fixed radius searches, the cell list
+	const K3DTreeBucket *kdTree=0;
+	const CellList *cells=0;
+	unsigned int cellErr=0,treeErr=0;
+	if(stopMode == STOP_MODE_RADIUS)
+		cellErr=SpatialIndexCache::getCellList(p,distMax,cells,progress.filterProgress,*Filter::wantAbort);
+	else
+		treeErr=SpatialIndexCache::getBucketTree(p,kdTree,progress.filterProgress,*Filter::wantAbort);
 
+	if(cellErr == SPATIALINDEX_ERR_MEMALLOC || treeErr == SPATIALINDEX_ERR_MEMALLOC)
+		return ERR_BINOMIAL_NO_MEM;
 	//Update progress 
-	if(*Filter::wantAbort)
+	if((!kdTree && !cells) || *Filter::wantAbort)
 		return FILTER_ERR_ABORT;
+
+	//Keep some points to measure the error of approximate searches
+	vector<Point3D> errorSamples;
+	if(kdTree && nnApproxError > 0.0f)
+		sampleApproxNNPoints(p,errorSamples);
+
 	p.clear(); //We don't need pts any more, as tree *is* a copy.
 
 
@@ -3063,61 +3764,69 @@ size_t SpatialAnalysisFilter::algorithmDensityFilter(ProgressData &progress,
 				IonStreamData *newD = new IonStreamData;
 				newD->parent=this;
 
-				//Adjust this number to provide more update thanusual, because we
-				//are not doing an o(1) task between updates; yes, it is a hack
-				unsigned int curProg=NUM_CALLBACK/(10*nnMax);
 				newD->data.reserve(d->data.size());
+
+				//Ions are queried in blocks, and their keep flags recorded
+				// so the output retains the input order
+				vector<char> keep(d->data.size());
+				const size_t numBlocks=(d->data.size()+KDBUCKET_QUERY_BLOCK-1)/KDBUCKET_QUERY_BLOCK;
 				if(stopMode == STOP_MODE_NEIGHBOUR)
 				{
 					bool spin=false;
-					#pragma omp parallel for shared(spin)
-					for(size_t uj=0;uj<d->data.size();uj++)
+					#pragma omp parallel
 					{
-						if(spin)
-							continue;
-						Point3D r;
-						vector<const Point3D *> res;
-						r=d->data[uj].getPosRef();
-						
-						//Assign the mass to charge using nn density estimates
-						kdTree.findKNearest(r,treeDomain,nnMax,res);
-
-						if(res.size())
-						{	
-							float maxSqrRad;
-
-							//Get the radius as the furthest object
-							maxSqrRad= (res[res.size()-1]->sqrDist(r));
-
-
-							float density;
-							density = res.size()/(4.0/3.0*M_PI*powf(maxSqrRad,3.0/2.0));
-
-							if(xorFunc((density <=densityCutoff), keepDensityUpper))
+						vector<Point3D> queries(KDBUCKET_QUERY_BLOCK);
+						vector<float> sqrDists(KDBUCKET_QUERY_BLOCK*nnMax);
+						vector<size_t> indices(KDBUCKET_QUERY_BLOCK*nnMax);
+						#pragma omp for schedule(dynamic)
+						for(size_t uj=0;uj<numBlocks;uj++)
+						{
+							if(spin)
+								continue;
+
+							size_t start=uj*KDBUCKET_QUERY_BLOCK;
+							size_t nQueries=std::min((size_t)KDBUCKET_QUERY_BLOCK,d->data.size()-start);
+							for(size_t uk=0;uk<nQueries;uk++)
+								queries[uk]=d->data[start+uk].getPosRef();
+
+							//Assign the mass to charge using nn density estimates.
+							// Zero-distance (self) matches are not counted
+							kdTree->findKNearest(&queries[0],nQueries,nnMax,0.0f,
+									&sqrDists[0],&indices[0],nnApproxError);
+							for(size_t uk=0;uk<nQueries;uk++)
 							{
-#pragma omp critical
-								newD->data.push_back(d->data[uj]);
-							}
+								//Get the radius as the furthest object
+								unsigned int numFound=0;
+								float maxSqrRad=0;
+								while(numFound < nnMax && indices[uk*nnMax+numFound] != (size_t)-1)
+								{
+									maxSqrRad=sqrDists[uk*nnMax+numFound];
+									numFound++;
+								}
 
-						}
-						else
-						{
-							#pragma omp critical
-							badPts.push_back(make_pair(uj,ui));
-						}
+								if(numFound)
+								{
+									float density;
+									density = numFound/(4.0/3.0*M_PI*powf(maxSqrRad,3.0/2.0));
+									keep[start+uk]=xorFunc((density <=densityCutoff), keepDensityUpper);
+								}
+								else
+								{
+									keep[start+uk]=false;
+									#pragma omp critical
+									badPts.push_back(make_pair(start+uk,ui));
+								}
+							}
 
-						res.clear();
-						
-						//Update progress as needed
-						if(!curProg--)
-						{
-							#pragma omp critical 
+							#pragma omp atomic
+							n+=nQueries;
+#ifdef _OPENMP
+							if(!omp_get_thread_num())
+#endif
 							{
-							n+=NUM_CALLBACK/(nnMax);
-							progress.filterProgress= (unsigned int)(((float)n/(float)totalDataSize)*100.0f);
-							if(*Filter::wantAbort)
-								spin=true;
-							curProg=NUM_CALLBACK/(nnMax);
+								progress.filterProgress= (unsigned int)((float)n/(float)totalDataSize*100.0f);
+								if(*Filter::wantAbort)
+									spin=true;
 							}
 						}
 					}
@@ -3127,92 +3836,55 @@ size_t SpatialAnalysisFilter::algorithmDensityFilter(ProgressData &progress,
 						delete newD;
 						return ERR_ABORT_FAIL;
 					}
-
-
 				}
 				else if(stopMode == STOP_MODE_RADIUS)
 				{
-#ifdef _OPENMP
 					bool spin=false;
-#endif
-					float maxSqrRad = distMax*distMax;
-					float vol = 4.0/3.0*M_PI*maxSqrRad*distMax; //Sphere volume=4/3 Pi R^3
-					#pragma omp parallel for shared(spin) firstprivate(treeDomain,curProg)
-					for(size_t uj=0;uj<d->data.size();uj++)
-					{
-						Point3D r;
-						const Point3D *res;
-						float deadDistSqr;
-						unsigned int numInRad;
-#ifdef _OPENMP
-						if(spin)
-							continue;
-#endif	
-						r=d->data[uj].getPosRef();
-						numInRad=0;
-						deadDistSqr=0;
+					const float maxSqrRad = distMax*distMax;
+					const float vol = 4.0/3.0*M_PI*maxSqrRad*distMax; //Sphere volume=4/3 Pi R^3
 
-						//Assign the mass to charge using nn density estimates
-						do
+					#pragma omp parallel
+					{
+						vector<Point3D> queries(KDBUCKET_QUERY_BLOCK);
+						vector<size_t> counts(KDBUCKET_QUERY_BLOCK);
+						#pragma omp for schedule(dynamic)
+						for(size_t uj=0;uj<numBlocks;uj++)
 						{
-							res=kdTree.findNearest(r,treeDomain,deadDistSqr);
+							if(spin)
+								continue;
+
+							size_t start=uj*KDBUCKET_QUERY_BLOCK;
+							size_t nQueries=std::min((size_t)KDBUCKET_QUERY_BLOCK,d->data.size()-start);
+							for(size_t uk=0;uk<nQueries;uk++)
+								queries[uk]=d->data[start+uk].getPosRef();
 
-							//Check to see if we found something
-							if(!res)
+							//Zero-distance (self) matches are not counted
+							cells->countInSphere(&queries[0],nQueries,maxSqrRad,0.0f,&counts[0]);
+							for(size_t uk=0;uk<nQueries;uk++)
 							{
-#pragma omp critical
-								badPts.push_back(make_pair(uj, ui));
-								break;
+								float density;
+								density = counts[uk]/vol;
+								keep[start+uk]=xorFunc((density <=densityCutoff), keepDensityUpper);
 							}
-							
-							if(res->sqrDist(r) >maxSqrRad)
-								break;
-							numInRad++;
-							//Advance ever so slightly beyond the next ion
-							deadDistSqr = res->sqrDist(r)+std::numeric_limits<float>::epsilon();
-							//Update progress as needed
-							if(!curProg--)
+
+							#pragma omp atomic
+							n+=nQueries;
+#ifdef _OPENMP
+							if(!omp_get_thread_num())
+#endif
 							{
-#pragma omp critical
-								{
 								progress.filterProgress= (unsigned int)((float)n/(float)totalDataSize*100.0f);
 								if(*Filter::wantAbort)
-								{
-#ifdef _OPENMP
 									spin=true;
-#else
-									delete newD;
-									return ERR_ABORT_FAIL;
-#endif
-								}
-								}
-#ifdef _OPENMP
-								if(spin)
-									break;
-#endif
-								curProg=NUM_CALLBACK/(10*nnMax);
 							}
-						}while(true);
-						
-						n++;
-						float density;
-						density = numInRad/vol;
-
-						if(xorFunc((density <=densityCutoff), keepDensityUpper))
-						{
-#pragma omp critical
-							newD->data.push_back(d->data[uj]);
 						}
-						
 					}
 
-#ifdef _OPENMP
 					if(spin)
 					{
 						delete newD;
 						return ERR_ABORT_FAIL;
 					}
-#endif
 				}
 				else
 				{
@@ -3220,25 +3892,13 @@ size_t SpatialAnalysisFilter::algorithmDensityFilter(ProgressData &progress,
 					ASSERT(false);
 				}
 
-
-				//move any bad points from the array to the end, then drop them
-				//To do this, we have to reverse sort the array, then
-				//swap the output ion vector entries with the end,
-				//then do a resize.
-				ComparePairFirst cmp;
-				badPts.sort(cmp);
-				badPts.reverse();
-
-				//Do some swappage
-				size_t pos=1;
-				for(std::list<std::pair<size_t,size_t> >::iterator it=badPts.begin(); it!=badPts.end();++it)
+				//Copy out the kept points. Un-analysable points are never kept
+				for(size_t uj=0;uj<keep.size();uj++)
 				{
-					newD->data[(*it).first]=newD->data[newD->data.size()-pos];
+					if(keep[uj])
+						newD->data.push_back(d->data[uj]);
 				}
 
-				//Trim the tail of bad points, leaving only good points
-				newD->data.resize(newD->data.size()-badPts.size());
-
 
 				if(newD->data.size())
 				{
@@ -3248,6 +3908,8 @@ size_t SpatialAnalysisFilter::algorithmDensityFilter(ProgressData &progress,
 					newD->b=d->b;
 					newD->a=d->a;
 					newD->ionSize=d->ionSize;
+					//Kept points retain their input order
+					newD->spatialOrder=d->spatialOrder;
 					newD->valueType=TRANS("Number Density (\\#/Vol^3)");
 
 					//Cache result as needed
@@ -3263,6 +3925,9 @@ size_t SpatialAnalysisFilter::algorithmDensityFilter(ProgressData &progress,
 				break;
 		}
 	}
+	if(!errorSamples.empty())
+		reportApproxNNError(*kdTree,errorSamples,nnMax,nnApproxError,consoleOutput);
+
 	//If we have bad points, let the user know.
 	if(!badPts.empty())
 	{
@@ -3548,9 +4213,25 @@ size_t SpatialAnalysisFilter::algorithmAxialDf(ProgressData &progress,
 	IonHit::getPoints(ionsOutside,dest);
 	ionsOutside.clear();
 
+	//The 3D map uses a fixed radius search, and so a cell list
+	const bool want3D = (want3DSDM && stopMode == STOP_MODE_RADIUS);
 	K3DTree tree;
-
-	tree.buildByRef(dest);
+	const CellList *cells=0;
+	if(want3D)
+	{
+		switch(SpatialIndexCache::getCellList(dest,distMax,cells,
+					progress.filterProgress,*Filter::wantAbort))
+		{
+			case 0:
+				break;
+			case SPATIALINDEX_ERR_MEMALLOC:
+				return ERR_BINOMIAL_NO_MEM;
+			default:
+				return FILTER_ERR_ABORT;
+		}
+	}
+	else
+		tree.buildByRef(dest);
 	if(*Filter::wantAbort)
 		return FILTER_ERR_ABORT;
 
@@ -3564,6 +4245,8 @@ size_t SpatialAnalysisFilter::algorithmAxialDf(ProgressData &progress,
 	float binWidth;
 	//OK, so now we have two datasets that need to be analysed. Lets do it
 	unsigned int errCode;
+	//3D map of neighbour vectors, if wanted
+	vector<size_t> sdmHist;
 
 	bool histOK=false;
 	switch(stopMode)
@@ -3584,8 +4267,19 @@ size_t SpatialAnalysisFilter::algorithmAxialDf(ProgressData &progress,
 			Point3D axisNormal=vectorParams[1];
 			axisNormal.normalise();
 
-			errCode=generate1DAxialDistHist(src,tree,axisNormal, histogram,
+			if(want3D)
+			{
+				//Bin every neighbour vector in 3D, and along the
+				// axis, in one pass
+				errCode=generate3DDistHist(src,*cells,dest,distMax,sdmBins,
+					sdmHist,axisNormal,numBins,histogram,
+					&progress.filterProgress,*Filter::wantAbort);
+			}
+			else
+			{
+				errCode=generate1DAxialDistHist(src,tree,axisNormal, histogram,
 					distMax,numBins,&progress.filterProgress,*Filter::wantAbort);
+			}
 
 			histOK = (errCode ==0);
 			break;
@@ -3607,6 +4301,9 @@ size_t SpatialAnalysisFilter::algorithmAxialDf(ProgressData &progress,
 		case RDF_ABORT_FAIL:
 			errCode=ERR_ABORT_FAIL;
 			break;
+		case RDF_ERR_MEMALLOC:
+			errCode=ERR_BINOMIAL_NO_MEM;
+			break;
 		default:
 			ASSERT(false);
 	}
@@ -3657,6 +4354,37 @@ size_t SpatialAnalysisFilter::algorithmAxialDf(ProgressData &progress,
 
 	delete[] histogram;
 
+	if(histOK && want3D)
+	{
+		VoxelStreamData *vs = new VoxelStreamData;
+		vs->parent=this;
+		Point3D mapBound(distMax,distMax,distMax);
+		if(vs->data->resize(sdmBins,sdmBins,sdmBins,-mapBound,mapBound))
+		{
+			delete vs;
+			return ERR_BINOMIAL_NO_MEM;
+		}
+
+		size_t idx=0;
+		for(size_t uk=0;uk<sdmBins;uk++)
+		{
+			for(size_t uj=0;uj<sdmBins;uj++)
+			{
+				for(size_t ui=0;ui<sdmBins;ui++,idx++)
+					vs->data->setData(ui,uj,uk,(float)sdmHist[idx]);
+			}
+		}
+		sdmHist.clear();
+
+		vs->representationType=VOXEL_REPRESENT_POINTCLOUD;
+		vs->r=rgba.r();
+		vs->g=rgba.g();
+		vs->b=rgba.b();
+
+		cacheAsNeeded(vs);
+		getOut.push_back(vs);
+	}
+
 	//Propagate non-ion/range data
 	for(unsigned int ui=0;ui<dataIn.size() ;ui++)
 	{
@@ -3717,6 +4445,145 @@ size_t SpatialAnalysisFilter::algorithmBinomial(ProgressData &progress,
 			selectedIons.push_back(ui);
 	}
 
+	if(wantBinomialSweep)
+	{
+		//Range and sort the ions once, then bin each block size
+		// from the same prepared ions
+		BINOMIAL_IONS prepared;
+		errCode=prepareBinomialIons(ions,rngF,selectedIons,
+					extrusionDirection,prepared);
+		if(errCode)
+			return ERR_BINOMIAL_NO_MEM;
+
+		vector<IonHit>().swap(ions);
+
+		//Evenly spaced block sizes, from the block size to the maximum
+		vector<size_t> blockSizes;
+		size_t maxIons=std::max(sweepMaxIons,numIonsSegment);
+		for(size_t ui=0;ui<sweepSteps;ui++)
+		{
+			size_t blockSize;
+			blockSize=numIonsSegment + 
+				((maxIons-numIonsSegment)*ui)/(sweepSteps-1);
+			if(blockSizes.empty() || blockSizes.back() != blockSize)
+				blockSizes.push_back(blockSize);
+		}
+
+		vector<BINOMIAL_STATS> sweepStats;
+		vector<char> sweepOK;
+		errCode=binomialBlockSizeSweep(prepared,segmentOpts,blockSizes,
+				sweepStats,sweepOK,&(progress.filterProgress),*Filter::wantAbort);
+		switch(errCode)
+		{
+			case 0:
+				break;
+			case BINOMIAL_NO_MEM:
+				return ERR_BINOMIAL_NO_MEM;
+			case BINOMIAL_ABORT:
+				return ERR_ABORT_FAIL;
+			default:
+				ASSERT(false);
+				return SPAT_ERR_END_OF_ENUM;
+		}
+
+		if(std::find(sweepOK.begin(),sweepOK.end(),1) == sweepOK.end())
+			return ERR_BINOMIAL_BIN_FAIL;
+
+		//Show the statistics for each block size
+		consoleOutput.push_back(" ------ Binomial block size sweep ------");
+		consoleOutput.push_back("Block size\tBlocks\tName\t\tChiSquare\t\tP_rand\t\tmu");
+		for(size_t ui=0;ui<blockSizes.size();ui++)
+		{
+			string sizeStr,tmpStr;
+			stream_cast(sizeStr,blockSizes[ui]);
+			if(!sweepOK[ui])
+			{
+				consoleOutput.push_back(sizeStr + "\t\t Insufficient ions ");
+				continue;
+			}
+
+			stream_cast(tmpStr,sweepStats[ui].nBlocks);
+			sizeStr+=string("\t") + tmpStr + string("\t");
+			for(size_t uj=0;uj<selectedIons.size();uj++)
+			{
+				string lineStr;
+				lineStr=sizeStr + rngF->getName(selectedIons[uj]) + string("\t\t");
+				if(!sweepStats[ui].pValueOK[uj])
+				{
+					consoleOutput.push_back(lineStr + "\t\t Not computable ");
+					continue;
+				}
+
+				stream_cast(tmpStr,sweepStats[ui].chiSquare[uj]);
+				lineStr+=tmpStr + string("\t\t");
+				stream_cast(tmpStr,sweepStats[ui].pValue[uj]);
+				lineStr+=tmpStr + string("\t\t");
+				stream_cast(tmpStr,sweepStats[ui].comparisonCoeff[uj]);
+				lineStr+=tmpStr;
+				consoleOutput.push_back(lineStr);
+			}
+		}
+		consoleOutput.push_back(" ---------------------------------------");
+
+		//Plot chi-square, and mu, against block size for each species
+		for(size_t ui=0;ui<selectedIons.size();ui++)
+		{
+			for(size_t plotType=0;plotType<2;plotType++)
+			{
+				PlotStreamData* plt;
+				plt = new PlotStreamData;
+				plt->index=ui + plotType*selectedIons.size();
+				plt->parent=this;
+				plt->plotMode=PLOT_MODE_1D;
+				plt->plotStyle=PLOT_LINE_LINES;
+				plt->xLabel=TRANS("Block size");
+
+				string ionName;
+				ionName=rngF->getName(selectedIons[ui]);
+				if(!plotType)
+				{
+					plt->yLabel=TRANS("Chi-square");
+					plt->dataLabel = string("Binomial chi-square:") + ionName;
+				}
+				else
+				{
+					plt->yLabel=TRANS("mu");
+					plt->dataLabel = string("Binomial mu:") + ionName;
+				}
+
+				//Set the colour to match that of the range
+				RGBf colour;	
+				colour=rngF->getColour(selectedIons[ui]);
+				plt->r=colour.red;
+				plt->g=colour.green;
+				plt->b=colour.blue;
+
+				for(size_t uj=0;uj<blockSizes.size();uj++)
+				{
+					if(!sweepOK[uj] || !sweepStats[uj].pValueOK[ui])
+						continue;
+
+					float v;
+					if(!plotType)
+						v=sweepStats[uj].chiSquare[ui];
+					else
+						v=sweepStats[uj].comparisonCoeff[ui];
+					plt->xyData.push_back(std::make_pair(blockSizes[uj],v));
+				}
+
+				if(plt->xyData.empty())
+				{
+					delete plt;
+					continue;
+				}
+
+				cacheAsNeeded(plt);
+				getOut.push_back(plt);
+			}
+		}
+
+		return 0;
+	}
 
 	errCode=countBinnedIons(ions,rngF,selectedIons,segmentOpts,gridEntries);
 
@@ -3946,44 +4813,28 @@ size_t SpatialAnalysisFilter::algorithmLocalConcentration(ProgressData &progress
 #endif
 	if(stopMode == STOP_MODE_RADIUS)
 	{
-		vector<Point3D> numeratorPts,denominatorPts;
-
 		progress.step=1;
 		progress.stepName=TRANS("Collate");
 		progress.filterProgress=0;
-		progress.maxStep=4;
-
-		//Build the numerator and denominator points
-		unsigned int errCode;
-		errCode = buildSplitPoints(dataIn, progress, totalDataSize, rngF, 
-				ionNumeratorEnabled,ionDenominatorEnabled,numeratorPts,denominatorPts);
-		if(errCode)
-			return errCode;	
-
-		if(*Filter::wantAbort)
-			return ERR_ABORT_FAIL;
-		progress.step=2;
-		progress.stepName = TRANS("Build Numerator");
-		progress.filterProgress=0;
-
-
-		//Build the tree (its roughly nlogn timing, but worst case n^2)
-		K3DTreeMk2 treeNumerator,treeDenominator;
-		treeNumerator.resetPts(numeratorPts);
-		if(*Filter::wantAbort)
-			return ERR_ABORT_FAIL;
-		treeNumerator.build();
-		if(*Filter::wantAbort)
-			return ERR_ABORT_FAIL;
+		progress.maxStep=3;
 
-		progress.step=3;
-		progress.stepName = TRANS("Build Denominator");
-		progress.filterProgress=0;
+		//Species whose neighbours must be counted
+		vector<bool> countedSpecies(ionNumeratorEnabled.size(),false);
+		for(size_t ui=0;ui<countedSpecies.size();ui++)
+		{
+			countedSpecies[ui]=(ionNumeratorEnabled[ui] ||
+						ionDenominatorEnabled[ui]);
+		}
 
-		treeDenominator.resetPts(denominatorPts);
-		treeDenominator.build();
-		if(*Filter::wantAbort)
-			return ERR_ABORT_FAIL;
+		//Previous neighbour counts can be reused if they
+		// include every species that is now needed
+		bool haveCounts=!lcCountSpecies.empty();
+		for(size_t ui=0;ui<countedSpecies.size() && haveCounts;ui++)
+		{
+			if(countedSpecies[ui] && std::find(lcCountSpecies.begin(),
+				lcCountSpecies.end(),ui) == lcCountSpecies.end())
+				haveCounts=false;
+		}
 
 		unsigned int sizeNeeded=0;
 		//Count the array size that we need to store the points 
@@ -4069,82 +4920,179 @@ size_t SpatialAnalysisFilter::algorithmLocalConcentration(ProgressData &progress
 		ASSERT(curOffset == pSource.size());
 		//--
 
-		progress.step=4;
-		progress.stepName = TRANS("Compute");
-		progress.filterProgress=0;
+		//Counts are only valid for the same source ions and search radius
+		unsigned long long sourceFingerprint=SpatialIndexCache::fingerprint(pSource);
+		if(haveCounts && (lcNeighbourCounts.size() != pSource.size()*lcCountSpecies.size() 
+				|| lcCountsFingerprint != sourceFingerprint || lcCountsDistMax != distMax))
+			haveCounts=false;
 
-		//Loop through the array, and perform local search on each tree
-#pragma omp parallel for schedule(dynamic)
-		for(unsigned int ui=0;ui<pSource.size(); ui++)
+		if(!haveCounts)
 		{
-#ifdef _OPENMP
-			if(spin)
-				continue;
-#endif
+			std::vector<unsigned int>().swap(lcNeighbourCounts);
+			lcCountSpecies.clear();
 
-			vector<size_t> ptsNum,ptsDenom;
-			//Find the points that are within the search radius
-			treeNumerator.ptsInSphere(pSource[ui].getPosRef(),distMax,ptsNum);
-			treeDenominator.ptsInSphere(pSource[ui].getPosRef(),distMax,ptsDenom);
+			//Build a single set of points, labelled by species, 
+			// covering both numerator and denominator
+			vector<Point3D> countPts[2];
+			vector<unsigned int> countIDs[2];
+			unsigned int errCode;
+			errCode = buildLabelledSplitPoints(dataIn, progress, totalDataSize, rngF, 
+					countedSpecies,vector<bool>(),countPts,countIDs);
+			if(errCode)
+				return ERR_ABORT_FAIL;	
+
+			//Map each counted species to a column of the count field
+			vector<unsigned int> speciesColumn(countedSpecies.size(),(unsigned int)-1);
+			vector<unsigned int> countSpecies;
+			for(size_t ui=0;ui<countedSpecies.size();ui++)
+			{
+				if(!countedSpecies[ui])
+					continue;
+				speciesColumn[ui]=countSpecies.size();
+				countSpecies.push_back(ui);
+			}
+			for(size_t ui=0;ui<countIDs[0].size();ui++)
+				countIDs[0][ui]=speciesColumn[countIDs[0][ui]];
 
-			//Check to see if there is any self-matching going on. Don't allow zero-distance matches
-			// as this biases the composition towards the chosen source points
-			//TODO: Is there a faster way to do this? We might be able to track the original index of the point
-			// that we built, and map it back to the input?
-			//--
-			unsigned int nCount,dCount;
-			nCount=0;
-			for(unsigned int uj=0;uj<ptsNum.size(); uj++)
+			progress.step=2;
+			progress.stepName = TRANS("Build");
+			progress.filterProgress=0;
+
+			//Bin the points for fixed-radius searching
+			const CellList *cells;
+			switch(SpatialIndexCache::getCellList(countPts[0],distMax,cells,
+						progress.filterProgress,*Filter::wantAbort))
 			{
-				size_t ptIdx;
-				ptIdx=ptsNum[uj];
-				float dist;
-				dist = treeNumerator.getPtRef(ptIdx).sqrDist(pSource[ui].getPosRef());
-				if(dist > DISTANCE_EPSILON)
-					nCount++;
+				case 0:
+					break;
+				case SPATIALINDEX_ERR_MEMALLOC:
+					return ERR_BINOMIAL_NO_MEM;
+				default:
+					return ERR_ABORT_FAIL;
 			}
+			countPts[0].clear();
+
+			vector<unsigned int> cellLabels;
+			cells->toCellOrder(countIDs[0],cellLabels);
+			countIDs[0].clear();
 
-			dCount=0;
-			for(unsigned int uj=0;uj<ptsDenom.size(); uj++)
+			const unsigned int nCols=countSpecies.size();
+			try
 			{
-				size_t ptIdx;
-				ptIdx=ptsDenom[uj];
-				float dist;
-				dist = treeDenominator.getPtRef(ptIdx).sqrDist(pSource[ui].getPosRef());
-				if(dist> DISTANCE_EPSILON)
-					dCount++;
+				lcNeighbourCounts.resize(pSource.size()*nCols);
+			}
+			catch(std::bad_alloc)
+			{
+				return ERR_BINOMIAL_NO_MEM;
 			}
-			//--
-			
-			//compute concentration
-			if( nCount + dCount )
-				pSource[ui].setMassToCharge((float)nCount/(float)(nCount + dCount)*100.0f);
-			else
-				pSource[ui].setMassToCharge(-1.0f);
-			
 
-#ifdef _OPENMP 
-			#pragma omp critical
-			if(!omp_get_thread_num())
+			progress.step=3;
+			progress.stepName = TRANS("Compute");
+			progress.filterProgress=0;
+
+			//Loop through the array in blocks, and count the neighbours of each species
+			const float sqrDistMax=distMax*distMax;
+			const size_t numBlocks=(pSource.size()+KDBUCKET_QUERY_BLOCK-1)/KDBUCKET_QUERY_BLOCK;
+			size_t numDone=0;
+#pragma omp parallel
 			{
+			vector<Point3D> queries(KDBUCKET_QUERY_BLOCK);
+#pragma omp for schedule(dynamic)
+			for(size_t ui=0;ui<numBlocks; ui++)
+			{
+#ifdef _OPENMP
+				if(spin)
+					continue;
 #endif
-				//let master thread do update	
-				progress.filterProgress= (unsigned int)((float)ui/(float)pSource.size()*100.0f);
+				size_t start=ui*KDBUCKET_QUERY_BLOCK;
+				size_t nQueries=std::min((size_t)KDBUCKET_QUERY_BLOCK,pSource.size()-start);
+				for(size_t uj=0;uj<nQueries;uj++)
+					queries[uj]=pSource[start+uj].getPosRef();
+
+				//Count the points that are within the search radius.
+				// Don't allow zero-distance matches
+				// as this biases the composition towards the chosen source points
+				if(nCols)
+				{
+					cells->countLabelsInSphere(&queries[0],nQueries,sqrDistMax,DISTANCE_EPSILON,
+						&cellLabels[0],nCols,&lcNeighbourCounts[start*nCols]);
+				}
 
-				if(*Filter::wantAbort)
+				#pragma omp atomic
+				numDone+=nQueries;
+#ifdef _OPENMP 
+				if(!omp_get_thread_num())
 				{
+#endif
+					//let master thread do update	
+					progress.filterProgress= (unsigned int)((float)numDone/(float)pSource.size()*100.0f);
+
+					if(*Filter::wantAbort)
+					{
 #ifndef _OPENMP
-					return ERR_ABORT_FAIL;
+						lcNeighbourCounts.clear();
+						return ERR_ABORT_FAIL;
 #else
-					#pragma atomic
-					spin=true;
+						spin=true;
 #endif			
+					}
+#ifdef _OPENMP
 				}
+#endif
+			}
+			}
+
 #ifdef _OPENMP
+			if(spin)
+			{
+				lcNeighbourCounts.clear();
+				return ERR_ABORT_FAIL;
 			}
 #endif
+			lcCountSpecies.swap(countSpecies);
+			lcCountsFingerprint=sourceFingerprint;
+			lcCountsDistMax=distMax;
+		}
+		else
+		{
+			progress.step=3;
+			progress.stepName = TRANS("Compute");
+		}
 
-			
+		//Compute the concentration from the neighbour counts
+		const size_t nCols=lcCountSpecies.size();
+		vector<char> colNumerator(nCols),colDenominator(nCols);
+		for(size_t ui=0;ui<nCols;ui++)
+		{
+			colNumerator[ui]=ionNumeratorEnabled[lcCountSpecies[ui]];
+			colDenominator[ui]=ionDenominatorEnabled[lcCountSpecies[ui]];
+		}
+
+		#pragma omp parallel for
+		for(size_t ui=0;ui<pSource.size();ui++)
+		{
+			//Ion can be either numerator or denominator OR BOTH.
+			size_t nCount=0,dCount=0;
+			const unsigned int *c=nCols ? &lcNeighbourCounts[ui*nCols] : 0;
+			for(size_t uj=0;uj<nCols;uj++)
+			{
+				if(colNumerator[uj])
+					nCount+=c[uj];
+				if(colDenominator[uj])
+					dCount+=c[uj];
+			}
+
+			if( nCount + dCount )
+				pSource[ui].setMassToCharge((float)nCount/(float)(nCount + dCount)*100.0f);
+			else
+				pSource[ui].setMassToCharge(-1.0f);
+		}
+
+		//Only keep the counts if they fit in the cache budget
+		if(!cacheEnabled())
+		{
+			std::vector<unsigned int>().swap(lcNeighbourCounts);
+			lcCountSpecies.clear();
 		}
 	}
 	else if(stopMode == STOP_MODE_NEIGHBOUR)
@@ -4191,89 +5139,93 @@ size_t SpatialAnalysisFilter::algorithmLocalConcentration(ProgressData &progress
 		for(unsigned int ui=0;ui<pTarget.size();ui++)
 			dataMasses[ui]=pTarget[ui].getMassToCharge();
 
-		K3DTreeMk2 searchTree;
-		searchTree.resetPts(pTarget);
-		searchTree.build();
-		if(*Filter::wantAbort)
-			return ERR_ABORT_FAIL;
+		const K3DTreeBucket *searchTree;
+		switch(SpatialIndexCache::getBucketTree(pTarget,searchTree,
+				progress.filterProgress,*Filter::wantAbort))
+		{
+			case 0:
+				break;
+			case SPATIALINDEX_ERR_MEMALLOC:
+				return ERR_BINOMIAL_NO_MEM;
+			default:
+				return ERR_ABORT_FAIL;
+		}
+		pTarget.clear();
 
 		progress.step=3;
 		progress.stepName=TRANS("Compute");
 		progress.filterProgress=0;
 
 
-		//Loop through the array, and perform local search on each tree
-		BoundCube bc;
-		searchTree.getBoundCube(bc);
-
-#pragma omp parallel for schedule(dynamic) 
-		for(unsigned int ui=0;ui<pSource.size(); ui++)
+		//Loop through the array in blocks, and perform local search on the tree
+		const size_t numBlocks=(pSource.size()+KDBUCKET_QUERY_BLOCK-1)/KDBUCKET_QUERY_BLOCK;
+		size_t numDone=0;
+#pragma omp parallel
+		{
+		vector<Point3D> queries(KDBUCKET_QUERY_BLOCK);
+		vector<float> sqrDists(KDBUCKET_QUERY_BLOCK*nnMax);
+		vector<size_t> indices(KDBUCKET_QUERY_BLOCK*nnMax);
+#pragma omp for schedule(dynamic) 
+		for(size_t ui=0;ui<numBlocks; ui++)
 		{
 #ifdef _OPENMP
 			//If user requests abort, then do not process any more
 			if(spin)
 				continue;
 #endif
-			set<size_t> ptsFound;
+			size_t start=ui*KDBUCKET_QUERY_BLOCK;
+			size_t nQueries=std::min((size_t)KDBUCKET_QUERY_BLOCK,pSource.size()-start);
+			for(size_t uj=0;uj<nQueries;uj++)
+				queries[uj]=pSource[start+uj].getPosRef();
+
+			//Find the NNs, ignoring zero-distance matches to force no self-matching
+			searchTree->findKNearest(&queries[0],nQueries,nnMax,DISTANCE_EPSILON,
+							&sqrDists[0],&indices[0]);
 
-			//Points from the tree we have already found. Abort if we cannot find enough NNs to satisfy search
-			while(ptsFound.size()<nnMax)
+			for(size_t uj=0;uj<nQueries;uj++)
 			{
-				size_t ptIdx;
-				ptIdx=searchTree.findNearestWithSkip(pSource[ui].getPosRef(),bc,ptsFound);
+				const size_t *idx=&indices[uj*nnMax];
 
-				//Check that we have a valid NN
-				if(ptIdx == (size_t)-1)
+				//Abort if we cannot find enough NNs to satisfy search
+				if(idx[nnMax-1] == (size_t)-1)
 				{
-					ptsFound.clear();
-					break;
+					pSource[start+uj].setMassToCharge(-1.0f);
+					continue;
 				}
 
-				//distance between search pt and found pt
-				float sqrDistance;
-				sqrDistance = searchTree.getPtRef(ptIdx).sqrDist(pSource[ui].getPosRef());
-
-				if(sqrDistance > DISTANCE_EPSILON)
-					ptsFound.insert(ptIdx);
-			}
-
-
-			unsigned int nCount;
-			unsigned int dCount;
-			nCount=dCount=0;	
-			//Count the number of numerator and denominator ions, using the masses we set aside earlier
-			for(set<size_t>::iterator it=ptsFound.begin(); it!=ptsFound.end(); ++it)
-			{
-				float ionMass;
-				//check that the distance is non-zero, to force no self-matching
-				ionMass = dataMasses[searchTree.getOrigIndex(*it)];
-
-				unsigned int ionID;
-				ionID = rngF->getIonID(ionMass);
+				unsigned int nCount;
+				unsigned int dCount;
+				nCount=dCount=0;	
+				//Count the number of numerator and denominator ions, using the masses we set aside earlier
+				for(unsigned int uk=0;uk<nnMax;uk++)
+				{
+					unsigned int ionID;
+					ionID = rngF->getIonID(dataMasses[idx[uk]]);
 
+					//Ion can be either numerator or denominator OR BOTH.
+					if(ionNumeratorEnabled[ionID])
+						nCount++;
+					if(ionDenominatorEnabled[ionID])
+						dCount++;
+				}
 
-				//Ion can be either numerator or denominator OR BOTH.
-				if(ionNumeratorEnabled[ionID])
-					nCount++;
-				if(ionDenominatorEnabled[ionID])
-					dCount++;
+				//compute concentration
+				pSource[start+uj].setMassToCharge((float)nCount/(float)(nCount + dCount)*100.0f);
 			}
 
-			//compute concentration
-			pSource[ui].setMassToCharge((float)nCount/(float)(nCount + dCount)*100.0f);
-
+			#pragma omp atomic
+			numDone+=nQueries;
 #ifdef _OPENMP 
 			if(!omp_get_thread_num())
 			{
 #endif
 				//let master thread do update	
-				progress.filterProgress= (unsigned int)((float)ui/(float)pSource.size()*100.0f);
+				progress.filterProgress= (unsigned int)((float)numDone/(float)pSource.size()*100.0f);
 				if(*Filter::wantAbort)
 				{
 #ifndef _OPENMP
 					return ERR_ABORT_FAIL;
 #else
-					#pragma atomic
 					spin=true;
 #endif			
 				}
@@ -4281,8 +5233,7 @@ size_t SpatialAnalysisFilter::algorithmLocalConcentration(ProgressData &progress
 #ifdef _OPENMP
 			}
 #endif
-
-			
+		}
 		}
 	
 	}
@@ -4323,9 +5274,12 @@ size_t SpatialAnalysisFilter::algorithmLocalConcentration(ProgressData &progress
 #ifdef DEBUG
 
 bool densityPairTest();
+bool densityApproxTest();
 bool nnHistogramTest();
 bool rdfPlotTest();
+bool rdfPairTest();
 bool axialDistTest();
+bool axialSDMTest();
 bool replaceTest();
 bool localConcTestRadius();
 bool localConcTestNN();
@@ -4335,14 +5289,22 @@ bool SpatialAnalysisFilter::runUnitTests()
 	if(!densityPairTest())
 		return false;
 
+	if(!densityApproxTest())
+		return false;
+
 	if(!nnHistogramTest())
 		return false;
 
 	if(!rdfPlotTest())
 		return false;
 
+	if(!rdfPairTest())
+		return false;
+
 	if(!axialDistTest())
 		return false;
+	if(!axialSDMTest())
+		return false;
 	if(!replaceTest())
 		return false;
 	if(!localConcTestRadius())
@@ -4414,6 +5376,70 @@ bool densityPairTest()
 	return true;
 }
 
+bool densityApproxTest()
+{
+	IonStreamData*d = new IonStreamData;
+	RandNumGen rng;
+	rng.initialise(1357);
+	d->data.resize(2000);
+	for(size_t ui=0;ui<d->data.size();ui++)
+	{
+		d->data[ui].setPos(Point3D(rng.genUniformDev(),rng.genUniformDev(),rng.genUniformDev()));
+		d->data[ui].setMassToCharge(1);
+	}
+
+	vector<const FilterStreamData*> streamIn,streamOut[2];
+	streamIn.push_back(d);
+
+	//Compute exact, then approximate, NN densities
+	const float MAX_ERROR=0.25f;
+	vector<string> console;
+	for(unsigned int ui=0;ui<2;ui++)
+	{
+		SpatialAnalysisFilter *f=new SpatialAnalysisFilter;
+		f->setCaching(false);	
+		bool needUp;
+		string s;
+		s=TRANS(SPATIAL_ALGORITHMS[ALGORITHM_DENSITY]);
+		TEST(f->setProperty(KEY_ALGORITHM,s,needUp),"Set prop");
+		TEST(f->setProperty(KEY_NNMAX,"10",needUp),"Set prop");
+		if(ui)
+		{
+			stream_cast(s,MAX_ERROR);
+			TEST(f->setProperty(KEY_NN_APPROX_ERROR,s,needUp),"Set prop");
+		}
+		TEST(!f->setProperty(KEY_NN_APPROX_ERROR,"-1",needUp),"Reject negative error");
+
+		ProgressData p;
+		TEST(!f->refresh(streamIn,streamOut[ui],p),"refresh OK");
+		f->getConsoleStrings(console);
+		delete f;
+		TEST(streamOut[ui].size() == 1,"stream count");
+	}
+	delete d;
+
+	//Only the approximate run reports its error
+	TEST(console.size() == 2,"approx error report");
+
+	//Density goes as 1/r^3, so is underestimated by at most (1+err)^3
+	const IonStreamData *exact=(const IonStreamData*)streamOut[0][0];
+	const IonStreamData *approx=(const IonStreamData*)streamOut[1][0];
+	TEST(exact->data.size() == approx->data.size(),"ion count");
+	const float tol=sqrtf(std::numeric_limits<float>::epsilon());
+	for(size_t ui=0;ui<exact->data.size();ui++)
+	{
+		float e=exact->data[ui].getMassToCharge();
+		float a=approx->data[ui].getMassToCharge();
+		TEST(a <= e*(1.0f+tol),"approx density upper bound");
+		TEST(a*powf(1.0f+MAX_ERROR,3.0f) >= e*(1.0f-tol),"approx density lower bound");
+	}
+
+	delete streamOut[0][0];
+	delete streamOut[1][0];
+
+	return true;
+}
+
 bool nnHistogramTest()
 {
 	//Build some points to pass to the filter
@@ -4534,6 +5560,69 @@ bool rdfPlotTest()
 	return true;
 }
 
+//Forward declarations of the local concentration test helpers,
+// whose ranged data is reused here
+const IonStreamData *createLCIonStream();
+RangeStreamData *createLCRangeStream();
+
+bool rdfPairTest()
+{
+	vector<const FilterStreamData*> streamIn,streamOut;
+
+	//Three species, A, B and C, with one A, one B and two Cs
+	RangeStreamData *rngStream=createLCRangeStream();
+	streamIn.push_back(rngStream);
+	streamIn.push_back(createLCIonStream());
+
+	SpatialAnalysisFilter *f=new SpatialAnalysisFilter;
+	f->setCaching(false);
+	f->initFilter(streamIn,streamOut);
+
+	bool needUp;
+	TEST(f->setProperty(KEY_ALGORITHM,
+			TRANS(SPATIAL_ALGORITHMS[ALGORITHM_RDF]),needUp),"set Algorithm");
+	TEST(f->setProperty(KEY_STOPMODE,
+		TRANS(STOP_MODES[STOP_MODE_RADIUS]),needUp),"set stop mode");
+	TEST(f->setProperty(KEY_DISTMAX,"1",needUp),"Set distmax");
+	TEST(f->setProperty(KEY_RDF_PAIRS,"1",needUp),"Set pair mode");
+	//Disable B as a source
+	TEST(f->setProperty(Filter::muxKey(KEYTYPE_ENABLE_SOURCE,1),"0",needUp),"Disable source");
+
+	ProgressData p;
+	TEST(!f->refresh(streamIn,streamOut,p),"refresh OK");
+	delete f;
+
+	//Two sources, three targets
+	TEST(streamOut.size() == 6,"stream count");
+
+	//Total counts for each pair. Every ion lies within 1 of every other
+	const unsigned int NSPECIES=3;
+	const size_t expected[NSPECIES][NSPECIES] = { {0,1,2}, {0,0,0}, {2,2,2}};
+	for(size_t ui=0;ui<streamOut.size();ui++)
+	{
+		TEST(streamOut[ui]->getStreamType() == STREAM_TYPE_PLOT,"plot outputting");
+		const PlotStreamData* dPlot=(const PlotStreamData *)streamOut[ui];
+
+		unsigned int src,target;
+		src=dPlot->index/NSPECIES;
+		target=dPlot->index%NSPECIES;
+		TEST(src !=1 && target < NSPECIES,"plot index");
+
+		float total=0;
+		for(size_t uj=0;uj<dPlot->xyData.size();uj++)
+			total+=dPlot->xyData[uj].second;
+		TEST(EQ_TOL(total,expected[src][target]),"pair count");
+
+		delete dPlot;
+	}
+
+	delete rngStream->rangeFile;
+	for(unsigned int ui=0;ui<streamIn.size(); ui++)
+		delete streamIn[ui];
+
+	return true;
+}
+
 bool axialDistTest()
 {
 	//Build some points to pass to the filter
@@ -4617,6 +5706,72 @@ bool axialDistTest()
 	return true;
 }
 
+bool axialSDMTest()
+{
+	vector<const FilterStreamData*> streamIn,streamOut;
+
+	//Two points, each within the search radius of the other
+	IonStreamData*d = new IonStreamData;
+	IonHit h;
+	h.setMassToCharge(1);
+	h.setPos(Point3D(0,0,0));
+	d->data.push_back(h);
+	h.setPos(Point3D(0.5,0.5,0.5));
+	d->data.push_back(h);
+	streamIn.push_back(d);
+
+	SpatialAnalysisFilter *f=new SpatialAnalysisFilter;
+	f->setCaching(false);	
+
+	bool needUp;
+	string s;
+	s=TRANS(SPATIAL_ALGORITHMS[ALGORITHM_AXIAL_DF]);
+	TEST(f->setProperty(KEY_ALGORITHM,s,needUp),"Set prop (algorithm)");
+	s=TRANS(STOP_MODES[STOP_MODE_RADIUS]);
+	TEST(f->setProperty(KEY_STOPMODE,s,needUp),"Set prop (stopmode)");
+	TEST(f->setProperty(KEY_DISTMAX,"1",needUp),"Set prop (distmax)");
+	TEST(f->setProperty(KEY_SDM_3D,"1",needUp),"Set prop (3D map)");
+	TEST(f->setProperty(KEY_SDM_BINS,"10",needUp),"Set prop (map bins)");
+
+	stream_cast(s,Point3D(0,0,0));
+	TEST(f->setProperty(KEY_ORIGIN,s,needUp),"Set prop (origin)");
+	stream_cast(s,Point3D(1.1,1.1,1.1));
+	TEST(f->setProperty(KEY_NORMAL,s,needUp),"Set prop (axis)");
+	TEST(f->setProperty(KEY_RADIUS,"1",needUp),"Set prop (radius)");
+
+	ProgressData p;
+	TEST(!f->refresh(streamIn,streamOut,p),"Checking refresh code");
+	delete f;
+	delete d; 
+
+	const VoxelStreamData *vs=0;
+	const PlotStreamData *plot=0;
+	for(size_t ui=0;ui<streamOut.size();ui++)
+	{
+		if(streamOut[ui]->getStreamType() == STREAM_TYPE_VOXEL)
+			vs=(const VoxelStreamData*)streamOut[ui];
+		else if(streamOut[ui]->getStreamType() == STREAM_TYPE_PLOT)
+			plot=(const PlotStreamData*)streamOut[ui];
+	}
+	TEST(vs && plot,"voxel and plot output");
+
+	//Each point sees the other, at +/-(0.5,0.5,0.5)
+	TEST(EQ_TOL(vs->data->getSum(),2.0f),"map total");
+	TEST(EQ_TOL(vs->data->getPointData(Point3D(0.55,0.55,0.55)),1.0f),"map +ve vector");
+	TEST(EQ_TOL(vs->data->getPointData(Point3D(-0.45,-0.45,-0.45)),1.0f),"map -ve vector");
+
+	//Both vectors lie along the axis, so the profile holds both
+	float plotSum=0;
+	for(size_t ui=0;ui<plot->xyData.size();ui++)
+		plotSum+=plot->xyData[ui].second;
+	TEST(EQ_TOL(plotSum,2.0f),"axial profile");
+
+	for(size_t ui=0;ui<streamOut.size();ui++)
+		delete streamOut[ui];
+
+	return true;
+}
+
 bool replaceTest()
 {
 	std::string ionFile=createTmpFilename(NULL,".pos");
@@ -4656,9 +5811,6 @@ bool replaceTest()
 	vector<const FilterStreamData*> streamIn,streamOut;
 	streamIn.push_back(d);
 	TEST(!f->refresh(streamIn,streamOut,p),"refresh OK");
-	delete f;
-	delete d;
-	streamIn.clear();
 
 	TEST(streamOut.size() == 1,"stream count");
 	TEST(streamOut[0]->getStreamType() == STREAM_TYPE_IONS,"stream type");
@@ -4670,11 +5822,35 @@ bool replaceTest()
 	{
 		ASSERT(outIons->data[ui].getMassToCharge() == 1); 
 	}
+	delete streamOut[0];
+	streamOut.clear();
 
-	wxRemoveFile(ionFile);
-
+	//Union, with an extra ion that is not in the file, 
+	// should give each matched ion once, plus the extra ion
+	d->data.push_back(IonHit(Point3D(100,100,100),2));
+	s=TRANS(REPLACE_ALGORITHMS[REPLACE_MODE_UNION]);
+	TEST(f->setProperty(KEY_REPLACE_ALGORITHM,s,needUp),"Set prop");
+	TEST(!f->refresh(streamIn,streamOut,p),"refresh OK (union)");
+	TEST(streamOut.size() == 1,"stream count (union)");
+	TEST(streamOut[0]->getNumBasicObjects() == NIONS+1,"Number objects (union)");
 	delete streamOut[0];
+	streamOut.clear();
 	
+	//Subtraction leaves only the extra ion
+	s=TRANS(REPLACE_ALGORITHMS[REPLACE_MODE_SUBTRACT]);
+	TEST(f->setProperty(KEY_REPLACE_ALGORITHM,s,needUp),"Set prop");
+	TEST(!f->refresh(streamIn,streamOut,p),"refresh OK (subtract)");
+	TEST(streamOut.size() == 1,"stream count (subtract)");
+	outIons = (const IonStreamData*)streamOut[0];
+	TEST(outIons->data.size() == 1 && outIons->data[0].getMassToCharge() == 2,"subtract");
+	delete streamOut[0];
+
+	delete f;
+	delete d;
+	streamIn.clear();
+
+	wxRemoveFile(ionFile);
+
 	return true;
 }
 
@@ -4804,7 +5980,6 @@ bool localConcTestRadius()
 	//Do the refresh
 	ProgressData p;
 	TEST(!f->refresh(streamIn,streamOut,p),"Checking refresh code");
-	delete f;
 
 	//FIXME: Check the data coming out
 	TEST(streamOut.size() == 1,"stream size");
@@ -4816,6 +5991,29 @@ bool localConcTestRadius()
 	float localConc = ionD->data[0].getMassToCharge(); 
 	TEST(EQ_TOL(localConc,1.0/3.0*100.0),"Local Concentration check");
 
+	//Change the numerator selection, which reuses the neighbour
+	// counts (C is counted in both numerator and denominator)
+	TEST(f->setProperty(Filter::muxKey(KEYTYPE_ENABLE_NUMERATOR,2),"1",needUp),
+				"Set prop (numerator)");
+	vector<const FilterStreamData*> reOut;
+	TEST(!f->refresh(streamIn,reOut,p),"Checking refresh code (numerator change)");
+	TEST(reOut.size() == 1,"stream size");
+	localConc = ((IonStreamData *)reOut[0])->data[0].getMassToCharge(); 
+	TEST(EQ_TOL(localConc,3.0/5.0*100.0),"Local Concentration check (numerator change)");
+	delete reOut[0];
+	reOut.clear();
+
+	//A needs counting, but was not counted before. Source ion's
+	// own species is not counted, as there is no other A
+	TEST(f->setProperty(Filter::muxKey(KEYTYPE_ENABLE_DENOMINATOR,0),"1",needUp),
+				"Set prop (denominator)");
+	TEST(!f->refresh(streamIn,reOut,p),"Checking refresh code (denominator change)");
+	TEST(reOut.size() == 1,"stream size");
+	localConc = ((IonStreamData *)reOut[0])->data[0].getMassToCharge(); 
+	TEST(EQ_TOL(localConc,3.0/5.0*100.0),"Local Concentration check (denominator change)");
+	delete reOut[0];
+	delete f;
+
 	delete rngStream->rangeFile;
 
 	for(unsigned int ui=0;ui<streamIn.size(); ui++)
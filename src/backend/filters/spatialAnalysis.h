@@ -39,6 +39,10 @@ class SpatialAnalysisFilter : public Filter
 		//!Distance maximum
 		float distMax;
 
+		//!Permitted relative error in NN distances for density
+		// estimation. Zero for exact searches
+		float nnApproxError;
+
 		//!Do we have range data to use (is nonzero)
 		bool haveRangeParent;
 		//!The names of the incoming ions
@@ -49,6 +53,17 @@ class SpatialAnalysisFilter : public Filter
 		//!work out which ions to count in the numerator vs denominator
 		std::vector<bool> ionNumeratorEnabled,ionDenominatorEnabled;
 
+		//!Local concentration (radius mode) neighbour counts, for each source 
+		// ion, and each counted species. Kept so that the numerator and
+		// denominator can be changed without repeating the neighbour search
+		std::vector<unsigned int> lcNeighbourCounts;
+		//!Range file ion IDs of the species counted in lcNeighbourCounts
+		std::vector<unsigned int> lcCountSpecies;
+		//!Fingerprint of the source ion positions used for lcNeighbourCounts
+		unsigned long long lcCountsFingerprint;
+		//!Search radius used for lcNeighbourCounts
+		float lcCountsDistMax;
+
 		//RDF specific params
 		//--------
 		//RDF bin count
@@ -66,6 +81,22 @@ class SpatialAnalysisFilter : public Filter
 		
 		//!Do we want to display theoretical random NN distances on top?
 		bool wantRandomNNHist;
+
+		//!Compute the RDF of every source/target species pair, rather than a single RDF
+		bool wantPairRDF;
+
+		//!Compute the RDF by correlating voxelised data (FFT), rather than by neighbour search
+		bool wantFFTRDF;
+		//!Voxel size to use for FFT RDFs
+		float fftVoxelSize;
+		//--------
+
+		//Axial DF specific params
+		//--------
+		//!Also compute a 3D spatial distribution map (radius mode only)
+		bool want3DSDM;
+		//!Number of voxels along each axis of the 3D map
+		unsigned int sdmBins;
 		//--------
 		
 		//Density filtering specific params
@@ -113,6 +144,11 @@ class SpatialAnalysisFilter : public Filter
 		//Do we show the overlaid extruded grid?
 		bool showGridOverlay;
 
+		//Do we evaluate a series of block sizes, rather than one?
+		bool wantBinomialSweep;
+		//Largest block size, and number of block sizes, to evaluate
+		unsigned int sweepMaxIons,sweepSteps;
+
 		//--------
 
 		//Replace specific code
@@ -135,6 +171,23 @@ class SpatialAnalysisFilter : public Filter
 			const std::vector<const FilterStreamData *>  &dataIn, 
 			std::vector<const FilterStreamData * > &getOut,const RangeFile *rngF);
 
+		//Partial RDFs - as per the RDF, but computing a separate histogram for
+		// each pair of source and target species, in one pass over the data
+		size_t algorithmRDFPairs(ProgressData &progress, size_t totalDataSize, 
+			const std::vector<const FilterStreamData *>  &dataIn, 
+			std::vector<const FilterStreamData * > &getOut,const RangeFile *rngF);
+
+		//Pair correlation g(r) computed on a grid, using FFTs, for the selected
+		// source/target ions (or each species pair). Cost is independent of ion count
+		size_t algorithmRDFFFT(ProgressData &progress, size_t totalDataSize, 
+			const std::vector<const FilterStreamData *>  &dataIn, 
+			std::vector<const FilterStreamData * > &getOut,const RangeFile *rngF);
+
+		//Surface removal step - drops points lying within reductionDistance of the
+		// (convex hull) surface of pts, compacting pts, and ionIDs if given, in place
+		size_t removeSurfacePoints(ProgressData &progress, std::vector<Point3D> &pts,
+				std::vector<unsigned int> *ionIDs=0) const;
+
 
 		//Local density function - places a sphere around each point to compute per-point density
 		size_t algorithmDensity(ProgressData &progress, size_t totalDataSize, 
@@ -192,6 +245,8 @@ class SpatialAnalysisFilter : public Filter
 
 		//!Returns -1, as range file cache size is dependant upon input.
 		virtual size_t numBytesForCache(size_t nObjects) const;
+		//!Erase cached outputs, and cached neighbour counts
+		virtual void clearCache();
 		//!Returns FILTER_TYPE_SPATIAL_ANALYSIS
 		unsigned int getType() const { return FILTER_TYPE_SPATIAL_ANALYSIS;};
 		//update filter
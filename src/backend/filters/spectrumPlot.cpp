@@ -17,6 +17,8 @@
 */
 #include "spectrumPlot.h"
 #include "algorithms/mass.h"
+#include "algorithms/threadHistogram.h"
+
 
 #include "../plot.h"
 
@@ -174,32 +176,61 @@ unsigned int SpectrumPlotFilter::refresh(const std::vector<const FilterStreamDat
 			maxPlot =-std::numeric_limits<float>::max();
 			//Loop through each type of data
 			
-			unsigned int curProg=NUM_CALLBACK;	
 			for(unsigned int ui=0;ui<dataIn.size() ;ui++)
 			{
 				//Only process stream_type_ions. Do not propagate anything,
 				//except for the spectrum
 				if(dataIn[ui]->getStreamType() == STREAM_TYPE_IONS)
 				{
-					IonStreamData *ions;
-					ions = (IonStreamData *)dataIn[ui];
-					for(unsigned int uj=0;uj<ions->data.size(); uj++)
+					const IonStreamData *ions;
+					ions = (const IonStreamData *)dataIn[ui];
+					const vector<IonHit> &h=ions->data;
+
+					//Each thread finds the extrema of its share
+					// of the ions, then these are combined
+					const size_t nStart=n;
+					bool spin=false;
+					#pragma omp parallel
 					{
-						minPlot = std::min(minPlot,
-							ions->data[uj].getMassToCharge());
-						maxPlot = std::max(maxPlot,
-							ions->data[uj].getMassToCharge());
-
+						float thisMin=std::numeric_limits<float>::max();
+						float thisMax=-std::numeric_limits<float>::max();
+						unsigned int curProg=NUM_CALLBACK;
+						#pragma omp for nowait
+						for(size_t uj=0;uj<h.size(); uj++)
+						{
+							if(spin)
+								continue;
+
+							thisMin = std::min(thisMin,h[uj].getMassToCharge());
+							thisMax = std::max(thisMax,h[uj].getMassToCharge());
+
+							if(!curProg--)
+							{
+								curProg=NUM_CALLBACK;
+								#pragma omp atomic
+								n+=NUM_CALLBACK;
+#ifdef _OPENMP
+								if(!omp_get_thread_num())
+#endif
+								{
+									progress.filterProgress= (unsigned int)((float)(n)/((float)totalSize)*100.0f);
+									if(*Filter::wantAbort)
+										spin=true;
+								}
+							}
+						}
 
-						if(!curProg--)
+						#pragma omp critical
 						{
-							n+=NUM_CALLBACK;
-							progress.filterProgress= (unsigned int)((float)(n)/((float)totalSize)*100.0f);
-							curProg=NUM_CALLBACK;
-							if(*Filter::wantAbort)
-								return SPECTRUM_ABORT_FAIL;
+						minPlot = std::min(minPlot,thisMin);
+						maxPlot = std::max(maxPlot,thisMax);
 						}
 					}
+
+					if(spin)
+						return SPECTRUM_ABORT_FAIL;
+					n=nStart+h.size();
+
 		
 				}
 				
@@ -368,10 +399,17 @@ unsigned int SpectrumPlotFilter::refresh(const std::vector<const FilterStreamDat
 	d->hardMinY=std::min(1.0f,d->hardMaxY);
 
 
+	//Each thread counts into its own bins, which are summed at the end
+	ThreadHistogram binCounts;
+	if(!binCounts.init(d->xyData.size()))
+	{
+		delete d;
+		return SPECTRUM_BAD_ALLOC;
+	}
+
 	//Number of ions currently processed
 	size_t n=0;
-	unsigned int curProg=NUM_CALLBACK;
-	//Loop through each type of data	
+	//Loop through each type of data		
 	for(unsigned int ui=0;ui<dataIn.size() ;ui++)
 	{
 		switch(dataIn[ui]->getStreamType())
@@ -383,30 +421,55 @@ unsigned int SpectrumPlotFilter::refresh(const std::vector<const FilterStreamDat
 
 
 
+				const vector<IonHit> &h=ions->data;
+				const size_t numBins=d->xyData.size();
+
 				//Sum the data bins as needed
-				for(unsigned int uj=0;uj<ions->data.size(); uj++)
+				const size_t nStart=n;
+				bool spin=false;
+				#pragma omp parallel
 				{
-					unsigned int bin;
-					bin = (unsigned int)((ions->data[uj].getMassToCharge()-minPlot)/binWidth);
-					//Dependant upon the bounds,
-					//actual data could be anywhere. >=0 is implicit
-					if( bin < d->xyData.size())
-						d->xyData[bin].second++;
-
-					//update progress every CALLBACK ions
-					if(!curProg--)
+					size_t *bins=binCounts.threadBins();
+					unsigned int curProg=NUM_CALLBACK;
+					#pragma omp for
+					for(size_t uj=0;uj<h.size(); uj++)
 					{
-						n+=NUM_CALLBACK;
-						progress.filterProgress= (unsigned int)(((float)(n)/((float)totalSize))*100.0f);
-						curProg=NUM_CALLBACK;
-						if(*Filter::wantAbort)
+						if(spin)
+							continue;
+
+						unsigned int bin;
+						bin = (unsigned int)((h[uj].getMassToCharge()-minPlot)/binWidth);
+						//Dependant upon the bounds,
+						//actual data could be anywhere. >=0 is implicit
+						if( bin < numBins)
+							bins[bin]++;
+
+						//update progress every CALLBACK ions
+						if(!curProg--)
 						{
-							delete d;
-							return SPECTRUM_ABORT_FAIL;
+							curProg=NUM_CALLBACK;
+							#pragma omp atomic
+							n+=NUM_CALLBACK;
+#ifdef _OPENMP
+							if(!omp_get_thread_num())
+#endif
+							{
+								progress.filterProgress= (unsigned int)(((float)(n)/((float)totalSize))*100.0f);
+								if(*Filter::wantAbort)
+									spin=true;
+							}
 						}
 					}
 				}
 
+				if(spin)
+				{
+					delete d;
+					return SPECTRUM_ABORT_FAIL;
+				}
+				n=nStart+h.size();
+
+
 				break;
 			}
 			default:
@@ -416,6 +479,15 @@ unsigned int SpectrumPlotFilter::refresh(const std::vector<const FilterStreamDat
 
 	}
 
+	//Sum the thread bins into the plot
+	{
+	vector<size_t> counts(d->xyData.size(),0);
+	binCounts.mergeInto(&counts[0]);
+	for(size_t ui=0;ui<counts.size();ui++)
+		d->xyData[ui].second+=counts[ui];
+	}
+
+
 	if(fitMode!= FIT_MODE_NONE)
 	{
 		BACKGROUND_PARAMS backParams;
@@ -22,9 +22,16 @@
 
 #include "openvdb_includes.h"
 #include "contribution_transfer_function_TestSuite/CTF_functions.h"
+#include "algorithms/vdbSplat.h"
+#include "algorithms/spatialIndexCache.h"
+#include "wx/wxcommon.h"
 #include <math.h> // pow
 
 #include <map>
+#include <cstring>
+#include <cstdio>
+#include <iomanip>
+#include <sstream>
 
 enum
 {
@@ -60,7 +67,8 @@ enum
 	KEY_FILTER_RATIO,
 	KEY_FILTER_STDEV,
 	KEY_ENABLE_NUMERATOR,
-	KEY_ENABLE_DENOMINATOR
+	KEY_ENABLE_DENOMINATOR,
+	KEY_VDB_CACHEDIR
 };
 
 //!Normalisation method
@@ -178,6 +186,191 @@ int countPoints(Voxels<float> &v, const std::vector<IonHit> &points,
 	return 0;
 }
 
+//Grid name, and format version, of the on-disk isosurface cache.
+// Increment the version if the computation of the grid changes
+const char *VDB_CACHE_GRIDNAME="voxelise";
+const unsigned int VDB_CACHE_VERSION=1;
+
+//Identifies the inputs of an on-disk cache grid. The fingerprint names the
+// file; the other fields are also written into the grid's metadata, and checked
+// when the file is loaded, in case of a fingerprint collision
+class VdbCacheKey
+{
+	public:
+		//!Fingerprint of the ion positions, and each stream's numerator and
+		// denominator selection, plus the fields below
+		unsigned long long hash;
+		float voxelSize;
+		unsigned int normaliseType;
+		//!Number of ions counted in the numerator and the denominator
+		unsigned long long numeratorIons,denominatorIons;
+};
+
+static VdbCacheKey makeVdbCacheKey(const std::vector<SplatSource> &sources,
+					float voxelsize, unsigned int normaliseType)
+{
+	VdbCacheKey k;
+	k.voxelSize=voxelsize;
+	k.normaliseType=normaliseType;
+	k.numeratorIons=k.denominatorIons=0;
+
+	//FNV-1a, over 64 bit words
+	const unsigned long long FNV_PRIME=1099511628211ULL;
+	unsigned long long h=14695981039346656037ULL;
+	h=(h^VDB_CACHE_VERSION)*FNV_PRIME;
+	for(size_t ui=0;ui<sources.size();ui++)
+	{
+		//Streams that are not counted do not change the grid
+		if(!sources[ui].numerator && !sources[ui].denominator)
+			continue;
+
+		h=(h^SpatialIndexCache::fingerprint(*sources[ui].pts))*FNV_PRIME;
+		h=(h^sources[ui].pts->size())*FNV_PRIME;
+		h=(h^((sources[ui].numerator ? 1 : 0) | (sources[ui].denominator ? 2 : 0)))*FNV_PRIME;
+
+		if(sources[ui].numerator)
+			k.numeratorIons+=sources[ui].pts->size();
+		if(sources[ui].denominator)
+			k.denominatorIons+=sources[ui].pts->size();
+	}
+
+	unsigned int bits;
+	memcpy(&bits,&voxelsize,sizeof(bits));
+	h=(h^bits)*FNV_PRIME;
+	h=(h^normaliseType)*FNV_PRIME;
+	k.hash=h;
+
+	return k;
+}
+
+//Name of the on-disk cache file for an isosurface grid
+static std::string vdbCacheFilename(const std::string &dir, const VdbCacheKey &k)
+{
+	std::stringstream ss;
+	ss << dir << "/" << VDB_CACHE_GRIDNAME << "-" << std::hex << std::setw(16) <<
+		std::setfill('0') << k.hash << ".vdb";
+	return ss.str();
+}
+
+//Metadata names for the cache key fields
+const char *VDB_CACHE_META_HASH="voxelise_fingerprint";
+const char *VDB_CACHE_META_VOXELSIZE="voxelise_voxelsize";
+const char *VDB_CACHE_META_NORMALISE="voxelise_normalise";
+const char *VDB_CACHE_META_NUMERATOR="voxelise_numerator_ions";
+const char *VDB_CACHE_META_DENOMINATOR="voxelise_denominator_ions";
+
+static std::string vdbCacheHashStr(const VdbCacheKey &k)
+{
+	std::stringstream ss;
+	ss << std::hex << k.hash;
+	return ss.str();
+}
+
+//Record the cache key in the grid's metadata
+static void setVdbCacheMeta(openvdb::FloatGrid &grid, const VdbCacheKey &k)
+{
+	grid.insertMeta(VDB_CACHE_META_HASH,openvdb::StringMetadata(vdbCacheHashStr(k)));
+	grid.insertMeta(VDB_CACHE_META_VOXELSIZE,openvdb::FloatMetadata(k.voxelSize));
+	grid.insertMeta(VDB_CACHE_META_NORMALISE,openvdb::Int64Metadata(k.normaliseType));
+	grid.insertMeta(VDB_CACHE_META_NUMERATOR,openvdb::Int64Metadata(k.numeratorIons));
+	grid.insertMeta(VDB_CACHE_META_DENOMINATOR,openvdb::Int64Metadata(k.denominatorIons));
+}
+
+//True if the grid's metadata holds the given cache key
+static bool checkVdbCacheMeta(const openvdb::FloatGrid &grid, const VdbCacheKey &k)
+{
+	openvdb::StringMetadata::Ptr hash=grid.getMetadata<openvdb::StringMetadata>(VDB_CACHE_META_HASH);
+	openvdb::FloatMetadata::Ptr voxSize=grid.getMetadata<openvdb::FloatMetadata>(VDB_CACHE_META_VOXELSIZE);
+	openvdb::Int64Metadata::Ptr norm=grid.getMetadata<openvdb::Int64Metadata>(VDB_CACHE_META_NORMALISE);
+	openvdb::Int64Metadata::Ptr num=grid.getMetadata<openvdb::Int64Metadata>(VDB_CACHE_META_NUMERATOR);
+	openvdb::Int64Metadata::Ptr denom=grid.getMetadata<openvdb::Int64Metadata>(VDB_CACHE_META_DENOMINATOR);
+	if(!hash || !voxSize || !norm || !num || !denom)
+		return false;
+
+	return hash->value() == vdbCacheHashStr(k) && voxSize->value() == k.voxelSize &&
+		norm->value() == (openvdb::Int64)k.normaliseType &&
+		num->value() == (openvdb::Int64)k.numeratorIons &&
+		denom->value() == (openvdb::Int64)k.denominatorIons;
+}
+
+//Load a grid written by writeVdbCacheFile. Returns false if the file is
+// missing, unreadable, or was not computed from the same inputs. errStr is
+// set if the file exists but cannot be used. openvdb delays loading the
+// voxel data until it is used
+static bool readVdbCacheFile(const std::string &filename, const VdbCacheKey &k,
+			openvdb::FloatGrid::Ptr &grid, std::string &errStr)
+{
+	errStr.clear();
+	//Avoid asking openvdb to open files that do not exist
+	{
+	std::ifstream f(filename.c_str());
+	if(!f)
+		return false;
+	}
+
+	try
+	{
+		openvdb::io::File file(filename);
+		file.open();
+		openvdb::FloatGrid::Ptr g;
+		g=openvdb::gridPtrCast<openvdb::FloatGrid>(file.readGrid(VDB_CACHE_GRIDNAME));
+		file.close();
+		if(!g)
+		{
+			errStr=std::string(TRANS("Voxel cache file holds no grid, recomputing: ")) + filename;
+			return false;
+		}
+		if(!checkVdbCacheMeta(*g,k))
+		{
+			errStr=std::string(TRANS("Voxel cache file does not match the input data, recomputing: ")) + filename;
+			return false;
+		}
+		grid=g;
+	}
+	catch(const std::exception &e)
+	{
+		errStr=std::string(TRANS("Unable to read voxel cache file, recomputing: ")) + filename + " : " + e.what();
+		return false;
+	}
+
+	return true;
+}
+
+//Write the grid to the on-disk cache. The file is written under a temporary
+// name, then renamed, so an interrupted write cannot leave a corrupt entry.
+// On failure, errStr is set
+static bool writeVdbCacheFile(const std::string &filename, const VdbCacheKey &k,
+			openvdb::FloatGrid::Ptr &grid, std::string &errStr)
+{
+	std::string tmpName=filename+".tmp";
+	try
+	{
+		grid->setName(VDB_CACHE_GRIDNAME);
+		setVdbCacheMeta(*grid,k);
+		openvdb::GridPtrVec grids;
+		grids.push_back(grid);
+
+		openvdb::io::File file(tmpName);
+		file.write(grids);
+		file.close();
+	}
+	catch(const std::exception &e)
+	{
+		errStr=std::string(TRANS("Unable to write voxel cache file: ")) + filename + " : " + e.what();
+		remove(tmpName.c_str());
+		return false;
+	}
+
+	if(rename(tmpName.c_str(),filename.c_str()))
+	{
+		errStr=std::string(TRANS("Unable to write voxel cache file: ")) + filename;
+		remove(tmpName.c_str());
+		return false;
+	}
+
+	return true;
+}
+
 // == Voxels filter ==
 VoxeliseFilter::VoxeliseFilter() 
 : fixedWidth(false), normaliseType(VOXELISE_NORMALISETYPE_NONE)
@@ -291,6 +484,8 @@ Filter *VoxeliseFilter::cloneUncached() const
 	p->sliceAxis = sliceAxis;
 	p->sliceOffset = sliceOffset;
 
+	p->vdbCacheDir = vdbCacheDir;
+
 	p->cache=cache;
 	p->cacheOK=false;
 	p->userString=userString;
@@ -433,18 +628,11 @@ unsigned int VoxeliseFilter::refresh(const std::vector<const FilterStreamData *>
 					break;
 
 
-				// clear the calculation results andd provide an accessor
-	
-				calculation_result_grid->clear();
-				openvdb::FloatGrid::Accessor calculation_result_accessor = calculation_result_grid->getAccessor();
+				const bool needDenominator = (normaliseType == VOXELISE_NORMALISETYPE_ALLATOMSINVOXEL) ||
+								(normaliseType == VOXELISE_NORMALISETYPE_COUNT2INVOXEL);
 
-				// initialize nominator and denominator grids
-				openvdb::FloatGrid::Ptr denominator_grid = openvdb::FloatGrid::create(background);
-				openvdb::FloatGrid::Accessor denominator_accessor = denominator_grid->getAccessor();
-
-				openvdb::FloatGrid::Ptr numerator_grid = openvdb::FloatGrid::create(background);
-				openvdb::FloatGrid::Accessor numerator_accessor = numerator_grid->getAccessor();
-	
+				//Find the channels that each ion stream contributes to
+				std::vector<SplatSource> sources;
 				for(size_t ui=0;ui<dataIn.size();ui++)
 				{
 					//Check for ion stream types. Don't use anything else in counting
@@ -453,6 +641,8 @@ unsigned int VoxeliseFilter::refresh(const std::vector<const FilterStreamData *>
 
 					const IonStreamData  *ions; 
 					ions = (const IonStreamData *)dataIn[ui];
+					if(ions->data.empty())
+						continue;
 		
 					//get the denominator ions
 					unsigned int ionID;
@@ -473,160 +663,97 @@ unsigned int VoxeliseFilter::refresh(const std::vector<const FilterStreamData *>
 					else
 						thisNumeratorIonEnabled=false;
 
-					for(size_t uj=0;uj<ions->data.size(); uj++)
-					{
-						const int xyzs = 3;
-						std::vector<float> atom_position(xyzs); 
-						for (int i=0;i<xyzs;i++)
-						{
-							atom_position[i] = ions->data[uj].getPos()[i];
-						}
-	
-						// 1st step - project the current atom position to unit voxel i.e. from 0 to 1
-						std::vector<float> position_in_unit_voxel;
-						position_in_unit_voxel = projectAtompositionToUnitvoxel(atom_position, voxelsize);
-
-						// 2nd step - determine each contribution to the adjecent 8 voxels outgoining from the position in the unit voxel
-						std::vector<float> volumes_of_subcuboids;
-						std::vector<float> contributions_to_adjacent_voxels;
-						bool vertex_corner_coincidence = false;
-			
-						vertex_corner_coincidence = checkVertexCornerCoincidence(position_in_unit_voxel);
-			
-						// in case of coincidence of atom and voxel the contribution becomes 100 percent
-						if (vertex_corner_coincidence == false)
-						{
-							volumes_of_subcuboids = calcSubvolumes(position_in_unit_voxel);
-							contributions_to_adjacent_voxels = HellmanContributions(volumes_of_subcuboids);
-						}
-						else
-						{
-							contributions_to_adjacent_voxels = handleVertexCornerCoincidence(position_in_unit_voxel);
-						}
-			
-						// 3rd step - determine the adjacent voxel indices in the actual grid
-						std::vector<std::vector<float> > adjacent_voxel_vertices;
-						adjacent_voxel_vertices = determineAdjacentVoxelVertices(atom_position, voxelsize);
-			
-						// 4th step - assign each of the 8 adjacent voxels the corresponding contribution that results from the atom position in the unit voxel
-						const int number_of_adjacent_voxels = 8;
-						std::vector<float> current_voxel_index;
-						for (int i=0;i<number_of_adjacent_voxels;i++)
-						{
-							current_voxel_index = adjacent_voxel_vertices[i];
-							// normalized voxel indices based on 00, 01, 02 etc. // very important otherwise there will be spacings
-							openvdb::Coord ijk(current_voxel_index[0], current_voxel_index[1], current_voxel_index[2]);
-
-
-							/// normalization methods
-							/// 1 raw count 2 volume (density) 3 all ions (conc) 4 ratio (num/denum)
-
-							// raw count
-							if ((normaliseType == VOXELISE_NORMALISETYPE_NONE) || (normaliseType == VOXELISE_NORMALISETYPE_VOLUME))
-							{
-									calculation_result_accessor.setValue(ijk, contributions_to_adjacent_voxels[i] + numerator_accessor.getValue(ijk));
-							}
-
-
-							// concentration
-							else if (normaliseType == VOXELISE_NORMALISETYPE_ALLATOMSINVOXEL)
-							{
-								// write to all ions to the denominator grid
-
-								denominator_accessor.setValue(ijk, contributions_to_adjacent_voxels[i] + denominator_accessor.getValue(ijk));
-
-								// write selected numerators to numerator grid
-								if(thisNumeratorIonEnabled)
-								{	
-									numerator_accessor.setValue(ijk, contributions_to_adjacent_voxels[i] + numerator_accessor.getValue(ijk));
-								}
-								else
-								{
-									numerator_accessor.setValue(ijk, 0.0 + numerator_accessor.getValue(ijk));
-								}
-							}
-
-							else if (normaliseType == VOXELISE_NORMALISETYPE_COUNT2INVOXEL)
-							{
-								// write to denominator grid
-								if(thisDenominatorIonEnabled)
-								{
-					
-									denominator_accessor.setValue(ijk, contributions_to_adjacent_voxels[i] + denominator_accessor.getValue(ijk));
-								}
-								else
-								{
-									denominator_accessor.setValue(ijk, 0.0 + denominator_accessor.getValue(ijk));
-								}
-
-								// write to numerator grid
-								if(thisNumeratorIonEnabled)
-								{	
-									numerator_accessor.setValue(ijk, contributions_to_adjacent_voxels[i] + numerator_accessor.getValue(ijk));
-								}
-								else
-								{
-									numerator_accessor.setValue(ijk, 0.0 + numerator_accessor.getValue(ijk));
-								}
-							}				
-
-							else 
-							{}
-
-						}
-					}
+					/// normalization methods
+					/// 1 raw count 2 volume (density) 3 all ions (conc) 4 ratio (num/denum)
+					SplatSource src;
+					src.pts=&ions->data;
+					src.numerator=thisNumeratorIonEnabled;
+					src.denominator=(normaliseType == VOXELISE_NORMALISETYPE_ALLATOMSINVOXEL) ||
+						(normaliseType == VOXELISE_NORMALISETYPE_COUNT2INVOXEL && thisDenominatorIonEnabled);
+					sources.push_back(src);
 				}
 
 				float minVal = 0.0;
 				float maxVal = 0.0;
-				denominator_grid->evalMinMax(minVal,maxVal);
-				std::cout << " eval min max denominator grid" << " = " << minVal << " , " << maxVal << std::endl;
-				std::cout << " active voxel count denominator grid" << " = " << denominator_grid->activeVoxelCount() << std::endl;
 
-				numerator_grid->evalMinMax(minVal,maxVal);
-				std::cout << " eval min max numerator grid" << " = " << minVal << " , " << maxVal << std::endl;
-				std::cout << " active voxel count numerator grid" << " = " << numerator_grid->activeVoxelCount() << std::endl;
-				
-				if ((normaliseType == VOXELISE_NORMALISETYPE_ALLATOMSINVOXEL) || (normaliseType == VOXELISE_NORMALISETYPE_COUNT2INVOXEL))
+				//Try the on-disk cache first, if enabled
+				std::string diskCacheFile;
+				VdbCacheKey diskCacheKey;
+				bool diskCacheHit=false;
+				if(vdbCacheDir.size())
 				{
-					// composite.h operations modify the first grid and leave the second grid emtpy !!!!!!!!!!!!!!!!!!
-					// compute a = a / b
-					openvdb::tools::compDiv(*numerator_grid, *denominator_grid);
-	
-					calculation_result_grid = numerator_grid->deepCopy();
-
-					//check for negative nans and infs introduced by the division
-					//set them to zero in order not to obtain nan mesh coordinates
+					diskCacheKey=makeVdbCacheKey(sources,voxelsize,normaliseType);
+					diskCacheFile=vdbCacheFilename(vdbCacheDir,diskCacheKey);
+
+					std::string errStr;
+					diskCacheHit=readVdbCacheFile(diskCacheFile,diskCacheKey,
+								calculation_result_grid,errStr);
+					if(errStr.size())
+						consoleOutput.push_back(errStr);
+				}
 
-					for (openvdb::FloatGrid::ValueAllIter iter = calculation_result_grid->beginValueAll(); iter; ++iter)
-					{   
-						if (std::isfinite(iter.getValue()) == false)
+				if(!diskCacheHit)
+				{
+					// splat each ion over its 8 adjacent voxels, in parallel
+					unsigned int errCode;
+					if(needDenominator)
+					{
+						// numerator and denominator are accumulated together, in one
+						// two-channel grid, then divided leaf by leaf. Voxels without
+						// any denominator are set to zero, rather than nan/inf
+						openvdb::Vec2SGrid::Ptr counts_grid = openvdb::Vec2SGrid::create(openvdb::Vec2s(0.0f,0.0f));
+						errCode=splatRatio(sources,voxelsize,*counts_grid,
+								progress.filterProgress,*Filter::wantAbort);
+						if(!errCode)
 						{
-				    			iter.setValue(0.0);
+							divideChannels(*counts_grid,*calculation_result_grid);
 						}
 					}
-				}
-				
-				else if (normaliseType == VOXELISE_NORMALISETYPE_VOLUME)
-				{
+					else
+					{
+						// raw count and density use the numerator counts directly
+						std::vector<const std::vector<IonHit> *> numeratorIons;
+						for(size_t ui=0;ui<sources.size();ui++)
+						{
+							if(sources[ui].numerator)
+								numeratorIons.push_back(sources[ui].pts);
+						}
+						errCode=splatPoints(numeratorIons,voxelsize,*calculation_result_grid,
+								progress.filterProgress,*Filter::wantAbort);
+					}
 
-					for (openvdb::FloatGrid::ValueAllIter iter = calculation_result_grid->beginValueAll(); iter; ++iter)
-					{   
-				    		iter.setValue(iter.getValue() / single_voxel_volume);
+					switch(errCode)
+					{
+						case 0:
+							break;
+						case VDBSPLAT_ERR_ABORT:
+							return VOXELISE_ABORT_ERR;
+						case VDBSPLAT_ERR_MEMALLOC:
+							return VOXELISE_MEMORY_ERR;
+						default:
+							ASSERT(false);
 					}
 
-					//normalize these values again in order to obtain values from zero to one
-					// so the isovalue still matches
-					calculation_result_grid->evalMinMax(minVal,maxVal);
+					if (normaliseType == VOXELISE_NORMALISETYPE_VOLUME)
+					{
+
+						for (openvdb::FloatGrid::ValueAllIter iter = calculation_result_grid->beginValueAll(); iter; ++iter)
+						{   
+					    		iter.setValue(iter.getValue() / single_voxel_volume);
+						}
 
-					for (openvdb::FloatGrid::ValueAllIter iter = calculation_result_grid->beginValueAll(); iter; ++iter)
-					{   
-				    		iter.setValue((iter.getValue() - minVal) / (maxVal - minVal));
-					}
+						//normalize these values again in order to obtain values from zero to one
+						// so the isovalue still matches
+						calculation_result_grid->evalMinMax(minVal,maxVal);
+
+						for (openvdb::FloatGrid::ValueAllIter iter = calculation_result_grid->beginValueAll(); iter; ++iter)
+						{   
+					    		iter.setValue((iter.getValue() - minVal) / (maxVal - minVal));
+						}
 	
+					}
 				}
 
-			
 				calculation_result_grid->evalMinMax(minVal,maxVal);
 				std::cout << " eval min max calculation_result_grid after division" << " = " << minVal << " , " << maxVal << std::endl;
 				std::cout << " active voxel count calculation_result_grid after division" << " = " << calculation_result_grid->activeVoxelCount() << std::endl;
@@ -638,6 +765,16 @@ unsigned int VoxeliseFilter::refresh(const std::vector<const FilterStreamData *>
 				openvdb::math::Transform::Ptr linearTransform = openvdb::math::Transform::createLinearTransform(voxelsize);
 				calculation_result_grid->setTransform(linearTransform);
 
+				//Failure to write the disk cache is not an error; the grid
+				// is simply recomputed next time
+				if(diskCacheFile.size() && !diskCacheHit)
+				{
+					std::string errStr;
+					if(!writeVdbCacheFile(diskCacheFile,diskCacheKey,calculation_result_grid,errStr))
+						consoleOutput.push_back(errStr);
+				}
+
+
 
 				/*
 
@@ -1300,6 +1437,14 @@ void VoxeliseFilter::getProperties(FilterPropGroup &propertyList) const
 			p.helpText=TRANS("Voxel size in x,y,z direction");
 			propertyList.addProperty(p,curGroup);
 
+			p.name=TRANS("Disk cache");
+			p.data=vdbCacheDir;
+			p.key=KEY_VDB_CACHEDIR;
+			p.type=PROPERTY_TYPE_DIR;
+			p.helpText=TRANS("Folder in which to keep computed grids, for reuse in later sessions. Files are never deleted, so the folder must be cleared by hand. Leave empty to disable");
+			propertyList.addProperty(p,curGroup);
+
+
 			propertyList.setGroupTitle(curGroup,TRANS("Computation"));
 			curGroup++;
 	
@@ -1472,6 +1617,16 @@ bool VoxeliseFilter::setProperty(unsigned int key,
 				vdbgs->voxelsize = voxelsize;
 			}			break;
 		}
+		case KEY_VDB_CACHEDIR:
+		{
+			//The disk cache does not change the output,
+			// so no update is needed
+			if(value.size() && !wxDirExists((value)))
+				return false;
+			vdbCacheDir=value;
+			break;
+		}
+
 
 		case KEY_FIXEDWIDTH: 
 		{
@@ -2007,6 +2162,8 @@ bool VoxeliseFilter::writeState(std::ostream &f,unsigned int format, unsigned in
 			f << tabs(depth+1) << "<isovalue value=\""<<isoLevel << "\"/>" << endl;
 			f << tabs(depth+1) << "<colour r=\"" <<  rgba.r()<< "\" g=\"" << rgba.g() << "\" b=\"" <<rgba.b()
 				<< "\" a=\"" << rgba.a() << "\"/>" <<endl;
+			f << tabs(depth+1) << "<diskcache dir=\"" << escapeXML(convertFileStringToCanonical(vdbCacheDir)) << "\"/>" << endl;
+
 
 			f << tabs(depth+1) << "<axialslice>" << endl;
 			f << tabs(depth+2) << "<offset value=\""<<sliceOffset<< "\"/>" << endl;
@@ -2209,6 +2366,21 @@ bool VoxeliseFilter::readState(xmlNodePtr &nodePtr, const std::string &stateFile
 
 	//====
 
+	//Retrieve disk cache folder, if present (older files lack it)
+	{
+	xmlNodePtr tmpNode=nodePtr;
+	if(!XMLHelpFwdToElem(tmpNode,"diskcache"))
+	{
+		xmlString=xmlGetProp(tmpNode,(const xmlChar *)"dir");
+		if(xmlString)
+		{
+			vdbCacheDir=convertFileStringToNative((char *)xmlString);
+			xmlFree(xmlString);
+		}
+	}
+	}
+
+
 	//try to retrieve slice, where possible
 	if(!XMLHelpFwdToElem(nodePtr,"axialslice"))
 	{
@@ -2569,6 +2741,60 @@ bool voxelMultiCountTest()
 }
 
 
+bool vdbCacheNameTest()
+{
+	//Cache file names must change with any input that changes the grid
+	vector<IonHit> ionsA(10),ionsB(10);
+	for(unsigned int ui=0;ui<ionsA.size();ui++)
+	{
+		ionsA[ui]=IonHit(Point3D(ui,0.5f*ui,1.0f),1);
+		ionsB[ui]=ionsA[ui];
+	}
+
+	vector<SplatSource> src(1);
+	src[0].pts=&ionsA;
+	src[0].numerator=true;
+	src[0].denominator=true;
+
+	std::string name=vdbCacheFilename("dir",makeVdbCacheKey(src,0.5f,VOXELISE_NORMALISETYPE_ALLATOMSINVOXEL));
+	TEST(name.substr(0,4) == "dir/","cache file in cache dir");
+
+	//Same positions, in a different array, give the same name
+	src[0].pts=&ionsB;
+	TEST(vdbCacheFilename("dir",makeVdbCacheKey(src,0.5f,VOXELISE_NORMALISETYPE_ALLATOMSINVOXEL)) == name,
+			"name depends only on content");
+
+	ionsB[3].setPos(Point3D(3.0f,1.5f,1.001f));
+	TEST(vdbCacheFilename("dir",makeVdbCacheKey(src,0.5f,VOXELISE_NORMALISETYPE_ALLATOMSINVOXEL)) != name,
+			"name depends on positions");
+	src[0].pts=&ionsA;
+
+	TEST(vdbCacheFilename("dir",makeVdbCacheKey(src,0.6f,VOXELISE_NORMALISETYPE_ALLATOMSINVOXEL)) != name,
+			"name depends on voxel size");
+	TEST(vdbCacheFilename("dir",makeVdbCacheKey(src,0.5f,VOXELISE_NORMALISETYPE_COUNT2INVOXEL)) != name,
+			"name depends on normalisation");
+
+	src[0].numerator=false;
+	TEST(vdbCacheFilename("dir",makeVdbCacheKey(src,0.5f,VOXELISE_NORMALISETYPE_ALLATOMSINVOXEL)) != name,
+			"name depends on ion selection");
+	src[0].numerator=true;
+
+	//The metadata written with the grid must match only the same inputs
+	VdbCacheKey k=makeVdbCacheKey(src,0.5f,VOXELISE_NORMALISETYPE_ALLATOMSINVOXEL);
+	TEST(k.numeratorIons == ionsA.size() && k.denominatorIons == ionsA.size(),"cache key ion counts");
+	openvdb::FloatGrid::Ptr g=openvdb::FloatGrid::create(0.0f);
+	TEST(!checkVdbCacheMeta(*g,k),"grid without metadata rejected");
+	setVdbCacheMeta(*g,k);
+	TEST(checkVdbCacheMeta(*g,k),"cache metadata matches");
+	TEST(!checkVdbCacheMeta(*g,makeVdbCacheKey(src,0.6f,VOXELISE_NORMALISETYPE_ALLATOMSINVOXEL)),
+			"cache metadata voxel size mismatch");
+	src[0].pts=&ionsB;
+	TEST(!checkVdbCacheMeta(*g,makeVdbCacheKey(src,0.5f,VOXELISE_NORMALISETYPE_ALLATOMSINVOXEL)),
+			"cache metadata data mismatch");
+
+	return true;
+}
+
 bool VoxeliseFilter::runUnitTests()
 {
 
@@ -2578,6 +2804,10 @@ bool VoxeliseFilter::runUnitTests()
 	if(!voxelMultiCountTest())
 		return false;
 
+	if(!vdbCacheNameTest())
+		return false;
+
+
 
 	return true;
 }
@@ -108,6 +108,10 @@ private:
 	// console warning: non-static data member initializers only available with -std=c++11 or -std=gnu++11
 	openvdb::FloatGrid::Ptr vdbCache;
 
+	//Folder for the on-disk isosurface grid cache. Disabled if empty
+	std::string vdbCacheDir;
+
+
 public:
 	VoxeliseFilter();
 	~VoxeliseFilter() { if(rsdIncoming) delete rsdIncoming;}
@@ -20,6 +20,7 @@
 
 #include "filtertree.h"
 #include "filters/allFilter.h"
+#include "filters/algorithms/spatialIndexCache.h"
 
 #include "common/xmlHelper.h"
 #include "common/stringFuncs.h"
@@ -757,8 +758,9 @@ unsigned int FilterTree::refreshFilterTree(list<FILTER_OUTPUT_DATA > &outData,
 							float ramFreeForUse;
 							ramFreeForUse= maxCachePercent/(float)100.0f*getAvailRAM();
 
+							//Shared search trees count against the same budget
 							bool cache;
-							cache=((float)cacheBytes/(1024*1024) ) < ramFreeForUse;
+							cache=((float)(cacheBytes+SpatialIndexCache::memoryUsage())/(1024*1024) ) < ramFreeForUse;
 
 							currentFilter->setCaching( cache);
 							break;
@@ -798,6 +800,12 @@ unsigned int FilterTree::refreshFilterTree(list<FILTER_OUTPUT_DATA > &outData,
 				errCode=FILTERTREE_REFRESH_ERR_MEM;
 			}
 
+			//Release any shared search trees that no longer fit in the cache
+			if(cacheStrategy == CACHE_DEPTH_FIRST)
+				SpatialIndexCache::trim((size_t)(maxCachePercent/100.0f*getAvailRAM())*1024*1024);
+			else
+				SpatialIndexCache::clear();
+
 #ifdef DEBUG
 			//Perform sanity checks on filter output
 			checkRefreshValidity(curData,currentFilter);
@@ -139,7 +139,7 @@ void VisController::updateScene(list<vector<const FilterStreamData *> > &sceneDa
 	vector<std::pair<size_t,string> > plotLabels;
 
 	//rate-limit the number of drawables to show in the scene
-	map<const IonStreamData *, const IonStreamData*> throttleMap;
+	map<const IonStreamData *, float> throttleMap;
 	throttleSceneInput(sceneData,throttleMap);
 
 	//-- Build buffer of new objects to send to scene
@@ -171,24 +171,53 @@ void VisController::updateScene(list<vector<const FilterStreamData *> > &sceneDa
 
 
 					//Obtain the ion data pointer.
-					// note that we have to use the throttled points
-					// (in throttlemap) if they are there, to prevent
+					// note that we have to sample the points
+					// (as given in throttlemap) if they are there, to prevent
 					// overloading the display system.
 					const IonStreamData *ionData;
 					ionData=((const IonStreamData *)((*it)[ui]));
+					float fraction=1.0f;
 					if(throttleMap.find(ionData) != throttleMap.end())
+						fraction=throttleMap[ionData];
+
+					//Positions are stored for display in 16-bit fixed
+					// point, relative to the stream's bounding box
+					if(ionData->data.size())
 					{
-						ionData=throttleMap[ionData];
+						BoundCube ionBounds;
+						IonHit::getBoundCube(ionData->data,ionBounds);
+						curIonDraw->setQuantisationBounds(ionBounds);
 					}
 
+					if(fraction < 1.0f)
+					{
+						//Select the points to draw, without
+						// duplicating the ion data itself
+						vector<size_t> sampled;
+						sampled.reserve((size_t)(fraction*ionData->data.size()*1.1f));
+						RandNumGen rng;
+						rng.initTimer();
+						for(size_t uj=0;uj<ionData->data.size();uj++)
+						{
+							if(rng.genUniformDev() < fraction)
+								sampled.push_back(uj);
+						}
 
-					curIonDraw->resize(ionData->data.size());
-					//Slice out just the coordinate data for the 
-					// ion pointer, run callback immediately 
-					// after, as its a long operation
-					#pragma omp parallel for shared(curIonDraw,ionData)
-					for(size_t ui=0;ui<ionData->data.size();ui++)
-						curIonDraw->setPoint(ui,ionData->data[ui].getPosRef());
+						curIonDraw->resize(sampled.size());
+						#pragma omp parallel for shared(curIonDraw,ionData,sampled)
+						for(size_t uj=0;uj<sampled.size();uj++)
+							curIonDraw->setPoint(uj,ionData->data[sampled[uj]].getPosRef());
+					}
+					else
+					{
+						curIonDraw->resize(ionData->data.size());
+						//Slice out just the coordinate data for the 
+						// ion pointer, run callback immediately 
+						// after, as its a long operation
+						#pragma omp parallel for shared(curIonDraw,ionData)
+						for(size_t uj=0;uj<ionData->data.size();uj++)
+							curIonDraw->setPoint(uj,ionData->data[uj].getPosRef());
+					}
 					
 					//Set the colour from the ionstream data
 					curIonDraw->setColour(ionData->r,
@@ -455,12 +484,6 @@ void VisController::updateScene(list<vector<const FilterStreamData *> > &sceneDa
 			
 	}
 
-	//Free the rate-limited points
-	for(map<const IonStreamData *, const IonStreamData*>::iterator it =throttleMap.begin();
-		it!=throttleMap.end();++it)
-	{
-		delete it->second;
-	}
 	throttleMap.clear();	
 	//---
 
@@ -595,8 +618,8 @@ void VisController::updateScene(list<vector<const FilterStreamData *> > &sceneDa
 	//===============
 }
 
-void VisController::throttleSceneInput(list<vector<const FilterStreamData *> > &sceneData,
-		std::map<const IonStreamData *,const IonStreamData *> &throttleMap) const
+void VisController::throttleSceneInput(const list<vector<const FilterStreamData *> > &sceneData,
+		std::map<const IonStreamData *,float> &sampleFractions) const
 {
 	//Count the number of input ions, as we may need to perform culling,
 	if(!limitIonOutput)
@@ -614,33 +637,19 @@ void VisController::throttleSceneInput(list<vector<const FilterStreamData *> > &
 	//Need to cull
 	float cullFraction = (float)limitIonOutput/(float)inputIonCount;
 
-	for(list<vector<const FilterStreamData *> >::iterator it=sceneData.begin(); 
+	//Record the fraction to draw. The sampling itself is done
+	// when building the drawable, so the ion data is never copied
+	for(list<vector<const FilterStreamData *> >::const_iterator it=sceneData.begin(); 
 							it!=sceneData.end(); ++it)
 	{
 		for(unsigned int ui=0;ui<it->size(); ui++)
 		{
 			if((*it)[ui]->getStreamType() != STREAM_TYPE_IONS)
 				continue;
-			//Obtain the ion data pointer
-			const IonStreamData *ionData;
-			ionData=((const IonStreamData *)((*it)[ui]));
-
-
-			//Duplicate this object, then forget
-			// about the old one. The freeing will be done by
-			//the refresh thread as needed, so don't free here.
-
-			// We can't modify the input, even when uncached,
-			// as the object is const
-			IonStreamData *newIonData;
-			newIonData=ionData->cloneSampled(cullFraction);
-			throttleMap[ionData]  = newIonData;
 
+			sampleFractions[(const IonStreamData *)((*it)[ui])] = cullFraction;
 		}
 	}
-		
-
-
 }
 
 void VisController::updateRawGrid() const
@@ -104,9 +104,10 @@ class VisController
 
 		//!Update the console strings
 		void updateConsole(const std::vector<std::string> &v, const Filter *f) const;
-		//!Limit the number of objects we are sending to the scene
-		void throttleSceneInput(std::list<std::vector<const FilterStreamData *> > &outputData, 
-			std::map<const IonStreamData *, const IonStreamData *> &throttleMap) const;
+		//!Limit the number of objects we are sending to the scene, by
+		// computing the fraction of each ion stream that should be drawn
+		void throttleSceneInput(const std::list<std::vector<const FilterStreamData *> > &outputData, 
+			std::map<const IonStreamData *, float> &sampleFractions) const;
 	public:
 		AnalysisState state;
 		Scene scene;
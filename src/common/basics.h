@@ -54,6 +54,14 @@
 	#endif
 #endif
 
+//OpenMP 4 provides explicit vectorisation hints; older compilers
+// will simply rely upon auto-vectorisation of the (branch-free) loops
+#if defined(_OPENMP) && (_OPENMP >= 201307)
+	#define SIMD_PRAGMA(clause) _Pragma(clause)
+#else
+	#define SIMD_PRAGMA(clause)
+#endif
+
 #include "mathfuncs.h"
 #include "common/assertion.h"
 
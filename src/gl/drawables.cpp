@@ -996,7 +996,8 @@ void DrawCylinder::getBoundingBox(BoundCube &b) const
 
 //======
 
-DrawManyPoints::DrawManyPoints() : r(1.0f),g(1.0f),b(1.0f),a(1.0f), size(1.0f)
+DrawManyPoints::DrawManyPoints() : quantCentre(0,0,0), quantStep(1,1,1), 
+	r(1.0f),g(1.0f),b(1.0f),a(1.0f), size(1.0f), haveCachedBounds(false)
 {
 	wantsLight=false;
 }
@@ -1012,6 +1013,13 @@ DrawableObj* DrawManyPoints::clone() const
 	return d;
 }
 
+Point3D DrawManyPoints::unquantise(const QuantisedPoint &q) const
+{
+	return Point3D(quantCentre[0] + q.v[0]*quantStep[0],
+			quantCentre[1] + q.v[1]*quantStep[1],
+			quantCentre[2] + q.v[2]*quantStep[2]);
+}
+
 void DrawManyPoints::getBoundingBox(BoundCube &b) const
 {
 
@@ -1019,23 +1027,86 @@ void DrawManyPoints::getBoundingBox(BoundCube &b) const
 	if(!haveCachedBounds)
 	{
 		haveCachedBounds=true;
-		cachedBounds.setBounds(pts);
+		if(pts.empty())
+		{
+			cachedBounds.setInvalid();
+		}
+		else
+		{
+			short lo[3],hi[3];
+			for(unsigned int ui=0;ui<3;ui++)
+			{
+				lo[ui]=pts[0].v[ui];
+				hi[ui]=pts[0].v[ui];
+			}
+			for(size_t ui=1;ui<pts.size();ui++)
+			{
+				for(unsigned int uj=0;uj<3;uj++)
+				{
+					lo[uj]=std::min(lo[uj],pts[ui].v[uj]);
+					hi[uj]=std::max(hi[uj],pts[ui].v[uj]);
+				}
+			}
+
+			QuantisedPoint qLo,qHi;
+			for(unsigned int ui=0;ui<3;ui++)
+			{
+				qLo.v[ui]=lo[ui];
+				qHi.v[ui]=hi[ui];
+			}
+			cachedBounds.setBounds(unquantise(qLo),unquantise(qHi));
+		}
 	}
 
 	b=cachedBounds;
 	return;
 }
 
+void DrawManyPoints::setQuantisationBounds(const BoundCube &bc)
+{
+	ASSERT(bc.isValid());
+	pts.clear();
+	haveCachedBounds=false;
+
+	for(unsigned int ui=0;ui<3;ui++)
+	{
+		float lo=bc.getBound(ui,0), hi=bc.getBound(ui,1);
+		quantCentre[ui]=(lo+hi)*0.5f;
+		float halfWidth=(hi-lo)*0.5f;
+		//Flat axes still need a non-zero step
+		if(halfWidth <=std::numeric_limits<float>::epsilon()*fabs(quantCentre[ui]) ||
+			halfWidth <= std::numeric_limits<float>::min())
+			halfWidth=1.0f;
+		quantStep[ui]=halfWidth/32767.0f;
+	}
+}
+
 void DrawManyPoints::clear()
 {
 	pts.clear();
+	haveCachedBounds=false;
 }
 
 void DrawManyPoints::addPoints(const vector<Point3D> &vp)
 {
-	pts.resize(pts.size()+vp.size());
-	std::copy(vp.begin(),vp.end(),pts.begin());
-	haveCachedBounds=false;
+	if(vp.empty())
+		return;
+
+	//Find the volume holding both old and new points, 
+	// then re-quantise everything into it
+	vector<Point3D> allPts;
+	allPts.resize(pts.size()+vp.size());
+	for(size_t ui=0;ui<pts.size();ui++)
+		allPts[ui]=unquantise(pts[ui]);
+	std::copy(vp.begin(),vp.end(),allPts.begin()+pts.size());
+
+	BoundCube bc;
+	bc.setBounds(allPts);
+	setQuantisationBounds(bc);
+
+	resize(allPts.size());
+	for(size_t ui=0;ui<allPts.size();ui++)
+		setPoint(ui,allPts[ui]);
 }
 
 void DrawManyPoints::shuffle()
@@ -1049,13 +1120,6 @@ void DrawManyPoints::resize(size_t resizeVal)
 	haveCachedBounds=false;
 }
 
-
-void DrawManyPoints::setPoint(size_t offset,const Point3D &p)
-{
-	ASSERT(!haveCachedBounds);
-	pts[offset]=p;
-}
-
 void DrawManyPoints::setColour(float rnew, float gnew, float bnew, float anew)
 {
 	r=rnew;
@@ -1075,15 +1139,22 @@ void DrawManyPoints::draw() const
 	if(a < std::numeric_limits<float>::epsilon())
 		return;
 
+	//Let the GL undo the quantisation, so we can hand it the 
+	// compact form directly. Lighting is not used, so a 
+	// non-uniform scale does no harm
+	glPushMatrix();
+	glTranslatef(quantCentre[0],quantCentre[1],quantCentre[2]);
+	glScalef(quantStep[0],quantStep[1],quantStep[2]);
+
 	glPointSize(size); 
 	glBegin(GL_POINTS);
 		glColor4f(r,g,b,a);
 		//TODO: Consider Vertex buffer objects. would be faster, but less portable.
-		for(unsigned int ui=0; ui<pts.size(); ui++)
-		{
-			glVertex3fv(pts[ui].getValueArr());
-		}
+		for(size_t ui=0; ui<pts.size(); ui++)
+			glVertex3sv(pts[ui].v);
 	glEnd();
+
+	glPopMatrix();
 }
 
 //======
@@ -260,11 +260,21 @@ class DrawPoint : public DrawableObj
 };
 
 //!A point drawing class - for many points of same size & colour
+//!Point position stored as 16-bit fixed point, relative to a bounding volume
+struct QuantisedPoint
+{
+	short v[3];
+};
+
 class DrawManyPoints : public DrawableObj
 {
 	protected:
-		//!Vector of points to draw
-		std::vector<Point3D> pts;
+		//!Vector of points to draw, quantised relative to the quantisation box
+		std::vector<QuantisedPoint> pts;
+		//!Centre of the quantisation box
+		Point3D quantCentre;
+		//!Size of one quantisation step, for each axis
+		Point3D quantStep;
 		//!Point colours (r,g,b,a) range: [0.0f,1.0f]
 		float r,g,b,a;
 		//!Size of the point
@@ -272,6 +282,9 @@ class DrawManyPoints : public DrawableObj
 
 		mutable bool haveCachedBounds;
 		mutable BoundCube cachedBounds;
+
+		//!Convert a quantised point back to a real-space position
+		Point3D unquantise(const QuantisedPoint &q) const;
 	public:
 		//!Constructor
 		DrawManyPoints();
@@ -282,15 +295,26 @@ class DrawManyPoints : public DrawableObj
 
 		virtual DrawableObj *clone() const;
 		
-		//!Swap out the internal vector with an extenal one
-		void swap(std::vector<Point3D> &);
+		//!Set the volume used to quantise positions. Points outside this will be clamped.
+		// Must be called prior to setPoint, and will discard any existing points
+		void setQuantisationBounds(const BoundCube &b);
 		//!Remove all points
 		void clear();
-		//!Add points into the drawing vector
+		//!Add points into the drawing vector. May re-quantise existing points
 		void addPoints(const std::vector<Point3D> &);
 		//!Add a single point into the drawing vector, at a particular offset
-		// *must call resize first*
-		void setPoint(size_t offset,const Point3D &);
+		// *must call setQuantisationBounds and resize first*
+		void setPoint(size_t offset,const Point3D &p)
+		{
+			ASSERT(!haveCachedBounds);
+			for(unsigned int ui=0;ui<3;ui++)
+			{
+				float f=(p[ui]-quantCentre[ui])/quantStep[ui];
+				f=std::max(-32767.0f,std::min(32767.0f,f));
+				//round to nearest
+				pts[offset].v[ui]=(short)(f < 0 ? f-0.5f : f+0.5f);
+			}
+		}
 
 		//!Reset the number of many points to draw
 		void resize(size_t newSize);
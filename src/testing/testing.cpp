@@ -34,8 +34,18 @@
 #include "backend/configFile.h"
 #include "backend/filters/algorithms/binomial.h"
 #include "backend/filters/algorithms/K3DTree-mk2.h"
+#include "backend/filters/algorithms/K3DTree-bucket.h"
 #include "backend/filters/algorithms/K3DTree.h"
+#include "backend/filters/algorithms/cellList.h"
 #include "backend/filters/algorithms/mass.h"
+#include "backend/filters/algorithms/spaceFillingCurve.h"
+#include "backend/filters/algorithms/spatialIndexCache.h"
+#include "backend/filters/algorithms/threadHistogram.h"
+#include "backend/filters/algorithms/pairCorrelation.h"
+#include "backend/filters/algorithms/hullIndex.h"
+#include "backend/filters/algorithms/pointHash.h"
+#include "backend/filters/algorithms/linkClustering.h"
+#include "backend/filters/algorithms/vdbSplat.h"
 
 #include "backend/APT/ionhit.h"
 #include "backend/APT/APTFileIO.h"
@@ -566,9 +576,39 @@ bool algorithmTests()
 
 	if(!K3DMk2Tests())
 		return false;
+
+	if(!K3DTreeBucketTests())
+		return false;
+
+	if(!CellListTests())
+		return false;
+
+	if(!testSpatialIndexCache())
+		return false;
+
+	if(!testThreadHistogram())
+		return false;
+
+	if(!testFFTPairCorrelation())
+		return false;
+
+	if(!testHullIndex())
+		return false;
+
+	if(!testPointHash())
+		return false;
+
+	if(!testLinkClustering())
+		return false;
+
+	if(!testVdbSplat())
+		return false;
 	
 	if(!testBinomial())
 		return false;
+
+	if(!testSpaceFillingCurve())
+		return false;
 	return true;
 }
 